@@ -1,20 +1,25 @@
 #version 450 core
 precision highp float;
 
-in vec2 v_TexCoords;
+in vec3 v_TexCoords;
 in vec4 v_Color;
-flat in float v_Solid;
+flat in uint v_Solid;
 
 layout(location = 0) out vec4 o_Color;
 
-layout(binding = 0) uniform sampler2D u_Tex;
+layout(binding = 0) uniform sampler2DArray u_Tex;
+// Glyphs are distance fields with the outline at 0.5 when this isn't 0,
+// it is half a pixel in the field's units.
+layout(location = 0) uniform float u_SdfEdge;
 
 void main()
 {
     o_Color = v_Color;
-    if(v_Solid == 0.0f)
-    {
-        float alpha = pow(texture(u_Tex, v_TexCoords).r, 1.0f / 2.2f);
-        o_Color.a *= alpha;
-    }
+    if(v_Solid != 0u)
+        return;
+    float value = texture(u_Tex, v_TexCoords).r;
+    if(u_SdfEdge > 0.0f)
+        o_Color.a *= smoothstep(0.5f - u_SdfEdge, 0.5f + u_SdfEdge, value);
+    else
+        o_Color.a *= pow(value, 1.0f / 2.2f);
 }
@@ -1,24 +1,46 @@
 #version 450 core
 precision highp float;
 
-layout(location = 0) in vec2 a_Position;
-layout(location = 1) in vec2 a_TexCoords;
-layout(location = 2) in vec4 a_Color;
-layout(location = 3) in float a_Solid;
+// One instance per quad, the quad's corners come from gl_VertexID.
+layout(location = 0) in ivec2 a_Position; // Top left corner
+layout(location = 1) in uvec2 a_Size;
+layout(location = 2) in uint  a_Glyph;
+layout(location = 3) in vec4  a_Color;
 
-out vec2 v_TexCoords;
+out vec3 v_TexCoords;
 out vec4 v_Color;
-flat out float v_Solid;
+flat out uint v_Solid;
 
 layout(std140, binding = 0) uniform u_Buffer
 {
     mat4 u_Proj;
 };
 
+struct Glyph
+{
+    vec4 tex;  // Left, bottom, right, top
+    vec4 rect; // Only used by the grid renderer
+    uint layer;
+};
+
+layout(std430, binding = 1) readonly buffer u_Glyphs
+{
+    Glyph u_Glyph[];
+};
+
+#define GLYPH_SOLID 0x80000000u
+
 void main()
 {
-    v_TexCoords = a_TexCoords;
+    // Triangle strip order: top left, top right, bottom left, bottom right.
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    v_Solid = a_Glyph & GLYPH_SOLID;
+    v_TexCoords = vec3(0.0f);
+    if(v_Solid == 0u)
+    {
+        vec4 tex = u_Glyph[a_Glyph].tex;
+        v_TexCoords = vec3(mix(tex.x, tex.z, corner.x), mix(tex.w, tex.y, corner.y), float(u_Glyph[a_Glyph].layer));
+    }
     v_Color = a_Color;
-    v_Solid = a_Solid;
-    gl_Position = u_Proj * vec4(a_Position, 0.0f, 1.0f);
+    gl_Position = u_Proj * vec4(vec2(a_Position) + corner * vec2(a_Size), 0.0f, 1.0f);
 }
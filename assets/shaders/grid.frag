@@ -0,0 +1,87 @@
+#version 450 core
+precision highp float;
+
+in vec2 v_Pixel;
+flat in ivec2 v_Origin;
+
+layout(location = 0) out vec4 o_Color;
+
+layout(binding = 0) uniform sampler2DArray u_Tex;
+
+struct Glyph
+{
+    vec4 tex;  // Left, bottom, right, top
+    vec4 rect; // Offset from the cell's top left, then size
+    uint layer;
+};
+
+layout(std430, binding = 1) readonly buffer u_Glyphs
+{
+    Glyph u_Glyph[];
+};
+
+// Glyph index in the low 24 bits, palette entry in the high 8.
+layout(std430, binding = 2) readonly buffer u_Cells
+{
+    uint u_Cell[];
+};
+
+layout(location = 0) uniform ivec2 u_CellSize;
+layout(location = 1) uniform ivec2 u_GridSize; // Columns, rows
+layout(location = 2) uniform uint  u_FirstCell;
+layout(location = 3) uniform vec4  u_Palette[4];
+layout(location = 7) uniform float u_SdfEdge; // Same as in basic.frag
+
+#define CELL_EMPTY 0xFFFFFFFFu
+#define CELL_WIDE  0xFFFFFFFEu // Second cell of a wide codepoint, drawn by the one before it
+
+uint cell_at(int x, int y)
+{
+    return x < 0 || x >= u_GridSize.x ? CELL_EMPTY : u_Cell[u_FirstCell + uint(y * u_GridSize.x + x)];
+}
+
+// Coverage of the pixel by the glyph of cell x, in that cell's color.
+vec4 sample_cell(vec2 local, int x, int y)
+{
+    uint code = cell_at(x, y);
+    if(code >= CELL_WIDE)
+        return vec4(0.0f);
+
+    Glyph g = u_Glyph[code & 0xFFFFFFu];
+    vec2 inside = (local - vec2(ivec2(x, y) * u_CellSize) - g.rect.xy) / g.rect.zw;
+    if(any(lessThan(inside, vec2(0.0f))) || any(greaterThanEqual(inside, vec2(1.0f))))
+        return vec4(0.0f);
+
+    vec2 uv = vec2(mix(g.tex.x, g.tex.z, inside.x), mix(g.tex.w, g.tex.y, inside.y));
+    vec4 color = u_Palette[code >> 24];
+    float value = textureLod(u_Tex, vec3(uv, float(g.layer)), 0.0f).r;
+    if(u_SdfEdge > 0.0f)
+        color.a *= smoothstep(0.5f - u_SdfEdge, 0.5f + u_SdfEdge, value);
+    else
+        color.a *= pow(value, 1.0f / 2.2f);
+    return color;
+}
+
+void main()
+{
+    vec2 local = v_Pixel - vec2(v_Origin);
+    ivec2 cell = clamp(ivec2(local) / u_CellSize, ivec2(0), u_GridSize - 1);
+
+    // Glyphs can reach past their cells, wide ones always do, so the cells
+    // on either side are sampled too. The one to the left is followed back
+    // to the cell that owns it so a wide glyph isn't drawn twice.
+    int first = cell.x - 1;
+    if(cell_at(first, cell.y) == CELL_WIDE)
+        first--;
+    o_Color = vec4(0.0f);
+    for(int x = first; x <= cell.x + 1; ++x)
+    {
+        vec4 color = sample_cell(local, x, cell.y);
+        float alpha = color.a + o_Color.a * (1.0f - color.a);
+        if(alpha > 0.0f)
+            o_Color.rgb = (color.rgb * color.a + o_Color.rgb * o_Color.a * (1.0f - color.a)) / alpha;
+        o_Color.a = alpha;
+    }
+    if(o_Color.a <= 0.0f)
+        discard;
+}
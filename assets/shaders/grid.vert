@@ -0,0 +1,23 @@
+#version 450 core
+precision highp float;
+
+// Same instances as basic.vert, only the text area of a window is drawn
+// and the fragment shader finds the glyph under each pixel itself.
+layout(location = 0) in ivec2 a_Position; // Top left corner
+layout(location = 1) in uvec2 a_Size;
+
+out vec2 v_Pixel;
+flat out ivec2 v_Origin;
+
+layout(std140, binding = 0) uniform u_Buffer
+{
+    mat4 u_Proj;
+};
+
+void main()
+{
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    v_Pixel = vec2(a_Position) + corner * vec2(a_Size);
+    v_Origin = a_Position;
+    gl_Position = u_Proj * vec4(v_Pixel, 0.0f, 1.0f);
+}
@@ -4,33 +4,60 @@
 #include "timing.h"
 #include "window.h"
 #include "fileman/fileio.h"
+#include "fileman/journal.h"
+#include "fileman/loader.h"
+#include "fileman/watcher.h"
 #include "render/font.h"
 #include "render/renderer.h"
-#include "render/uniforms.h"
 #include "editor/bufferwin.h"
+#include "editor/session.h"
+#include "structs/pagecache.h"
 
 #include <glad/glad.h>
 
 #define GEM_INITIAL_WIDTH  1080
 #define GEM_INITIAL_HEIGHT 720
+#define BENCH_FRAMES       200
+#define MIN_FONT_SIZE      6
+#define MAX_FONT_SIZE      96
 
 static bool s_redraw;
 static bool s_print_stats;
 
+static void render_benchmark(void);
+static void zoom(int delta);
+
 void gem_init(char* file_to_open)
 {
     // Create window, and initialize OpenGL context, renderer,
     // and freetype.
     window_create(GEM_INITIAL_WIDTH, GEM_INITIAL_HEIGHT);
+
+    // Files bigger than this are paged in from disk instead of read whole.
+    const char* page_budget = getenv("GEM_PAGE_BUDGET_MB");
+    if(page_budget != NULL && atol(page_budget) > 0)
+        page_cache_set_budget((size_t)atol(page_budget) << 20);
+    // Journals cost a write per edit group, some would rather not have them.
+    if(getenv("GEM_NO_JOURNAL") != NULL)
+        journal_set_enabled(false);
+    watcher_init();
+    fileio_init();
+    journal_init();
+    loader_init();
     freetype_init();
+    // Distance field glyphs zoom without rasterizing again, at some cost in
+    // sharpness at small sizes.
+    if(getenv("GEM_FONT_SDF") != NULL)
+        set_font_sdf(true);
     renderer_init();
     bufwin_init_root_frame();
     buffer_list_init();
-    bufwin_open(file_to_open);
+    if(file_to_open != NULL || !session_restore())
+        bufwin_open(file_to_open);
 
     int width, height;
     window_get_dims(&width, &height);
-    set_projection(width, height);
+    renderer_resize(width, height);
     bufwin_update_screen(width, height);
 
     s_redraw = false;
@@ -48,11 +75,18 @@ void gem_run(void)
             // glClear(GL_COLOR_BUFFER_BIT);
             renderer_start_batch();
             bufwin_render_all();
-            renderer_render_batch();
+            renderer_present();
             if(s_print_stats)
             {
                 const GemRenderStats* stats = renderer_get_stats();
-                printf("Draw Calls: %2u\tQuad Count: %u\n", stats->draw_calls, stats->quad_count);
+                printf("Draw Calls: %2u\tQuad Count: %u\tCell Count: %u\tFence Waits: %u\tComposites: %u\tGlyph Loads: %u\n",
+                       stats->draw_calls, stats->quad_count, stats->cell_count, stats->fence_waits,
+                       stats->composites, stats->glyph_loads);
+                const GemSaveStats* save_stats = fileio_get_save_stats();
+                if(save_stats->save_cnt > 0)
+                    printf("Last Save: %.3fms (%zu bytes, %u writes)\tAvg Save: %.3fms\n",
+                           save_stats->last_ms, save_stats->last_bytes, save_stats->last_syscalls,
+                           save_stats->total_ms / save_stats->save_cnt);
             }
             window_swap();
             s_redraw = false;
@@ -65,6 +99,12 @@ void gem_close(int err)
 { 
     renderer_cleanup();
     freetype_cleanup();
+    loader_cleanup();
+    fileio_cleanup();
+    if(err == EXIT_SUCCESS)
+        session_save();
+    journal_cleanup();
+    watcher_cleanup();
     window_destroy();
     exit(err);
 }
@@ -79,6 +119,19 @@ void gem_key_press(uint16_t keycode, uint32_t mods)
             s_print_stats = !s_print_stats;
             printf("Printing stats turned %s.\n", s_print_stats ? "on" : "off");
         }
+        else if(keycode == GEM_KEY_G)
+        {
+            bool grid = renderer_get_mode() != RENDER_MODE_GRID;
+            renderer_set_mode(grid ? RENDER_MODE_GRID : RENDER_MODE_QUADS);
+            printf("Grid renderer turned %s.\n", grid ? "on" : "off");
+            bufwin_damage_all();
+            s_redraw = true;
+        }
+        else if(keycode == GEM_KEY_B)
+        {
+            render_benchmark();
+            s_redraw = true;
+        }
         else if(keycode == GEM_KEY_C)
         {
             bufwin_close();
@@ -105,7 +158,12 @@ void gem_key_press(uint16_t keycode, uint32_t mods)
 
 void gem_mouse_press(uint32_t button, uint32_t mods, int sequence, int x, int y)
 {
-    bufwin_mouse_press(button, mods, sequence, x, y);
+    if(mods & GEM_MOD_CONTROL && button == GEM_MOUSE_SCROLL_UP)
+        zoom(1);
+    else if(mods & GEM_MOD_CONTROL && button == GEM_MOUSE_SCROLL_DOWN)
+        zoom(-1);
+    else
+        bufwin_mouse_press(button, mods, sequence, x, y);
 }
 
 void gem_request_redraw(void)
@@ -117,3 +175,49 @@ bool gem_needs_redraw(void)
 {
     return s_redraw;
 }
+
+// Draws the current screen BENCH_FRAMES times with each renderer. CPU is the
+// time spent building and submitting a frame, total also waits for the GPU
+// to finish it. Nothing is swapped, so vsync stays out of it.
+static void render_benchmark(void)
+{
+    static const char* const names[RENDER_MODE_CNT] = { "Quads", "Grid" };
+    GemRenderMode prev = renderer_get_mode();
+    for(int mode = 0; mode < RENDER_MODE_CNT; ++mode)
+    {
+        renderer_set_mode(mode);
+        double cpu_ms = 0.0;
+        double total_ms = 0.0;
+        for(int i = 0; i < BENCH_FRAMES; ++i)
+        {
+            DeltaTimer dt;
+            gem_dt_record(&dt);
+            DeltaTimer start = dt;
+            bufwin_damage_all();
+            renderer_start_batch();
+            bufwin_render_all();
+            renderer_present();
+            cpu_ms += gem_dt_record_get_ms(&dt);
+            glFinish();
+            total_ms += gem_dt_record_get_ms(&start);
+        }
+        const GemRenderStats* stats = renderer_get_stats();
+        printf("%-6s CPU: %.3fms/frame\tTotal: %.3fms/frame\t(%u draw calls, %u quads, %u cells)\n",
+               names[mode], cpu_ms / BENCH_FRAMES, total_ms / BENCH_FRAMES,
+               stats->draw_calls, stats->quad_count, stats->cell_count);
+    }
+    renderer_set_mode(prev);
+    bufwin_damage_all();
+}
+
+static void zoom(int delta)
+{
+    int size = get_font_size() + delta;
+    if(size < MIN_FONT_SIZE || size > MAX_FONT_SIZE)
+        return;
+    renderer_set_font_size(size);
+    int width, height;
+    window_get_dims(&width, &height);
+    bufwin_update_screen(width, height);
+    s_redraw = true;
+}
@@ -0,0 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
+#include "parallel.h"
+#include "core.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+size_t parallel_slice_cnt(size_t len, size_t slice_min)
+{
+    GEM_ASSERT(slice_min > 0);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t cnt = len / slice_min;
+    if(cores > 0 && cnt > (size_t)cores)
+        cnt = cores;
+    if(cnt > PARALLEL_MAX_SLICES)
+        cnt = PARALLEL_MAX_SLICES;
+    return cnt > 0 ? cnt : 1;
+}
+
+void parallel_run(void* items, size_t item_size, size_t cnt, void* (*fn)(void*))
+{
+    GEM_ASSERT(cnt <= PARALLEL_MAX_SLICES);
+    char* item = items;
+    pthread_t threads[PARALLEL_MAX_SLICES];
+    bool threaded[PARALLEL_MAX_SLICES];
+    for(size_t i = 1; i < cnt; ++i)
+        threaded[i] = pthread_create(threads + i, NULL, fn, item + i * item_size) == 0;
+    if(cnt > 0)
+        fn(item);
+    for(size_t i = 1; i < cnt; ++i)
+    {
+        if(threaded[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn(item + i * item_size);
+    }
+}
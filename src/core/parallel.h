@@ -0,0 +1,12 @@
+#pragma once
+#include <stddef.h>
+
+#define PARALLEL_MAX_SLICES 64
+
+// How many slices of at least slice_min bytes len can be split into, at most
+// one per core and never less than 1.
+size_t parallel_slice_cnt(size_t len, size_t slice_min);
+// Calls fn on each of the cnt items, item_size bytes apart, a thread each.
+// The calling thread takes the first item, and any that can't get a thread
+// of their own. Never bails out, so worker threads can use it too.
+void   parallel_run(void* items, size_t item_size, size_t cnt, void* (*fn)(void*));
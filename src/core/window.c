@@ -1,8 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
 #include "window.h"
 #include "app.h"
 #include "core.h"
 #include "keycode.h"
-#include "render/uniforms.h"
 
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
@@ -11,13 +11,19 @@
 #include <glad/glad.h>
 #include <GL/glx.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
+#include <unistd.h>
 
 #define REPEAT_INTERVAL 300
+#define MAX_FD_SOURCES  8
 
 typedef GLXContext (*glXCreateContextAttribsARBProc)(Display*, GLXFBConfig, GLXContext, Bool, const int*);
 typedef struct MouseState MouseState;
 typedef struct GemWindow  GemWindow;
+typedef struct FdSource   FdSource;
 
 struct MouseState
 {
@@ -34,12 +40,20 @@ struct GemWindow
     bool   focused;
 };
 
+struct FdSource
+{
+    int  fd;
+    void (*callback)(int fd);
+};
+
 static bool extension_supported(const char* extension);
 static GLXFBConfig get_best_config(void);
 static void set_keymap(void);
 static int translate_keysym(const KeySym* keysyms, int width);
+static void wait_for_events(void);
 
 extern void bufwin_update_screen(int width, int height);
+extern void renderer_resize(int width, int height);
 
 /*
  * Static variables relating to the window.
@@ -58,6 +72,9 @@ static Atom       s_maximizev_atom;
 static MouseState s_last_mouse;
 static int        s_keymap[256];
 
+static FdSource   s_fd_sources[MAX_FD_SOURCES];
+static size_t     s_fd_source_cnt;
+
 
 static bool s_Initialized = false;
 
@@ -171,6 +188,12 @@ void window_dispatch_events(void)
 
     while(!s_window.focused || !gem_needs_redraw() || XPending(s_display))
     {
+        if(!XPending(s_display))
+        {
+            wait_for_events();
+            continue;
+        }
+
         XNextEvent(s_display, &ev);
         unsigned int scancode = ev.xkey.keycode;
 
@@ -232,11 +255,57 @@ void window_dispatch_events(void)
 
     if(prev_width != s_window.width || prev_height != s_window.height)
     {
-        set_projection(s_window.width, s_window.height);
+        renderer_resize(s_window.width, s_window.height);
         bufwin_update_screen(s_window.width, s_window.height);
     }
 }
 
+void window_add_fd_source(int fd, void (*callback)(int fd))
+{
+    GEM_ASSERT(fd >= 0);
+    GEM_ASSERT(callback != NULL);
+    GEM_ENSURE(s_fd_source_cnt < MAX_FD_SOURCES);
+    s_fd_sources[s_fd_source_cnt].fd = fd;
+    s_fd_sources[s_fd_source_cnt].callback = callback;
+    s_fd_source_cnt++;
+}
+
+void window_remove_fd_source(int fd)
+{
+    for(size_t i = 0; i < s_fd_source_cnt; ++i)
+    {
+        if(s_fd_sources[i].fd == fd)
+        {
+            s_fd_source_cnt--;
+            s_fd_sources[i] = s_fd_sources[s_fd_source_cnt];
+            return;
+        }
+    }
+}
+
+void window_open_wakeup(int fds[2])
+{
+    GEM_ENSURE(pipe(fds) == 0);
+    for(int i = 0; i < 2; ++i)
+    {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+bool window_wake(int fd)
+{
+    // A full pipe already has a wakeup pending.
+    char byte = 0;
+    return write(fd, &byte, 1) == 1 || errno == EAGAIN;
+}
+
+void window_drain_wakeup(int fd)
+{
+    char drain[64];
+    while(read(fd, drain, sizeof(drain)) > 0);
+}
+
 void window_swap(void)
 {
     glXSwapBuffers(s_display, s_window.handle);
@@ -281,6 +350,45 @@ void window_toggle_maximize(void)
 
 }
 
+// Blocks until either the X connection or one of the registered fd
+// sources becomes readable, and dispatches the sources that are ready.
+// X events themselves are left for XPending/XNextEvent to pick up.
+static void wait_for_events(void)
+{
+    struct pollfd fds[MAX_FD_SOURCES + 1];
+    fds[0].fd = ConnectionNumber(s_display);
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for(size_t i = 0; i < s_fd_source_cnt; ++i)
+    {
+        fds[i + 1].fd = s_fd_sources[i].fd;
+        fds[i + 1].events = POLLIN;
+        fds[i + 1].revents = 0;
+    }
+
+    size_t count = s_fd_source_cnt;
+    if(poll(fds, count + 1, -1) < 0)
+    {
+        GEM_ASSERT(errno == EINTR);
+        return;
+    }
+
+    // Callbacks may add or remove sources, so match by fd rather than index.
+    for(size_t i = 1; i <= count; ++i)
+    {
+        if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        for(size_t j = 0; j < s_fd_source_cnt; ++j)
+        {
+            if(s_fd_sources[j].fd == fds[i].fd)
+            {
+                s_fd_sources[j].callback(fds[i].fd);
+                break;
+            }
+        }
+    }
+}
+
 static bool extension_supported(const char* extension)
 {
     const char* extensions = glXQueryExtensionsString(s_display, s_screen);
@@ -7,6 +7,13 @@
 void window_create(uint32_t width, uint32_t height);
 void window_destroy(void);
 void window_dispatch_events(void);
+void window_add_fd_source(int fd, void (*callback)(int fd));
+void window_remove_fd_source(int fd);
+// Wakeup pipes let other threads get the main thread's attention. fds[0] is
+// the end to add as an fd source and drain, fds[1] the one to wake.
+void window_open_wakeup(int fds[2]);
+bool window_wake(int fd); // Safe from any thread
+void window_drain_wakeup(int fd);
 void window_swap(void);
 void window_get_dims(int* width, int* height);
 void window_toggle_fullscreen(void);
@@ -1,16 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
 #include "buffer.h"
 #include "core/app.h"
 #include "core/core.h"
 #include "fileman/fileio.h"
+#include "fileman/journal.h"
+#include "fileman/loader.h"
 #include "fileman/path.h"
+#include "fileman/watcher.h"
 #include "structs/da.h"
+#include "structs/linediff.h"
 
 #define MAX_BUFFER_CNT 128
 #define INITIAL_CAP    4
 
-#define FF_READONLY    1
-
 typedef struct BufferStorage BufferStorage;
+typedef struct ReloadLines   ReloadLines;
+
 struct BufferStorage
 {
     Buffer* buffers;
@@ -24,6 +29,27 @@ static void  ensure_free(size_t count);
 static bool  is_valid_buf(BufNr nr);
 static BufNr alloc_buf(void);
 static void  free_buf(BufNr nr);
+static BufNr new_buf(void);
+static void  attach_file(BufNr nr, char* full_path);
+static BufNr restore_file(char* full_path, int64_t mtime, size_t size, uint64_t version,
+                          uint64_t saved_version, SerialReader* tree);
+static int   watch_parent_dir(const char* path);
+static bool  reload_with_diff(PieceTree* pt, const char* contents, size_t size, LineDiff* diff);
+static bool  reload_streamed(BufNr bufnr, size_t size, LineDiff* diff);
+static uint64_t* hash_tree_lines(PieceTree* pt, size_t* starts);
+static bool  same_line(void* ctx, size_t old_line, size_t new_line);
+static bool  can_modify(const Buffer* buf);
+static void  track_edit(Buffer* buf, BufferPos pos, size_t prev_line_cnt);
+
+// Where the lines of the tree and of the new contents start, both with a
+// virtual newline after the last line.
+struct ReloadLines
+{
+    PieceTree*       pt;
+    const size_t*    old_starts;
+    const char*      contents;
+    const size_t*    new_starts;
+};
 
 Buffer* g_cur_buf;
 static BufferStorage s_buffers;
@@ -40,13 +66,8 @@ void buffer_list_init(void)
 
 BufNr buffer_open_empty(void)
 {
-    ensure_free(1);
-    BufNr res = alloc_buf();
-    Buffer* buf = buffer_get(res);
-    buf->filepath = NULL;
-    buf->modified = false;
-    buf->next = -1;
-    piece_tree_init(&buf->contents, NULL, 0, false);
+    BufNr res = new_buf();
+    piece_tree_init(&buffer_get(res)->contents, NULL, 0, false);
     return res;
 }
 
@@ -60,30 +81,33 @@ BufNr buffer_open_file(char* filepath)
         return -1;
     }
 
-    for(size_t i = 0; i < s_buffers.capacity; ++i)
+    BufNr existing = buffer_find(full_path);
+    if(existing != -1)
     {
-        Buffer* buf = s_buffers.buffers + i;
-        if(buf->open && buf->filepath && strcmp(buf->filepath, full_path) == 0)
-        {
-            free(full_path);
-            return i;
-        }
+        free(full_path);
+        return existing;
     }
 
-    ensure_free(1);
-    BufNr res = alloc_buf();
+    BufNr res = new_buf();
     Buffer* buf = buffer_get(res);
-    buf->modified = false;
-    buf->next = -1;
-    buf->open = true;
 
-    char* contents;
+    // Anything bigger than a chunk is streamed in so it shows up right away,
+    // the journal is opened once the whole file is there.
     size_t size;
+    if(get_file_info(full_path, NULL, &size) && size > LOAD_CHUNK_SIZE &&
+       loader_start(res, full_path, size))
+    {
+        attach_file(res, full_path);
+        return res;
+    }
+
+    char* contents;
     bool readonly;
     if(!read_entire_file(filepath, &contents, &size, &readonly))
     {
         fprintf(stderr, "Failed to find file: %s\n", filepath);
         piece_tree_init(&buf->contents, NULL, 0, false);
+        free(full_path);
     }
     else
     {
@@ -91,11 +115,125 @@ BufNr buffer_open_file(char* filepath)
             size--;
         piece_tree_init(&buf->contents, contents, size, false);
         buf->file_flags = readonly ? FF_READONLY : 0;
-        buf->filepath = full_path;
+        attach_file(res, full_path);
+        journal_open(res);
     }
     return res;
 }
 
+BufNr buffer_find(const char* full_path)
+{
+    GEM_ASSERT(full_path != NULL);
+    for(size_t i = 0; i < s_buffers.capacity; ++i)
+    {
+        Buffer* buf = s_buffers.buffers + i;
+        if(buf->open && buf->filepath && strcmp(buf->filepath, full_path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+void buffer_forget_watch(int wd)
+{
+    for(size_t i = 0; i < s_buffers.capacity; ++i)
+    {
+        Buffer* buf = s_buffers.buffers + i;
+        if(buf->open && buf->dir_wd == wd)
+            buf->dir_wd = -1;
+    }
+}
+
+bool buffer_reload(BufNr bufnr, LineDiff* diff)
+{
+    Buffer* buf = buffer_get(bufnr);
+    GEM_ASSERT(buf->saves_pending == 0);
+    GEM_ASSERT(!(buf->file_flags & FF_LOADING));
+    if(buf->filepath == NULL)
+        return false;
+
+    // Files too big to read whole are streamed in again, without a diff to
+    // keep cursors on their lines.
+    size_t size;
+    if(get_file_info(buf->filepath, NULL, &size) && size > MAX_FILE_SIZE)
+        return reload_streamed(bufnr, size, diff);
+
+    char* contents;
+    bool readonly;
+    if(!read_entire_file(buf->filepath, &contents, &size, &readonly))
+        return false;
+
+    if(size > 0 && contents[size - 1] == '\n')
+        size--;
+
+    LineDiff local;
+    if(diff == NULL)
+        diff = &local;
+    if(reload_with_diff(&buf->contents, contents, size, diff))
+    {
+        free(contents);
+        buf->orig_on_disk = false;
+    }
+    else
+    {
+        piece_tree_free(&buf->contents);
+        piece_tree_init(&buf->contents, contents, size, false);
+        buf->orig_on_disk = true;
+    }
+    if(diff == &local)
+        da_free_data(&local);
+
+    buf->file_flags = readonly ? FF_READONLY : 0;
+    buf->saved_version = ++buf->version;
+    get_file_info(buf->filepath, &buf->disk_mtime, &buf->disk_size);
+    if(buf->journal != NULL)
+        journal_checkpoint(buf->journal, buf->version, buf->disk_mtime, buf->disk_size);
+    return true;
+}
+
+int buffer_check_disk(BufNr bufnr, LineDiff* diff)
+{
+    Buffer* buf = buffer_get(bufnr);
+    if(buf->filepath == NULL)
+        return DISK_UNCHANGED;
+    if(buf->dir_wd < 0)
+        buf->dir_wd = watch_parent_dir(buf->filepath);
+
+    int64_t mtime;
+    size_t size;
+    if(!get_file_info(buf->filepath, &mtime, &size))
+    {
+        if(!(buf->file_flags & FF_DISK_CHANGED))
+            printf("File was removed from disk: %s\n", buf->filepath);
+        buf->file_flags |= FF_DISK_CHANGED;
+        return DISK_DELETED;
+    }
+
+    // Our own saves land here too, they are filtered out by the recorded mtime.
+    // That is only known once the save completes, and until then the original
+    // buffer must stay put for the save thread anyway, same as while loading.
+    // A paged buffer can also find out from a page that didn't read back the
+    // same, an edit in place may not have moved the mtime yet.
+    bool stale = piece_tree_is_stale(&buf->contents);
+    if(buf->saves_pending > 0 || (buf->file_flags & FF_LOADING) ||
+       (mtime == buf->disk_mtime && size == buf->disk_size && !stale))
+        return DISK_UNCHANGED;
+
+    if(!buffer_is_modified(buf) && buffer_reload(bufnr, diff))
+        return DISK_RELOADED;
+
+    printf("File changed on disk but the buffer has unsaved changes: %s\n", buf->filepath);
+    buf->file_flags |= FF_DISK_CHANGED;
+    if(stale)
+    {
+        // Parts of it are blanks now, saving would write those over the file.
+        printf("Parts of the buffer couldn't be read back, it is readonly now: %s\n", buf->filepath);
+        buf->file_flags |= FF_READONLY;
+    }
+    buf->disk_mtime = mtime;
+    buf->disk_size = size;
+    return DISK_CONFLICT;
+}
+
 bool buffer_reopen(BufNr bufnr)
 {
     GEM_ASSERT(is_valid_buf(bufnr));
@@ -110,8 +248,10 @@ bool buffer_reopen(BufNr bufnr)
 
 void buffer_close(BufNr bufnr, bool force)
 {
+    // A save still in flight decides whether the buffer counts as modified.
+    fileio_finish_saves(bufnr);
     Buffer* buf = buffer_get(bufnr);
-    if(!force && buf->modified)
+    if(!force && buffer_is_modified(buf))
         printf("Attempted to close a buffer that has been modified.\n");
     else
         free_buf(bufnr);
@@ -124,7 +264,8 @@ void close_all_buffers(bool force)
         Buffer* buf = s_buffers.buffers + i;
         if(buf->open)
         {
-            if(!force && buf->modified)
+            fileio_finish_saves(i);
+            if(!force && buffer_is_modified(buf))
                 printf("Attempted to close a buffer that has been modified.\n");
             else
                 free_buf(i);
@@ -141,41 +282,134 @@ void buffer_insert(BufNr bufnr, const char* str, size_t len, size_t offset)
 {
     GEM_ASSERT(str != NULL);
     Buffer* buf = buffer_get(bufnr);
-    if(buf->file_flags & FF_READONLY)
-    {
-        printf("Tried to modify a readonly buffer.\n");
+    if(!can_modify(buf))
         return;
-    }
+    BufferPos pos = piece_tree_get_buffer_pos(&buf->contents, offset);
+    size_t line_cnt = buf->contents.line_cnt;
     piece_tree_insert(&buf->contents, str, len, offset);
-    buf->modified = true;
+    track_edit(buf, pos, line_cnt);
+    buf->version++;
+    if(buf->journal != NULL)
+        journal_insert(buf->journal, buf->version, offset, str, len, 1);
 }
 
 void buffer_insert_repeat(BufNr bufnr, const char* str, size_t len, size_t count, size_t offset)
 {
     GEM_ASSERT(str != NULL);
     Buffer* buf = buffer_get(bufnr);
-    if(buf->file_flags & FF_READONLY)
-    {
-        printf("Tried to modify a readonly buffer.\n");
+    if(!can_modify(buf))
         return;
-    }
+    BufferPos pos = piece_tree_get_buffer_pos(&buf->contents, offset);
+    size_t line_cnt = buf->contents.line_cnt;
     piece_tree_insert_repeat(&buf->contents, str, len, count, offset);
-    buf->modified = true;
+    track_edit(buf, pos, line_cnt);
+    buf->version++;
+    if(buf->journal != NULL)
+        journal_insert(buf->journal, buf->version, offset, str, len, count);
 }
 
 void buffer_delete(BufNr bufnr, size_t offset, size_t count)
 {
     Buffer* buf = buffer_get(bufnr);
-    if(buf->file_flags & FF_READONLY)
-    {
-        printf("Tried to modify a readonly buffer.\n");
+    if(!can_modify(buf))
         return;
-    }
+    BufferPos pos = piece_tree_get_buffer_pos(&buf->contents, offset);
+    size_t line_cnt = buf->contents.line_cnt;
     piece_tree_delete(&buf->contents, offset, count);
-    buf->modified = true;
+    track_edit(buf, pos, line_cnt);
+    buf->version++;
+    if(buf->journal != NULL)
+        journal_delete(buf->journal, buf->version, offset, count);
 
 }
 
+void buffer_list_serialize(StringBuilder* out)
+{
+    GEM_ASSERT(out != NULL);
+    uint64_t count = 0;
+    for(size_t i = 0; i < s_buffers.capacity; ++i)
+        count += s_buffers.buffers[i].open;
+    serial_put_u64(out, count);
+
+    StringBuilder tree;
+    da_init(&tree, 0);
+    for(size_t i = 0; i < s_buffers.capacity; ++i)
+    {
+        Buffer* buf = s_buffers.buffers + i;
+        if(!buf->open)
+            continue;
+
+        serial_put_u64(out, i);
+        serial_put_bytes(out, buf->filepath, buf->filepath ? strlen(buf->filepath) : 0);
+        serial_put_u64(out, (uint64_t)buf->disk_mtime);
+        serial_put_u64(out, buf->disk_size);
+        serial_put_u64(out, buf->version);
+        serial_put_u64(out, buf->saved_version);
+
+        // The tree is only any use while the file still holds the contents
+        // its original buffer was read from. It goes in as its own blob so
+        // it can be skipped when the file turns out to have changed.
+        tree.size = 0;
+        // Paged trees are left out too, their files are too big to read
+        // back in on restore anyway.
+        if(buf->filepath == NULL || (buf->orig_on_disk && !(buf->file_flags & FF_LOADING) &&
+                                     !piece_tree_is_paged(&buf->contents)))
+            piece_tree_serialize(&buf->contents, &tree);
+        serial_put_bytes(out, tree.data, tree.size);
+    }
+    da_free_data(&tree);
+}
+
+BufNr* buffer_list_deserialize(SerialReader* in, size_t* map_size)
+{
+    GEM_ASSERT(in != NULL);
+    GEM_ASSERT(map_size != NULL);
+    BufNr* map = malloc(sizeof(BufNr) * MAX_BUFFER_CNT);
+    GEM_ENSURE(map != NULL);
+    for(size_t i = 0; i < MAX_BUFFER_CNT; ++i)
+        map[i] = -1;
+    *map_size = MAX_BUFFER_CNT;
+
+    uint64_t count = serial_get_u64(in);
+    for(uint64_t i = 0; i < count && in->ok; ++i)
+    {
+        uint64_t old_nr = serial_get_u64(in);
+        size_t path_len, tree_len;
+        const char* path = serial_get_bytes(in, &path_len);
+        int64_t mtime = (int64_t)serial_get_u64(in);
+        size_t disk_size = serial_get_u64(in);
+        uint64_t version = serial_get_u64(in);
+        uint64_t saved_version = serial_get_u64(in);
+        const char* tree = serial_get_bytes(in, &tree_len);
+        if(!in->ok || old_nr >= MAX_BUFFER_CNT)
+            break;
+
+        SerialReader tree_in = { tree, tree + tree_len, tree_len > 0 };
+        if(path_len == 0)
+        {
+            BufNr nr = new_buf();
+            Buffer* buf = buffer_get(nr);
+            if(!piece_tree_deserialize(&buf->contents, NULL, 0, &tree_in))
+                piece_tree_init(&buf->contents, NULL, 0, false);
+            else
+            {
+                buf->version = version;
+                buf->saved_version = saved_version;
+            }
+            map[old_nr] = nr;
+            continue;
+        }
+
+        char* full_path = malloc(path_len + 1);
+        GEM_ENSURE(full_path != NULL);
+        memcpy(full_path, path, path_len);
+        full_path[path_len] = '\0';
+        map[old_nr] = restore_file(full_path, mtime, disk_size, version, saved_version, &tree_in);
+    }
+
+    return map;
+}
+
 Buffer* buffer_get(BufNr bufnr)
 {
     GEM_ASSERT(is_valid_buf(bufnr));
@@ -247,11 +481,327 @@ static BufNr alloc_buf(void)
 
 static void free_buf(BufNr nr)
 {
+    fileio_finish_saves(nr);
     Buffer* buf = buffer_get(nr);
     buf->next = s_buffers.free_head;
     s_buffers.free_head = nr;
+    if(buf->file_flags & FF_LOADING)
+        loader_cancel(nr);
+    watcher_unwatch(buf->dir_wd);
+    if(buf->journal != NULL)
+        journal_close(buf->journal);
     free(buf->filepath);
     buf->open = false;
     piece_tree_free(&buf->contents);
+    vis_index_free(&buf->vis);
     s_buffers.free_count++;
 }
+
+static BufNr new_buf(void)
+{
+    ensure_free(1);
+    BufNr res = alloc_buf();
+    Buffer* buf = buffer_get(res);
+    buf->filepath = NULL;
+    buf->disk_mtime = 0;
+    buf->disk_size = 0;
+    buf->file_flags = 0;
+    buf->dir_wd = -1;
+    buf->version = 0;
+    buf->saved_version = 0;
+    buf->queued_version = 0;
+    buf->queued_to_file = false;
+    buf->saves_pending = 0;
+    buf->journal = NULL;
+    buf->orig_on_disk = false;
+    buf->next = -1;
+    vis_index_init(&buf->vis);
+    memset(buf->edit_log, 0, sizeof(buf->edit_log));
+    return res;
+}
+
+// Takes ownership of full_path, the buffer's contents must have just been
+// read from it.
+static void attach_file(BufNr nr, char* full_path)
+{
+    Buffer* buf = buffer_get(nr);
+    buf->filepath = full_path;
+    buf->orig_on_disk = true;
+    get_file_info(full_path, &buf->disk_mtime, &buf->disk_size);
+    buf->dir_wd = watch_parent_dir(full_path);
+}
+
+// Brings back a file buffer from a session snapshot, skipping the line
+// indexing when the file is unchanged. Anything that doesn't line up falls
+// back to opening the file normally, where the journal takes care of
+// unsaved edits.
+static BufNr restore_file(char* full_path, int64_t mtime, size_t size, uint64_t version,
+                          uint64_t saved_version, SerialReader* tree)
+{
+    BufNr existing = buffer_find(full_path);
+    if(existing != -1)
+    {
+        free(full_path);
+        return existing;
+    }
+
+    int64_t cur_mtime;
+    size_t cur_size;
+    char* contents;
+    bool readonly;
+    if(!tree->ok || !get_file_info(full_path, &cur_mtime, &cur_size) ||
+       cur_mtime != mtime || cur_size != size ||
+       !read_entire_file(full_path, &contents, &size, &readonly))
+    {
+        BufNr res = buffer_open_file(full_path);
+        free(full_path);
+        return res;
+    }
+
+    if(size > 0 && contents[size - 1] == '\n')
+        size--;
+    BufNr res = new_buf();
+    Buffer* buf = buffer_get(res);
+    if(!piece_tree_deserialize(&buf->contents, contents, size, tree))
+    {
+        free(contents);
+        piece_tree_init(&buf->contents, NULL, 0, false);
+        free_buf(res);
+        res = buffer_open_file(full_path);
+        free(full_path);
+        return res;
+    }
+
+    buf->file_flags = readonly ? FF_READONLY : 0;
+    buf->version = version;
+    buf->saved_version = saved_version;
+    attach_file(res, full_path);
+    // Without journals the snapshot is the only copy of unsaved edits, so
+    // it is kept as is.
+    if(version == saved_version || !journal_is_enabled())
+        journal_open(res);
+    else if(!journal_resume(res))
+    {
+        // Without its journal the edits wouldn't survive a crash, so they are
+        // recovered from the journal left on disk instead.
+        full_path = strdup(buf->filepath);
+        GEM_ENSURE(full_path != NULL);
+        free_buf(res);
+        res = buffer_open_file(full_path);
+        free(full_path);
+    }
+    return res;
+}
+
+static int watch_parent_dir(const char* path)
+{
+    char dir[GEM_PATH_MAX];
+    const char* slash = strrchr(path, '/');
+    if(slash == NULL)
+        return -1;
+
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    return watcher_watch_dir(dir);
+}
+
+// Brings the tree in line with the new contents by replacing only the lines
+// that differ, which keeps untouched pieces (and the original buffer) alive.
+// Returns false without touching the tree when most of the file changed, in
+// which case starting over from the new contents is cheaper.
+static bool reload_with_diff(PieceTree* pt, const char* contents, size_t size, LineDiff* diff)
+{
+    if(size == 0)
+        contents = "";
+
+    size_t new_line_cnt = 1;
+    for(const char* nl = memchr(contents, '\n', size); nl != NULL;
+        nl = memchr(nl + 1, '\n', size - (nl + 1 - contents)))
+        new_line_cnt++;
+
+    // Every line is treated as ending in a newline, including a virtual one
+    // after the last line, so line ranges map directly onto byte ranges.
+    size_t* new_starts = malloc(sizeof(size_t) * (new_line_cnt + 1));
+    uint64_t* new_hashes = malloc(sizeof(uint64_t) * new_line_cnt);
+    GEM_ENSURE(new_starts != NULL && new_hashes != NULL);
+    new_starts[0] = 0;
+    for(size_t line = 0, start = 0; line < new_line_cnt; ++line)
+    {
+        const char* nl = memchr(contents + start, '\n', size - start);
+        size_t end = nl == NULL ? size : (size_t)(nl - contents);
+        new_hashes[line] = line_hash_update(LINE_HASH_INIT, contents + start, end - start);
+        start = end + 1;
+        new_starts[line + 1] = start;
+    }
+
+    size_t old_line_cnt = pt->line_cnt;
+    size_t* old_starts = malloc(sizeof(size_t) * (old_line_cnt + 1));
+    GEM_ENSURE(old_starts != NULL);
+    uint64_t* old_hashes = hash_tree_lines(pt, old_starts);
+    ReloadLines lines = { pt, old_starts, contents, new_starts };
+    line_diff(old_hashes, old_line_cnt, new_hashes, new_line_cnt, same_line, &lines, diff);
+    free(old_starts);
+    free(old_hashes);
+    free(new_hashes);
+
+    size_t changed = 0;
+    for(size_t i = 0; i < diff->size; ++i)
+        changed += new_starts[diff->data[i].new_start + diff->data[i].new_cnt] - new_starts[diff->data[i].new_start];
+    if(changed > size / 2)
+    {
+        free(new_starts);
+        return false;
+    }
+
+    // Apply back to front so the offsets of earlier hunks stay valid.
+    for(size_t i = diff->size; i-- > 0; )
+    {
+        const LineHunk* h = diff->data + i;
+        size_t old_start = h->old_start < old_line_cnt ? piece_tree_get_offset(pt, h->old_start, 0) : pt->size + 1;
+        size_t old_end = h->old_start + h->old_cnt < old_line_cnt ?
+                         piece_tree_get_offset(pt, h->old_start + h->old_cnt, 0) :
+                         pt->size + 1;
+        size_t new_start = new_starts[h->new_start];
+        size_t new_end = new_starts[h->new_start + h->new_cnt];
+
+        if(old_end == pt->size + 1)
+        {
+            // The range runs into the virtual trailing newline, swap it for
+            // the real one in front of the first line.
+            GEM_ASSERT(new_end == size + 1);
+            old_end--;
+            new_end--;
+            if(h->old_start > 0)
+            {
+                GEM_ASSERT(h->new_start > 0);
+                old_start--;
+                new_start--;
+            }
+        }
+
+        if(old_end > old_start)
+            piece_tree_delete(pt, old_start, old_end - old_start);
+        if(new_end > new_start)
+            piece_tree_insert(pt, contents + new_start, new_end - new_start, old_start);
+    }
+
+    free(new_starts);
+    return true;
+}
+
+// Starts the buffer over from a fresh load of its file. The new lines aren't
+// known yet, so the diff replaces every old line with nothing.
+static bool reload_streamed(BufNr bufnr, size_t size, LineDiff* diff)
+{
+    Buffer* buf = buffer_get(bufnr);
+    PieceTree old = buf->contents;
+    if(!loader_start(bufnr, buf->filepath, size))
+        return false;
+    size_t old_line_cnt = old.line_cnt;
+    piece_tree_free(&old);
+
+    if(diff != NULL)
+    {
+        LineHunk hunk = { 0, old_line_cnt, 0, 0 };
+        da_init(diff, 1);
+        da_append(diff, hunk);
+    }
+    // The loader opens a new journal once the file is in, the buffer had
+    // nothing unsaved for this one to keep.
+    if(buf->journal != NULL)
+        journal_close(buf->journal);
+    buf->journal = NULL;
+    buf->orig_on_disk = true;
+    buf->saved_version = ++buf->version;
+    get_file_info(buf->filepath, &buf->disk_mtime, &buf->disk_size);
+    return true;
+}
+
+// Also fills in the offset each line starts at, starts needs room for one
+// past the last line.
+static uint64_t* hash_tree_lines(PieceTree* pt, size_t* starts)
+{
+    uint64_t* hashes = malloc(sizeof(uint64_t) * pt->line_cnt);
+    GEM_ENSURE(hashes != NULL);
+
+    size_t line = 0;
+    size_t offset = 0;
+    uint64_t hash = LINE_HASH_INIT;
+    starts[0] = 0;
+    for(const PTNode* node = piece_tree_next_inorder(pt, NULL); node != NULL;
+        node = piece_tree_next_inorder(pt, node))
+    {
+        const char* data = piece_tree_get_node_start(pt, node);
+        size_t start = 0;
+        const char* nl;
+        while((nl = memchr(data + start, '\n', node->length - start)) != NULL)
+        {
+            size_t end = nl - data;
+            hashes[line++] = line_hash_update(hash, data + start, end - start);
+            starts[line] = offset + end + 1;
+            hash = LINE_HASH_INIT;
+            start = end + 1;
+        }
+        hash = line_hash_update(hash, data + start, node->length - start);
+        offset += node->length;
+    }
+    hashes[line++] = hash;
+    starts[line] = pt->size + 1;
+    GEM_ASSERT(line == pt->line_cnt);
+    return hashes;
+}
+
+static bool same_line(void* ctx, size_t old_line, size_t new_line)
+{
+    const ReloadLines* lines = ctx;
+    size_t offset = lines->old_starts[old_line];
+    size_t len = lines->old_starts[old_line + 1] - offset - 1;
+    if(len != lines->new_starts[new_line + 1] - lines->new_starts[new_line] - 1)
+        return false;
+    if(len == 0)
+        return true;
+
+    const char* str = lines->contents + lines->new_starts[new_line];
+    size_t node_start;
+    const PTNode* node = piece_tree_node_at(lines->pt, offset, &node_start);
+    while(len > 0 && node != NULL)
+    {
+        size_t skip = offset - node_start;
+        size_t cnt = node->length - skip < len ? node->length - skip : len;
+        if(memcmp(piece_tree_get_node_start(lines->pt, node) + skip, str, cnt) != 0)
+            return false;
+        str += cnt;
+        len -= cnt;
+        offset += cnt;
+        node_start += node->length;
+        node = piece_tree_next_inorder(lines->pt, node);
+    }
+    return len == 0;
+}
+
+static bool can_modify(const Buffer* buf)
+{
+    if(buf->file_flags & FF_LOADING)
+        printf("Tried to modify a buffer that is still loading.\n");
+    else if(buf->file_flags & FF_READONLY)
+        printf("Tried to modify a readonly buffer.\n");
+    else if(piece_tree_is_stale(&buf->contents))
+        printf("Tried to modify a buffer whose file changed underneath it.\n");
+    else
+        return true;
+    return false;
+}
+
+// Lets the visual column index and windows keep what an edit at pos didn't
+// touch, must run before the version is bumped.
+static void track_edit(Buffer* buf, BufferPos pos, size_t prev_line_cnt)
+{
+    size_t line_cnt = buf->contents.line_cnt;
+    BufferEdit* edit = buf->edit_log + (buf->version + 1) % BUFFER_EDIT_LOG;
+    edit->version = buf->version + 1;
+    edit->line = pos.line;
+    edit->removed_lines = prev_line_cnt > line_cnt ? prev_line_cnt - line_cnt : 0;
+    edit->added_lines = line_cnt > prev_line_cnt ? line_cnt - prev_line_cnt : 0;
+    vis_index_edit(&buf->vis, buf->version, pos, edit->removed_lines, edit->added_lines);
+}
@@ -1,18 +1,54 @@
 #pragma once
+#include "structs/linediff.h"
 #include "structs/piecetree.h"
 #include "structs/quad.h"
+#include "structs/visindex.h"
+
+#define FF_READONLY     1
+#define FF_DISK_CHANGED 2
+#define FF_LOADING      4 // Still being streamed in, the contents end early
+
+#define BUFFER_EDIT_LOG 64 // Recent edits kept for windows to catch up on
 
 typedef int BufNr;
 typedef struct Buffer Buffer;
+typedef struct BufferEdit BufferEdit;
+
+enum
+{
+    DISK_UNCHANGED = 0,
+    DISK_RELOADED,
+    DISK_CONFLICT,
+    DISK_DELETED
+};
+
+struct BufferEdit
+{
+    uint64_t version;       /* Version the edit made */
+    size_t   line;          /* Line the edit started on */
+    size_t   removed_lines;
+    size_t   added_lines;
+};
 
 struct Buffer
 {
     PieceTree contents;
+    VisIndex  vis;       // Byte to visual column mapping of recently used lines
+    BufferEdit edit_log[BUFFER_EDIT_LOG]; // Indexed by version % BUFFER_EDIT_LOG
     char*     filepath;  // Absolute path for when multiple windows have different cwds
+    int64_t   disk_mtime; // Modification time (ns) and size of the file when last read or written
+    size_t    disk_size;
     BufNr     next;
     int       file_flags;
     int       soft_tab_width;
-    bool      modified;
+    int       dir_wd;    // Watch descriptor of the parent directory, -1 if not watched
+    uint64_t  version;   // Bumped on every edit
+    uint64_t  saved_version;
+    uint64_t  queued_version; // Version of the most recently queued save
+    bool      queued_to_file; // Whether that save went to filepath
+    int       saves_pending;
+    struct Journal* journal; // Edit journal for crash recovery, NULL without a file
+    bool      orig_on_disk; // Whether the file still holds the original buffer's contents
     bool      open;
 };
 
@@ -23,6 +59,11 @@ void  buffer_list_init(void);
 BufNr buffer_open_empty(void);
 BufNr buffer_open_file(char* filepath);
 bool  buffer_reopen(BufNr bufnr);
+bool  buffer_reload(BufNr bufnr, LineDiff* diff);
+int   buffer_check_disk(BufNr bufnr, LineDiff* diff);
+BufNr buffer_find(const char* full_path);
+// Buffers whose directory watch was dropped watch it again when next checked.
+void  buffer_forget_watch(int wd);
 void  buffer_close(BufNr bufnr, bool force);
 void  close_all_buffers(bool force);
 int   open_buffer_count(void);
@@ -32,3 +73,21 @@ void  buffer_insert_repeat(BufNr bufnr, const char* str, size_t len, size_t coun
 void  buffer_delete(BufNr bufnr, size_t offset, size_t count);
 
 Buffer* buffer_get(BufNr bufnr);
+
+// Session snapshots. Deserializing returns a map from the bufnrs in the
+// snapshot to the reopened buffers.
+void   buffer_list_serialize(StringBuilder* out);
+BufNr* buffer_list_deserialize(SerialReader* in, size_t* map_size);
+
+static inline bool buffer_is_modified(const Buffer* buf)
+{
+    return buf->version != buf->saved_version;
+}
+
+// The edit that made version, NULL if it has left the log or the version
+// came from something else, like a reload.
+static inline const BufferEdit* buffer_get_edit(const Buffer* buf, uint64_t version)
+{
+    const BufferEdit* edit = buf->edit_log + version % BUFFER_EDIT_LOG;
+    return edit->version == version && version != 0 ? edit : NULL;
+}
@@ -4,7 +4,9 @@
 #include "core/keycode.h"
 #include "fileman/fileio.h"
 #include "fileman/path.h"
+#include "fileman/watcher.h"
 #include "render/font.h"
+#include "render/linecache.h"
 #include "render/renderer.h"
 
 #include <math.h>
@@ -18,10 +20,33 @@
 
 static void      render_frame(WinFrame* frame);
 static void      update_frame(WinFrame* frame, GemQuad* cur); //Temporary
-static BufferPos actual_to_vis(const PieceTree* pt, BufferPos actual);
-static BufferPos vis_to_actual(const PieceTree* pt, BufferPos vis);
+static BufferPos actual_to_vis(Buffer* buf, BufferPos actual);
+static BufferPos vis_to_actual(Buffer* buf, BufferPos vis);
+static void      set_cursor_offset(BufferWin* bufwin, size_t offset);
+static void      sync_wrap(BufferWin* bufwin);
+static void      sync_folds(BufferWin* bufwin);
+static uint32_t  measure_line(BufferWin* bufwin, size_t line);
+static void      measure_view(BufferWin* bufwin);
+static uint64_t  view_top_row(const BufferWin* bufwin);
+static void      set_view_row(BufferWin* bufwin, uint64_t row);
+static int64_t   row_in_view(const BufferWin* bufwin, size_t line);
+static void      damage_rows(WinDamage* d, int64_t first, int64_t last);
+static void      update_damage(BufferWin* bufwin, bool active);
+static bool      same_shape(const WinDamage* d, const BufferWin* bufwin);
+static void      damage_frame(WinFrame* frame);
 static void      clamp_val(int64_t* val, int64_t min, int64_t max);
 static void      bufwin_free(BufferWin* bufwin);
+static void      set_fileman_dir(BufferWin* bufwin, char* dir);
+static void      leave_fileman(BufferWin* bufwin);
+static void      watch_event_frame(WinFrame* frame, int wd, const char* name, int event);
+static void      check_buffer(BufNr bufnr);
+static bool      check_stale(WinFrame* frame, bool handle);
+static void      refresh_buffer_windows(WinFrame* frame, BufNr bufnr, const LineDiff* diff);
+static void      refresh_loaded_windows(WinFrame* frame, BufNr bufnr, bool done);
+static void      serialize_frame(const WinFrame* frame, StringBuilder* out);
+static WinFrame* deserialize_frame(SerialReader* in, const BufNr* map, size_t map_size,
+                                   BufferWin** cur, int depth);
+static void      free_frame(WinFrame* frame);
 
 static WinFrame* left_test(WinFrame* start);
 
@@ -34,6 +59,7 @@ void bufwin_init_root_frame(void)
     GEM_ENSURE(g_cur_win != NULL);
     g_cur_win->text_padding = DEFAULT_PADDING;
     g_cur_win->local_dir = get_cwd_path();
+    g_cur_win->dir_wd = -1;
     da_init(&g_cur_win->dir_entries, 0);
 
     s_root_frame = &g_cur_win->frame;
@@ -49,6 +75,9 @@ void bufwin_open(char* filepath)
     if(g_cur_win->bufnr == -1)
         g_cur_win->bufnr = buffer_open_empty();
     g_cur_buf = buffer_get(g_cur_win->bufnr);
+    wrap_index_reset(&g_cur_win->wrap, 0);
+    fold_set_clear(&g_cur_win->folds);
+    g_cur_win->damage.valid = false;
     bufwin_update_view(g_cur_win);
 }
 
@@ -72,6 +101,13 @@ BufferWin* bufwin_copy(BufferWin* bufwin)
     copy->bufnr = bufwin->bufnr;
     copy->mode = WIN_MODE_NORMAL;
     copy->sel_entry = 0;
+    copy->dir_wd = -1;
+    copy->wrap_lines = bufwin->wrap_lines;
+    wrap_index_init(&copy->wrap);
+    memset(&copy->folds, 0, sizeof(FoldSet));
+    memset(&copy->damage, 0, sizeof(WinDamage));
+    copy->line_cache = NULL;
+    copy->surface = NULL;
     return copy;
 }
 
@@ -161,7 +197,8 @@ void bufwin_set_cursor(BufferWin* bufwin, int64_t line, int64_t column)
     GEM_ASSERT(bufwin != NULL);
     
     Cursor* c = &bufwin->cursor;
-    const PieceTree* pt = &buffer_get(bufwin->bufnr)->contents;
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    PieceTree* pt = &buf->contents;
     size_t line_len;
 
     clamp_val(&line, 0, pt->line_cnt - 1);
@@ -170,11 +207,15 @@ void bufwin_set_cursor(BufferWin* bufwin, int64_t line, int64_t column)
     if(line == c->pos.line && column == c->pos.column)
         return;
 
+    sync_folds(bufwin);
+    if(fold_set_reveal(&bufwin->folds, line))
+        bufwin->damage.valid = false;
+
     if(column != c->pos.column)
         c->horiz = column;
     c->vis.line = line;
     c->vis.column = column;
-    c->pos = vis_to_actual(pt, c->vis);
+    c->pos = vis_to_actual(buf, c->vis);
     c->offset = piece_tree_get_offset_bp(pt, c->pos);
     gem_request_redraw();
 }
@@ -185,15 +226,23 @@ void bufwin_move_cursor_line(BufferWin* bufwin, int64_t line_delta)
     if(line_delta == 0)
         return;
 
-    const PieceTree* pt = &buffer_get(bufwin->bufnr)->contents;
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    PieceTree* pt = &buf->contents;
     Cursor* c = &bufwin->cursor;
-    clamp_val(&line_delta, -c->pos.line, pt->line_cnt - 1 - c->pos.line);
+    // Moves by visible rows, a closed fold is one row.
+    FoldSet* fs = &bufwin->folds;
+    sync_folds(bufwin);
+    int64_t row = fold_set_row_of_line(fs, c->pos.line) + line_delta;
+    clamp_val(&row, 0, pt->line_cnt - 1 - fold_set_hidden(fs));
+    line_delta = fold_set_line_at_row(fs, row) - c->pos.line;
     if(line_delta != 0)
     {
+        // Only looks as far into the line as horiz, long lines don't get
+        // walked to their end.
         c->vis.line += line_delta;
-        c->vis.column = piece_tree_get_line_length(pt, c->vis.line);
-        c->vis.column = MIN(c->horiz, actual_to_vis(pt, c->vis).column);
-        c->pos = vis_to_actual(pt, c->vis);
+        c->vis.column = c->horiz;
+        c->pos = vis_to_actual(buf, c->vis);
+        c->vis = actual_to_vis(buf, c->pos);
         c->offset = piece_tree_get_offset_bp(pt, c->pos);
         bufwin_put_cursor_in_view(bufwin);
         if(bufwin->frame.visible)
@@ -207,29 +256,24 @@ void bufwin_move_cursor_horiz(BufferWin* bufwin, int64_t horiz_delta)
     if(horiz_delta == 0)
         return;
 
-    const PieceTree* pt = &buffer_get(bufwin->bufnr)->contents;
-    Cursor* c = &bufwin->cursor;
-    clamp_val(&horiz_delta, -c->offset, pt->size - c->offset);
-    c->offset += horiz_delta;
+    // Moves by codepoints, not bytes.
+    PieceTree* pt = &buffer_get(bufwin->bufnr)->contents;
+    size_t chars = piece_tree_chars_before(pt, bufwin->cursor.offset);
+    size_t total = piece_tree_chars_before(pt, pt->size);
+    clamp_val(&horiz_delta, -chars, total - chars);
     if(horiz_delta != 0)
-    {
-        c->pos = piece_tree_get_buffer_pos(pt, c->offset);
-        c->vis = actual_to_vis(pt, c->pos);
-        c->horiz = c->vis.column;
-        bufwin_put_cursor_in_view(bufwin);
-        if(bufwin->frame.visible)
-            gem_request_redraw();
-    }
+        set_cursor_offset(bufwin, piece_tree_offset_of_char(pt, chars + horiz_delta));
 }
 
 void bufwin_cursor_refresh(BufferWin* bufwin)
 {
     GEM_ASSERT(bufwin != NULL);
     Cursor* c = &bufwin->cursor;
-    const PieceTree* pt = &buffer_get(bufwin->bufnr)->contents;
-    c->vis.column = piece_tree_get_line_length(pt, c->vis.line);
-    c->vis.column = MIN(c->horiz, actual_to_vis(pt, c->vis).column);
-    c->pos = vis_to_actual(pt, c->vis);
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    PieceTree* pt = &buf->contents;
+    c->vis.column = c->horiz;
+    c->pos = vis_to_actual(buf, c->vis);
+    c->vis = actual_to_vis(buf, c->pos);
     c->offset = piece_tree_get_offset_bp(pt, c->pos);
 }
 
@@ -239,13 +283,18 @@ void bufwin_set_view(BufferWin* bufwin, int64_t start_line, int64_t start_col)
     GEM_ASSERT(bufwin != NULL);
     const PieceTree* pt = &buffer_get(bufwin->bufnr)->contents;
     clamp_val(&start_line, 0, pt->line_cnt - 1);
-    if(start_col < 0)
+    sync_folds(bufwin);
+    const Fold* fold = fold_set_find(&bufwin->folds, start_line);
+    if(fold != NULL)
+        start_line = fold->start - 1;
+    if(start_col < 0 || bufwin->wrap_lines)
         start_col = 0;
     if(start_line != bufwin->view.start.line || 
        start_col != bufwin->view.start.column)
     {
         bufwin->view.start.line = start_line;
         bufwin->view.start.column = start_col;
+        bufwin->view.start_row = 0;
         if(bufwin->frame.visible)
             gem_request_redraw();
     }
@@ -257,7 +306,17 @@ void bufwin_move_view(BufferWin* bufwin, int64_t line_delta)
     if(line_delta == 0)
         return;
 
-    bufwin_set_view(bufwin, bufwin->view.start.line + line_delta, bufwin->view.start.column);
+    if(bufwin->wrap_lines)
+    {
+        // Scrolls by rows, which only needs the rows of the lines it lands on.
+        sync_wrap(bufwin);
+        int64_t row = view_top_row(bufwin) + line_delta;
+        set_view_row(bufwin, row < 0 ? 0 : row);
+        return;
+    }
+    sync_folds(bufwin);
+    int64_t row = fold_set_row_of_line(&bufwin->folds, bufwin->view.start.line) + line_delta;
+    bufwin_set_view(bufwin, fold_set_line_at_row(&bufwin->folds, row < 0 ? 0 : row), bufwin->view.start.column);
 }
 
 void bufwin_put_cursor_in_view(BufferWin* bufwin)
@@ -265,12 +324,30 @@ void bufwin_put_cursor_in_view(BufferWin* bufwin)
     // TODO: Change hardcoded 4 to be customizable
     GEM_ASSERT(bufwin != NULL);
     BufferPos* vis = &bufwin->cursor.vis;
-    int64_t new_line = bufwin->view.start.line;
+    if(bufwin->wrap_lines)
+    {
+        sync_wrap(bufwin);
+        measure_line(bufwin, vis->line);
+        int64_t row = wrap_index_row_of_line(&bufwin->wrap, vis->line) + vis->column / bufwin->wrap.width;
+        int64_t top = view_top_row(bufwin);
+        if(row < top + 4)
+            top = row - 4;
+        else if(row > bufwin->view.count.line - 4 + top)
+            top = row + 4 - bufwin->view.count.line;
+        set_view_row(bufwin, top < 0 ? 0 : top);
+        return;
+    }
+
+    // Lines are compared by visible row so closed folds don't take up space.
+    sync_folds(bufwin);
+    int64_t top = fold_set_row_of_line(&bufwin->folds, bufwin->view.start.line);
+    int64_t row = fold_set_row_of_line(&bufwin->folds, vis->line);
     int64_t new_col = bufwin->view.start.column;
-    if(vis->line < bufwin->view.start.line + 4) 
-        new_line = vis->line - 4;
-    else if(vis->line > bufwin->view.count.line - 4 + bufwin->view.start.line)
-        new_line = vis->line + 4 - bufwin->view.count.line;
+    if(row < top + 4) 
+        top = row - 4;
+    else if(row > bufwin->view.count.line - 4 + top)
+        top = row + 4 - bufwin->view.count.line;
+    int64_t new_line = fold_set_line_at_row(&bufwin->folds, top < 0 ? 0 : top);
 
     if(vis->column < bufwin->view.start.column + 4)
         new_col = vis->column - 4;
@@ -311,14 +388,89 @@ void bufwin_update_view(BufferWin* bufwin)
 void bufwin_render_all(void)
 {
     GEM_ASSERT(g_cur_win != NULL);
+    // Paged buffers can find out their file changed in the middle of drawing,
+    // they go through the usual disk check before the next frame uses them.
+    check_stale(s_root_frame, true);
     render_frame(s_root_frame);
+    if(check_stale(s_root_frame, false))
+        gem_request_redraw();
 }
 
 
+void bufwin_damage_all(void)
+{
+    damage_frame(s_root_frame);
+}
+
 void bufwin_update_screen(int width, int height)
 {
     GemQuad full_screen = make_quad(0, height, width, 0);
     update_frame(s_root_frame, &full_screen);
+    damage_frame(s_root_frame);
+}
+
+void bufwin_handle_watch_event(int wd, const char* name, int event)
+{
+    if(event == WATCH_EVENT_OVERFLOW)
+    {
+        // Events were dropped, nothing short of a full check is reliable.
+        watch_event_frame(s_root_frame, -1, NULL, event);
+        gem_request_redraw();
+        return;
+    }
+    if(event == WATCH_EVENT_UNWATCHED)
+    {
+        buffer_forget_watch(wd);
+        watch_event_frame(s_root_frame, wd, NULL, event);
+        gem_request_redraw();
+        return;
+    }
+
+    const char* dir = watcher_get_path(wd);
+    if(dir == NULL)
+        return;
+
+    char path[GEM_PATH_MAX];
+    size_t dir_len = strlen(dir);
+    if(snprintf(path, sizeof(path), "%s%s%s", dir, dir[dir_len - 1] == '/' ? "" : "/", name) < (int)sizeof(path))
+    {
+        BufNr bufnr = buffer_find(path);
+        if(bufnr != -1)
+            check_buffer(bufnr);
+    }
+
+    watch_event_frame(s_root_frame, wd, name, event);
+    gem_request_redraw();
+}
+
+void bufwin_serialize(StringBuilder* out)
+{
+    GEM_ASSERT(out != NULL);
+    serialize_frame(s_root_frame, out);
+}
+
+bool bufwin_deserialize(SerialReader* in, const BufNr* map, size_t map_size)
+{
+    GEM_ASSERT(in != NULL);
+    BufferWin* cur = NULL;
+    WinFrame* root = deserialize_frame(in, map, map_size, &cur, 0);
+    if(root == NULL)
+        return false;
+
+    free_frame(s_root_frame);
+    s_root_frame = root;
+    root->parent = NULL;
+    g_cur_win = cur != NULL ? cur : frame_win(left_test(root));
+    g_cur_buf = buffer_get(g_cur_win->bufnr);
+    return true;
+}
+
+void bufwin_handle_load_progress(BufNr bufnr, bool done)
+{
+    refresh_loaded_windows(s_root_frame, bufnr, done);
+    // The file may have changed while it was being read.
+    if(done)
+        check_buffer(bufnr);
 }
 
 void bufwin_key_press(uint16_t keycode, uint32_t mods)
@@ -349,10 +501,53 @@ void bufwin_key_press(uint16_t keycode, uint32_t mods)
             {
                 save_buffer(bufnr);
             }
+            else if(keycode == GEM_KEY_W)
+            {
+                // The index is rebuilt lazily next time wrapping is turned on.
+                g_cur_win->wrap_lines = !g_cur_win->wrap_lines;
+                wrap_index_reset(&g_cur_win->wrap, 0);
+                fold_set_clear(&g_cur_win->folds);
+                g_cur_win->view.start.column = 0;
+                g_cur_win->view.start_row = 0;
+                bufwin_put_cursor_in_view(g_cur_win);
+                gem_request_redraw();
+            }
+            else if(keycode == GEM_KEY_F && !g_cur_win->wrap_lines)
+            {
+                FoldSet* fs = &g_cur_win->folds;
+                Cursor* c = &g_cur_win->cursor;
+                sync_folds(g_cur_win);
+                if(mods & GEM_MOD_SHIFT)
+                {
+                    // Folds everything under unindented lines, or opens it all.
+                    if(fs->size > 0)
+                        fold_set_clear(fs);
+                    else
+                        fold_top_level(fs, pt);
+                }
+                else if(!fold_set_open(fs, c->pos.line))
+                {
+                    size_t end = fold_indent_block(pt, c->pos.line);
+                    if(end > (size_t)c->pos.line)
+                        fold_set_add(fs, c->pos.line + 1, end);
+                }
+
+                // A new fold can swallow the cursor, it goes up to the header.
+                const Fold* fold = fold_set_find(fs, c->pos.line);
+                if(fold != NULL)
+                {
+                    c->vis.line = fold->start - 1;
+                    bufwin_cursor_refresh(g_cur_win);
+                }
+                bufwin_set_view(g_cur_win, g_cur_win->view.start.line, g_cur_win->view.start.column);
+                bufwin_put_cursor_in_view(g_cur_win);
+                g_cur_win->damage.valid = false;
+                gem_request_redraw();
+            }
             else if(keycode == GEM_KEY_O)
             {
                 g_cur_win->mode = WIN_MODE_FILEMAN;
-                scan_bufwin_dir(g_cur_win);
+                set_fileman_dir(g_cur_win, NULL);
                 gem_request_redraw();
             }
             else if(keycode == GEM_KEY_D && mods & GEM_MOD_SHIFT && pt->size > 0)
@@ -371,7 +566,7 @@ void bufwin_key_press(uint16_t keycode, uint32_t mods)
                         go_down = true;
                     }
                 }
-                piece_tree_delete(pt, start, count);
+                buffer_delete(bufnr, start, count);
                 if(go_down)
                     bufwin_move_cursor_line(g_cur_win, -1);
                 else
@@ -428,11 +623,16 @@ void bufwin_key_press(uint16_t keycode, uint32_t mods)
                 if(node != NULL)
                     node_start = node->length - 1;
             }
+            // Anything but indentation goes one whole codepoint at a time.
+            size_t offset = g_cur_win->cursor.offset;
             if(cnt == 0)
-                cnt++;
+            {
+                size_t chars = piece_tree_chars_before(pt, offset);
+                cnt = chars > 0 ? offset - piece_tree_offset_of_char(pt, chars - 1) : offset;
+            }
 
-            buffer_delete(bufnr, g_cur_win->cursor.offset - cnt, cnt);
-            bufwin_move_cursor_horiz(g_cur_win, -cnt);
+            buffer_delete(bufnr, offset - cnt, cnt);
+            set_cursor_offset(g_cur_win, offset - cnt);
         }
         else if(keycode == GEM_KEY_RIGHT)
             bufwin_move_cursor_horiz(g_cur_win, 1);
@@ -453,7 +653,7 @@ void bufwin_key_press(uint16_t keycode, uint32_t mods)
         {
             if(keycode == GEM_KEY_O)
             {
-                g_cur_win->mode = WIN_MODE_NORMAL;
+                leave_fileman(g_cur_win);
                 gem_request_redraw();
             }
             return;
@@ -483,17 +683,15 @@ void bufwin_key_press(uint16_t keycode, uint32_t mods)
             }
             if(is_dir(e))
             {
-                free(g_cur_win->local_dir);
-                g_cur_win->local_dir = resolved;
-                scan_bufwin_dir(g_cur_win);
+                set_fileman_dir(g_cur_win, resolved);
                 g_cur_win->sel_entry = 0;
             }
             else
             {
                 bufwin_open(resolved);
                 free(resolved);
-                g_cur_win->mode = WIN_MODE_NORMAL;
                 g_cur_win->local_dir[len] = '\0';
+                leave_fileman(g_cur_win);
             }
             gem_request_redraw();
         }
@@ -518,6 +716,21 @@ void bufwin_mouse_press(uint32_t button, uint32_t mods, int sequence, int x, int
             pos.column = g_cur_win->view.start.column + (x - g_cur_win->contents_bb.bl.x) / gem_get_font()->advance;
             clamp_val(&pos.line, g_cur_win->view.start.line, g_cur_win->view.start.line + g_cur_win->view.count.line);
             clamp_val(&pos.column, g_cur_win->view.start.column, g_cur_win->view.start.column + g_cur_win->view.count.column);
+            if(g_cur_win->wrap_lines)
+            {
+                // The rows above the click are on screen, so they were measured.
+                sync_wrap(g_cur_win);
+                uint64_t line_row;
+                uint64_t row = view_top_row(g_cur_win) + pos.line - g_cur_win->view.start.line;
+                pos.line = wrap_index_line_at_row(&g_cur_win->wrap, row, &line_row);
+                pos.column += (row - line_row) * g_cur_win->wrap.width;
+            }
+            else
+            {
+                sync_folds(g_cur_win);
+                uint64_t row = fold_set_row_of_line(&g_cur_win->folds, g_cur_win->view.start.line);
+                pos.line = fold_set_line_at_row(&g_cur_win->folds, row + pos.line - g_cur_win->view.start.line);
+            }
             bufwin_set_cursor_bp(g_cur_win, pos);
         }
         else
@@ -563,6 +776,14 @@ static void render_frame(WinFrame* frame)
     if(frame->type == FRAME_TYPE_LEAF)
     {
         BufferWin* win = frame_win(frame);
+        if(win->wrap_lines && win->mode == WIN_MODE_NORMAL)
+            measure_view(win);
+        sync_folds(win);
+        update_damage(win, win == g_cur_win);
+        if(win->line_cache == NULL)
+            win->line_cache = line_cache_create();
+        if(win->surface == NULL)
+            win->surface = renderer_create_surface();
         renderer_draw_bufwin(win, win == g_cur_win);
     }
     else
@@ -633,63 +854,280 @@ static void update_frame(WinFrame* frame, GemQuad* cur)
     update_frame(frame->right, &next);
 }
 
-static BufferPos actual_to_vis(const PieceTree* pt, BufferPos actual)
+static BufferPos actual_to_vis(Buffer* buf, BufferPos actual)
 {
     BufferPos res;
     res.line = actual.line; // If I add line wrapping this can change
-    res.column = 0;
-    size_t start;
-    const PTNode* node = piece_tree_node_at_line(pt, actual.line, &start);
-    int64_t cur_off = 0;
-    while(node != NULL && cur_off < actual.column)
-    {
-        const char* buf = piece_tree_get_node_start(pt, node);
-        for(size_t i = start; cur_off < actual.column && i < node->length; ++i)
-        {
-            if(buf[i] == '\t')
-                res.column += 4 - res.column % 4;
-            else if(buf[i] == '\n')
-                return res;
-            else
-                res.column++;
+    res.column = vis_index_to_vis(&buf->vis, &buf->contents, buf->version, actual);
+    return res;
+}
+
+static BufferPos vis_to_actual(Buffer* buf, BufferPos vis)
+{
+    BufferPos res;
+    res.line = vis.line; // If we add line wrapping this can change
+    res.column = vis_index_to_actual(&buf->vis, &buf->contents, buf->version, vis);
+    return res;
+}
 
-            cur_off++;
+static void set_cursor_offset(BufferWin* bufwin, size_t offset)
+{
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    PieceTree* pt = &buf->contents;
+    Cursor* c = &bufwin->cursor;
+    c->offset = offset;
+    c->pos = piece_tree_get_buffer_pos(pt, c->offset);
+    c->vis = actual_to_vis(buf, c->pos);
+    c->horiz = c->vis.column;
+    sync_folds(bufwin);
+    if(fold_set_reveal(&bufwin->folds, c->pos.line))
+        bufwin->damage.valid = false;
+    bufwin_put_cursor_in_view(bufwin);
+    if(bufwin->frame.visible)
+        gem_request_redraw();
+}
+
+// Catches the wrap index up with the buffer. Recent edits are replayed so
+// only the lines they touched need measuring again, anything older or not
+// in the edit log starts the index over.
+static void sync_wrap(BufferWin* bufwin)
+{
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    const PieceTree* pt = &buf->contents;
+    WrapIndex* wi = &bufwin->wrap;
+    wrap_index_set_width(wi, bufwin->view.count.column > 0 ? bufwin->view.count.column : 1);
+
+    bool fresh = wi->line_total == 0 || wi->version > buf->version;
+    if(!fresh && wi->version == buf->version && wi->size != pt->size)
+    {
+        // Streaming a file in only adds to its end and leaves the version be.
+        if(pt->line_cnt >= wi->line_total)
+            wrap_index_edit(wi, wi->line_total - 1, 0, pt->line_cnt - wi->line_total);
+        else
+            fresh = true;
+    }
+    for(uint64_t v = wi->version + 1; !fresh && v <= buf->version; ++v)
+    {
+        const BufferEdit* edit = buffer_get_edit(buf, v);
+        if(edit != NULL)
+            wrap_index_edit(wi, edit->line, edit->removed_lines, edit->added_lines);
+        else
+            fresh = true;
+    }
+    if(fresh || wi->line_total != pt->line_cnt)
+        wrap_index_reset(wi, pt->line_cnt);
+    wi->version = buf->version;
+    wi->size = pt->size;
+}
+
+// Moves folds along with the edits made since they were last looked at.
+// Edits gone from the log, like a reload, open every fold. Opening one
+// moves every row below it, so the window is drawn in full.
+static void sync_folds(BufferWin* bufwin)
+{
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    FoldSet* fs = &bufwin->folds;
+    bool opened = false;
+    for(uint64_t v = fs->version + 1; fs->size > 0 && v <= buf->version; ++v)
+    {
+        const BufferEdit* edit = buffer_get_edit(buf, v);
+        if(edit != NULL)
+            opened |= fold_set_edit(fs, edit->line, edit->removed_lines, edit->added_lines);
+        else
+        {
+            fold_set_clear(fs);
+            opened = true;
         }
-        start = 0;
-        node = piece_tree_next_inorder(pt, node);
     }
+    if(fs->version > buf->version && fs->size > 0)
+    {
+        fold_set_clear(fs);
+        opened = true;
+    }
+    if(opened)
+        bufwin->damage.valid = false;
+    fs->version = buf->version;
+}
 
-    return res;
+// Rows line wraps into, measuring it if the index only has a guess.
+static uint32_t measure_line(BufferWin* bufwin, size_t line)
+{
+    WrapIndex* wi = &bufwin->wrap;
+    if(wrap_index_is_exact(wi, line))
+        return wrap_index_line_rows(wi, line);
+
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    BufferPos end = { line, piece_tree_get_line_length(&buf->contents, line) };
+    uint32_t rows = actual_to_vis(buf, end).column / wi->width + 1;
+    wrap_index_set_rows(wi, line, rows);
+    return rows;
+}
 
+// Only what's on screen gets measured, the rest keeps its guess until
+// scrolled to.
+static void measure_view(BufferWin* bufwin)
+{
+    sync_wrap(bufwin);
+    View* view = &bufwin->view;
+    size_t line_cnt = bufwin->wrap.line_total;
+    int64_t rows = measure_line(bufwin, view->start.line);
+    if(view->start_row >= rows)
+        view->start_row = rows - 1;
+
+    int64_t shown = rows - view->start_row;
+    for(size_t line = view->start.line + 1; shown < view->count.line && line < line_cnt; ++line)
+        shown += measure_line(bufwin, line);
 }
 
-static BufferPos vis_to_actual(const PieceTree* pt, BufferPos vis)
+static uint64_t view_top_row(const BufferWin* bufwin)
 {
-    BufferPos res;
-    res.line = vis.line; // If we add line wrapping this can change
-    res.column = 0;
-    size_t start;
-    const PTNode* node = piece_tree_node_at_line(pt, vis.line, &start);
-    int64_t cur_vis = 0;
-    while(node != NULL && cur_vis < vis.column)
-    {
-        const char* buf = piece_tree_get_node_start(pt, node);
-        for(size_t i = start; cur_vis < vis.column && i < node->length; ++i)
+    return wrap_index_row_of_line(&bufwin->wrap, bufwin->view.start.line) + bufwin->view.start_row;
+}
+
+static void set_view_row(BufferWin* bufwin, uint64_t row)
+{
+    uint64_t line_row;
+    int64_t line = wrap_index_line_at_row(&bufwin->wrap, row, &line_row);
+    int64_t start_row = row - line_row;
+    if(start_row >= wrap_index_line_rows(&bufwin->wrap, line))
+        start_row = wrap_index_line_rows(&bufwin->wrap, line) - 1;
+    if(line != bufwin->view.start.line || start_row != bufwin->view.start_row)
+    {
+        bufwin->view.start.line = line;
+        bufwin->view.start.column = 0;
+        bufwin->view.start_row = start_row;
+        if(bufwin->frame.visible)
+            gem_request_redraw();
+    }
+}
+
+// Row of line's first row counted from the top of the view, can be negative
+// or past the bottom. Only meant for lines near the view when wrapping.
+static int64_t row_in_view(const BufferWin* bufwin, size_t line)
+{
+    if(bufwin->wrap_lines)
+        return (int64_t)wrap_index_row_of_line(&bufwin->wrap, line) - view_top_row(bufwin);
+    return (int64_t)fold_set_row_of_line(&bufwin->folds, line) - 
+           (int64_t)fold_set_row_of_line(&bufwin->folds, bufwin->view.start.line);
+}
+
+static void damage_rows(WinDamage* d, int64_t first, int64_t last)
+{
+    if(first < 0)
+        first = 0;
+    if(last >= DAMAGE_MAX_ROWS)
+        last = DAMAGE_MAX_ROWS - 1;
+    for(int64_t row = first; row <= last; ++row)
+        d->rows[row / 64] |= (uint64_t)1 << (row % 64);
+}
+
+// Works out which rows of the window changed since it was last drawn.
+// Edits come from the buffer's edit log: one that stays on its line only
+// damages that row, one that adds or removes lines damages everything
+// below it. The cursor damages the row it left and the one it is on, and
+// scrolling moves the old image instead of drawing it again.
+static void update_damage(BufferWin* bufwin, bool active)
+{
+    WinDamage* d = &bufwin->damage;
+    const View* view = &bufwin->view;
+    Buffer* buf = buffer_get(bufwin->bufnr);
+    const PieceTree* pt = &buf->contents;
+    int64_t rows = view->count.line;
+
+    memset(d->rows, 0, sizeof(d->rows));
+    d->scroll = 0;
+    d->full = !d->valid || bufwin->mode != WIN_MODE_NORMAL || d->mode != bufwin->mode ||
+              d->active != active || d->wrap_lines != bufwin->wrap_lines ||
+              rows > DAMAGE_MAX_ROWS || d->view.count.line != rows ||
+              d->view.count.column != view->count.column ||
+              d->view.start.column != view->start.column || !same_shape(d, bufwin);
+
+    if(!d->full && (d->view.start.line != view->start.line || d->view.start_row != view->start_row))
+    {
+        // Only worth it while the lines in between are the same ones that
+        // were drawn, and were measured if wrapping.
+        int64_t scroll = -row_in_view(bufwin, d->view.start.line);
+        if(bufwin->wrap_lines)
+            scroll -= d->view.start_row;
+        if(d->version == buf->version && d->size == pt->size && scroll > -rows + 1 && scroll < rows - 1)
         {
-            if(buf[i] == '\t')
-                cur_vis += 4 - cur_vis % 4;
-            else if(buf[i] == '\n')
-                return res;
+            d->scroll = scroll;
+            if(scroll > 0)
+                damage_rows(d, rows - scroll - 1, rows - 1);
             else
-                cur_vis++;
+                damage_rows(d, 0, -scroll);
+        }
+        else
+            d->full = true;
+    }
 
-            res.column++;
+    for(uint64_t v = d->version + 1; !d->full && v <= buf->version; ++v)
+    {
+        const BufferEdit* edit = buffer_get_edit(buf, v);
+        if(edit == NULL)
+        {
+            d->full = true;
+            break;
         }
-        start = 0;
-        node = piece_tree_next_inorder(pt, node);
+        // Later edits can have joined away the line this one was on, the
+        // rows past the end are theirs to damage. A wrapped line can change
+        // how many rows it takes.
+        size_t line = edit->line < pt->line_cnt ? edit->line : pt->line_cnt - 1;
+        int64_t row = row_in_view(bufwin, line);
+        bool same_rows = edit->removed_lines == 0 && edit->added_lines == 0 && !bufwin->wrap_lines;
+        damage_rows(d, row, same_rows ? row : rows - 1);
+    }
+    if(!d->full && d->version == buf->version && d->size != pt->size)
+    {
+        // Streamed in, the old last line and everything after it.
+        damage_rows(d, row_in_view(bufwin, d->line_cnt - 1), rows - 1);
     }
 
-    return res;
+    const Cursor* c = &bufwin->cursor;
+    int64_t cursor_row = row_in_view(bufwin, c->vis.line);
+    if(bufwin->wrap_lines)
+        cursor_row += c->vis.column / bufwin->wrap.width;
+    if(!d->full && cursor_row != d->cursor_row - d->scroll)
+    {
+        damage_rows(d, d->cursor_row - d->scroll, d->cursor_row - d->scroll);
+        damage_rows(d, cursor_row, cursor_row);
+    }
+
+    d->valid = true;
+    d->active = active;
+    d->wrap_lines = bufwin->wrap_lines;
+    d->mode = bufwin->mode;
+    d->view = *view;
+    d->bb = bufwin->frame.bounding_box;
+    d->contents_bb = bufwin->contents_bb;
+    d->cursor_row = cursor_row;
+    d->version = buf->version;
+    d->size = pt->size;
+    d->line_cnt = pt->line_cnt;
+}
+
+// Whether the window is laid out the same as when last drawn, wherever it
+// is now. Its surface goes wherever it moved to.
+static bool same_shape(const WinDamage* d, const BufferWin* bufwin)
+{
+    const GemQuad* bb = &bufwin->frame.bounding_box;
+    const GemQuad* cb = &bufwin->contents_bb;
+    int dx = bb->bl.x - d->bb.bl.x;
+    int dy = bb->tr.y - d->bb.tr.y;
+    return bb->tr.x - dx == d->bb.tr.x && bb->bl.y - dy == d->bb.bl.y &&
+           cb->bl.x - dx == d->contents_bb.bl.x && cb->tr.x - dx == d->contents_bb.tr.x &&
+           cb->bl.y - dy == d->contents_bb.bl.y && cb->tr.y - dy == d->contents_bb.tr.y;
+}
+
+static void damage_frame(WinFrame* frame)
+{
+    if(frame->type != FRAME_TYPE_LEAF)
+    {
+        damage_frame(frame->left);
+        damage_frame(frame->right);
+    }
+    else
+        frame_win(frame)->damage.valid = false;
 }
 
 static void clamp_val(int64_t* val, int64_t min, int64_t max)
@@ -703,11 +1141,257 @@ static void clamp_val(int64_t* val, int64_t min, int64_t max)
 
 static void bufwin_free(BufferWin* bufwin)
 {
+    watcher_unwatch(bufwin->dir_wd);
     free(bufwin->local_dir);
     da_free_data(&bufwin->dir_entries);
+    wrap_index_free(&bufwin->wrap);
+    fold_set_free(&bufwin->folds);
+    line_cache_free(bufwin->line_cache);
+    renderer_free_surface(bufwin->surface);
     free(bufwin);
 }
 
+// Takes ownership of dir, NULL rescans the current directory.
+static void set_fileman_dir(BufferWin* bufwin, char* dir)
+{
+    if(dir != NULL)
+    {
+        free(bufwin->local_dir);
+        bufwin->local_dir = dir;
+    }
+    watcher_unwatch(bufwin->dir_wd);
+    scan_bufwin_dir(bufwin);
+    bufwin->dir_wd = bufwin->local_dir ? watcher_watch_dir(bufwin->local_dir) : -1;
+    if(bufwin->sel_entry >= bufwin->dir_entries.size)
+        bufwin->sel_entry = 0;
+}
+
+static void leave_fileman(BufferWin* bufwin)
+{
+    bufwin->mode = WIN_MODE_NORMAL;
+    watcher_unwatch(bufwin->dir_wd);
+    bufwin->dir_wd = -1;
+}
+
+static void watch_event_frame(WinFrame* frame, int wd, const char* name, int event)
+{
+    if(frame->type != FRAME_TYPE_LEAF)
+    {
+        watch_event_frame(frame->left, wd, name, event);
+        watch_event_frame(frame->right, wd, name, event);
+        return;
+    }
+
+    BufferWin* win = frame_win(frame);
+    if(event == WATCH_EVENT_OVERFLOW)
+    {
+        check_buffer(win->bufnr);
+        if(win->mode == WIN_MODE_FILEMAN)
+            set_fileman_dir(win, NULL);
+    }
+    else if(event == WATCH_EVENT_UNWATCHED)
+    {
+        // Rescanning watches the directory again if it is back already.
+        if(win->dir_wd == wd)
+        {
+            win->dir_wd = -1;
+            if(win->mode == WIN_MODE_FILEMAN)
+                set_fileman_dir(win, NULL);
+        }
+    }
+    else if(win->mode == WIN_MODE_FILEMAN && win->dir_wd == wd)
+        update_bufwin_dir_entry(win, name, event);
+}
+
+static void check_buffer(BufNr bufnr)
+{
+    LineDiff diff;
+    if(buffer_check_disk(bufnr, &diff) != DISK_RELOADED)
+        return;
+    refresh_buffer_windows(s_root_frame, bufnr, &diff);
+    da_free_data(&diff);
+}
+
+// True if a window shows a stale buffer that wasn't checked yet, handle
+// checks them.
+static bool check_stale(WinFrame* frame, bool handle)
+{
+    if(frame->type != FRAME_TYPE_LEAF)
+    {
+        bool left = check_stale(frame->left, handle);
+        return check_stale(frame->right, handle) || left;
+    }
+
+    BufferWin* win = frame_win(frame);
+    Buffer* buf = buffer_get(win->bufnr);
+    if(!piece_tree_is_stale(&buf->contents) || (buf->file_flags & FF_DISK_CHANGED))
+        return false;
+    if(handle)
+        check_buffer(win->bufnr);
+    return true;
+}
+
+// Carries cursors and views across a reload by following the line diff.
+static void refresh_buffer_windows(WinFrame* frame, BufNr bufnr, const LineDiff* diff)
+{
+    if(frame->type != FRAME_TYPE_LEAF)
+    {
+        refresh_buffer_windows(frame->left, bufnr, diff);
+        refresh_buffer_windows(frame->right, bufnr, diff);
+        return;
+    }
+
+    BufferWin* win = frame_win(frame);
+    if(win->bufnr != bufnr)
+        return;
+
+    const PieceTree* pt = &buffer_get(bufnr)->contents;
+    win->cursor.vis.line = line_diff_map_line(diff, win->cursor.vis.line);
+    clamp_val(&win->cursor.vis.line, 0, pt->line_cnt - 1);
+    bufwin_cursor_refresh(win);
+    bufwin_update_view(win);
+    bufwin_set_view(win, line_diff_map_line(diff, win->view.start.line), win->view.start.column);
+}
+
+// Line number widths follow the line count as it grows. Replaying a journal
+// at the end of the load can move lines around, so cursors get clamped then.
+static void refresh_loaded_windows(WinFrame* frame, BufNr bufnr, bool done)
+{
+    if(frame->type != FRAME_TYPE_LEAF)
+    {
+        refresh_loaded_windows(frame->left, bufnr, done);
+        refresh_loaded_windows(frame->right, bufnr, done);
+        return;
+    }
+
+    BufferWin* win = frame_win(frame);
+    if(win->bufnr != bufnr)
+        return;
+
+    bufwin_update_view(win);
+    // Catches the index up while the size alone says what changed.
+    if(win->wrap_lines)
+        sync_wrap(win);
+    if(done)
+    {
+        const PieceTree* pt = &buffer_get(bufnr)->contents;
+        clamp_val(&win->cursor.vis.line, 0, pt->line_cnt - 1);
+        bufwin_cursor_refresh(win);
+        bufwin_set_view(win, win->view.start.line, win->view.start.column);
+    }
+}
+
+// Frames are written in preorder. Only what can't be recomputed is kept,
+// bounding boxes and view sizes come back with the next screen update.
+static void serialize_frame(const WinFrame* frame, StringBuilder* out)
+{
+    serial_put_u64(out, frame->type);
+    if(frame->type != FRAME_TYPE_LEAF)
+    {
+        serialize_frame(frame->left, out);
+        serialize_frame(frame->right, out);
+        return;
+    }
+
+    const BufferWin* win = frame_win(frame);
+    serial_put_u64(out, win->bufnr);
+    serial_put_u64(out, win->mode);
+    serial_put_u64(out, win == g_cur_win);
+    serial_put_u64(out, win->cursor.vis.line);
+    serial_put_u64(out, win->cursor.horiz);
+    serial_put_u64(out, win->view.start.line);
+    serial_put_u64(out, win->view.start.column);
+    serial_put_u64(out, win->sel_entry);
+    serial_put_bytes(out, win->local_dir, win->local_dir ? strlen(win->local_dir) : 0);
+}
+
+static WinFrame* deserialize_frame(SerialReader* in, const BufNr* map, size_t map_size,
+                                   BufferWin** cur, int depth)
+{
+    uint64_t type = serial_get_u64(in);
+    if(!in->ok || depth > 64 || type > FRAME_TYPE_HSPLIT)
+        return NULL;
+
+    if(type != FRAME_TYPE_LEAF)
+    {
+        WinFrame* frame = calloc(1, sizeof(WinFrame));
+        GEM_ENSURE(frame != NULL);
+        frame->type = type;
+        frame->left = deserialize_frame(in, map, map_size, cur, depth + 1);
+        frame->right = frame->left ? deserialize_frame(in, map, map_size, cur, depth + 1) : NULL;
+        if(frame->right == NULL)
+        {
+            if(frame->left != NULL)
+                free_frame(frame->left);
+            free(frame);
+            return NULL;
+        }
+        frame->left->parent = frame;
+        frame->right->parent = frame;
+        return frame;
+    }
+
+    uint64_t bufnr = serial_get_u64(in);
+    uint64_t mode = serial_get_u64(in);
+    uint64_t is_cur = serial_get_u64(in);
+    int64_t cursor_line = serial_get_u64(in);
+    int64_t horiz = serial_get_u64(in);
+    int64_t view_line = serial_get_u64(in);
+    int64_t view_col = serial_get_u64(in);
+    size_t sel_entry = serial_get_u64(in);
+    size_t dir_len;
+    const char* dir = serial_get_bytes(in, &dir_len);
+    if(!in->ok || dir_len >= GEM_PATH_MAX || mode > WIN_MODE_FILEMAN)
+        return NULL;
+
+    BufferWin* win = calloc(1, sizeof(BufferWin));
+    GEM_ENSURE(win != NULL);
+    win->text_padding = DEFAULT_PADDING;
+    win->dir_wd = -1;
+    da_init(&win->dir_entries, 0);
+    if(dir_len == 0)
+        win->local_dir = get_cwd_path();
+    else
+    {
+        win->local_dir = malloc(GEM_PATH_MAX);
+        GEM_ENSURE(win->local_dir != NULL);
+        memcpy(win->local_dir, dir, dir_len);
+        win->local_dir[dir_len] = '\0';
+    }
+    win->frame.type = FRAME_TYPE_LEAF;
+    win->bufnr = bufnr < map_size && map[bufnr] != -1 ? map[bufnr] : buffer_open_empty();
+
+    // The buffer may have been reloaded from a changed file, so everything
+    // is clamped to what's there now.
+    const PieceTree* pt = &buffer_get(win->bufnr)->contents;
+    clamp_val(&cursor_line, 0, pt->line_cnt - 1);
+    win->cursor.vis.line = cursor_line;
+    win->cursor.horiz = horiz < 0 ? 0 : horiz;
+    bufwin_cursor_refresh(win);
+    bufwin_set_view(win, view_line, view_col);
+
+    if(mode == WIN_MODE_FILEMAN)
+    {
+        win->mode = WIN_MODE_FILEMAN;
+        win->sel_entry = sel_entry;
+        set_fileman_dir(win, NULL);
+    }
+    if(is_cur)
+        *cur = win;
+    return &win->frame;
+}
+
+static void free_frame(WinFrame* frame)
+{
+    if(frame->type == FRAME_TYPE_LEAF)
+    {
+        bufwin_free(frame_win(frame));
+        return;
+    }
+    free_frame(frame->left);
+    free_frame(frame->right);
+    free(frame);
+}
 
 static WinFrame* left_test(WinFrame* start)
 {
@@ -1,8 +1,10 @@
 #pragma once
 #include "buffer.h"
 #include "structs/da.h"
+#include "structs/foldset.h"
 #include "structs/piecetree.h"
 #include "structs/quad.h"
+#include "structs/wrapindex.h"
 
 #include <limits.h>
 #include <sys/stat.h>
@@ -13,6 +15,7 @@
 typedef struct Cursor    Cursor;
 typedef struct View      View;
 typedef struct WinFrame  WinFrame;
+typedef struct WinDamage WinDamage;
 typedef struct BufferWin BufferWin;
 typedef struct DirEntry  DirEntry;
 typedef struct EntryDA   EntryDA;
@@ -29,6 +32,7 @@ struct View
 {
     BufferPos start;
     BufferPos count;
+    int64_t   start_row; // Rows of start.line scrolled past when wrapping lines
 };
 
 enum
@@ -54,6 +58,32 @@ struct WinFrame
     bool       visible;
 };
 
+#define DAMAGE_MAX_ROWS 512 // Taller views are always drawn in full
+
+// What has to be drawn for a window this frame. The renderer keeps the last
+// frame around, so a window nothing happened to is skipped, and otherwise
+// only the rows that changed get drawn over it.
+struct WinDamage
+{
+    uint64_t rows[DAMAGE_MAX_ROWS / 64]; /* Bit per view row, ignored when full */
+    int64_t  scroll;   /* Rows the old image moves up before drawing, negative moves it down */
+    bool     full;
+
+    // What the window looked like when last drawn, valid is cleared to
+    // have it drawn in full next frame.
+    bool     valid;
+    bool     active;
+    bool     wrap_lines;
+    uint8_t  mode;
+    View     view;
+    GemQuad  bb;
+    GemQuad  contents_bb;
+    int64_t  cursor_row;
+    uint64_t version;
+    size_t   size;
+    size_t   line_cnt;
+};
+
 struct DirEntry
 {
     struct stat stats;
@@ -82,6 +112,14 @@ struct BufferWin
     char*       local_dir;
     EntryDA     dir_entries;
     size_t      sel_entry;
+    int         dir_wd;
+
+    WrapIndex   wrap;    // Only kept up to date while wrap_lines is set
+    bool        wrap_lines;
+    FoldSet     folds;   // Always empty while wrap_lines is set
+    WinDamage   damage;
+    struct LineCache* line_cache; // Glyphs of lines last drawn, made on first draw
+    struct WinSurface* surface;   // Window's last frame, made on first draw
 
     int         bufnr; 
     uint8_t     mode;
@@ -109,14 +147,30 @@ void bufwin_put_cursor_in_view(BufferWin* bufwin);
 void bufwin_update_view(BufferWin* bufwin);
 
 void bufwin_render_all(void);
+// Has every window drawn in full next frame.
+void bufwin_damage_all(void);
 void bufwin_update_screen(int width, int height);
 
+// Session snapshots of the split tree, cursors and views. bufnrs are
+// translated through map, which comes from buffer_list_deserialize.
+void bufwin_serialize(StringBuilder* out);
+bool bufwin_deserialize(SerialReader* in, const BufNr* map, size_t map_size);
+
+void bufwin_handle_watch_event(int wd, const char* name, int event);
+// Called as a streamed buffer grows, and once more when it is done.
+void bufwin_handle_load_progress(BufNr bufnr, bool done);
 void bufwin_key_press(uint16_t keycode, uint32_t mods);
 void bufwin_mouse_press(uint32_t button, uint32_t mods, int sequence, int x, int y);
 
 void bufwin_print_cursor_loc(const BufferWin* bufwin);
 void bufwin_print_view(const BufferWin* bufwin);
 
+static inline bool bufwin_row_damaged(const BufferWin* bufwin, int64_t row)
+{
+    const WinDamage* d = &bufwin->damage;
+    return d->full || (row >= 0 && row < DAMAGE_MAX_ROWS && (d->rows[row / 64] >> (row % 64) & 1));
+}
+
 static inline void bufwin_set_cursor_bp(BufferWin* bufwin, BufferPos pos)
 { 
     bufwin_set_cursor(bufwin, pos.line, pos.column);
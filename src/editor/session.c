@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+#include "session.h"
+#include "buffer.h"
+#include "bufferwin.h"
+#include "core/core.h"
+#include "fileman/path.h"
+#include "structs/serial.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SESSION_MAGIC      "GEMSESS"
+#define SESSION_VERSION    1
+#define SESSION_BYTE_ORDER 0x0102030405060708ull
+#define SESSION_HEADER_LEN 40
+
+/*
+ * Layout, all in 8 byte words:
+ *   magic, format version, byte order mark, sizeof(size_t),
+ *   checksum of the payload, then the payload: the buffer list followed by
+ *   the window tree.
+ * Nothing in it is a pointer, trees refer to their nodes by index.
+ */
+
+static bool session_path(char* path, bool create_dir);
+
+void session_save(void)
+{
+    char path[GEM_PATH_MAX];
+    if(!session_path(path, true))
+        return;
+
+    StringBuilder out;
+    da_init(&out, 1 << 12);
+    da_append_arr(&out, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+    serial_put_u64(&out, SESSION_VERSION);
+    serial_put_u64(&out, SESSION_BYTE_ORDER);
+    serial_put_u64(&out, sizeof(size_t));
+    serial_put_u64(&out, 0); // Checksum, filled in below
+    GEM_ASSERT(out.size == SESSION_HEADER_LEN);
+
+    buffer_list_serialize(&out);
+    bufwin_serialize(&out);
+    uint64_t sum = serial_checksum(out.data + SESSION_HEADER_LEN, out.size - SESSION_HEADER_LEN);
+    memcpy(out.data + SESSION_HEADER_LEN - sizeof(sum), &sum, sizeof(sum));
+
+    // Written next to the real path and renamed over it so a crash can't
+    // leave half a session behind.
+    char temp_path[GEM_PATH_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    bool success = fd >= 0;
+    size_t written = 0;
+    while(success && written < out.size)
+    {
+        ssize_t res = write(fd, out.data + written, out.size - written);
+        success = res > 0;
+        written += success ? (size_t)res : 0;
+    }
+    if(fd >= 0 && close(fd) < 0)
+        success = false;
+    if(!success || rename(temp_path, path) < 0)
+    {
+        fprintf(stderr, "Failed to save session: %s\n", path);
+        unlink(temp_path);
+    }
+    da_free_data(&out);
+}
+
+bool session_restore(void)
+{
+    char path[GEM_PATH_MAX];
+    if(!session_path(path, false))
+        return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= SESSION_HEADER_LEN)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    // A session is only good for one start, whatever happens after this the
+    // buffers' journals are the source of truth.
+    unlink(path);
+    if(map == MAP_FAILED)
+        return false;
+
+    const char* data = map;
+    size_t size = st.st_size;
+    SerialReader in = { data + sizeof(SESSION_MAGIC), data + size, true };
+    bool valid = memcmp(data, SESSION_MAGIC, sizeof(SESSION_MAGIC)) == 0 &&
+                 serial_get_u64(&in) == SESSION_VERSION &&
+                 serial_get_u64(&in) == SESSION_BYTE_ORDER &&
+                 serial_get_u64(&in) == sizeof(size_t);
+    valid = valid && serial_get_u64(&in) == serial_checksum(data + SESSION_HEADER_LEN, size - SESSION_HEADER_LEN);
+    if(!valid)
+    {
+        fprintf(stderr, "Ignoring session from an incompatible version or damaged: %s\n", path);
+        munmap(map, size);
+        return false;
+    }
+
+    size_t map_size;
+    BufNr* bufnr_map = buffer_list_deserialize(&in, &map_size);
+    bool restored = bufwin_deserialize(&in, bufnr_map, map_size);
+    if(!restored)
+    {
+        // Keep at least the buffers reachable.
+        for(size_t i = 0; i < map_size && !restored; ++i)
+        {
+            if(bufnr_map[i] == -1)
+                continue;
+            g_cur_win->bufnr = bufnr_map[i];
+            g_cur_buf = buffer_get(bufnr_map[i]);
+            restored = true;
+        }
+    }
+
+    free(bufnr_map);
+    munmap(map, size);
+    return restored;
+}
+
+static bool session_path(char* path, bool create_dir)
+{
+    const char* state = getenv("XDG_STATE_HOME");
+    const char* home = getenv("HOME");
+    int len;
+    if(state != NULL && state[0] == '/')
+        len = snprintf(path, GEM_PATH_MAX, "%s/gem", state);
+    else if(home != NULL && home[0] == '/')
+        len = snprintf(path, GEM_PATH_MAX, "%s/.local/state/gem", home);
+    else
+        return false;
+    if(len >= GEM_PATH_MAX - 9)
+        return false;
+
+    if(create_dir)
+    {
+        // Create each missing component, ~/.local/state may not exist yet.
+        for(char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+        {
+            *slash = '\0';
+            mkdir(path, S_IRWXU);
+            *slash = '/';
+        }
+        mkdir(path, S_IRWXU);
+    }
+    strcat(path, "/session");
+    return true;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdbool.h>
+
+// The session is written on a clean exit and consumed by the next start
+// without a file argument. Returns false when there was nothing to restore.
+void session_save(void);
+bool session_restore(void);
@@ -1,11 +1,75 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE   700
 #include "fileio.h"
+#include "journal.h"
 #include "core/core.h"
+#include "core/app.h"
+#include "core/timing.h"
+#include "core/window.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
-#define MAX_FILE_SIZE (1ull << 25) // This is 32MiB, temporary
+#define TEMP_SUFFIX   ".gem-XXXXXX"
+#define COPY_BUF_SIZE (1 << 20)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct SaveJob SaveJob;
+struct SaveJob
+{
+    BufNr         bufnr;
+    uint64_t      version;    // Buffer version the snapshot was taken at
+    char*         path;
+    bool          is_buf_path;
+    struct iovec* segs;
+    off_t*        src_offs;   // Per segment, where paged original pieces are read from src_fd, -1 otherwise
+    int           src_fd;
+    size_t        seg_cnt;
+    char*         added;      // Copy of the added buffer pieces, segs point into it
+    size_t        bytes;
+
+    // Filled in by the save thread
+    bool          success;
+    int64_t       mtime;
+    size_t        size;
+    uint32_t      syscalls;
+    double        ms;
+
+    SaveJob*      next;
+};
+
+static void  snapshot_tree(PieceTree* pt, SaveJob* job);
+static void  append_seg(SaveJob* job, char* data, off_t src_off, size_t len);
+static void  free_job(SaveJob* job);
+static void* save_thread(void* arg);
+static void  handle_notify(int fd);
+static void  complete_saves(void);
+static bool  write_file_atomic(SaveJob* job);
+static bool  write_segs(int fd, SaveJob* job);
+static bool  write_iovs(int fd, SaveJob* job, struct iovec* cur, size_t remaining);
+static bool  copy_range(int fd, SaveJob* job, off_t src_off, size_t len);
+
+static GemSaveStats    s_save_stats;
+static pthread_t       s_thread;
+static pthread_mutex_t s_mutex;
+static pthread_cond_t  s_queue_cond;
+static pthread_cond_t  s_done_cond;
+static SaveJob*        s_queue_head;
+static SaveJob*        s_queue_tail;
+static SaveJob*        s_done;
+static bool            s_stop;
+static int             s_notify_read = -1;
+static int             s_notify_write = -1;
 
 bool read_entire_file(const char* path, char** src, size_t* size, bool* readonly)
 {
@@ -35,8 +99,10 @@ bool read_entire_file(const char* path, char** src, size_t* size, bool* readonly
         goto end;
     if(file_size == 0)
     {
-        *size = 0;
-        return true;
+        if(size != NULL)
+            *size = 0;
+        success = true;
+        goto end;
     }
 
     if(lseek(fd, 0, SEEK_SET) < 0)
@@ -70,10 +136,70 @@ end:
     return success;
 }
 
+bool get_file_info(const char* path, int64_t* mtime, size_t* size)
+{
+    GEM_ASSERT(path != NULL);
+    struct stat st;
+    if(stat(path, &st) < 0)
+        return false;
+    if(mtime != NULL)
+        *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    if(size != NULL)
+        *size = (size_t)st.st_size;
+    return true;
+}
+
+void fileio_init(void)
+{
+    int fds[2];
+    window_open_wakeup(fds);
+    s_notify_read = fds[0];
+    s_notify_write = fds[1];
+    s_stop = false;
+    s_queue_head = s_queue_tail = s_done = NULL;
+    pthread_mutex_init(&s_mutex, NULL);
+    pthread_cond_init(&s_queue_cond, NULL);
+    pthread_cond_init(&s_done_cond, NULL);
+    GEM_ENSURE(pthread_create(&s_thread, NULL, save_thread, NULL) == 0);
+    window_add_fd_source(s_notify_read, handle_notify);
+}
+
+void fileio_cleanup(void)
+{
+    if(s_notify_read < 0)
+        return;
+
+    // Queued saves still run to completion, exiting must not lose them.
+    pthread_mutex_lock(&s_mutex);
+    s_stop = true;
+    pthread_cond_signal(&s_queue_cond);
+    pthread_mutex_unlock(&s_mutex);
+    pthread_join(s_thread, NULL);
+    complete_saves();
+
+    window_remove_fd_source(s_notify_read);
+    close(s_notify_read);
+    close(s_notify_write);
+    s_notify_read = s_notify_write = -1;
+    pthread_cond_destroy(&s_done_cond);
+    pthread_cond_destroy(&s_queue_cond);
+    pthread_mutex_destroy(&s_mutex);
+}
+
 bool save_buffer_as(BufNr bufnr, const char* path)
 {
     Buffer* buf = buffer_get(bufnr);
-    if(buf->modified == false)
+    if(buf->file_flags & FF_LOADING)
+    {
+        printf("Can't save a buffer that is still loading.\n");
+        return false;
+    }
+    if(piece_tree_is_stale(&buf->contents))
+    {
+        printf("Can't save a buffer whose file changed underneath it.\n");
+        return false;
+    }
+    if(!buffer_is_modified(buf))
         return true;
     if(path == NULL)
     {
@@ -81,44 +207,400 @@ bool save_buffer_as(BufNr bufnr, const char* path)
             return false;
         path = buf->filepath;
     }
+    // Only the same contents to the same place make another save pointless.
+    if(buf->saves_pending > 0 && buf->queued_version == buf->version &&
+       path == buf->filepath && buf->queued_to_file)
+        return true;
 
-    bool success = false;
-    int fd;
+    SaveJob* job = malloc(sizeof(SaveJob));
+    GEM_ENSURE(job != NULL);
+    job->bufnr = bufnr;
+    job->version = buf->version;
+    job->path = strdup(path);
+    GEM_ENSURE(job->path != NULL);
+    job->is_buf_path = path == buf->filepath;
+    job->success = false;
+    job->mtime = 0;
+    job->size = 0;
+    job->syscalls = 0;
+    job->ms = 0.0;
+    job->next = NULL;
+    snapshot_tree(&buf->contents, job);
 
-    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
-    if(fd == -1)
-        return false;
+    buf->saves_pending++;
+    buf->queued_version = buf->version;
+    buf->queued_to_file = job->is_buf_path;
+
+    pthread_mutex_lock(&s_mutex);
+    if(s_queue_tail == NULL)
+        s_queue_head = job;
+    else
+        s_queue_tail->next = job;
+    s_queue_tail = job;
+    pthread_cond_signal(&s_queue_cond);
+    pthread_mutex_unlock(&s_mutex);
+    return true;
+}
 
-    const PieceTree* pt = &buf->contents; 
-    const PTNode* node = piece_tree_next_inorder(pt, NULL);
-    size_t total_written = 0;
-    while(node != NULL)
+void fileio_finish_saves(BufNr bufnr)
+{
+    while(buffer_get(bufnr)->saves_pending > 0)
     {
-        const char* buf = piece_tree_get_node_start(pt, node);
-        size_t written = 0;
-        do
+        pthread_mutex_lock(&s_mutex);
+        while(s_done == NULL)
+            pthread_cond_wait(&s_done_cond, &s_mutex);
+        pthread_mutex_unlock(&s_mutex);
+        complete_saves();
+    }
+}
+
+const GemSaveStats* fileio_get_save_stats(void)
+{
+    return &s_save_stats;
+}
+
+// Freezes the tree's contents for the save thread. Original pieces can be
+// referenced directly since that buffer never changes while saves are
+// pending, but the added buffer moves when it grows so those pieces are
+// copied out. Pieces that end up adjacent in memory are merged.
+// Paged original pieces are read from the file by the save thread instead,
+// the cache's descriptor keeps the old file readable even once it is
+// replaced.
+static void snapshot_tree(PieceTree* pt, SaveJob* job)
+{
+    size_t node_cnt = 0;
+    size_t added_len = 0;
+    for(const PTNode* node = piece_tree_next_inorder(pt, NULL); node != NULL;
+        node = piece_tree_next_inorder(pt, node))
+    {
+        node_cnt++;
+        if(!node->is_original)
+            added_len += node->length;
+    }
+
+    job->segs = malloc(sizeof(struct iovec) * (node_cnt + 1));
+    job->added = malloc(added_len + 1);
+    GEM_ENSURE(job->segs != NULL && job->added != NULL);
+    job->src_fd = -1;
+    job->src_offs = NULL;
+    if(piece_tree_is_paged(pt))
+    {
+        job->src_fd = pt->original.pages->fd;
+        job->src_offs = malloc(sizeof(off_t) * (node_cnt + 1));
+        GEM_ENSURE(job->src_offs != NULL);
+    }
+    job->seg_cnt = 0;
+    job->bytes = pt->size + 1;
+
+    char* added = job->added;
+    for(const PTNode* node = piece_tree_next_inorder(pt, NULL); node != NULL;
+        node = piece_tree_next_inorder(pt, node))
+    {
+        if(node->length == 0)
+            continue;
+        if(node->is_original && job->src_offs != NULL)
         {
-            ssize_t temp = write(fd, buf + written, node->length - written);
-            if(temp <= 0)
-                break;
-            written += temp;
-        } while(node->length > written);
-        if(node->length != written)
-            break;
-        total_written += written;
-        node = piece_tree_next_inorder(pt, node);
+            append_seg(job, NULL, piece_tree_get_node_buf_offset(pt, node), node->length);
+            continue;
+        }
+        char* data = (char*)piece_tree_get_node_start(pt, node);
+        if(!node->is_original)
+        {
+            memcpy(added, data, node->length);
+            data = added;
+            added += node->length;
+        }
+        append_seg(job, data, -1, node->length);
+    }
+
+    *added = '\n';
+    append_seg(job, added, -1, 1);
+}
+
+static void append_seg(SaveJob* job, char* data, off_t src_off, size_t len)
+{
+    struct iovec* last = job->segs + job->seg_cnt - 1;
+    off_t last_off = job->seg_cnt > 0 && job->src_offs != NULL ? job->src_offs[job->seg_cnt - 1] : -1;
+    if(job->seg_cnt > 0 && data != NULL && last_off < 0 && (char*)last->iov_base + last->iov_len == data)
+        last->iov_len += len;
+    else if(job->seg_cnt > 0 && src_off >= 0 && last_off >= 0 && last_off + (off_t)last->iov_len == src_off)
+        last->iov_len += len;
+    else
+    {
+        job->segs[job->seg_cnt].iov_base = data;
+        job->segs[job->seg_cnt].iov_len = len;
+        if(job->src_offs != NULL)
+            job->src_offs[job->seg_cnt] = src_off;
+        job->seg_cnt++;
+    }
+}
+
+static void free_job(SaveJob* job)
+{
+    free(job->path);
+    free(job->segs);
+    free(job->src_offs);
+    free(job->added);
+    free(job);
+}
+
+static void* save_thread(void* arg)
+{
+    (void)arg;
+    while(true)
+    {
+        pthread_mutex_lock(&s_mutex);
+        while(s_queue_head == NULL && !s_stop)
+            pthread_cond_wait(&s_queue_cond, &s_mutex);
+        SaveJob* job = s_queue_head;
+        if(job == NULL)
+        {
+            pthread_mutex_unlock(&s_mutex);
+            return NULL;
+        }
+        s_queue_head = job->next;
+        if(s_queue_head == NULL)
+            s_queue_tail = NULL;
+        pthread_mutex_unlock(&s_mutex);
+
+        DeltaTimer timer;
+        gem_dt_record(&timer);
+        job->success = write_file_atomic(job);
+        job->ms = gem_dt_record_get_ms(&timer);
+
+        pthread_mutex_lock(&s_mutex);
+        SaveJob** tail = &s_done;
+        while(*tail != NULL)
+            tail = &(*tail)->next;
+        job->next = NULL;
+        *tail = job;
+        pthread_cond_signal(&s_done_cond);
+        pthread_mutex_unlock(&s_mutex);
+
+        window_wake(s_notify_write);
+    }
+}
+
+static void handle_notify(int fd)
+{
+    window_drain_wakeup(fd);
+    complete_saves();
+}
+
+static void complete_saves(void)
+{
+    pthread_mutex_lock(&s_mutex);
+    SaveJob* job = s_done;
+    s_done = NULL;
+    pthread_mutex_unlock(&s_mutex);
+
+    while(job != NULL)
+    {
+        SaveJob* next = job->next;
+        Buffer* buf = buffer_get(job->bufnr);
+        buf->saves_pending--;
+        if(job->success)
+        {
+            // Edits made while the save ran bumped the version past the
+            // snapshot's, so those leave the buffer modified.
+            buf->saved_version = job->version;
+            if(job->is_buf_path)
+            {
+                buf->disk_mtime = job->mtime;
+                buf->disk_size = job->size;
+                buf->file_flags &= ~FF_DISK_CHANGED;
+                buf->orig_on_disk = false;
+                if(buf->journal != NULL)
+                    journal_checkpoint(buf->journal, job->version, job->mtime, job->size);
+            }
+            s_save_stats.save_cnt++;
+            s_save_stats.last_syscalls = job->syscalls;
+            s_save_stats.last_bytes = job->bytes;
+            s_save_stats.last_ms = job->ms;
+            s_save_stats.total_ms += job->ms;
+        }
+        else
+            fprintf(stderr, "Failed to save file: %s\n", job->path);
+        free_job(job);
+        job = next;
+    }
+    gem_request_redraw();
+}
+
+// Runs on the save thread, so nothing in here may touch the buffer or
+// bail out through GEM_ENSURE.
+static bool write_file_atomic(SaveJob* job)
+{
+    // Saving through a symlink should replace the file it points to,
+    // not the link itself.
+    char* target = NULL;
+    struct stat st;
+    bool exists = lstat(job->path, &st) == 0;
+    if(exists && S_ISLNK(st.st_mode))
+    {
+        target = realpath(job->path, NULL);
+        exists = target != NULL && stat(target, &st) == 0;
+    }
+    const char* dest = target != NULL ? target : job->path;
+
+    // The contents go to a temporary file next to the destination and only
+    // replace it once they are fully on disk, so a failed or interrupted save
+    // leaves the old file intact.
+    size_t dest_len = strlen(dest);
+    const char* name = strrchr(dest, '/');
+    size_t dir_len = name == NULL ? 0 : (size_t)(name - dest + 1);
+    name = name == NULL ? dest : name + 1;
+    char* temp_path = malloc(dest_len + sizeof(TEMP_SUFFIX) + 1);
+    if(temp_path == NULL)
+    {
+        free(target);
+        return false;
+    }
+    sprintf(temp_path, "%.*s.%s" TEMP_SUFFIX, (int)dir_len, dest, name);
+
+    bool success = false;
+    int fd = mkstemp(temp_path);
+    if(fd < 0)
+    {
+        free(temp_path);
+        free(target);
+        return false;
+    }
+
+    if(exists)
+    {
+        // Ownership can only be kept when permitted. When it can't, the
+        // setuid/setgid bits are dropped rather than handed to our own file.
+        mode_t mode = st.st_mode & 07777;
+        if(fchown(fd, st.st_uid, st.st_gid) < 0)
+            mode &= 0777;
+        fchmod(fd, mode);
+    }
+    else
+    {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
     }
 
-    if(total_written == pt->size)
+    bool written = write_segs(fd, job) && fsync(fd) == 0;
+    if(written && fstat(fd, &st) == 0)
+    {
+        job->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        job->size = (size_t)st.st_size;
+    }
+    if(close(fd) == 0 && written && rename(temp_path, dest) == 0)
     {
-        char c = '\n';
-        write(fd, &c, 1);
-        fsync(fd);
         success = true;
-        buf->modified = false;
+
+        // Make the rename itself durable.
+        if(dir_len > 0)
+        {
+            temp_path[dir_len] = '\0';
+            int dir_fd = open(temp_path, O_RDONLY | O_DIRECTORY);
+            if(dir_fd >= 0)
+            {
+                fsync(dir_fd);
+                close(dir_fd);
+            }
+        }
     }
+    else
+        unlink(temp_path);
 
-    close(fd);
+    free(temp_path);
+    free(target);
     return success;
+}
 
+static bool write_segs(int fd, SaveJob* job)
+{
+    job->syscalls = 0;
+    if(job->src_offs == NULL)
+        return write_iovs(fd, job, job->segs, job->seg_cnt);
+
+    // In memory runs are still gathered, file backed segments in between are
+    // copied over in bounded reads.
+    size_t start = 0;
+    while(start < job->seg_cnt)
+    {
+        if(job->src_offs[start] >= 0)
+        {
+            if(!copy_range(fd, job, job->src_offs[start], job->segs[start].iov_len))
+                return false;
+            start++;
+            continue;
+        }
+        size_t end = start;
+        while(end < job->seg_cnt && job->src_offs[end] < 0)
+            end++;
+        if(!write_iovs(fd, job, job->segs + start, end - start))
+            return false;
+        start = end;
+    }
+    return true;
+}
+
+static bool write_iovs(int fd, SaveJob* job, struct iovec* cur, size_t remaining)
+{
+    // Segments go out IOV_MAX at a time. The job's array is consumed in
+    // place, it isn't needed once written.
+    while(remaining > 0)
+    {
+        int cnt = remaining < IOV_MAX ? (int)remaining : IOV_MAX;
+        ssize_t written = writev(fd, cur, cnt);
+        job->syscalls++;
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Skip past whatever was fully written and trim a partially written entry.
+        while(remaining > 0 && (size_t)written >= cur->iov_len)
+        {
+            written -= cur->iov_len;
+            cur++;
+            remaining--;
+        }
+        if(remaining > 0)
+        {
+            cur->iov_base = (char*)cur->iov_base + written;
+            cur->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+static bool copy_range(int fd, SaveJob* job, off_t src_off, size_t len)
+{
+    char* buf = malloc(len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE);
+    if(buf == NULL)
+        return false;
+
+    bool success = true;
+    while(success && len > 0)
+    {
+        ssize_t got = pread(job->src_fd, buf, len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE, src_off);
+        job->syscalls++;
+        if(got < 0 && errno == EINTR)
+            continue;
+        // Coming up short means the file was cut down underneath us, writing
+        // anything else in its place would corrupt the save.
+        success = got > 0;
+        for(ssize_t done = 0; success && done < got;)
+        {
+            ssize_t res = write(fd, buf + done, got - done);
+            job->syscalls++;
+            if(res < 0 && errno == EINTR)
+                continue;
+            success = res > 0;
+            done += success ? res : 0;
+        }
+        src_off += success ? got : 0;
+        len -= success ? (size_t)got : 0;
+    }
+    free(buf);
+    return success;
 }
@@ -3,9 +3,31 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define MAX_FILE_SIZE (1ull << 25) // This is 32MiB, temporary, read_entire_file won't go past it
+
+typedef struct GemSaveStats GemSaveStats;
+struct GemSaveStats
+{
+    uint32_t save_cnt;
+    uint32_t last_syscalls;
+    size_t   last_bytes;
+    double   last_ms;
+    double   total_ms;
+};
+
+void fileio_init(void);
+void fileio_cleanup(void);
 
 bool read_entire_file(const char* path, char** src, size_t* size, bool* readonly);
+bool get_file_info(const char* path, int64_t* mtime, size_t* size);
+// Saves are queued to a background thread and this returns once the buffer's
+// contents have been snapshotted. Failures are reported on completion.
 bool save_buffer_as(BufNr bufnr, const char* path);
+void fileio_finish_saves(BufNr bufnr);
+
+const GemSaveStats* fileio_get_save_stats(void);
 
 static inline bool save_buffer(BufNr bufnr)
 { 
@@ -0,0 +1,595 @@
+#define _POSIX_C_SOURCE 200809L
+#include "journal.h"
+#include "fileio.h"
+#include "core/core.h"
+#include "core/window.h"
+#include "structs/da.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define JOURNAL_MAGIC      "GEMJRN\x01"
+#define JOURNAL_MAGIC_LEN  8
+#define JOURNAL_SUFFIX     ".gem-swp"
+#define JOURNAL_FLUSH_SIZE (1 << 20) // Pending bytes past this are written out early
+
+/*
+ * Layout: the magic, a base record, then checkpoint and edit records.
+ * Every record is a type byte, LEB128 fields, an optional payload and a
+ * 32-bit FNV-1a checksum of all of that, so a torn tail is detected and
+ * dropped on recovery.
+ *
+ *   JR_BASE, JR_CHECKPOINT: version, file mtime, file size
+ *   JR_INSERT:              version, offset, length, repeat count, payload
+ *   JR_DELETE:              version, offset, count
+ */
+enum
+{
+    JR_BASE = 1,
+    JR_CHECKPOINT,
+    JR_INSERT,
+    JR_DELETE
+};
+
+typedef struct JournalBytes JournalBytes;
+typedef struct JournalOp    JournalOp;
+typedef struct JournalOpDA  JournalOpDA;
+typedef struct JournalDA    JournalDA;
+
+struct JournalBytes
+{
+    uint8_t* data;
+    size_t   size;
+    size_t   capacity;
+};
+
+struct Journal
+{
+    int          fd;
+    char*        path;
+    uint64_t     op_version;         // Version of the newest recorded edit
+    uint64_t     checkpoint_version; // Newest version known to be on disk
+    JournalBytes pending;
+};
+
+struct JournalOp
+{
+    int            type;
+    uint64_t       version;
+    size_t         offset;
+    size_t         len;
+    size_t         count;
+    const uint8_t* data;
+};
+
+struct JournalOpDA
+{
+    JournalOp* data;
+    size_t     size;
+    size_t     capacity;
+};
+
+struct JournalDA
+{
+    Journal** data;
+    size_t    size;
+    size_t    capacity;
+};
+
+static char*    journal_path(const char* file_path);
+static bool     find_unsaved(const Buffer* buf, const uint8_t* data, size_t size, JournalOpDA* ops);
+static bool     parse_record(const uint8_t** ptr, const uint8_t* end, JournalOp* op);
+static void     begin_record(Journal* journal, int type, uint64_t version);
+static void     end_record(Journal* journal, size_t start);
+static void     put_varint(JournalBytes* bytes, uint64_t value);
+static bool     get_varint(const uint8_t** ptr, const uint8_t* end, uint64_t* value);
+static uint32_t checksum(const uint8_t* data, size_t len);
+static void     reset(Journal* journal, uint64_t version, int64_t mtime, size_t size);
+static void     commit(Journal* journal, bool sync);
+static void     arm_timer(void);
+static void     handle_timer(int fd);
+
+static bool      s_enabled = true;
+static int       s_timer_fd = -1;
+static bool      s_timer_armed;
+static JournalDA s_journals;
+
+void journal_init(void)
+{
+    GEM_ASSERT(s_timer_fd < 0);
+    da_init(&s_journals, 0);
+    s_timer_armed = false;
+    s_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(s_timer_fd < 0)
+    {
+        fprintf(stderr, "Failed to create journal timer, edits will be committed immediately.\n");
+        return;
+    }
+    window_add_fd_source(s_timer_fd, handle_timer);
+}
+
+void journal_cleanup(void)
+{
+    // Journals of buffers with unsaved edits are kept for the next session.
+    for(size_t i = 0; i < s_journals.size; ++i)
+    {
+        Journal* journal = s_journals.data[i];
+        if(journal->checkpoint_version >= journal->op_version)
+            unlink(journal->path);
+        else
+            commit(journal, true);
+        close(journal->fd);
+        free(journal->path);
+        da_free_data(&journal->pending);
+        free(journal);
+    }
+    da_free_data(&s_journals);
+
+    if(s_timer_fd >= 0)
+    {
+        window_remove_fd_source(s_timer_fd);
+        close(s_timer_fd);
+        s_timer_fd = -1;
+    }
+}
+
+void journal_set_enabled(bool enabled)
+{
+    s_enabled = enabled;
+}
+
+bool journal_is_enabled(void)
+{
+    return s_enabled;
+}
+
+void journal_open(BufNr bufnr)
+{
+    Buffer* buf = buffer_get(bufnr);
+    GEM_ASSERT(buf->filepath != NULL);
+    GEM_ASSERT(buf->journal == NULL);
+    if(!s_enabled)
+        return;
+
+    char* path = journal_path(buf->filepath);
+    char* old_contents = NULL;
+    size_t old_size = 0;
+    JournalOpDA ops;
+    da_init(&ops, 0);
+    if(read_entire_file(path, &old_contents, &old_size, NULL) &&
+       !find_unsaved(buf, (const uint8_t*)old_contents, old_size, &ops))
+    {
+        // Keep edits that can't be applied anymore around for the user.
+        char* kept = malloc(strlen(path) + 5);
+        GEM_ENSURE(kept != NULL);
+        sprintf(kept, "%s.old", path);
+        if(rename(path, kept) == 0)
+            fprintf(stderr, "Journal %s doesn't match the file anymore, moved it to %s\n", path, kept);
+        free(kept);
+    }
+
+    // The new journal is written next to the old one and only renamed over
+    // it once the replayed edits are synced, a crash before that still
+    // leaves the old one to recover from.
+    char* temp_path = malloc(strlen(path) + 5);
+    GEM_ENSURE(temp_path != NULL);
+    sprintf(temp_path, "%s.tmp", path);
+    int fd = open(temp_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd >= 0)
+    {
+        Journal* journal = malloc(sizeof(Journal));
+        GEM_ENSURE(journal != NULL);
+        journal->fd = fd;
+        journal->path = path;
+        da_init(&journal->pending, 0);
+        reset(journal, buf->version, buf->disk_mtime, buf->disk_size);
+        da_append(&s_journals, journal);
+        buf->journal = journal;
+    }
+    else
+        free(path);
+
+    // Replaying goes through the normal edit path, so the recovered edits
+    // land in the new journal as well.
+    if(ops.size > 0)
+    {
+        size_t applied = 0;
+        for(; applied < ops.size; ++applied)
+        {
+            const JournalOp* op = ops.data + applied;
+            size_t size = buffer_get(bufnr)->contents.size;
+            if(op->type == JR_INSERT && op->offset <= size && op->len > 0 && op->count > 0)
+                buffer_insert_repeat(bufnr, (const char*)op->data, op->len, op->count, op->offset);
+            else if(op->type == JR_DELETE && op->offset <= size && op->count <= size - op->offset)
+                buffer_delete(bufnr, op->offset, op->count);
+            else
+                break;
+        }
+        printf("Recovered %zu of %zu unsaved edits to %s\n", applied, ops.size, buf->filepath);
+    }
+
+    Journal* journal = buffer_get(bufnr)->journal;
+    if(journal != NULL)
+    {
+        commit(journal, true);
+        if(rename(temp_path, journal->path) < 0)
+        {
+            fprintf(stderr, "Failed to replace journal %s, keeping it at %s\n", journal->path, temp_path);
+            free(journal->path);
+            journal->path = temp_path;
+            temp_path = NULL;
+        }
+    }
+    free(temp_path);
+    da_free_data(&ops);
+    free(old_contents);
+}
+
+bool journal_resume(BufNr bufnr)
+{
+    Buffer* buf = buffer_get(bufnr);
+    GEM_ASSERT(buf->filepath != NULL);
+    GEM_ASSERT(buf->journal == NULL);
+
+    char* path = journal_path(buf->filepath);
+    char* contents;
+    size_t size;
+    if(!read_entire_file(path, &contents, &size, NULL))
+    {
+        free(path);
+        return false;
+    }
+
+    // The journal has to describe exactly the buffer being resumed: its newest
+    // matching checkpoint at the saved version and its last edit at the
+    // current one.
+    const uint8_t* data = (const uint8_t*)contents;
+    const uint8_t* ptr = data + JOURNAL_MAGIC_LEN;
+    const uint8_t* end = data + size;
+    JournalOp op;
+    bool matched = false;
+    uint64_t saved_version = 0;
+    uint64_t op_version = 0;
+    if(size >= JOURNAL_MAGIC_LEN && memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) == 0 &&
+       parse_record(&ptr, end, &op) && op.type == JR_BASE)
+    {
+        do
+        {
+            if(op.type != JR_BASE && op.type != JR_CHECKPOINT)
+                op_version = op.version;
+            else if((int64_t)op.offset == buf->disk_mtime && op.len == buf->disk_size)
+            {
+                matched = true;
+                saved_version = op.version;
+            }
+        } while(parse_record(&ptr, end, &op));
+    }
+    size_t valid_len = ptr - data;
+    free(contents);
+
+    int fd = -1;
+    if(matched && saved_version == buf->saved_version && op_version == buf->version)
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+    // A torn tail is cut off so new records follow the last good one.
+    if(fd < 0 || ftruncate(fd, valid_len) < 0 || lseek(fd, 0, SEEK_END) < 0)
+    {
+        if(fd >= 0)
+            close(fd);
+        free(path);
+        return false;
+    }
+
+    Journal* journal = malloc(sizeof(Journal));
+    GEM_ENSURE(journal != NULL);
+    journal->fd = fd;
+    journal->path = path;
+    journal->op_version = op_version;
+    journal->checkpoint_version = saved_version;
+    da_init(&journal->pending, 0);
+    da_append(&s_journals, journal);
+    buf->journal = journal;
+    return true;
+}
+
+void journal_close(Journal* journal)
+{
+    GEM_ASSERT(journal != NULL);
+    for(size_t i = 0; i < s_journals.size; ++i)
+    {
+        if(s_journals.data[i] == journal)
+        {
+            s_journals.data[i] = s_journals.data[--s_journals.size];
+            break;
+        }
+    }
+
+    // The buffer is gone, whatever was unsaved was discarded on purpose.
+    close(journal->fd);
+    unlink(journal->path);
+    free(journal->path);
+    da_free_data(&journal->pending);
+    free(journal);
+}
+
+void journal_insert(Journal* journal, uint64_t version, size_t offset,
+                    const char* data, size_t len, size_t count)
+{
+    GEM_ASSERT(journal != NULL);
+    GEM_ASSERT(data != NULL);
+    size_t start = journal->pending.size;
+    begin_record(journal, JR_INSERT, version);
+    put_varint(&journal->pending, offset);
+    put_varint(&journal->pending, len);
+    put_varint(&journal->pending, count);
+    if(len > 0)
+        da_append_arr(&journal->pending, (const uint8_t*)data, len);
+    end_record(journal, start);
+}
+
+void journal_delete(Journal* journal, uint64_t version, size_t offset, size_t count)
+{
+    GEM_ASSERT(journal != NULL);
+    size_t start = journal->pending.size;
+    begin_record(journal, JR_DELETE, version);
+    put_varint(&journal->pending, offset);
+    put_varint(&journal->pending, count);
+    end_record(journal, start);
+}
+
+void journal_checkpoint(Journal* journal, uint64_t version, int64_t mtime, size_t size)
+{
+    GEM_ASSERT(journal != NULL);
+    if(version >= journal->op_version)
+    {
+        reset(journal, version, mtime, size);
+        return;
+    }
+
+    // Edits made after the saved version are still only in the journal.
+    size_t start = journal->pending.size;
+    begin_record(journal, JR_CHECKPOINT, version);
+    put_varint(&journal->pending, (uint64_t)mtime);
+    put_varint(&journal->pending, size);
+    end_record(journal, start);
+    journal->checkpoint_version = version;
+    commit(journal, true);
+}
+
+static char* journal_path(const char* file_path)
+{
+    const char* name = strrchr(file_path, '/');
+    size_t dir_len = name == NULL ? 0 : (size_t)(name - file_path + 1);
+    name = name == NULL ? file_path : name + 1;
+
+    char* path = malloc(strlen(file_path) + sizeof(JOURNAL_SUFFIX) + 1);
+    GEM_ENSURE(path != NULL);
+    sprintf(path, "%.*s.%s" JOURNAL_SUFFIX, (int)dir_len, file_path, name);
+    return path;
+}
+
+// Collects the edits made after the newest checkpoint that matches the file
+// on disk. Returns false when there are some but the file doesn't match.
+static bool find_unsaved(const Buffer* buf, const uint8_t* data, size_t size, JournalOpDA* ops)
+{
+    const uint8_t* ptr = data + JOURNAL_MAGIC_LEN;
+    const uint8_t* end = data + size;
+    JournalOp op;
+    if(size < JOURNAL_MAGIC_LEN || memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0 ||
+       !parse_record(&ptr, end, &op) || op.type != JR_BASE)
+        return true;
+
+    // For base and checkpoint records the offset and length fields hold the
+    // file's mtime and size.
+    bool matched = false;
+    uint64_t saved_version = 0;
+    do
+    {
+        if(op.type == JR_BASE || op.type == JR_CHECKPOINT)
+        {
+            if((int64_t)op.offset == buf->disk_mtime && op.len == buf->disk_size)
+            {
+                matched = true;
+                saved_version = op.version;
+            }
+        }
+        else
+            da_append(ops, op);
+    } while(parse_record(&ptr, end, &op));
+
+    // Edits made while a save ran are recorded before its checkpoint, the
+    // version tells them apart from the ones that were saved.
+    size_t unsaved = 0;
+    for(size_t i = 0; i < ops->size; ++i)
+        if(ops->data[i].version > saved_version)
+            ops->data[unsaved++] = ops->data[i];
+    ops->size = unsaved;
+
+    if(unsaved == 0)
+        return true;
+    if(!matched || (buf->file_flags & FF_READONLY))
+    {
+        ops->size = 0;
+        return false;
+    }
+    return true;
+}
+
+static bool parse_record(const uint8_t** ptr, const uint8_t* end, JournalOp* op)
+{
+    const uint8_t* start = *ptr;
+    const uint8_t* cur = start;
+    if(cur >= end)
+        return false;
+    op->type = *cur++;
+
+    uint64_t fields[4] = { 0, 0, 0, 0 };
+    int field_cnt;
+    switch(op->type)
+    {
+    case JR_BASE:
+    case JR_CHECKPOINT:
+    case JR_DELETE:
+        field_cnt = 3;
+        break;
+    case JR_INSERT:
+        field_cnt = 4;
+        break;
+    default:
+        return false;
+    }
+    for(int i = 0; i < field_cnt; ++i)
+        if(!get_varint(&cur, end, fields + i))
+            return false;
+
+    op->version = fields[0];
+    op->offset = fields[1];
+    op->len = op->type == JR_DELETE ? 0 : fields[2];
+    op->count = op->type == JR_DELETE ? fields[2] : fields[3];
+    op->data = NULL;
+    if(op->type == JR_INSERT)
+    {
+        if(op->len > (size_t)(end - cur))
+            return false;
+        op->data = cur;
+        cur += op->len;
+    }
+
+    if(end - cur < 4)
+        return false;
+    uint32_t stored = (uint32_t)cur[0] | (uint32_t)cur[1] << 8 |
+                      (uint32_t)cur[2] << 16 | (uint32_t)cur[3] << 24;
+    if(stored != checksum(start, cur - start))
+        return false;
+    *ptr = cur + 4;
+    return true;
+}
+
+static void begin_record(Journal* journal, int type, uint64_t version)
+{
+    uint8_t t = (uint8_t)type;
+    da_append(&journal->pending, t);
+    put_varint(&journal->pending, version);
+    if(type == JR_INSERT || type == JR_DELETE)
+        journal->op_version = version;
+}
+
+static void end_record(Journal* journal, size_t start)
+{
+    uint32_t sum = checksum(journal->pending.data + start, journal->pending.size - start);
+    for(int i = 0; i < 4; ++i)
+    {
+        uint8_t b = (uint8_t)(sum >> (8 * i));
+        da_append(&journal->pending, b);
+    }
+
+    if(journal->pending.size >= JOURNAL_FLUSH_SIZE)
+        commit(journal, false);
+    if(s_timer_fd < 0)
+        commit(journal, true);
+    else
+        arm_timer();
+}
+
+static void put_varint(JournalBytes* bytes, uint64_t value)
+{
+    do
+    {
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        if(value != 0)
+            b |= 0x80;
+        da_append(bytes, b);
+    } while(value != 0);
+}
+
+static bool get_varint(const uint8_t** ptr, const uint8_t* end, uint64_t* value)
+{
+    uint64_t res = 0;
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+        if(*ptr >= end)
+            return false;
+        uint8_t b = *(*ptr)++;
+        res |= (uint64_t)(b & 0x7F) << shift;
+        if(!(b & 0x80))
+        {
+            *value = res;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t checksum(const uint8_t* data, size_t len)
+{
+    uint32_t hash = 0x811c9dc5u;
+    for(size_t i = 0; i < len; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x01000193u;
+    }
+    return hash;
+}
+
+// Starts the journal over with the file on disk as its base.
+static void reset(Journal* journal, uint64_t version, int64_t mtime, size_t size)
+{
+    journal->pending.size = 0;
+    journal->op_version = version;
+    journal->checkpoint_version = version;
+    if(ftruncate(journal->fd, 0) < 0 || lseek(journal->fd, 0, SEEK_SET) < 0)
+        return;
+
+    da_append_arr(&journal->pending, (const uint8_t*)JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    size_t start = journal->pending.size;
+    begin_record(journal, JR_BASE, version);
+    put_varint(&journal->pending, (uint64_t)mtime);
+    put_varint(&journal->pending, size);
+    end_record(journal, start);
+    commit(journal, true);
+}
+
+static void commit(Journal* journal, bool sync)
+{
+    size_t written = 0;
+    while(written < journal->pending.size)
+    {
+        ssize_t res = write(journal->fd, journal->pending.data + written, journal->pending.size - written);
+        if(res <= 0)
+            break;
+        written += res;
+    }
+    if(written < journal->pending.size)
+        fprintf(stderr, "Failed to write journal: %s\n", journal->path);
+    journal->pending.size = 0;
+    if(sync)
+        fdatasync(journal->fd);
+}
+
+static void arm_timer(void)
+{
+    if(s_timer_armed)
+        return;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = JOURNAL_COMMIT_MS / 1000;
+    spec.it_value.tv_nsec = (JOURNAL_COMMIT_MS % 1000) * 1000000L;
+    if(timerfd_settime(s_timer_fd, 0, &spec, NULL) == 0)
+        s_timer_armed = true;
+}
+
+static void handle_timer(int fd)
+{
+    uint64_t expirations;
+    ssize_t res = read(fd, &expirations, sizeof(expirations));
+    (void)res;
+    s_timer_armed = false;
+
+    // Group commit, one write and sync per journal for every edit since the last tick.
+    for(size_t i = 0; i < s_journals.size; ++i)
+        if(s_journals.data[i]->pending.size > 0)
+            commit(s_journals.data[i], true);
+}
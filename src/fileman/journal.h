@@ -0,0 +1,35 @@
+#pragma once
+#include "editor/buffer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_COMMIT_MS 200
+
+typedef struct Journal Journal;
+
+void journal_init(void);
+void journal_cleanup(void);
+// Journals are on by default, buffers opened while they are off get none
+// and leftover journals are neither replayed nor removed.
+void journal_set_enabled(bool enabled);
+bool journal_is_enabled(void);
+
+// Creates the buffer's journal next to its file. A journal left behind by a
+// previous session is replayed onto the buffer first, as long as the file is
+// still the one the journal was recorded against.
+void journal_open(BufNr bufnr);
+// Picks up the journal a restored buffer's edits were recorded in, fails
+// unless it matches the buffer's versions and file exactly.
+bool journal_resume(BufNr bufnr);
+void journal_close(Journal* journal);
+
+// Edits are buffered and group committed every JOURNAL_COMMIT_MS.
+void journal_insert(Journal* journal, uint64_t version, size_t offset,
+                    const char* data, size_t len, size_t count);
+void journal_delete(Journal* journal, uint64_t version, size_t offset, size_t count);
+
+// Records that the file on disk now holds the buffer as of version. This is
+// committed immediately, and empties the journal when nothing newer is in it.
+void journal_checkpoint(Journal* journal, uint64_t version, int64_t mtime, size_t size);
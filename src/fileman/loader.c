@@ -0,0 +1,414 @@
+#define _POSIX_C_SOURCE 200809L
+#include "loader.h"
+#include "journal.h"
+#include "core/core.h"
+#include "core/app.h"
+#include "core/parallel.h"
+#include "core/window.h"
+#include "editor/bufferwin.h"
+#include "structs/lineindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOAD_FIRST_CHUNK (1 << 16)
+#define LOAD_MAX_QUEUED  16 // Chunks read ahead of the main thread before the reader waits
+#define LOAD_SLICE_MIN   (1 << 20) // Chunks are indexed on a core per this many bytes
+
+typedef struct LoadChunk LoadChunk;
+struct LoadChunk
+{
+    char*      data;        // Only set for paged buffers, others are read in place
+    size_t     len;
+    uint32_t*  line_starts; // Chunk relative offsets after each newline
+    size_t     line_cnt;
+    LoadChunk* next;
+};
+
+typedef struct LoadJob LoadJob;
+struct LoadJob
+{
+    BufNr      bufnr;
+    int        fd;
+    char*      data;      // The tree's original buffer, only written past what was handed over
+    size_t     size;
+    bool       paged;
+    pthread_t  thread;
+
+    // Guarded by s_mutex
+    LoadChunk* chunks_head;
+    LoadChunk* chunks_tail;
+    size_t     queued;
+    bool       cancel;
+    bool       finished;
+    bool       failed;
+
+    LoadJob*   next;
+};
+
+typedef struct ChunkSlice ChunkSlice;
+struct ChunkSlice
+{
+    const char* data;
+    size_t      base;        // Offset of data in the chunk
+    size_t      len;
+    size_t      nl_cnt;
+    uint32_t*   line_starts; // Where the slice's own go in the chunk's
+};
+
+static void*      load_thread(void* arg);
+static LoadChunk* index_chunk(const char* data, size_t len);
+static void*      count_slice(void* arg);
+static void*      fill_slice(void* arg);
+static void       handle_notify(int fd);
+static void       add_chunks(LoadJob* job, LoadChunk* chunks);
+static void       free_job(LoadJob* job);
+static LoadJob**  find_job(BufNr bufnr);
+
+static pthread_mutex_t s_mutex;
+static pthread_cond_t  s_drained_cond;
+static LoadJob*        s_jobs;
+static int             s_notify_read = -1;
+static int             s_notify_write = -1;
+
+void loader_init(void)
+{
+    int fds[2];
+    window_open_wakeup(fds);
+    s_notify_read = fds[0];
+    s_notify_write = fds[1];
+    s_jobs = NULL;
+    pthread_mutex_init(&s_mutex, NULL);
+    pthread_cond_init(&s_drained_cond, NULL);
+    window_add_fd_source(s_notify_read, handle_notify);
+}
+
+void loader_cleanup(void)
+{
+    if(s_notify_read < 0)
+        return;
+
+    // Unfinished buffers stay marked as loading, so nothing treats what was
+    // read as the whole file.
+    while(s_jobs != NULL)
+        loader_cancel(s_jobs->bufnr);
+
+    window_remove_fd_source(s_notify_read);
+    close(s_notify_read);
+    close(s_notify_write);
+    s_notify_read = s_notify_write = -1;
+    pthread_cond_destroy(&s_drained_cond);
+    pthread_mutex_destroy(&s_mutex);
+}
+
+bool loader_start(BufNr bufnr, const char* path, size_t size)
+{
+    GEM_ASSERT(path != NULL);
+    GEM_ASSERT(size > 0);
+    bool readonly = false;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+    {
+        readonly = true;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            return false;
+    }
+
+    LoadJob* job = malloc(sizeof(LoadJob));
+    GEM_ENSURE(job != NULL);
+    job->bufnr = bufnr;
+    job->fd = fd;
+    job->size = size;
+    job->chunks_head = job->chunks_tail = NULL;
+    job->queued = 0;
+    job->cancel = false;
+    job->finished = false;
+    job->failed = false;
+
+    // Files over the page cache budget are paged, each chunk read becomes a
+    // page the cache is free to drop and read back later.
+    Buffer* buf = buffer_get(bufnr);
+    job->paged = size > page_cache_get_budget();
+    if(job->paged)
+    {
+        int cache_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        GEM_ENSURE(cache_fd >= 0);
+        job->data = NULL;
+        piece_tree_init_paged(&buf->contents, cache_fd);
+    }
+    else
+    {
+        // Reserved in full up front so pieces already in the tree never move.
+        // Pages are only committed as the chunks are read into them.
+        job->data = malloc(size);
+        GEM_ENSURE(job->data != NULL);
+        piece_tree_init_stream(&buf->contents, job->data);
+    }
+    buf->file_flags = FF_LOADING | (readonly ? FF_READONLY : 0);
+
+    GEM_ENSURE(pthread_create(&job->thread, NULL, load_thread, job) == 0);
+    job->next = s_jobs;
+    s_jobs = job;
+    return true;
+}
+
+void loader_cancel(BufNr bufnr)
+{
+    LoadJob** link = find_job(bufnr);
+    if(link == NULL)
+        return;
+
+    LoadJob* job = *link;
+    pthread_mutex_lock(&s_mutex);
+    job->cancel = true;
+    pthread_cond_broadcast(&s_drained_cond);
+    pthread_mutex_unlock(&s_mutex);
+    pthread_join(job->thread, NULL);
+    *link = job->next;
+    free_job(job);
+}
+
+static void* load_thread(void* arg)
+{
+    LoadJob* job = arg;
+    size_t offset = 0;
+    bool failed = false;
+    bool cancel = false;
+    while(offset < job->size && !cancel && !failed)
+    {
+        // The first chunk is kept small so the first screen shows up quickly.
+        size_t chunk_size = offset == 0 ? LOAD_FIRST_CHUNK : LOAD_CHUNK_SIZE;
+        size_t want = job->size - offset < chunk_size ? job->size - offset : chunk_size;
+        // This runs on the load thread, bailing out through GEM_ENSURE would
+        // join it from itself. Running out of memory fails the load instead.
+        char* dest = job->paged ? malloc(want) : job->data + offset;
+        if(dest == NULL)
+        {
+            failed = true;
+            break;
+        }
+        size_t got = 0;
+        while(got < want)
+        {
+            ssize_t res = read(job->fd, dest + got, want - got);
+            if(res < 0 && errno == EINTR)
+                continue;
+            if(res <= 0)
+            {
+                failed = res < 0;
+                break;
+            }
+            got += res;
+        }
+
+        // A short read means the file shrank since it was opened, whatever
+        // was read is the end of it.
+        bool last = got < want || offset + got == job->size;
+        size_t len = got;
+        if(last && len > 0 && dest[len - 1] == '\n')
+            len--;
+        LoadChunk* chunk = NULL;
+        if(len > 0)
+        {
+            chunk = index_chunk(dest, len);
+            if(chunk != NULL)
+                chunk->data = job->paged ? dest : NULL;
+            else
+            {
+                failed = true;
+                if(job->paged)
+                    free(dest);
+            }
+        }
+        else if(job->paged)
+            free(dest);
+        offset += got;
+
+        pthread_mutex_lock(&s_mutex);
+        if(chunk != NULL)
+        {
+            if(job->chunks_tail == NULL)
+                job->chunks_head = chunk;
+            else
+                job->chunks_tail->next = chunk;
+            job->chunks_tail = chunk;
+            job->queued++;
+        }
+        cancel = job->cancel;
+        pthread_mutex_unlock(&s_mutex);
+
+        if(!window_wake(s_notify_write))
+            fprintf(stderr, "Failed to notify the main thread of a loaded chunk.\n");
+        if(last)
+            break;
+
+        // Paged chunks hold their data, don't let them pile up past what the
+        // cache would keep anyway.
+        pthread_mutex_lock(&s_mutex);
+        while(job->queued >= LOAD_MAX_QUEUED && !job->cancel)
+            pthread_cond_wait(&s_drained_cond, &s_mutex);
+        cancel = job->cancel;
+        pthread_mutex_unlock(&s_mutex);
+    }
+
+    pthread_mutex_lock(&s_mutex);
+    job->finished = true;
+    job->failed = failed;
+    pthread_mutex_unlock(&s_mutex);
+
+    if(!window_wake(s_notify_write))
+        fprintf(stderr, "Failed to notify the main thread of a finished load.\n");
+    return NULL;
+}
+
+// Every slice counts its newlines first, so each knows where its line
+// starts go and can fill them in alongside the others. NULL if it runs out
+// of memory.
+static LoadChunk* index_chunk(const char* data, size_t len)
+{
+    LoadChunk* chunk = malloc(sizeof(LoadChunk));
+    if(chunk == NULL)
+        return NULL;
+    chunk->len = len;
+    chunk->line_cnt = 0;
+    chunk->next = NULL;
+
+    ChunkSlice slices[PARALLEL_MAX_SLICES];
+    size_t cnt = parallel_slice_cnt(len, LOAD_SLICE_MIN);
+    size_t slice_len = len / cnt;
+    for(size_t i = 0; i < cnt; ++i)
+    {
+        slices[i].base = slice_len * i;
+        slices[i].data = data + slices[i].base;
+        slices[i].len = i + 1 < cnt ? slice_len : len - slices[i].base;
+    }
+    parallel_run(slices, sizeof(ChunkSlice), cnt, count_slice);
+    for(size_t i = 0; i < cnt; ++i)
+        chunk->line_cnt += slices[i].nl_cnt;
+
+    chunk->line_starts = malloc(sizeof(uint32_t) * (chunk->line_cnt > 0 ? chunk->line_cnt : 1));
+    if(chunk->line_starts == NULL)
+    {
+        free(chunk);
+        return NULL;
+    }
+    uint32_t* dest = chunk->line_starts;
+    for(size_t i = 0; i < cnt; ++i)
+    {
+        slices[i].line_starts = dest;
+        dest += slices[i].nl_cnt;
+    }
+    parallel_run(slices, sizeof(ChunkSlice), cnt, fill_slice);
+    return chunk;
+}
+
+static void* count_slice(void* arg)
+{
+    ChunkSlice* slice = arg;
+    slice->nl_cnt = line_index_count_newlines(slice->data, slice->len);
+    return NULL;
+}
+
+static void* fill_slice(void* arg)
+{
+    ChunkSlice* slice = arg;
+    const char* end = slice->data + slice->len;
+    size_t i = 0;
+    for(const char* nl = slice->data; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++)
+        slice->line_starts[i++] = slice->base + (nl - slice->data) + 1;
+    return NULL;
+}
+
+static void handle_notify(int fd)
+{
+    window_drain_wakeup(fd);
+
+    LoadJob** link = &s_jobs;
+    while(*link != NULL)
+    {
+        LoadJob* job = *link;
+        pthread_mutex_lock(&s_mutex);
+        LoadChunk* chunks = job->chunks_head;
+        job->chunks_head = job->chunks_tail = NULL;
+        job->queued = 0;
+        bool finished = job->finished;
+        bool failed = job->failed;
+        pthread_cond_broadcast(&s_drained_cond);
+        pthread_mutex_unlock(&s_mutex);
+
+        add_chunks(job, chunks);
+        if(!finished)
+        {
+            if(chunks != NULL)
+                bufwin_handle_load_progress(job->bufnr, false);
+            link = &job->next;
+            continue;
+        }
+
+        pthread_join(job->thread, NULL);
+        *link = job->next;
+        BufNr bufnr = job->bufnr;
+        Buffer* buf = buffer_get(bufnr);
+        buf->file_flags &= ~FF_LOADING;
+        piece_tree_end_stream(&buf->contents);
+        if(failed)
+        {
+            // Saving this would cut the file short.
+            fprintf(stderr, "Failed to read all of %s, opened it readonly.\n", buf->filepath);
+            buf->file_flags |= FF_READONLY;
+            buf->orig_on_disk = false;
+        }
+        else
+            journal_open(bufnr);
+        free_job(job);
+        bufwin_handle_load_progress(bufnr, true);
+    }
+    gem_request_redraw();
+}
+
+static void add_chunks(LoadJob* job, LoadChunk* chunks)
+{
+    PieceTree* pt = &buffer_get(job->bufnr)->contents;
+    while(chunks != NULL)
+    {
+        LoadChunk* next = chunks->next;
+        if(job->paged)
+            piece_tree_append_page(pt, chunks->data, chunks->len, chunks->line_starts, chunks->line_cnt);
+        else
+        {
+            piece_tree_append_original(pt, chunks->len, chunks->line_starts, chunks->line_cnt);
+            free(chunks->line_starts);
+        }
+        free(chunks);
+        chunks = next;
+    }
+}
+
+// The original buffer belongs to the tree, only the bookkeeping goes.
+static void free_job(LoadJob* job)
+{
+    LoadChunk* chunk = job->chunks_head;
+    while(chunk != NULL)
+    {
+        LoadChunk* next = chunk->next;
+        free(chunk->data);
+        free(chunk->line_starts);
+        free(chunk);
+        chunk = next;
+    }
+    close(job->fd);
+    free(job);
+}
+
+static LoadJob** find_job(BufNr bufnr)
+{
+    for(LoadJob** link = &s_jobs; *link != NULL; link = &(*link)->next)
+        if((*link)->bufnr == bufnr)
+            return link;
+    return NULL;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "editor/buffer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LOAD_CHUNK_SIZE (1 << 22) // 4MiB, files up to this size are read in one go
+
+void loader_init(void);
+void loader_cleanup(void);
+
+// Starts reading the file into the buffer on a worker thread. The buffer's
+// tree grows by one piece per chunk as they arrive, and the buffer is marked
+// FF_LOADING until the last one is in. Returns false if the file couldn't be
+// opened, leaving the buffer untouched.
+bool loader_start(BufNr bufnr, const char* path, size_t size);
+// Stops a load in progress, the buffer keeps whatever was read so far.
+void loader_cancel(BufNr bufnr);
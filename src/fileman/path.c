@@ -2,6 +2,7 @@
 #define _XOPEN_SOURCE   1
 #define _DEFAULT_SOURCE 1
 #include "path.h"
+#include "watcher.h"
 #include "core/core.h"
 
 #include <fcntl.h>
@@ -151,6 +152,89 @@ void scan_bufwin_dir(BufferWin* bufwin)
     closedir(dir);
 }
 
+static bool find_entry(const EntryDA* entries, const char* name, size_t* index)
+{
+    for(size_t i = 0; i < entries->size; ++i)
+    {
+        if(strcmp(entries->data[i].name, name) == 0)
+        {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void remove_entry(BufferWin* bufwin, size_t index)
+{
+    EntryDA* entries = &bufwin->dir_entries;
+    memmove(entries->data + index, entries->data + index + 1,
+            (entries->size - index - 1) * sizeof(DirEntry));
+    entries->size--;
+    if(bufwin->sel_entry > index || (bufwin->sel_entry == entries->size && bufwin->sel_entry > 0))
+        bufwin->sel_entry--;
+}
+
+void update_bufwin_dir_entry(BufferWin* bufwin, const char* name, int event)
+{
+    GEM_ASSERT(bufwin != NULL);
+    GEM_ASSERT(name != NULL);
+    EntryDA* entries = &bufwin->dir_entries;
+    size_t index;
+    bool exists = find_entry(entries, name, &index);
+    size_t len = strlen(name);
+
+    DirEntry e;
+    e.stats.st_mode = 0;
+    if(event != WATCH_EVENT_DELETED && len <= NAME_MAX)
+    {
+        int fd = open(bufwin->local_dir ? bufwin->local_dir : ".", O_RDONLY);
+        if(fd < 0)
+            return;
+        if(fstatat(fd, name, &e.stats, 0) < 0)
+            event = WATCH_EVENT_DELETED;
+        close(fd);
+    }
+    else
+        event = WATCH_EVENT_DELETED;
+
+    uint32_t type = e.stats.st_mode & S_IFMT;
+    if(event == WATCH_EVENT_DELETED || (type != S_IFREG && type != S_IFDIR))
+    {
+        if(exists)
+            remove_entry(bufwin, index);
+        return;
+    }
+
+    memcpy(e.name, name, len + 1);
+    if(exists)
+    {
+        uint32_t prev_type = entries->data[index].stats.st_mode & S_IFMT;
+        entries->data[index].stats = e.stats;
+        if(prev_type == type)
+            return;
+        // Files sort after directories, so a type change means a move.
+        remove_entry(bufwin, index);
+    }
+
+    // Binary search for the sorted position, then shift the tail over by one.
+    size_t lo = 0;
+    size_t hi = entries->size;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(dir_cmp(entries->data + mid, &e) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    da_insert(entries, e, lo);
+    if((int)len > entries->largest_name)
+        entries->largest_name = len;
+    if(entries->size > 1 && lo <= bufwin->sel_entry)
+        bufwin->sel_entry++;
+}
+
 bool is_dir(DirEntry* ent)
 {
     return S_ISDIR(ent->stats.st_mode);
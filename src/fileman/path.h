@@ -13,4 +13,5 @@
 char*  resolve_path(const char* path);
 char*  get_cwd_path(void);
 void   scan_bufwin_dir(BufferWin* bufwin);
+void   update_bufwin_dir_entry(BufferWin* bufwin, const char* name, int event);
 bool   is_dir(DirEntry* ent);
@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+#include "watcher.h"
+#include "core/core.h"
+#include "core/window.h"
+#include "editor/bufferwin.h"
+#include "structs/da.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB)
+#define EVENT_BUF_SIZE 4096
+
+typedef struct WatchEntry WatchEntry;
+typedef struct WatchDA    WatchDA;
+
+struct WatchEntry
+{
+    char* path;
+    int   wd;
+    int   ref_cnt;
+};
+
+struct WatchDA
+{
+    WatchEntry* data;
+    size_t      size;
+    size_t      capacity;
+};
+
+static void        handle_inotify(int fd);
+static WatchEntry* find_entry(int wd);
+static int         translate_mask(uint32_t mask);
+
+static int     s_inotify_fd = -1;
+static WatchDA s_watches;
+
+void watcher_init(void)
+{
+    GEM_ASSERT(s_inotify_fd < 0);
+    s_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(s_inotify_fd < 0)
+    {
+        fprintf(stderr, "Failed to initialize inotify, file changes will not be detected.\n");
+        return;
+    }
+    da_init(&s_watches, 0);
+    window_add_fd_source(s_inotify_fd, handle_inotify);
+}
+
+void watcher_cleanup(void)
+{
+    if(s_inotify_fd < 0)
+        return;
+    window_remove_fd_source(s_inotify_fd);
+    close(s_inotify_fd);
+    s_inotify_fd = -1;
+    for(size_t i = 0; i < s_watches.size; ++i)
+        free(s_watches.data[i].path);
+    da_free_data(&s_watches);
+}
+
+int watcher_watch_dir(const char* dir_path)
+{
+    GEM_ASSERT(dir_path != NULL);
+    if(s_inotify_fd < 0)
+        return -1;
+
+    int wd = inotify_add_watch(s_inotify_fd, dir_path, WATCH_MASK | IN_ONLYDIR);
+    if(wd < 0)
+        return -1;
+
+    // inotify hands back the same descriptor for the same directory, so
+    // several buffers and windows can share one watch.
+    WatchEntry* e = find_entry(wd);
+    if(e != NULL)
+    {
+        e->ref_cnt++;
+        return wd;
+    }
+
+    WatchEntry entry;
+    entry.path = strdup(dir_path);
+    GEM_ENSURE(entry.path != NULL);
+    entry.wd = wd;
+    entry.ref_cnt = 1;
+    da_append(&s_watches, entry);
+    return wd;
+}
+
+void watcher_unwatch(int wd)
+{
+    if(wd < 0 || s_inotify_fd < 0)
+        return;
+
+    for(size_t i = 0; i < s_watches.size; ++i)
+    {
+        WatchEntry* e = s_watches.data + i;
+        if(e->wd != wd)
+            continue;
+        if(--e->ref_cnt > 0)
+            return;
+        inotify_rm_watch(s_inotify_fd, wd);
+        free(e->path);
+        s_watches.data[i] = s_watches.data[--s_watches.size];
+        return;
+    }
+}
+
+const char* watcher_get_path(int wd)
+{
+    WatchEntry* e = find_entry(wd);
+    return e == NULL ? NULL : e->path;
+}
+
+static void handle_inotify(int fd)
+{
+    char buf[EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(true)
+    {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if(len <= 0)
+        {
+            GEM_ASSERT(len == 0 || errno == EAGAIN || errno == EINTR);
+            return;
+        }
+
+        for(char* ptr = buf; ptr < buf + len; )
+        {
+            const struct inotify_event* ev = (const struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if(ev->mask & IN_Q_OVERFLOW)
+            {
+                bufwin_handle_watch_event(-1, NULL, WATCH_EVENT_OVERFLOW);
+                continue;
+            }
+            if(ev->mask & IN_IGNORED)
+            {
+                // The directory itself went away, the kernel already dropped
+                // the watch. Its holders are told to let go of the descriptor,
+                // which the kernel is free to hand out again.
+                WatchEntry* e = find_entry(ev->wd);
+                if(e != NULL)
+                {
+                    free(e->path);
+                    *e = s_watches.data[--s_watches.size];
+                    bufwin_handle_watch_event(ev->wd, NULL, WATCH_EVENT_UNWATCHED);
+                }
+                continue;
+            }
+            if(ev->len == 0 || find_entry(ev->wd) == NULL)
+                continue;
+
+            bufwin_handle_watch_event(ev->wd, ev->name, translate_mask(ev->mask));
+        }
+    }
+}
+
+static WatchEntry* find_entry(int wd)
+{
+    for(size_t i = 0; i < s_watches.size; ++i)
+        if(s_watches.data[i].wd == wd)
+            return s_watches.data + i;
+    return NULL;
+}
+
+static int translate_mask(uint32_t mask)
+{
+    if(mask & (IN_CREATE | IN_MOVED_TO))
+        return WATCH_EVENT_CREATED;
+    if(mask & (IN_DELETE | IN_MOVED_FROM))
+        return WATCH_EVENT_DELETED;
+    return WATCH_EVENT_MODIFIED;
+}
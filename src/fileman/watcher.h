@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+enum
+{
+    WATCH_EVENT_CREATED = 0,
+    WATCH_EVENT_DELETED,
+    WATCH_EVENT_MODIFIED,
+    WATCH_EVENT_OVERFLOW,
+    WATCH_EVENT_UNWATCHED // The directory went away and took its watch with it
+};
+
+void watcher_init(void);
+void watcher_cleanup(void);
+
+// Directories are the only thing watched. Files are tracked through their
+// parent so that editors which save by renaming over the file are still seen.
+int         watcher_watch_dir(const char* dir_path);
+void        watcher_unwatch(int wd);
+const char* watcher_get_path(int wd);
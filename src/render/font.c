@@ -1,5 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
 #include "font.h"
+#include "core/app.h"
 #include "core/core.h"
+#include "core/window.h"
+#include "fileman/path.h"
+#include "structs/serial.h"
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -8,12 +13,36 @@
 
 #include <glad/glad.h>
 
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// TODO: Change this to a dynamic system
-#define ATLAS_ROWS    8
-#define ATLAS_COLUMNS 12
-#define ATLAS_OFFSET  10
+#define GLYPH_FREE    UINT32_MAX
+#define SHELF_ROUND   4 // Shelf heights are rounded up to this, so close heights share them
+#define INITIAL_SLOTS (1 << 8)
+#define SDF_SIZE      48 // Size distance fields are made at, whatever size they are drawn at
+#define SDF_SPREAD    8  // FreeType's default, distance at SDF_SIZE that maps to 0 or 1
+
+#define CACHE_MAGIC      "GEMFONT"
+#define CACHE_VERSION    1
+#define CACHE_BYTE_ORDER 0x0102030405060708ull
+#define CACHE_HEADER_LEN 40
+
+/*
+ * Cache layout, in the 8 byte words of structs/serial.h:
+ *   magic, format version, byte order mark, sizeof(GemGlyphData),
+ *   checksum of the payload, then the payload: the key (font path, device,
+ *   inode, mtime, file size, raster size, render mode, atlas size), the raw
+ *   advance, the glyph table, the shelves, each layer's top and the rows of
+ *   each layer up to it.
+ * One file per font path, raster size and mode. A key that doesn't match
+ * means the font changed, and the file is written again.
+ */
 
 #define DEFAULT_FONT_SIZE   20
 #define DEFAULT_LINE_HEIGHT 1.3f
@@ -30,14 +59,79 @@
         goto label;
 
 static const FT_Int32 LOAD_FLAGS = FT_LOAD_DEFAULT | FT_LOAD_NO_HINTING;
-static const FT_Int32 RENDER_FLAGS = FT_RENDER_MODE_NORMAL;
 
 static FT_Library s_lib;
 static float s_line_height = DEFAULT_LINE_HEIGHT;
 static int s_font_size = DEFAULT_FONT_SIZE; // For now only one font size is allowed globally
+static bool s_sdf = false;
 static int s_vert_adv = DEFAULT_VERT_ADV;
 static bool s_initialized = false;
 
+// A glyph for the worker to rasterize into slot, which shows the missing
+// glyph until the result is taken in.
+typedef struct GlyphJob GlyphJob;
+struct GlyphJob
+{
+    uint32_t  slot;
+    uint32_t  index;
+    uint32_t  size;
+    bool      sdf;
+    uint32_t  width, height;
+    int32_t   xoff, yoff;
+    uint8_t*  pixels; /* width * height, NULL if it failed */
+    GlyphJob* next;
+};
+
+// Rasterizes on its own thread with its own library and face, FreeType
+// objects can't be shared between threads.
+struct GemGlyphWorker
+{
+    pthread_t       thread;
+    FT_Library      lib;
+    FT_Face         face;   /* Opened on the worker's thread, NULL if that failed */
+    int             face_size;
+    char*           path;
+    int             notify_read;
+    int             notify_write;
+
+    // Guarded by mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    GlyphJob*       todo_head;
+    GlyphJob*       todo_tail;
+    GlyphJob*       done;
+    bool            quit;
+};
+
+static uint32_t hash_glyph(uint32_t cp, uint32_t size);
+static void     insert_ref(GemFont* font, uint32_t cp, uint32_t size, uint32_t slot);
+static void     rebuild_refs(GemFont* font, uint32_t cap);
+static bool     load_glyph(GemFont* font, uint32_t index, uint32_t cp, uint32_t* slot);
+static bool     store_glyph(GemFont* font, GemGlyphData* data, const uint8_t* pixels, int pitch);
+static void     mark_dirty(GemFont* font, uint32_t slot);
+static uint32_t queue_glyph(GemFont* font, uint32_t index, uint32_t cp, uint32_t size);
+static bool     take_glyphs(GemFont* font);
+static void     start_worker(GemFont* font);
+static void     stop_worker(GemFont* font);
+static void*    worker_thread(void* arg);
+static void     handle_notify(int fd);
+static bool     new_atlas(GemFont* font);
+static bool     prepare_face(GemFont* font);
+static void     load_ascii(GemFont* font);
+static bool     update_missing_glyph(GemFont* font);
+static int      raster_size(const GemFont* font);
+static FT_Render_Mode render_mode(const GemFont* font);
+static uint32_t new_slot(GemFont* font);
+static bool     place_box(GemFont* font, uint32_t width, uint32_t height, GemGlyphData* data);
+static void     grow_atlas(GemFont* font);
+static void     stage_glyph(GemFont* font, const GemGlyphData* data, const uint8_t* pixels, int pitch);
+static int      compare_use(const void* a, const void* b);
+static bool     evict_shelves(GemFont* font);
+static bool     cache_path(char* path, const GemFont* font, bool create_dir);
+static void     put_cache_key(StringBuilder* out, const GemFont* font, const struct stat* st);
+static bool     load_cache(GemFont* font, const struct stat* st);
+static void     save_cache(const GemFont* font, const struct stat* st);
+
 void freetype_init(void)
 {
     GEM_ASSERT(!s_initialized);
@@ -46,119 +140,971 @@ void freetype_init(void)
     s_initialized = true;
 }
 
-static bool get_cell_dims(FT_Face face, size_t* width, size_t* height)
+bool gen_font_atlas(const char* font_path, GemFont* font)
 {
-    *width = 0;
-    *height = 0;
-
-    CHECK_FT_OR_RET(FT_Load_Glyph(face, 0, LOAD_FLAGS), false);
+    GEM_ASSERT(font_path != NULL);
+    GEM_ASSERT(font != NULL);
 
-    *width = face->glyph->bitmap.width;
-    *height = face->glyph->bitmap.rows;
+    memset(font, 0, sizeof(GemFont));
+    font->path = strdup(font_path);
+    GEM_ENSURE(font->path != NULL);
+    font->sdf = s_sdf;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
-    for(size_t i = GEM_PRINTABLE_ASCII_START; i < GEM_PRINTABLE_ASCII_END; ++i)
+    struct stat st;
+    bool found = stat(font_path, &st) == 0;
+    bool result = found && load_cache(font, &st);
+    if(result)
+        result = resize_font(font);
+    else
     {
-        CHECK_FT_OR_CONTINUE(FT_Load_Char(face, i, LOAD_FLAGS));
-        if(*width < face->glyph->bitmap.width)
-            *width = face->glyph->bitmap.width;
-        if(*height < face->glyph->bitmap.rows)
-            *height = face->glyph->bitmap.rows;
+        result = new_atlas(font);
+        if(result && found)
+            save_cache(font, &st);
     }
 
+    if(result)
+        start_worker(font);
+    else
+        free_font(font);
+    return result;
+}
+
+bool resize_font(GemFont* font)
+{
+    GEM_ASSERT(font != NULL && font->path != NULL);
+    // Distance fields are always made at the same size, only bitmaps need
+    // the face again.
+    bool new_size = font->face_size != raster_size(font);
+    if(new_size && !prepare_face(font))
+        return false;
+    font->advance = (int)((font->raw_advance * s_font_size / raster_size(font)) >> 6);
+    font->scale = (float)s_font_size / (float)raster_size(font);
+    font->sdf_edge = font->sdf ? 0.5f / (2.0f * SDF_SPREAD * font->scale) : 0.0f;
+
+    // Table entries are in pixels at the drawn size, and whatever was drawn
+    // with the old ones is stale.
+    font->dirty_first = 0;
+    font->dirty_end = font->glyph_cnt;
+    font->generation++;
+    if(new_size && font->glyph_cnt > 0)
+    {
+        update_missing_glyph(font);
+        load_ascii(font);
+    }
     return true;
 }
 
-GemGlyphData put_glyph_in_atlas(uint8_t* atlas, size_t tex_width, size_t tex_height,
-                                FT_GlyphSlot glyph, size_t xloc, size_t yloc)
+void free_font(GemFont* font)
+{
+    GEM_ASSERT(font != NULL);
+    stop_worker(font);
+    if(font->face != NULL)
+        FT_Done_Face(font->face);
+    glDeleteTextures(1, &font->atlas_texture);
+    free(font->path);
+    free(font->glyphs);
+    free(font->free_slots);
+    free(font->refs);
+    free(font->shelves);
+    free(font->staging);
+    free(font->uploads);
+    memset(font, 0, sizeof(GemFont));
+}
+
+uint32_t get_font_glyph(GemFont* font, uint32_t cp)
+{
+    GEM_ASSERT(font != NULL && font->refs != NULL);
+    if(cp < 0x20 || (cp >= 0x7F && cp < 0xA0))
+        return GEM_MISSING_GLYPH; // Control characters
+
+    uint32_t size = (uint32_t)raster_size(font);
+    uint32_t mask = font->ref_cap - 1;
+    for(uint32_t i = hash_glyph(cp, size) & mask; font->refs[i].codepoint != GLYPH_FREE; i = (i + 1) & mask)
+    {
+        const GemGlyphRef* ref = font->refs + i;
+        if(ref->codepoint == cp && ref->size == size)
+        {
+            uint32_t shelf = font->glyphs[ref->slot].shelf;
+            if(shelf != GEM_NO_SHELF && font->shelves[shelf].last_use < font->frame)
+                font->shelves[shelf].last_use = font->frame;
+            return ref->slot;
+        }
+    }
+
+    // Codepoints the face doesn't have are remembered as the missing glyph,
+    // the rest get a slot right away and are rasterized in the background.
+    uint32_t slot = GEM_MISSING_GLYPH;
+    FT_UInt index = prepare_face(font) ? FT_Get_Char_Index(font->face, cp) : 0;
+    if(index != 0)
+        slot = queue_glyph(font, index, cp, size);
+    insert_ref(font, cp, size, slot);
+    return slot;
+}
+
+void upload_font_glyphs(GemFont* font)
+{
+    GEM_ASSERT(font != NULL);
+    for(uint32_t i = 0; i < font->upload_cnt; ++i)
+    {
+        const GemUpload* up = font->uploads + i;
+        glTextureSubImage3D(font->atlas_texture, 0, up->x, up->y, up->layer, up->width, up->height, 1,
+                            GL_RED, GL_UNSIGNED_BYTE, font->staging + up->offset);
+    }
+    font->upload_cnt = 0;
+    font->staging_size = 0;
+}
+
+bool next_font_frame(GemFont* font)
+{
+    GEM_ASSERT(font != NULL);
+    font->frame++;
+    font->loads = 0;
+    bool changed = false;
+    if(font->full)
+    {
+        font->full = false;
+        changed = evict_shelves(font);
+        changed = update_missing_glyph(font) || changed;
+    }
+    return take_glyphs(font) || changed;
+}
+
+static uint32_t hash_glyph(uint32_t cp, uint32_t size)
+{
+    uint32_t h = cp * 0x9E3779B1u ^ size * 0x85EBCA77u;
+    return h ^ (h >> 16);
+}
+
+static void insert_ref(GemFont* font, uint32_t cp, uint32_t size, uint32_t slot)
+{
+    if((font->ref_cnt + 1) * 2 > font->ref_cap)
+        rebuild_refs(font, font->ref_cap * 2);
+    uint32_t mask = font->ref_cap - 1;
+    uint32_t i = hash_glyph(cp, size) & mask;
+    while(font->refs[i].codepoint != GLYPH_FREE)
+        i = (i + 1) & mask;
+    font->refs[i] = (GemGlyphRef){ cp, size, slot };
+    font->ref_cnt++;
+}
+
+// Starts the map over from the slots in use, which forgets the codepoints
+// that only mapped to the missing glyph.
+static void rebuild_refs(GemFont* font, uint32_t cap)
+{
+    free(font->refs);
+    font->refs = malloc(sizeof(GemGlyphRef) * cap);
+    GEM_ENSURE(font->refs != NULL);
+    memset(font->refs, 0xFF, sizeof(GemGlyphRef) * cap); // GLYPH_FREE
+    font->ref_cap = cap;
+    font->ref_cnt = 0;
+    for(uint32_t slot = 0; slot < font->glyph_cnt; ++slot)
+    {
+        const GemGlyphData* data = font->glyphs + slot;
+        if(data->codepoint != GLYPH_FREE)
+            insert_ref(font, data->codepoint, data->size, slot);
+    }
+}
+
+// Rasterizes the glyph at index into a new slot, false if the atlas has no
+// room left for it this frame.
+static bool load_glyph(GemFont* font, uint32_t index, uint32_t cp, uint32_t* slot)
 {
-    FT_Bitmap* bmp = &glyph->bitmap;
-    float x = (float)xloc;
-    float y = (float)yloc;
-    float tw = (float)tex_width;
-    float th = (float)tex_height;
+    FT_Face face = font->face;
+    *slot = GEM_MISSING_GLYPH;
+    CHECK_FT_OR_RET(FT_Load_Glyph(face, index, LOAD_FLAGS), true);
+    CHECK_FT_OR_RET(FT_Render_Glyph(face->glyph, render_mode(font)), true);
 
-    GemGlyphData glyph_data = (GemGlyphData) { 
+    FT_Bitmap* bmp = &face->glyph->bitmap;
+    if(bmp->width + 2 > GEM_ATLAS_SIZE || bmp->rows + 2 > GEM_ATLAS_SIZE || bmp->pitch < 0)
+        return true;
+
+    GemGlyphData data = {
         .width = bmp->width,
         .height = bmp->rows,
-        .xoff = glyph->bitmap_left,
-        .yoff = glyph->bitmap_top,
-        .tex_coords = {
-            x / tw,
-            (y + (float)bmp->rows) / th,
-            (x + bmp->width) / tw,
-            y / th
-        }
+        .xoff = face->glyph->bitmap_left,
+        .yoff = face->glyph->bitmap_top,
+        .codepoint = cp,
+        .size = (uint32_t)raster_size(font)
     };
+    if(!store_glyph(font, &data, bmp->buffer, bmp->pitch))
+        return false;
 
-    for(uint32_t row = 0; row < bmp->rows; ++row)
-        memcpy(atlas + ((yloc + row) * tex_width + xloc), bmp->buffer + (row * bmp->pitch),
-               bmp->width);
-    return glyph_data;
+    *slot = new_slot(font);
+    font->glyphs[*slot] = data;
+    mark_dirty(font, *slot);
+    return true;
 }
 
-bool gen_font_atlas(const char* font_path, GemFont* font)
+// Places data's bitmap in the atlas and stages its pixels, false if the
+// atlas has no room left for it this frame.
+static bool store_glyph(GemFont* font, GemGlyphData* data, const uint8_t* pixels, int pitch)
 {
-    GEM_ASSERT(font_path != NULL);
-    GEM_ASSERT(font != NULL);
+    data->shelf = GEM_NO_SHELF;
+    data->pending = false;
+    font->loads++;
+    if(data->width == 0 || data->height == 0)
+        return true;
 
-    memset(font, 0, sizeof(GemFont));
-    FT_Face face;
-    bool result = false;
-    CHECK_FT_OR_RET(FT_New_Face(s_lib, font_path, 0, &face), false);
-    CHECK_FT_OR_GOTO(FT_Set_Pixel_Sizes(face, s_font_size, 0), clean);
+    // Each glyph gets a blank border, so filtering never reaches whatever
+    // is next to it.
+    if(!place_box(font, data->width + 2, data->height + 2, data))
+    {
+        font->full = true;
+        return false;
+    }
+    float x = (float)(data->x + 1);
+    float y = (float)(data->y + 1);
+    float size = (float)GEM_ATLAS_SIZE;
+    data->tex_coords[0] = x / size;
+    data->tex_coords[1] = (y + (float)data->height) / size;
+    data->tex_coords[2] = (x + (float)data->width) / size;
+    data->tex_coords[3] = y / size;
+    stage_glyph(font, data, pixels, pitch);
+    return true;
+}
 
-    size_t cell_width, cell_height;
-    if(!get_cell_dims(face, &cell_width, &cell_height))
-        goto clean;
+static void mark_dirty(GemFont* font, uint32_t slot)
+{
+    if(slot < font->dirty_first)
+        font->dirty_first = slot;
+    if(slot + 1 > font->dirty_end)
+        font->dirty_end = slot + 1;
+}
 
-    cell_width += 1; // Padding
-    cell_height += 1;
+// Gives the glyph a slot drawn as the missing glyph for now, and hands it to
+// the worker.
+static uint32_t queue_glyph(GemFont* font, uint32_t index, uint32_t cp, uint32_t size)
+{
+    uint32_t slot = new_slot(font);
+    GemGlyphData* data = font->glyphs + slot;
+    *data = font->glyphs[GEM_MISSING_GLYPH];
+    data->codepoint = cp;
+    data->size = size;
+    data->shelf = GEM_NO_SHELF;
+    data->pending = true;
+    mark_dirty(font, slot);
 
-    size_t tex_width = ATLAS_COLUMNS * cell_width + ATLAS_OFFSET;
-    size_t tex_height = ATLAS_ROWS * cell_height + ATLAS_OFFSET;
+    GlyphJob* job = calloc(1, sizeof(GlyphJob));
+    GEM_ENSURE(job != NULL);
+    job->slot = slot;
+    job->index = index;
+    job->size = size;
+    job->sdf = font->sdf;
 
-    // Load the 'missing glyph' glyph
-    CHECK_FT_OR_GOTO(FT_Load_Glyph(face, 0, LOAD_FLAGS), clean);
-    CHECK_FT_OR_GOTO(FT_Render_Glyph(face->glyph, RENDER_FLAGS), clean);
+    GemGlyphWorker* worker = font->worker;
+    pthread_mutex_lock(&worker->mutex);
+    if(worker->todo_tail == NULL)
+        worker->todo_head = job;
+    else
+        worker->todo_tail->next = job;
+    worker->todo_tail = job;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+    return slot;
+}
 
-    uint8_t* pixels = calloc(tex_width * tex_height, 1);
-    GEM_ENSURE(pixels != NULL);
+// Moves what the worker finished into the atlas, true if any slot changed.
+// A glyph the atlas turns away loses its slot and is queued again the next
+// time it is looked up.
+static bool take_glyphs(GemFont* font)
+{
+    GemGlyphWorker* worker = font->worker;
+    pthread_mutex_lock(&worker->mutex);
+    GlyphJob* job = worker->done;
+    worker->done = NULL;
+    pthread_mutex_unlock(&worker->mutex);
+    if(job == NULL)
+        return false;
+
+    bool dropped = false;
+    while(job != NULL)
+    {
+        GemGlyphData* data = font->glyphs + job->slot;
+        GEM_ASSERT(data->pending);
+        GemGlyphData res = {
+            .width = job->width,
+            .height = job->height,
+            .xoff = job->xoff,
+            .yoff = job->yoff,
+            .codepoint = data->codepoint,
+            .size = data->size
+        };
+        if(job->pixels == NULL)
+            data->pending = false; // Stays the missing glyph
+        else if(store_glyph(font, &res, job->pixels, res.width))
+            *data = res;
+        else
+        {
+            data->codepoint = GLYPH_FREE;
+            font->free_slots[font->free_cnt++] = job->slot;
+            dropped = true;
+        }
+        mark_dirty(font, job->slot);
+
+        GlyphJob* next = job->next;
+        free(job->pixels);
+        free(job);
+        job = next;
+    }
+    if(dropped)
+        rebuild_refs(font, font->ref_cap);
+    // Slots were drawn with the placeholder's size, they have to be drawn again.
+    font->generation++;
+    return true;
+}
+
+static void start_worker(GemFont* font)
+{
+    GemGlyphWorker* worker = calloc(1, sizeof(GemGlyphWorker));
+    GEM_ENSURE(worker != NULL);
+    worker->path = strdup(font->path);
+    GEM_ENSURE(worker->path != NULL);
+
+    int fds[2];
+    window_open_wakeup(fds);
+    worker->notify_read = fds[0];
+    worker->notify_write = fds[1];
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    font->worker = worker;
+    GEM_ENSURE(pthread_create(&worker->thread, NULL, worker_thread, worker) == 0);
+    window_add_fd_source(worker->notify_read, handle_notify);
+}
+
+static void stop_worker(GemFont* font)
+{
+    GemGlyphWorker* worker = font->worker;
+    if(worker == NULL)
+        return;
 
-    font->advance = face->glyph->advance.x >> 6;
-    font->glyphs[0] = put_glyph_in_atlas(pixels, tex_width, tex_height, face->glyph, ATLAS_OFFSET, ATLAS_OFFSET);
+    pthread_mutex_lock(&worker->mutex);
+    worker->quit = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+    pthread_join(worker->thread, NULL);
 
-    for(size_t i = 1; i < GEM_GLYPH_CNT; ++i)
+    for(int i = 0; i < 2; ++i)
     {
-        CHECK_FT_OR_CONTINUE(FT_Load_Char(face, i + GEM_PRINTABLE_ASCII_START - 1, LOAD_FLAGS));
-        CHECK_FT_OR_CONTINUE(FT_Render_Glyph(face->glyph, RENDER_FLAGS));
+        GlyphJob* job = i == 0 ? worker->todo_head : worker->done;
+        while(job != NULL)
+        {
+            GlyphJob* next = job->next;
+            free(job->pixels);
+            free(job);
+            job = next;
+        }
+    }
+    window_remove_fd_source(worker->notify_read);
+    close(worker->notify_read);
+    close(worker->notify_write);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    if(worker->face != NULL)
+        FT_Done_Face(worker->face);
+    if(worker->lib != NULL)
+        FT_Done_FreeType(worker->lib);
+    free(worker->path);
+    free(worker);
+    font->worker = NULL;
+}
+
+static void* worker_thread(void* arg)
+{
+    GemGlyphWorker* worker = arg;
+    // Opening the face here keeps it out of the main thread's startup, jobs
+    // just fail if it can't be.
+    if(FT_Init_FreeType(&worker->lib) != FT_Err_Ok)
+        worker->lib = NULL;
+    else if(FT_New_Face(worker->lib, worker->path, 0, &worker->face) != FT_Err_Ok)
+        worker->face = NULL;
+
+    while(true)
+    {
+        pthread_mutex_lock(&worker->mutex);
+        while(worker->todo_head == NULL && !worker->quit)
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+        GlyphJob* job = worker->todo_head;
+        if(worker->quit)
+        {
+            pthread_mutex_unlock(&worker->mutex);
+            break;
+        }
+        worker->todo_head = job->next;
+        if(worker->todo_head == NULL)
+            worker->todo_tail = NULL;
+        pthread_mutex_unlock(&worker->mutex);
+
+        FT_Face face = worker->face;
+        bool ok = face != NULL;
+        if(ok && worker->face_size != (int)job->size)
+        {
+            ok = FT_Set_Pixel_Sizes(face, job->size, 0) == FT_Err_Ok;
+            worker->face_size = ok ? (int)job->size : 0;
+        }
+        ok = ok && FT_Load_Glyph(face, job->index, LOAD_FLAGS) == FT_Err_Ok &&
+             FT_Render_Glyph(face->glyph, job->sdf ? FT_RENDER_MODE_SDF : FT_RENDER_MODE_NORMAL) == FT_Err_Ok;
 
-        size_t xloc = (i % ATLAS_COLUMNS) * cell_width + ATLAS_OFFSET;
-        size_t yloc = (i / ATLAS_COLUMNS) * cell_height + ATLAS_OFFSET;
+        FT_Bitmap* bmp = ok ? &face->glyph->bitmap : NULL;
+        if(ok && bmp->width + 2 <= GEM_ATLAS_SIZE && bmp->rows + 2 <= GEM_ATLAS_SIZE && bmp->pitch >= 0)
+        {
+            job->width = bmp->width;
+            job->height = bmp->rows;
+            job->xoff = face->glyph->bitmap_left;
+            job->yoff = face->glyph->bitmap_top;
+            // Bailing out from here would join this thread from itself, a
+            // glyph with no pixels just stays the missing glyph.
+            job->pixels = malloc((size_t)job->width * job->height + 1);
+            for(uint32_t row = 0; job->pixels != NULL && row < job->height; ++row)
+                memcpy(job->pixels + row * job->width, bmp->buffer + row * bmp->pitch, job->width);
+        }
 
-        font->glyphs[i] = put_glyph_in_atlas(pixels, tex_width, tex_height, face->glyph, xloc, yloc);
+        pthread_mutex_lock(&worker->mutex);
+        job->next = worker->done;
+        worker->done = job;
+        pthread_mutex_unlock(&worker->mutex);
+
+        if(!window_wake(worker->notify_write))
+            fprintf(stderr, "Failed to notify the main thread of a rasterized glyph.\n");
     }
+    return NULL;
+}
 
-    // stbi_write_bmp("test.bmp", tex_width, tex_height, 1, pixels);
-    
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glCreateTextures(GL_TEXTURE_2D, 1, &font->atlas_texture);
-    glTextureStorage2D(font->atlas_texture, 1, GL_R8, tex_width, tex_height);
+// Glyphs are taken in at the start of a frame, this just asks for one.
+static void handle_notify(int fd)
+{
+    window_drain_wakeup(fd);
+    gem_request_redraw();
+}
+
+// Starts an empty atlas with the missing glyph and ASCII in it.
+static bool new_atlas(GemFont* font)
+{
+    if(!resize_font(font))
+        return false;
+    grow_atlas(font);
+    rebuild_refs(font, INITIAL_SLOTS);
+    font->dirty_first = UINT32_MAX;
+    font->dirty_end = 0;
+
+    // Load the 'missing glyph' glyph, it takes slot 0 and its shelf is
+    // never evicted.
+    uint32_t slot;
+    if(!load_glyph(font, 0, 0, &slot) || font->glyph_cnt != 1)
+        return false;
+    if(font->glyphs[GEM_MISSING_GLYPH].shelf != GEM_NO_SHELF)
+        font->shelves[font->glyphs[GEM_MISSING_GLYPH].shelf].last_use = UINT64_MAX;
+    insert_ref(font, 0, raster_size(font), GEM_MISSING_GLYPH);
+    load_ascii(font);
+    return true;
+}
+
+// Opens the face the first time it is needed and sets it to the raster
+// size, measuring the advance there.
+static bool prepare_face(GemFont* font)
+{
+    int size = raster_size(font);
+    if(font->face != NULL && font->face_size == size)
+        return true;
+    if(font->face == NULL)
+    {
+        FT_Face face;
+        CHECK_FT_OR_RET(FT_New_Face(s_lib, font->path, 0, &face), false);
+        font->face = face;
+    }
+    CHECK_FT_OR_RET(FT_Set_Pixel_Sizes(font->face, size, 0), false);
+    CHECK_FT_OR_RET(FT_Load_Glyph(font->face, 0, LOAD_FLAGS), false);
+    font->raw_advance = font->face->glyph->advance.x;
+    font->face_size = size;
+    return true;
+}
+
+// ASCII is on nearly every screen and cheap, so it is rasterized right
+// away instead of showing placeholders for a frame.
+static void load_ascii(GemFont* font)
+{
+    for(uint32_t cp = 0x21; cp < 0x7F; ++cp)
+    {
+        uint32_t size = (uint32_t)raster_size(font);
+        uint32_t mask = font->ref_cap - 1;
+        uint32_t i = hash_glyph(cp, size) & mask;
+        while(font->refs[i].codepoint != GLYPH_FREE &&
+              (font->refs[i].codepoint != cp || font->refs[i].size != size))
+            i = (i + 1) & mask;
+        if(font->refs[i].codepoint == cp)
+            continue;
 
-    glTextureParameteri(font->atlas_texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTextureParameteri(font->atlas_texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        uint32_t slot;
+        FT_UInt index = FT_Get_Char_Index(font->face, cp);
+        if(index != 0 && load_glyph(font, index, cp, &slot))
+            insert_ref(font, cp, size, slot);
+    }
+}
 
-    glTextureParameteri(font->atlas_texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTextureParameteri(font->atlas_texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+// A bitmap missing glyph is only right at the size it was made at, so it is
+// made again in slot 0 when the size changes. If the atlas is full that
+// waits for the next eviction. True if slot 0 changed.
+static bool update_missing_glyph(GemFont* font)
+{
+    GemGlyphData* missing = font->glyphs + GEM_MISSING_GLYPH;
+    if(font->glyph_cnt == 0 || missing->size == (uint32_t)raster_size(font) || !prepare_face(font))
+        return false;
 
-    glTextureSubImage2D(font->atlas_texture, 0, 0, 0, tex_width, tex_height, GL_RED, GL_UNSIGNED_BYTE, pixels);
+    uint32_t slot;
+    if(!load_glyph(font, 0, 0, &slot))
+        return false;
+    if(slot == GEM_MISSING_GLYPH)
+    {
+        // The face can't render it at this size, keep the old one.
+        missing->size = (uint32_t)raster_size(font);
+        return false;
+    }
 
+    // The old box goes back to being evicted like any other, the new one
+    // is pinned in its place.
+    GemGlyphData old = *missing;
+    *missing = font->glyphs[slot];
+    font->glyphs[slot].codepoint = GLYPH_FREE;
+    font->free_slots[font->free_cnt++] = slot;
+    if(old.shelf != GEM_NO_SHELF)
+        font->shelves[old.shelf].last_use = font->frame;
+    if(missing->shelf != GEM_NO_SHELF)
+        font->shelves[missing->shelf].last_use = UINT64_MAX;
+    mark_dirty(font, GEM_MISSING_GLYPH);
 
-    free(pixels);
-    result = true;
+    // Placeholders, and glyphs that stayed the missing glyph, share the old
+    // box without holding its shelf. Real glyphs with pixels always have
+    // a shelf of their own.
+    for(uint32_t i = 0; old.shelf != GEM_NO_SHELF && i < font->glyph_cnt; ++i)
+    {
+        GemGlyphData* data = font->glyphs + i;
+        if(i == GEM_MISSING_GLYPH || data->codepoint == GLYPH_FREE || data->shelf != GEM_NO_SHELF ||
+           data->layer != old.layer || data->x != old.x || data->y != old.y ||
+           data->width != old.width || data->height != old.height)
+            continue;
+        GemGlyphData res = *missing;
+        res.codepoint = data->codepoint;
+        res.size = data->size;
+        res.shelf = GEM_NO_SHELF;
+        res.pending = data->pending;
+        *data = res;
+        mark_dirty(font, i);
+    }
+    return true;
+}
 
-clean:
-    CHECK_FT_OR_RET(FT_Done_Face(face), false);
-    return result;
+// Distance fields are made once at SDF_SIZE and scaled, bitmaps are made
+// at the size they are drawn at.
+static int raster_size(const GemFont* font)
+{
+    return font->sdf ? SDF_SIZE : s_font_size;
+}
+
+static FT_Render_Mode render_mode(const GemFont* font)
+{
+    return font->sdf ? FT_RENDER_MODE_SDF : FT_RENDER_MODE_NORMAL;
+}
+
+static uint32_t new_slot(GemFont* font)
+{
+    if(font->free_cnt > 0)
+        return font->free_slots[--font->free_cnt];
+    if(font->glyph_cnt == font->glyph_cap)
+    {
+        font->glyph_cap = font->glyph_cap == 0 ? INITIAL_SLOTS : font->glyph_cap * 2;
+        font->glyphs = realloc(font->glyphs, sizeof(GemGlyphData) * font->glyph_cap);
+        font->free_slots = realloc(font->free_slots, sizeof(uint32_t) * font->glyph_cap);
+        GEM_ENSURE(font->glyphs != NULL && font->free_slots != NULL);
+    }
+    return font->glyph_cnt++;
+}
+
+// Finds a width by height box for data on the shelf closest to its height,
+// or on a new shelf, growing the atlas if no layer has room for one.
+static bool place_box(GemFont* font, uint32_t width, uint32_t height, GemGlyphData* data)
+{
+    uint32_t shelf_height = (height + SHELF_ROUND - 1) / SHELF_ROUND * SHELF_ROUND;
+    GemShelf* best = NULL;
+    for(uint32_t i = 0; i < font->shelf_cnt; ++i)
+    {
+        GemShelf* shelf = font->shelves + i;
+        if(shelf->height >= shelf_height && shelf->height <= shelf_height * 2 &&
+           shelf->x + width <= GEM_ATLAS_SIZE && (best == NULL || shelf->height < best->height))
+            best = shelf;
+    }
+
+    if(best == NULL)
+    {
+        uint32_t layer = 0;
+        while(layer < font->layer_cnt && font->layer_top[layer] + shelf_height > GEM_ATLAS_SIZE)
+            layer++;
+        if(layer == font->layer_cnt)
+        {
+            if(font->layer_cnt == GEM_ATLAS_LAYERS)
+                return false;
+            grow_atlas(font);
+        }
+        if(font->shelf_cnt == font->shelf_cap)
+        {
+            font->shelf_cap = font->shelf_cap == 0 ? 64 : font->shelf_cap * 2;
+            font->shelves = realloc(font->shelves, sizeof(GemShelf) * font->shelf_cap);
+            GEM_ENSURE(font->shelves != NULL);
+        }
+        best = font->shelves + font->shelf_cnt++;
+        best->layer = layer;
+        best->y = font->layer_top[layer];
+        best->height = shelf_height;
+        best->x = 0;
+        best->last_use = font->frame;
+        font->layer_top[layer] += shelf_height;
+    }
+
+    data->shelf = best - font->shelves;
+    data->layer = best->layer;
+    data->x = best->x;
+    data->y = best->y;
+    best->x += width;
+    if(best->last_use < font->frame)
+        best->last_use = font->frame;
+    return true;
+}
+
+// Doubles the layers, up to GEM_ATLAS_LAYERS. The texture is made again and
+// the old layers copied over, batches drawn from here on use the new one.
+static void grow_atlas(GemFont* font)
+{
+    uint32_t layers = font->layer_cnt == 0 ? 1 : font->layer_cnt * 2;
+    if(layers > GEM_ATLAS_LAYERS)
+        layers = GEM_ATLAS_LAYERS;
+
+    GLuint tex;
+    glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &tex);
+    glTextureStorage3D(tex, 1, GL_R8, GEM_ATLAS_SIZE, GEM_ATLAS_SIZE, layers);
+
+    glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    if(font->layer_cnt > 0)
+    {
+        glCopyImageSubData(font->atlas_texture, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+                           tex, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+                           GEM_ATLAS_SIZE, GEM_ATLAS_SIZE, font->layer_cnt);
+        glDeleteTextures(1, &font->atlas_texture);
+    }
+    for(uint32_t i = font->layer_cnt; i < layers; ++i)
+        font->layer_top[i] = 0;
+    font->atlas_texture = tex;
+    font->layer_cnt = layers;
+}
+
+static void stage_glyph(GemFont* font, const GemGlyphData* data, const uint8_t* pixels, int pitch)
+{
+    uint32_t width = data->width + 2;
+    uint32_t height = data->height + 2;
+    size_t size = (size_t)width * height;
+    if(font->staging_size + size > font->staging_cap)
+    {
+        font->staging_cap = (font->staging_size + size) * 2;
+        font->staging = realloc(font->staging, font->staging_cap);
+        GEM_ENSURE(font->staging != NULL);
+    }
+    if(font->upload_cnt == font->upload_cap)
+    {
+        font->upload_cap = font->upload_cap == 0 ? 64 : font->upload_cap * 2;
+        font->uploads = realloc(font->uploads, sizeof(GemUpload) * font->upload_cap);
+        GEM_ENSURE(font->uploads != NULL);
+    }
+
+    uint8_t* box = font->staging + font->staging_size;
+    memset(box, 0, size);
+    for(uint32_t row = 0; row < data->height; ++row)
+        memcpy(box + (row + 1) * width + 1, pixels + row * pitch, data->width);
+    font->uploads[font->upload_cnt++] = (GemUpload){
+        .layer = data->layer,
+        .x = data->x,
+        .y = data->y,
+        .width = width,
+        .height = height,
+        .offset = font->staging_size
+    };
+    font->staging_size += size;
+}
+
+static int compare_use(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Empties the least recently used quarter of the shelves that weren't used
+// last frame. Their glyphs' slots are freed for reuse, false if there was
+// nothing to evict.
+static bool evict_shelves(GemFont* font)
+{
+    uint64_t* uses = malloc(sizeof(uint64_t) * (font->shelf_cnt + 1));
+    GEM_ENSURE(uses != NULL);
+    uint32_t cnt = 0;
+    for(uint32_t i = 0; i < font->shelf_cnt; ++i)
+        if(font->shelves[i].x > 0 && font->shelves[i].last_use < font->frame - 1)
+            uses[cnt++] = font->shelves[i].last_use;
+    if(cnt == 0)
+    {
+        free(uses);
+        return false;
+    }
+    qsort(uses, cnt, sizeof(uint64_t), compare_use);
+    uint64_t oldest = uses[cnt / 4];
+    free(uses);
+
+    for(uint32_t i = 0; i < font->shelf_cnt; ++i)
+    {
+        GemShelf* shelf = font->shelves + i;
+        if(shelf->x > 0 && shelf->last_use <= oldest)
+        {
+            shelf->x = 0;
+            shelf->last_use = 0;
+        }
+    }
+    for(uint32_t slot = 0; slot < font->glyph_cnt; ++slot)
+    {
+        GemGlyphData* data = font->glyphs + slot;
+        if(data->codepoint != GLYPH_FREE && data->shelf != GEM_NO_SHELF && font->shelves[data->shelf].x == 0)
+        {
+            data->codepoint = GLYPH_FREE;
+            font->free_slots[font->free_cnt++] = slot;
+        }
+    }
+    rebuild_refs(font, font->ref_cap);
+    font->generation++;
+    return true;
+}
+
+// Cached atlases live in $XDG_CACHE_HOME/gem/fonts, named after the font
+// path, raster size and render mode.
+static bool cache_path(char* path, const GemFont* font, bool create_dir)
+{
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int len;
+    if(cache != NULL && cache[0] == '/')
+        len = snprintf(path, GEM_PATH_MAX, "%s/gem/fonts", cache);
+    else if(home != NULL && home[0] == '/')
+        len = snprintf(path, GEM_PATH_MAX, "%s/.cache/gem/fonts", home);
+    else
+        return false;
+    if(len >= GEM_PATH_MAX - 48)
+        return false;
+
+    if(create_dir)
+    {
+        // Create each missing component, ~/.cache may not exist yet.
+        for(char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+        {
+            *slash = '\0';
+            mkdir(path, S_IRWXU);
+            *slash = '/';
+        }
+        mkdir(path, S_IRWXU);
+    }
+    uint64_t name = serial_checksum(font->path, strlen(font->path));
+    snprintf(path + len, GEM_PATH_MAX - len, "/%016llx-%d%s",
+             (unsigned long long)name, raster_size(font), font->sdf ? "-sdf" : "");
+    return true;
+}
+
+static void put_cache_key(StringBuilder* out, const GemFont* font, const struct stat* st)
+{
+    serial_put_bytes(out, font->path, strlen(font->path));
+    serial_put_u64(out, (uint64_t)st->st_dev);
+    serial_put_u64(out, (uint64_t)st->st_ino);
+    serial_put_u64(out, (uint64_t)st->st_mtim.tv_sec);
+    serial_put_u64(out, (uint64_t)st->st_mtim.tv_nsec);
+    serial_put_u64(out, (uint64_t)st->st_size);
+    serial_put_u64(out, (uint64_t)raster_size(font));
+    serial_put_u64(out, font->sdf);
+    serial_put_u64(out, GEM_ATLAS_SIZE);
+}
+
+// Fills an empty font with the atlas cached for st, uploading the layers
+// straight from the mapped file. False if there is none or it is stale.
+static bool load_cache(GemFont* font, const struct stat* st)
+{
+    char path[GEM_PATH_MAX];
+    if(!cache_path(path, font, false))
+        return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    struct stat cache_st;
+    void* map = MAP_FAILED;
+    if(fstat(fd, &cache_st) == 0 && cache_st.st_size >= CACHE_HEADER_LEN)
+        map = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return false;
+
+    const char* data = map;
+    size_t size = cache_st.st_size;
+    StringBuilder key;
+    da_init(&key, 1 << 8);
+    put_cache_key(&key, font, st);
+    SerialReader in = { data + sizeof(CACHE_MAGIC), data + size, true };
+    bool valid = memcmp(data, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+                 serial_get_u64(&in) == CACHE_VERSION &&
+                 serial_get_u64(&in) == CACHE_BYTE_ORDER &&
+                 serial_get_u64(&in) == sizeof(GemGlyphData);
+    uint64_t sum = serial_get_u64(&in);
+    valid = valid && size - CACHE_HEADER_LEN >= key.size && memcmp(in.ptr, key.data, key.size) == 0;
+    valid = valid && sum == serial_checksum(data + CACHE_HEADER_LEN, size - CACHE_HEADER_LEN);
+    in.ptr += valid ? key.size : 0;
+    da_free_data(&key);
+
+    size_t glyphs_len = 0, shelves_len = 0, tops_len = 0;
+    const char* layers[GEM_ATLAS_LAYERS];
+    int64_t raw_advance = (int64_t)serial_get_u64(&in);
+    const char* glyphs = serial_get_bytes(&in, &glyphs_len);
+    const char* shelves = serial_get_bytes(&in, &shelves_len);
+    const char* tops = serial_get_bytes(&in, &tops_len);
+    uint32_t glyph_cnt = glyphs_len / sizeof(GemGlyphData);
+    uint32_t shelf_cnt = shelves_len / sizeof(GemShelf);
+    uint32_t layer_cnt = tops_len / sizeof(uint32_t);
+    // Layer counts other than the ones grow_atlas goes through can't be
+    // recreated.
+    valid = valid && in.ok && glyph_cnt > 0 && glyphs_len % sizeof(GemGlyphData) == 0 &&
+            shelves_len % sizeof(GemShelf) == 0 && tops_len % sizeof(uint32_t) == 0 &&
+            layer_cnt > 0 && layer_cnt <= GEM_ATLAS_LAYERS && (layer_cnt & (layer_cnt - 1)) == 0;
+    uint32_t layer_top[GEM_ATLAS_LAYERS];
+    if(valid)
+        memcpy(layer_top, tops, tops_len);
+    for(uint32_t i = 0; valid && i < layer_cnt; ++i)
+    {
+        size_t len = 0;
+        layers[i] = serial_get_bytes(&in, &len);
+        valid = in.ok && layer_top[i] <= GEM_ATLAS_SIZE && len == (size_t)layer_top[i] * GEM_ATLAS_SIZE;
+    }
+    // The checksum only catches accidents, so every shelf and layer the
+    // table points at is checked before anything indexes with it.
+    for(uint32_t i = 0; valid && i < shelf_cnt; ++i)
+    {
+        GemShelf shelf;
+        memcpy(&shelf, shelves + i * sizeof(GemShelf), sizeof(GemShelf));
+        valid = shelf.layer < layer_cnt && shelf.height <= layer_top[shelf.layer] &&
+                shelf.y <= layer_top[shelf.layer] - shelf.height && shelf.x <= GEM_ATLAS_SIZE;
+    }
+    for(uint32_t i = 0; valid && i < glyph_cnt; ++i)
+    {
+        GemGlyphData glyph;
+        memcpy(&glyph, glyphs + i * sizeof(GemGlyphData), sizeof(GemGlyphData));
+        if(glyph.codepoint == GLYPH_FREE)
+            continue;
+        valid = glyph.layer < layer_cnt && (glyph.shelf == GEM_NO_SHELF || glyph.shelf < shelf_cnt);
+    }
+    if(!valid)
+    {
+        munmap(map, size);
+        return false;
+    }
+
+    font->glyph_cap = glyph_cnt > INITIAL_SLOTS ? glyph_cnt : INITIAL_SLOTS;
+    font->glyphs = malloc(sizeof(GemGlyphData) * font->glyph_cap);
+    font->free_slots = malloc(sizeof(uint32_t) * font->glyph_cap);
+    GEM_ENSURE(font->glyphs != NULL && font->free_slots != NULL);
+    memcpy(font->glyphs, glyphs, glyphs_len);
+    font->glyph_cnt = glyph_cnt;
+
+    font->shelf_cap = shelf_cnt > 64 ? shelf_cnt : 64;
+    font->shelves = malloc(sizeof(GemShelf) * font->shelf_cap);
+    GEM_ENSURE(font->shelves != NULL);
+    if(shelf_cnt > 0)
+        memcpy(font->shelves, shelves, shelves_len);
+    font->shelf_cnt = shelf_cnt;
+
+    while(font->layer_cnt < layer_cnt)
+        grow_atlas(font);
+    memcpy(font->layer_top, layer_top, tops_len);
+    for(uint32_t i = 0; i < layer_cnt; ++i)
+        if(layer_top[i] > 0)
+            glTextureSubImage3D(font->atlas_texture, 0, 0, 0, i, GEM_ATLAS_SIZE, layer_top[i], 1,
+                                GL_RED, GL_UNSIGNED_BYTE, layers[i]);
+    munmap(map, size);
+
+    uint32_t cap = INITIAL_SLOTS;
+    while(cap < (glyph_cnt + 1) * 2)
+        cap *= 2;
+    rebuild_refs(font, cap);
+    font->face_size = raster_size(font);
+    font->raw_advance = raw_advance;
+    return true;
+}
+
+// Called right after new_atlas, when every glyph's pixels are still staged.
+static void save_cache(const GemFont* font, const struct stat* st)
+{
+    char path[GEM_PATH_MAX];
+    if(!cache_path(path, font, true))
+        return;
+
+    StringBuilder out;
+    da_init(&out, 1 << 16);
+    da_append_arr(&out, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    serial_put_u64(&out, CACHE_VERSION);
+    serial_put_u64(&out, CACHE_BYTE_ORDER);
+    serial_put_u64(&out, sizeof(GemGlyphData));
+    serial_put_u64(&out, 0); // Checksum, filled in below
+    GEM_ASSERT(out.size == CACHE_HEADER_LEN);
+
+    put_cache_key(&out, font, st);
+    serial_put_u64(&out, (uint64_t)font->raw_advance);
+    serial_put_bytes(&out, font->glyphs, sizeof(GemGlyphData) * font->glyph_cnt);
+    serial_put_bytes(&out, font->shelves, sizeof(GemShelf) * font->shelf_cnt);
+    serial_put_bytes(&out, font->layer_top, sizeof(uint32_t) * font->layer_cnt);
+
+    // The staged boxes are put back together into the used rows of each
+    // layer, so loading is one upload per layer.
+    for(uint32_t layer = 0; layer < font->layer_cnt; ++layer)
+    {
+        size_t len = (size_t)font->layer_top[layer] * GEM_ATLAS_SIZE;
+        uint8_t* pixels = calloc(len + 1, 1);
+        GEM_ENSURE(pixels != NULL);
+        for(uint32_t i = 0; i < font->upload_cnt; ++i)
+        {
+            const GemUpload* up = font->uploads + i;
+            if(up->layer != layer)
+                continue;
+            for(uint32_t row = 0; row < up->height; ++row)
+                memcpy(pixels + (size_t)(up->y + row) * GEM_ATLAS_SIZE + up->x,
+                       font->staging + up->offset + (size_t)row * up->width, up->width);
+        }
+        serial_put_bytes(&out, pixels, len);
+        free(pixels);
+    }
+    uint64_t sum = serial_checksum(out.data + CACHE_HEADER_LEN, out.size - CACHE_HEADER_LEN);
+    memcpy(out.data + CACHE_HEADER_LEN - sizeof(sum), &sum, sizeof(sum));
+
+    char temp_path[GEM_PATH_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    bool success = fd >= 0;
+    size_t written = 0;
+    while(success && written < out.size)
+    {
+        ssize_t res = write(fd, out.data + written, out.size - written);
+        success = res > 0;
+        written += success ? (size_t)res : 0;
+    }
+    if(fd >= 0 && close(fd) < 0)
+        success = false;
+    if(!success || rename(temp_path, path) < 0)
+    {
+        fprintf(stderr, "Failed to cache font atlas: %s\n", path);
+        unlink(temp_path);
+    }
+    da_free_data(&out);
 }
 
 void freetype_cleanup(void)
@@ -187,15 +1133,18 @@ int get_vert_advance(void)
     return s_vert_adv;
 }
 
+// Fonts have to be resized after, see resize_font.
 void set_font_size(size_t font_size)
 {
     s_font_size = font_size;
-    // This should also recreate the atlases with the new
-    // font size, but in reality this is not a good way 
-    // of doing this at all, so this is temporary.
     s_vert_adv = (int)((float)s_font_size * s_line_height);
 }
 
+void set_font_sdf(bool sdf)
+{
+    s_sdf = sdf;
+}
+
 void set_line_height(float line_height)
 {
     s_line_height = line_height;
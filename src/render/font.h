@@ -5,37 +5,131 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-#define GEM_PRINTABLE_ASCII_START 33
-#define GEM_PRINTABLE_ASCII_END   127
-#define GEM_GLYPH_CNT             (GEM_PRINTABLE_ASCII_END - GEM_PRINTABLE_ASCII_START + 1)
+#define GEM_MISSING_GLYPH 0          // Slot of the font's missing glyph, also what a full atlas hands out
+#define GEM_ATLAS_SIZE    1024       // Width and height of each atlas layer
+#define GEM_ATLAS_LAYERS  8          // Most layers the atlas grows to before evicting
+#define GEM_NO_SHELF      UINT32_MAX
 
-typedef struct GemGlyphData GemGlyphData;
-typedef struct GemFont      GemFont;
+typedef struct GemGlyphData   GemGlyphData;
+typedef struct GemGlyphRef    GemGlyphRef;
+typedef struct GemShelf       GemShelf;
+typedef struct GemUpload      GemUpload;
+typedef struct GemFont        GemFont;
+typedef struct GemGlyphWorker GemGlyphWorker;
 
 struct GemGlyphData
 {
     float    tex_coords[4];
     uint32_t width, height;
-    uint32_t xoff, yoff;
+    int32_t  xoff, yoff;
+    uint32_t layer;
+    uint32_t codepoint; /* UINT32_MAX when the slot is free */
+    uint32_t size;      /* Font size it was rasterized at */
+    uint32_t shelf;     /* GEM_NO_SHELF for empty bitmaps */
+    uint16_t x, y;      /* Top left of the glyph's box in its layer */
+    bool     pending;   /* Still being rasterized, a copy of the missing glyph until then */
 };
 
-// TODO: Add support for unicode characters, and on-demand
-//       glyph loading into a dynamic atlas.
+// Maps a codepoint at a size to its slot, more than one codepoint can share
+// the missing glyph's.
+struct GemGlyphRef
+{
+    uint32_t codepoint; /* UINT32_MAX when empty */
+    uint32_t size;
+    uint32_t slot;
+};
+
+// A row of glyph boxes of about the same height, filled left to right.
+struct GemShelf
+{
+    uint32_t layer;
+    uint32_t y, height;
+    uint32_t x;        /* Where the next box goes */
+    uint64_t last_use; /* Frame any of its glyphs was last looked up in */
+};
+
+struct GemUpload
+{
+    uint32_t layer, x, y;
+    uint32_t width, height;
+    size_t   offset; /* Into the staging pixels */
+};
+
+// Glyphs are rasterized on a worker thread the first time they are looked
+// up, showing the missing glyph until then, and packed into shelves of a
+// texture array, which doubles its layers up to GEM_ATLAS_LAYERS. Once it
+// is full the least recently used shelves are evicted at the start of a
+// frame, which bumps generation so anything holding on to slots knows to
+// look them up again. New pixels and table entries are only handed to the
+// GPU when a batch is drawn. The atlas made at startup is cached on disk, a
+// font loaded from it doesn't open its face until a glyph the cache lacks
+// is looked up.
 struct GemFont
 {
-    GemGlyphData glyphs[GEM_GLYPH_CNT];
-    GLuint       atlas_texture;
-    int          advance; // TODO: Change this to be static for the whole program, as all bold and italic fonts should have the same advance
+    GemGlyphData*       glyphs;        /* Indexed by slot, the glyph table on the GPU mirrors it */
+    uint32_t            glyph_cnt;
+    uint32_t            glyph_cap;
+    uint32_t*           free_slots;
+    uint32_t            free_cnt;
+    GemGlyphRef*        refs;          /* Open addressing, ref_cap is a power of 2 */
+    uint32_t            ref_cnt;
+    uint32_t            ref_cap;
+    GemShelf*           shelves;
+    uint32_t            shelf_cnt;
+    uint32_t            shelf_cap;
+    uint32_t            layer_top[GEM_ATLAS_LAYERS]; /* First row no shelf covers */
+    uint32_t            layer_cnt;
+    uint8_t*            staging;
+    size_t              staging_size;
+    size_t              staging_cap;
+    GemUpload*          uploads;
+    uint32_t            upload_cnt;
+    uint32_t            upload_cap;
+    uint32_t            dirty_first;   /* Slots changed since the table was last uploaded */
+    uint32_t            dirty_end;
+    uint64_t            frame;
+    uint64_t            generation;    /* Bumped whenever slots are evicted */
+    uint32_t            loads;         /* Glyphs rasterized this frame */
+    bool                full;          /* A glyph didn't fit this frame */
+    float               scale;         /* Drawn size over the size glyphs were rasterized at */
+    bool                sdf;           /* Glyphs are distance fields, made once and scaled to any size */
+    float               sdf_edge;      /* Half a pixel at the drawn size in field units, 0 for bitmaps */
+    char*               path;
+    struct FT_FaceRec_* face;          /* NULL until needed when the atlas came from the cache */
+    int                 face_size;     /* Size the face is set to, or the cached atlas was made at */
+    int64_t             raw_advance;   /* Missing glyph's advance at face_size, 26.6 */
+    GemGlyphWorker*     worker;
+    GLuint              atlas_texture;
+    int                 advance; // TODO: Change this to be static for the whole program, as all bold and italic fonts should have the same advance
 };
 
 void  freetype_init(void);
+// Uses the mode set_font_sdf last picked, for as long as the font lives.
+// The startup atlas comes from the cache when the font file hasn't changed,
+// and is written to it otherwise.
 bool  gen_font_atlas(const char* font_path, GemFont* font);
+// Catches the font up with set_font_size. Distance fields are only scaled,
+// bitmaps at the new size are rasterized as they are looked up.
+bool  resize_font(GemFont* font);
+void  free_font(GemFont* font);
 void  freetype_cleanup(void);
 
+// Slot of the glyph for cp, queueing it for the worker if it isn't in the
+// atlas yet.
+uint32_t get_font_glyph(GemFont* font, uint32_t cp);
+// Hands the pixels of glyphs rasterized since the last call to the atlas,
+// which can mean a new texture.
+void  upload_font_glyphs(GemFont* font);
+// Evicts if the atlas filled up last frame and takes in what the worker
+// finished. True if slots changed, anything drawn with them is stale.
+bool  next_font_frame(GemFont* font);
+
 int   get_font_size(void);
 float get_line_height(void);
 int   get_vert_advance(void);
 
 void set_font_size(size_t font_size);
+void set_font_sdf(bool sdf);
 void set_line_height(float line_height);
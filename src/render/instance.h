@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+
+#define GLYPH_SOLID 0x80000000u
+
+// A quad as a single instance, the vertex shader expands it into its
+// corners and looks its texture coordinates up in the glyph table.
+typedef struct QuadInstance QuadInstance;
+struct QuadInstance
+{
+    int16_t  position[2]; /* Top left corner */
+    uint16_t size[2];
+    uint32_t glyph;       /* Index into the font's glyphs, or GLYPH_SOLID for a plain fill */
+    uint8_t  color[4];    /* RGBA8 */
+};
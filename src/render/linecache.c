@@ -0,0 +1,118 @@
+#include "linecache.h"
+#include "core/core.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void edit_runs(LineCache* lc, const BufferEdit* edit);
+
+LineCache* line_cache_create(void)
+{
+    LineCache* lc = calloc(1, sizeof(LineCache));
+    GEM_ENSURE(lc != NULL);
+    lc->bufnr = -1;
+    line_cache_clear(lc);
+    return lc;
+}
+
+void line_cache_free(LineCache* lc)
+{
+    if(lc == NULL)
+        return;
+    for(size_t i = 0; i < LINE_CACHE_LINES; ++i)
+        free(lc->runs[i].quads);
+    free(lc);
+}
+
+void line_cache_clear(LineCache* lc)
+{
+    for(size_t i = 0; i < LINE_CACHE_LINES; ++i)
+        lc->runs[i].line = -1;
+}
+
+void line_cache_sync(LineCache* lc, int bufnr, const Buffer* buf, uint64_t glyph_gen,
+                     int64_t start_column, int64_t columns, int32_t left)
+{
+    GEM_ASSERT(lc != NULL && buf != NULL);
+    bool fresh = lc->bufnr != bufnr || lc->glyph_gen != glyph_gen || lc->start_column != start_column || lc->columns != columns || lc->left != left ||
+                 lc->version > buf->version || (lc->version == buf->version && lc->size != buf->contents.size);
+    for(uint64_t v = lc->version + 1; !fresh && v <= buf->version; ++v)
+    {
+        const BufferEdit* edit = buffer_get_edit(buf, v);
+        if(edit != NULL)
+            edit_runs(lc, edit);
+        else
+            fresh = true;
+    }
+    if(fresh)
+        line_cache_clear(lc);
+
+    lc->bufnr = bufnr;
+    lc->glyph_gen = glyph_gen;
+    lc->version = buf->version;
+    lc->size = buf->contents.size;
+    lc->start_column = start_column;
+    lc->columns = columns;
+    lc->left = left;
+}
+
+LineRun* line_cache_find(LineCache* lc, int64_t line)
+{
+    GEM_ASSERT(lc != NULL);
+    for(size_t i = 0; i < LINE_CACHE_LINES; ++i)
+    {
+        LineRun* run = lc->runs + i;
+        if(run->line == line)
+        {
+            run->last_use = ++lc->clock;
+            return run;
+        }
+    }
+    return NULL;
+}
+
+LineRun* line_cache_add(LineCache* lc, int64_t line)
+{
+    GEM_ASSERT(lc != NULL && line >= 0);
+    LineRun* victim = lc->runs;
+    for(size_t i = 1; i < LINE_CACHE_LINES && victim->line >= 0; ++i)
+    {
+        LineRun* run = lc->runs + i;
+        if(run->line < 0 || run->last_use < victim->last_use)
+            victim = run;
+    }
+    victim->line = line;
+    victim->quad_cnt = 0;
+    victim->last_use = ++lc->clock;
+    return victim;
+}
+
+void line_run_push(LineRun* run, const QuadInstance* quad)
+{
+    if(run->quad_cnt == run->quad_cap)
+    {
+        run->quad_cap = run->quad_cap == 0 ? 64 : run->quad_cap * 2;
+        run->quads = realloc(run->quads, sizeof(QuadInstance) * run->quad_cap);
+        GEM_ENSURE(run->quads != NULL);
+    }
+    run->quads[run->quad_cnt++] = *quad;
+}
+
+// The edited line is dropped along with any it joined onto it, the lines
+// after them just get renumbered.
+static void edit_runs(LineCache* lc, const BufferEdit* edit)
+{
+    int64_t line = edit->line;
+    int64_t removed = edit->removed_lines;
+    int64_t added = edit->added_lines;
+    for(size_t i = 0; i < LINE_CACHE_LINES; ++i)
+    {
+        LineRun* run = lc->runs + i;
+        if(run->line < line)
+            continue;
+        if(run->line <= line + removed)
+            run->line = -1;
+        else
+            run->line += added - removed;
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "instance.h"
+#include "editor/buffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINE_CACHE_LINES 256 // Enough for a view and some scrolling around it
+
+typedef struct LineRun   LineRun;
+typedef struct LineCache LineCache;
+
+struct LineRun
+{
+    int64_t       line;     /* -1 when the slot is free */
+    QuadInstance* quads;
+    uint32_t      quad_cnt;
+    uint32_t      quad_cap;
+    int32_t       top;      /* y the quads were built at */
+    uint64_t      last_use;
+};
+
+// Glyph instances of a window's lines as they were last drawn, so a line
+// that didn't change is copied into the batch instead of being decoded and
+// laid out again. Runs follow the buffer through its edit log the same way
+// the vis index does. Anything that moves glyphs sideways starts it over,
+// scrolling only moves the runs up or down.
+struct LineCache
+{
+    LineRun  runs[LINE_CACHE_LINES];
+    int      bufnr;
+    uint64_t version;      /* Buffer version the runs match */
+    size_t   size;         /* Buffer size then, streaming changes it without a version */
+    uint64_t glyph_gen;    /* Font generation the runs' glyph slots belong to */
+    int64_t  start_column; /* Horizontal scroll, width and left edge the runs were laid out for */
+    int64_t  columns;
+    int32_t  left;
+    uint64_t clock;
+};
+
+LineCache* line_cache_create(void);
+void       line_cache_free(LineCache* lc);
+void       line_cache_clear(LineCache* lc);
+// Catches up with buf, and starts over if the layout differs.
+void       line_cache_sync(LineCache* lc, int bufnr, const Buffer* buf, uint64_t glyph_gen,
+                           int64_t start_column, int64_t columns, int32_t left);
+// NULL if line isn't cached.
+LineRun*   line_cache_find(LineCache* lc, int64_t line);
+// Empty run for line, taking the least recently used slot.
+LineRun*   line_cache_add(LineCache* lc, int64_t line);
+void       line_run_push(LineRun* run, const QuadInstance* quad);
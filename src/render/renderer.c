@@ -1,40 +1,82 @@
 #include "renderer.h"
 #include "font.h"
+#include "instance.h"
+#include "linecache.h"
 #include "uniforms.h"
+#include "core/app.h"
 #include "core/core.h"
 #include "fileman/fileio.h"
 #include "structs/color.h"
+#include "structs/utf8.h"
 
 #include <glad/glad.h>
 
 #include <math.h>
+#include <stddef.h>
 #include <string.h>
 
-#define MAX_QUADS    2000
-#define MAX_VERTICES (MAX_QUADS * 4)
-#define INDEX_COUNT  (MAX_QUADS * 6)
+#define MAX_QUADS   (1 << 16) // Enough for a 4K screen of text in one draw call
+#define RING_REGIONS 3        // Batches the GPU can still be reading while the next is written
+
+#define GRID_MAX_CELLS (1 << 18) // Per frame, windows past this fall back to quads
+#define CELL_EMPTY     0xFFFFFFFFu
+#define CELL_WIDE      0xFFFFFFFEu // Second cell of a wide codepoint
 
 #define TEXT_VERT_SHADER "assets/shaders/basic.vert"
 #define TEXT_FRAG_SHADER "assets/shaders/basic.frag"
+#define GRID_VERT_SHADER "assets/shaders/grid.vert"
+#define GRID_FRAG_SHADER "assets/shaders/grid.frag"
 #define DEFAULT_FONT     "assets/fonts/JetBrainsMono-Regular.ttf"
 
-typedef struct QuadVertex QuadVertex;
-struct QuadVertex
+// A window's last drawn contents, put on screen wherever the window is.
+struct WinSurface
+{
+    GLuint  fbo;
+    GLuint  tex;
+    int     width;
+    int     height;
+    GemQuad bb; /* Where it is on screen */
+};
+
+// Matches Glyph in the shaders, rect places the glyph inside its cell.
+typedef struct GlyphEntry GlyphEntry;
+struct GlyphEntry
 {
-    float     position[2];
-    float     tex_coords[2];
-    vec4color color;
-    float     solid;
+    float    tex[4];
+    float    rect[4];
+    uint32_t layer;
+    uint32_t pad[3];
 };
 
 static GLuint s_vao;
 static GLuint s_vbo;
-static GLuint s_ibo;
+static GLuint s_glyph_table;
+static uint32_t s_table_cap;   // Slots the glyph table has room for
+static GLuint s_bound_atlas;
 static GLuint s_shader;
 static GemFont s_font;
-static QuadVertex* s_vertex_data;
-static QuadVertex* s_vertex_insert;
-static uint32_t s_quad_cnt; // Quad count of current batch
+static QuadInstance* s_ring;      // Persistently mapped, RING_REGIONS regions of MAX_QUADS
+static QuadInstance* s_quad_data; // Region quads are written into
+static GLsync s_fences[RING_REGIONS];
+static uint32_t s_region;
+static uint32_t s_quad_cnt;    // Quads written into the current region
+static uint32_t s_batch_start; // First of those not drawn yet
+static GLuint s_grid_shader;
+static GLuint s_cell_buf;
+static uint32_t* s_cell_ring;  // Persistently mapped, RING_REGIONS regions of GRID_MAX_CELLS
+static GLsync s_cell_fences[RING_REGIONS];
+static uint32_t s_cell_region;
+static uint32_t s_cell_used;   // Cells written into the current region this frame
+static uint32_t* s_grid;       // Cells of the window being drawn, NULL draws text as quads
+static int64_t s_grid_cols;
+static GemRenderMode s_mode;
+static GLuint s_fbo;          // Holds the last frame, windows are only put on it when they change or move
+static GLuint s_screen_tex;
+static GLuint s_scratch_tex;  // Scrolling copies through it
+static int s_screen_width;
+static int s_screen_height;
+static const BufferWin* s_damage; // Window being drawn, handle_str skips its undamaged rows
+static LineRun* s_run;        // Line being drawn into the window's line cache, if any
 static GemRenderStats s_stats;
 static bool s_initialized = false;
 
@@ -46,11 +88,29 @@ static vec4color s_sidebar_color;
 static vec4color s_inactive_color;
 static vec4color s_cursor_color;
 
+static bool damage_area(const BufferWin* bufwin, GemQuad* area);
+static GemQuad row_rect(const BufferWin* bufwin, int64_t first, int64_t last, const GemQuad* columns);
+static bool rows_damaged(const BufferWin* bufwin, int64_t first, int64_t last);
+static void fill_rows(const BufferWin* bufwin, const GemQuad* columns, vec4color color);
+static void scroll_window(const BufferWin* bufwin);
+static void begin_surface(WinSurface* surface, const GemQuad* bb);
+static void end_surface(WinSurface* surface, const GemQuad* bb);
 static void draw_fileman(const BufferWin* bufwin);
-static void draw_cursor(const Cursor* cur, const View* view, vec2pos top_left);
-static void handle_str(const char* str, size_t count, const GemQuad* bounding_box, const View* view, BufferPos* pos);
-static void draw_char(char c, vec2pos pos, vec4color color);
-static void draw_quad(const GemQuad* quad, const float tex[4], vec4color color, bool is_solid);
+static void draw_cursor(int64_t row, int64_t column, const View* view, const GemQuad* contents_bb);
+static void draw_line_number(const BufferWin* bufwin, int64_t row, size_t number, bool folded);
+static void draw_lines(const BufferWin* bufwin, Buffer* buffer);
+static void draw_wrapped(const BufferWin* bufwin, Buffer* buffer);
+static size_t handle_str(const char* str, size_t count, const GemQuad* bounding_box, const View* view, BufferPos* pos);
+static void draw_char(uint32_t cp, vec2pos pos, vec4color color);
+static void emit_run(const LineRun* run, int32_t top);
+static void draw_quad(const GemQuad* quad, uint32_t glyph, vec4color color);
+static QuadInstance make_instance(const GemQuad* quad, uint32_t glyph, vec4color color);
+static void push_instance(const QuadInstance* inst);
+static bool begin_grid(const BufferWin* bufwin);
+static void end_grid(const BufferWin* bufwin);
+static void sync_glyphs(void);
+static void next_region(void);
+static void wait_fence(GLsync* fence);
 static bool create_shader_program(const char* vert_path, const char* frag_path, GLuint* program_id);
 
 #ifdef GEM_DEBUG
@@ -71,55 +131,67 @@ void renderer_init(void)
 
     glCreateVertexArrays(1, &s_vao);
     glCreateBuffers(1, &s_vbo);
-    glCreateBuffers(1, &s_ibo);
+    glCreateFramebuffers(1, &s_fbo);
 
     glBindVertexArray(s_vao);
     glBindBuffer(GL_ARRAY_BUFFER, s_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(QuadVertex) * MAX_VERTICES, NULL, GL_DYNAMIC_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, s_ibo);
+    // Batches are written straight into the buffer, each region is fenced
+    // when drawn and only written again once the GPU is done with it.
+    GLbitfield map_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    GLsizeiptr ring_size = sizeof(QuadInstance) * MAX_QUADS * RING_REGIONS;
+    glNamedBufferStorage(s_vbo, ring_size, NULL, map_flags);
+    s_ring = glMapNamedBufferRange(s_vbo, 0, ring_size, map_flags);
+    GEM_ENSURE_MSG(s_ring != NULL, "Failed to map vertex buffer.");
+    s_region = 0;
+    s_quad_cnt = 0;
+    s_batch_start = 0;
+    s_quad_data = s_ring;
 
     // Position
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), (const void*)0);
+    glVertexAttribIPointer(0, 2, GL_SHORT, sizeof(QuadInstance), (const void*)offsetof(QuadInstance, position));
+    glVertexAttribDivisor(0, 1);
     glEnableVertexAttribArray(0);
 
-    // Tex Coords
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), (const void*)(sizeof(float) * 2));
+    // Size
+    glVertexAttribIPointer(1, 2, GL_UNSIGNED_SHORT, sizeof(QuadInstance), (const void*)offsetof(QuadInstance, size));
+    glVertexAttribDivisor(1, 1);
     glEnableVertexAttribArray(1);
 
-    // Color
-    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), (const void*)(sizeof(float) * 4));
+    // Glyph
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(QuadInstance), (const void*)offsetof(QuadInstance, glyph));
+    glVertexAttribDivisor(2, 1);
     glEnableVertexAttribArray(2);
 
-    // Solid
-    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), (const void*)(sizeof(float) * 8));
+    // Color
+    glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(QuadInstance), (const void*)offsetof(QuadInstance, color));
+    glVertexAttribDivisor(3, 1);
     glEnableVertexAttribArray(3);
 
+    // Cells are fenced a frame at a time, the same way as batches.
+    GLsizeiptr cell_size = sizeof(uint32_t) * GRID_MAX_CELLS * RING_REGIONS;
+    glCreateBuffers(1, &s_cell_buf);
+    glNamedBufferStorage(s_cell_buf, cell_size, NULL, map_flags);
+    s_cell_ring = glMapNamedBufferRange(s_cell_buf, 0, cell_size, map_flags);
+    GEM_ENSURE_MSG(s_cell_ring != NULL, "Failed to map cell buffer.");
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, s_cell_buf);
+    s_cell_region = 0;
+    s_cell_used = 0;
+    s_mode = RENDER_MODE_QUADS;
+
     bool result = create_shader_program(TEXT_VERT_SHADER, TEXT_FRAG_SHADER, &s_shader);
     GEM_ENSURE_MSG(result, "Failed to create text shader, exiting.");
+    result = create_shader_program(GRID_VERT_SHADER, GRID_FRAG_SHADER, &s_grid_shader);
+    GEM_ENSURE_MSG(result, "Failed to create grid shader, exiting.");
     glUseProgram(s_shader);
 
-    s_vertex_data = malloc(MAX_VERTICES * sizeof(QuadVertex));
-    s_vertex_insert = s_vertex_data;
-
-    {
-        uint32_t indices[INDEX_COUNT];
-        for(size_t i = 0, j = 0; i < INDEX_COUNT; i += 6, j += 4)
-        {
-            indices[i + 0] = j + 0;
-            indices[i + 1] = j + 1;
-            indices[i + 2] = j + 2;
-
-            indices[i + 3] = j + 2;
-            indices[i + 4] = j + 3;
-            indices[i + 5] = j + 0;
-        }
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
-    }
-
     result = gen_font_atlas(DEFAULT_FONT, &s_font);
     GEM_ENSURE_MSG(result, "Failed to create font atlas.");
-    glBindTextureUnit(0, s_font.atlas_texture);
+    glProgramUniform1f(s_shader, 0, s_font.sdf_edge);
+    glProgramUniform1f(s_grid_shader, 7, s_font.sdf_edge);
+    glCreateBuffers(1, &s_glyph_table);
+    s_table_cap = 0;
+    s_bound_atlas = 0;
+    sync_glyphs();
 
     uniforms_init();
 
@@ -138,57 +210,186 @@ void renderer_cleanup(void)
     if(s_initialized)
     {
         s_initialized = false;
-        free(s_vertex_data);
+        for(size_t i = 0; i < RING_REGIONS; ++i)
+        {
+            glDeleteSync(s_fences[i]);
+            glDeleteSync(s_cell_fences[i]);
+        }
+        memset(s_fences, 0, sizeof(s_fences));
+        memset(s_cell_fences, 0, sizeof(s_cell_fences));
+        glUnmapNamedBuffer(s_vbo);
+        glUnmapNamedBuffer(s_cell_buf);
         uniforms_cleanup();
         glDeleteProgram(s_shader);
-        glDeleteTextures(1, &s_font.atlas_texture);
+        glDeleteProgram(s_grid_shader);
+        glDeleteBuffers(1, &s_cell_buf);
+        glDeleteFramebuffers(1, &s_fbo);
+        glDeleteTextures(1, &s_screen_tex);
+        glDeleteTextures(1, &s_scratch_tex);
+        free_font(&s_font);
         glDeleteBuffers(1, &s_vbo);
-        glDeleteBuffers(1, &s_ibo);
+        glDeleteBuffers(1, &s_glyph_table);
         glDeleteVertexArrays(1, &s_vao);
     }
 }
 
+void renderer_resize(int width, int height)
+{
+    set_projection(width, height);
+    glDeleteTextures(1, &s_screen_tex);
+    glDeleteTextures(1, &s_scratch_tex);
+    glCreateTextures(GL_TEXTURE_2D, 1, &s_screen_tex);
+    glCreateTextures(GL_TEXTURE_2D, 1, &s_scratch_tex);
+    glTextureStorage2D(s_screen_tex, 1, GL_RGBA8, width, height);
+    glTextureStorage2D(s_scratch_tex, 1, GL_RGBA8, width, height);
+    glNamedFramebufferTexture(s_fbo, GL_COLOR_ATTACHMENT0, s_screen_tex, 0);
+    GEM_ENSURE_MSG(glCheckNamedFramebufferStatus(s_fbo, GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE,
+                   "Failed to create screen framebuffer.");
+    s_screen_width = width;
+    s_screen_height = height;
+}
+
 void renderer_start_batch(void)
 {
-    s_vertex_insert = s_vertex_data;
-    s_quad_cnt = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, s_fbo);
+    // Each frame starts on a fresh region, so the GPU has a couple of
+    // frames to finish with one before it is written again.
+    if(s_quad_cnt > 0)
+        next_region();
     s_stats.draw_calls = 0;
     s_stats.quad_count = 0;
+    s_stats.cell_count = 0;
+    s_stats.fence_waits = 0;
+    s_stats.composites = 0;
+    // Slots evicted from the atlas may still be on screen or in line caches.
+    if(next_font_frame(&s_font))
+        bufwin_damage_all();
+    if(s_cell_used > 0)
+    {
+        // Last frame's draws are all submitted, so one fence covers its cells.
+        s_cell_fences[s_cell_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        s_cell_region = (s_cell_region + 1) % RING_REGIONS;
+        s_cell_used = 0;
+    }
 }
 
 void renderer_render_batch(void)
 {
-    if(s_quad_cnt == 0)
+    sync_glyphs();
+    uint32_t count = s_quad_cnt - s_batch_start;
+    if(count == 0)
         return;
 
-    glBufferSubData(GL_ARRAY_BUFFER, 0, (uintptr_t)s_vertex_insert - (uintptr_t)s_vertex_data, s_vertex_data);
-    glDrawElements(GL_TRIANGLES, s_quad_cnt * 6, GL_UNSIGNED_INT, NULL);
+    glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4, count, s_region * MAX_QUADS + s_batch_start);
 
-    s_stats.quad_count += s_quad_cnt; // Add quad count of current batch to the total
+    s_stats.quad_count += count; // Add quad count of current batch to the total
     s_stats.draw_calls++;
-    s_vertex_insert = s_vertex_data;
-    s_quad_cnt = 0;
+    s_batch_start = s_quad_cnt;
 }
 
-static const GemGlyphData* get_glyph_data_from_font(const GemFont* font, char c)
+// Hands glyphs rasterized since the last batch to the GPU, before anything
+// drawn with them.
+static void sync_glyphs(void)
 {
-    size_t index = c >= GEM_PRINTABLE_ASCII_START && c < GEM_PRINTABLE_ASCII_END
-                       ? (size_t)c - GEM_PRINTABLE_ASCII_START + 1
-                       : 0;
-    return font->glyphs[index].width == 0 ? &font->glyphs[0] : &font->glyphs[index];
+    upload_font_glyphs(&s_font);
+    if(s_bound_atlas != s_font.atlas_texture)
+    {
+        glBindTextureUnit(0, s_font.atlas_texture);
+        s_bound_atlas = s_font.atlas_texture;
+    }
+
+    uint32_t first = s_font.dirty_first;
+    uint32_t end = s_font.dirty_end;
+    if(s_font.glyph_cap > s_table_cap)
+    {
+        s_table_cap = s_font.glyph_cap;
+        glNamedBufferData(s_glyph_table, sizeof(GlyphEntry) * s_table_cap, NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, s_glyph_table);
+        first = 0;
+        end = s_font.glyph_cnt;
+    }
+    if(first >= end)
+        return;
+
+    GlyphEntry* table = calloc(end - first, sizeof(GlyphEntry));
+    GEM_ENSURE(table != NULL);
+    for(uint32_t i = first; i < end; ++i)
+    {
+        const GemGlyphData* data = s_font.glyphs + i;
+        GlyphEntry* entry = table + (i - first);
+        memcpy(entry->tex, data->tex_coords, sizeof(entry->tex));
+        entry->rect[0] = (float)data->xoff * s_font.scale;
+        entry->rect[1] = (float)get_font_size() - (float)data->yoff * s_font.scale;
+        entry->rect[2] = (float)data->width * s_font.scale;
+        entry->rect[3] = (float)data->height * s_font.scale;
+        entry->layer = data->layer;
+    }
+    glNamedBufferSubData(s_glyph_table, sizeof(GlyphEntry) * first, sizeof(GlyphEntry) * (end - first), table);
+    free(table);
+    s_font.dirty_first = UINT32_MAX;
+    s_font.dirty_end = 0;
+}
+
+void renderer_present(void)
+{
+    renderer_render_batch();
+    s_stats.glyph_loads = s_font.loads;
+    // Glyphs the atlas had no room for get evicted space next frame.
+    if(s_font.full)
+        gem_request_redraw();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBlitNamedFramebuffer(s_fbo, 0, 0, 0, s_screen_width, s_screen_height,
+                           0, 0, s_screen_width, s_screen_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
 }
 
+WinSurface* renderer_create_surface(void)
+{
+    WinSurface* surface = calloc(1, sizeof(WinSurface));
+    GEM_ENSURE(surface != NULL);
+    glCreateFramebuffers(1, &surface->fbo);
+    return surface;
+}
 
+void renderer_free_surface(WinSurface* surface)
+{
+    if(surface == NULL)
+        return;
+    glDeleteFramebuffers(1, &surface->fbo);
+    glDeleteTextures(1, &surface->tex);
+    free(surface);
+}
 
 void renderer_draw_bufwin(const BufferWin* bufwin, bool active)
 {
-    GEM_ASSERT(bufwin != NULL);
+    GEM_ASSERT(bufwin != NULL && bufwin->surface != NULL);
 
-    const PieceTree* pt = &buffer_get(bufwin->bufnr)->contents;
+    Buffer* buffer = buffer_get(bufwin->bufnr);
+    WinSurface* surface = bufwin->surface;
     const GemQuad* buf_bb = &bufwin->frame.bounding_box;
+    GemQuad area;
+    if(buf_bb->tr.x <= buf_bb->bl.x || buf_bb->bl.y <= buf_bb->tr.y)
+        return;
+    if(!damage_area(bufwin, &area))
+    {
+        // Nothing changed, but other windows moving it around still does.
+        if(memcmp(&surface->bb, buf_bb, sizeof(GemQuad)) != 0)
+        {
+            renderer_render_batch();
+            end_surface(surface, buf_bb);
+        }
+        return;
+    }
+
+    // Scissored to the damage, so batches can't be shared between windows.
+    begin_surface(surface, buf_bb);
+    if(bufwin->damage.scroll != 0)
+        scroll_window(bufwin);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(area.bl.x - buf_bb->bl.x, buf_bb->bl.y - area.bl.y, 
+              area.tr.x - area.bl.x, area.bl.y - area.tr.y);
     
     // Draw background
-    draw_quad(buf_bb, NULL, s_bg_color, true);
+    fill_rows(bufwin, buf_bb, s_bg_color);
 
     if(bufwin->mode == WIN_MODE_FILEMAN)
     {
@@ -196,66 +397,179 @@ void renderer_draw_bufwin(const BufferWin* bufwin, bool active)
     }
     else
     {
-        uint32_t num_pad = s_font.advance / 4;
+        fill_rows(bufwin, &bufwin->line_num_bb, s_sidebar_color);
+        bool grid = s_mode == RENDER_MODE_GRID && begin_grid(bufwin);
+        s_damage = bufwin;
+        if(bufwin->wrap_lines)
+            draw_wrapped(bufwin, buffer);
+        else
+            draw_lines(bufwin, buffer);
+        s_damage = NULL;
+        if(grid)
+            end_grid(bufwin);
+    }
+    if(!active)
+        fill_rows(bufwin, buf_bb, s_inactive_color);
+    renderer_render_batch();
+    glDisable(GL_SCISSOR_TEST);
+    end_surface(surface, buf_bb);
+}
 
-        // Draw sidebar with line numbers
-        vec2pos   pen;
-        pen.y = bufwin->line_num_bb.tr.y + bufwin->text_padding.top;
+void renderer_set_font_size(int font_size)
+{
+    GEM_ASSERT(font_size > 0);
+    set_font_size(font_size);
+    bool result = resize_font(&s_font);
+    GEM_ENSURE_MSG(result, "Failed to resize font.");
+    glProgramUniform1f(s_shader, 0, s_font.sdf_edge);
+    glProgramUniform1f(s_grid_shader, 7, s_font.sdf_edge);
+}
 
-        float vert_advance = get_vert_advance();
+void renderer_set_mode(GemRenderMode mode)
+{
+    GEM_ASSERT(mode < RENDER_MODE_CNT);
+    s_mode = mode;
+}
 
-        draw_quad(&bufwin->line_num_bb, NULL, s_sidebar_color, true);
-        for(int64_t line = 0; line < bufwin->view.count.line; ++line)
-        {
-            size_t cpy = line + 1 + bufwin->view.start.line;
-            pen.x = bufwin->line_num_bb.tr.x - s_font.advance - num_pad;
-            if(cpy > pt->line_cnt)
-                draw_char('~', pen, s_text_color);
-            else
-            {
-                while(cpy > 0)
-                {
-                    draw_char('0' + cpy % 10, pen, s_text_color);
-                    pen.x -= s_font.advance;
-                    cpy /= 10;
-                }
-            }
-            pen.y += vert_advance;
-        }
+GemRenderMode renderer_get_mode(void)
+{
+    return s_mode;
+}
+
+const GemFont* gem_get_font(void)
+{
+    return &s_font;
+}
 
-        // Draw actual text in buffer.
-        pen.x = bufwin->contents_bb.bl.x;
-        pen.y = bufwin->contents_bb.tr.y;
+const GemRenderStats* renderer_get_stats(void)
+{
+    return &s_stats;
+}
 
-        size_t node_offset;
-        BufferPos view_pos = { 0, -bufwin->view.start.column };
-        const char* buf;
-        const PTNode* node = piece_tree_node_at_line(pt, bufwin->view.start.line, &node_offset);
+// Bounding box of the window's damaged rows, false if there are none.
+static bool damage_area(const BufferWin* bufwin, GemQuad* area)
+{
+    const WinDamage* d = &bufwin->damage;
+    if(d->full)
+    {
+        *area = bufwin->frame.bounding_box;
+        return true;
+    }
 
-        while(node != NULL)
+    int64_t first = -1;
+    int64_t last = -1;
+    for(int64_t row = 0; row < bufwin->view.count.line; ++row)
+    {
+        if(bufwin_row_damaged(bufwin, row))
         {
-            buf = piece_tree_get_node_start(pt, node) + node_offset;
-            handle_str(buf, node->length - node_offset, &bufwin->contents_bb, &bufwin->view, &view_pos);
-            node_offset = 0;
-            node = piece_tree_next_inorder(pt, node);
+            if(first < 0)
+                first = row;
+            last = row;
         }
+    }
+    if(first < 0)
+        return false;
+    *area = row_rect(bufwin, first, last, &bufwin->frame.bounding_box);
+    return true;
+}
+
+// Rows first to last across the columns of the given quad. The first and
+// last rows of the view take the padding above and below them along.
+static GemQuad row_rect(const BufferWin* bufwin, int64_t first, int64_t last, const GemQuad* columns)
+{
+    const GemQuad* bb = &bufwin->frame.bounding_box;
+    int vert_adv = get_vert_advance();
+    int top = first == 0 ? bb->tr.y : bufwin->contents_bb.tr.y + first * vert_adv;
+    int bottom = bufwin->contents_bb.tr.y + (last + 1) * vert_adv;
+    if(last == bufwin->view.count.line - 1 || bottom > bb->bl.y)
+        bottom = bb->bl.y;
+    return make_quad(columns->bl.x, bottom, columns->tr.x, top);
+}
+
+static bool rows_damaged(const BufferWin* bufwin, int64_t first, int64_t last)
+{
+    for(int64_t row = first; row <= last; ++row)
+        if(bufwin_row_damaged(bufwin, row))
+            return true;
+    return false;
+}
+
+// Fills the damaged rows across columns, a quad per run of them.
+static void fill_rows(const BufferWin* bufwin, const GemQuad* columns, vec4color color)
+{
+    if(bufwin->damage.full)
+    {
+        draw_quad(columns, GLYPH_SOLID, color);
+        return;
+    }
 
-        pen.x = bufwin->contents_bb.bl.x;
-        pen.y = bufwin->contents_bb.tr.y;
-        draw_cursor(&bufwin->cursor, &bufwin->view, pen); 
+    int64_t rows = bufwin->view.count.line;
+    for(int64_t row = 0; row < rows; ++row)
+    {
+        if(!bufwin_row_damaged(bufwin, row))
+            continue;
+        int64_t first = row;
+        while(row + 1 < rows && bufwin_row_damaged(bufwin, row + 1))
+            row++;
+        GemQuad quad = row_rect(bufwin, first, row, columns);
+        draw_quad(&quad, GLYPH_SOLID, color);
     }
-    if(!active)
-        draw_quad(buf_bb, NULL, s_inactive_color, true);
 }
 
-const GemFont* gem_get_font(void)
+// Moves the window's rows from the last frame by damage.scroll rows, the
+// rows it uncovers are damaged and get drawn after.
+static void scroll_window(const BufferWin* bufwin)
 {
-    return &s_font;
+    const WinSurface* surface = bufwin->surface;
+    int shift = bufwin->damage.scroll * get_vert_advance();
+    int top = bufwin->contents_bb.tr.y - bufwin->frame.bounding_box.tr.y;
+    int src = shift > 0 ? top + shift : top;
+    int dst = shift > 0 ? top : top - shift;
+    int height = surface->height - (shift > 0 ? src : dst);
+    if(height <= 0)
+        return;
+
+    // Copies within one image can't overlap, so it goes through the
+    // scratch texture.
+    glCopyImageSubData(surface->tex, GL_TEXTURE_2D, 0, 0, surface->height - src - height, 0,
+                       s_scratch_tex, GL_TEXTURE_2D, 0, 0, 0, 0, surface->width, height, 1);
+    glCopyImageSubData(s_scratch_tex, GL_TEXTURE_2D, 0, 0, 0, 0,
+                       surface->tex, GL_TEXTURE_2D, 0, 0, surface->height - dst - height, 0, 
+                       surface->width, height, 1);
 }
 
-const GemRenderStats* renderer_get_stats(void)
+// Points drawing at the surface, window coordinates stay as they are on
+// screen. A surface the window outgrew is made again, damage is full then.
+static void begin_surface(WinSurface* surface, const GemQuad* bb)
 {
-    return &s_stats;
+    int width = bb->tr.x - bb->bl.x;
+    int height = bb->bl.y - bb->tr.y;
+    renderer_render_batch();
+    if(surface->width != width || surface->height != height)
+    {
+        glDeleteTextures(1, &surface->tex);
+        glCreateTextures(GL_TEXTURE_2D, 1, &surface->tex);
+        glTextureStorage2D(surface->tex, 1, GL_RGBA8, width, height);
+        glNamedFramebufferTexture(surface->fbo, GL_COLOR_ATTACHMENT0, surface->tex, 0);
+        GEM_ENSURE_MSG(glCheckNamedFramebufferStatus(surface->fbo, GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE,
+                       "Failed to create window framebuffer.");
+        surface->width = width;
+        surface->height = height;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, surface->fbo);
+    set_projection_area(bb->bl.x, bb->tr.y, width, height);
+}
+
+// Puts the surface on the retained frame at bb, drawing is back on screen.
+static void end_surface(WinSurface* surface, const GemQuad* bb)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, s_fbo);
+    set_projection(s_screen_width, s_screen_height);
+    glBlitNamedFramebuffer(surface->fbo, s_fbo, 0, 0, surface->width, surface->height,
+                           bb->bl.x, s_screen_height - bb->bl.y, bb->tr.x, s_screen_height - bb->tr.y,
+                           GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    surface->bb = *bb;
+    s_stats.composites++;
 }
 
 static void draw_fileman(const BufferWin* bufwin)
@@ -284,7 +598,7 @@ static void draw_fileman(const BufferWin* bufwin)
                                   bb.tr.y + (i + 1) * vert_adv,
                                   bb.bl.x + len * hori_adv,
                                   bb.tr.y + i * vert_adv);
-            draw_quad(&q, NULL, s_cursor_color, true);
+            draw_quad(&q, GLYPH_SOLID, s_cursor_color);
         }
         // pos.column = bufwin->dir_entries.largest_name + 2;
         // switch(bufwin->dir_entries.ents[i]->d_type)
@@ -301,118 +615,432 @@ static void draw_fileman(const BufferWin* bufwin)
     }
 }
 
-static void draw_cursor(const Cursor* cur, const View* view, vec2pos top_left)
+static void draw_cursor(int64_t row, int64_t column, const View* view, const GemQuad* contents_bb)
 {
-    int64_t rel_line = cur->vis.line - view->start.line;
-    int64_t rel_col = cur->vis.column - view->start.column;
-    if(rel_line < 0 || rel_line >= view->count.line ||
-       rel_col < 0 || rel_col >= view->count.column)
+    if(row < 0 || row >= view->count.line ||
+       column < 0 || column >= view->count.column)
         return;
 
-
     int vert_adv = get_vert_advance();
     int hori_adv = s_font.advance;
-    int x = top_left.x + rel_col * hori_adv;
-    int y = top_left.y + rel_line * vert_adv;
+    int x = contents_bb->bl.x + column * hori_adv;
+    int y = contents_bb->tr.y + row * vert_adv;
     GemQuad cursor_quad = make_quad(x, 
                                     y + vert_adv,
                                     x + hori_adv, 
                                     y);
-    draw_quad(&cursor_quad, NULL, s_cursor_color, true);
+    draw_quad(&cursor_quad, GLYPH_SOLID, s_cursor_color);
+}
+
+// Right aligned in the sidebar, 0 marks a row past the end of the buffer.
+static void draw_line_number(const BufferWin* bufwin, int64_t row, size_t number, bool folded)
+{
+    uint32_t num_pad = s_font.advance / 4;
+    vec2pos pen;
+    pen.x = bufwin->line_num_bb.tr.x - s_font.advance - num_pad;
+    pen.y = bufwin->line_num_bb.tr.y + bufwin->text_padding.top + row * get_vert_advance();
+    if(folded)
+    {
+        // The gutter always has a spare cell on its left.
+        vec2pos mark = { bufwin->line_num_bb.bl.x + num_pad, pen.y };
+        draw_char('+', mark, s_text_color);
+    }
+    if(number == 0)
+        draw_char('~', pen, s_text_color);
+    while(number > 0)
+    {
+        draw_char('0' + number % 10, pen, s_text_color);
+        pen.x -= s_font.advance;
+        number /= 10;
+    }
+}
+
+static void draw_lines(const BufferWin* bufwin, Buffer* buffer)
+{
+    PieceTree* pt = &buffer->contents;
+    const FoldSet* fs = &bufwin->folds;
+
+    // Draw sidebar with line numbers, skipping over the lines folds hide.
+    size_t line = bufwin->view.start.line;
+    for(int64_t row = 0; row < bufwin->view.count.line; ++row)
+    {
+        bool folded = fold_set_next_visible(fs, line) != line + 1;
+        if(bufwin_row_damaged(bufwin, row))
+            draw_line_number(bufwin, row, line < pt->line_cnt ? line + 1 : 0, folded && line < pt->line_cnt);
+        line = fold_set_next_visible(fs, line);
+    }
+
+    // Draw actual text in buffer, a line at a time from its first visible
+    // column to the right edge, so long lines only cost what is on screen.
+    // Stops at the bottom of the view, paged buffers would otherwise read
+    // in the whole rest of the file.
+    const View* view = &bufwin->view;
+    const PTNode* node = NULL;
+    size_t node_offset = 0;
+    LineCache* lc = s_grid == NULL ? bufwin->line_cache : NULL;
+    if(lc != NULL)
+        line_cache_sync(lc, bufwin->bufnr, buffer, s_font.generation, view->start.column, view->count.column,
+                        bufwin->contents_bb.bl.x);
+    line = view->start.line;
+    for(int64_t row = 0; row < view->count.line && line < pt->line_cnt; ++row)
+    {
+        BufferPos view_pos = { row, -view->start.column };
+        size_t next = fold_set_next_visible(fs, line);
+        if(!bufwin_row_damaged(bufwin, row))
+        {
+            node = NULL;
+            line = next;
+            continue;
+        }
+        int32_t top = bufwin->contents_bb.tr.y + row * get_vert_advance();
+        const LineRun* cached = lc != NULL ? line_cache_find(lc, line) : NULL;
+        if(cached != NULL)
+        {
+            emit_run(cached, top);
+            node = NULL;
+            line = next;
+            continue;
+        }
+        if(node == NULL || view->start.column > 0)
+        {
+            BufferPos first = { line, 0 };
+            if(view->start.column > 0)
+            {
+                BufferPos vis = { first.line, view->start.column };
+                VisMark mark = vis_index_seek(&buffer->vis, pt, buffer->version, vis);
+                first.column = mark.column;
+                view_pos.column += mark.vis;
+            }
+            size_t offset = piece_tree_get_offset_bp(pt, first);
+            if(offset == pt->size)
+                break;
+            node = piece_tree_node_at(pt, offset, &node_offset);
+            node_offset = offset - node_offset;
+        }
+        if(lc != NULL)
+        {
+            s_run = line_cache_add(lc, line);
+            s_run->top = top;
+        }
+
+        while(node != NULL)
+        {
+            const char* buf = piece_tree_get_node_start(pt, node);
+            node_offset += handle_str(buf + node_offset, node->length - node_offset, 
+                                      &bufwin->contents_bb, view, &view_pos);
+            if(view_pos.line != row)
+                break;
+            if(node_offset < node->length)
+            {
+                // Past the right edge, the next line usually starts in
+                // the same node and memchr finds it without a lookup.
+                const char* nl = memchr(buf + node_offset, '\n', node->length - node_offset);
+                if(nl != NULL)
+                    node_offset = nl - buf + 1;
+                else
+                    node = NULL;
+                break;
+            }
+            node = piece_tree_next_inorder(pt, node);
+            node_offset = 0;
+        }
+        s_run = NULL;
+        // Where the text left off is only the next line to draw when no fold
+        // sits between them.
+        if(next != line + 1)
+            node = NULL;
+        line = next;
+    }
+
+    const Cursor* cur = &bufwin->cursor;
+    int64_t cursor_row = fold_set_row_of_line(fs, cur->vis.line) - fold_set_row_of_line(fs, view->start.line);
+    if(bufwin_row_damaged(bufwin, cursor_row))
+        draw_cursor(cursor_row, cur->vis.column - view->start.column, 
+                    &bufwin->view, &bufwin->contents_bb);
 }
 
+// Lines carry on into the rows below instead of running off the right edge,
+// only their first row gets a line number. The window measured these lines
+// already, this just lays them out again while drawing.
+static void draw_wrapped(const BufferWin* bufwin, Buffer* buffer)
+{
+    PieceTree* pt = &buffer->contents;
+    const View* view = &bufwin->view;
+    const Cursor* cur = &bufwin->cursor;
+    int64_t width = view->count.column;
+    int64_t row = 0;
+    for(int64_t line = view->start.line; row < view->count.line; ++line)
+    {
+        if(line >= (int64_t)pt->line_cnt)
+        {
+            if(bufwin_row_damaged(bufwin, row))
+                draw_line_number(bufwin, row, 0, false);
+            row++;
+            continue;
+        }
 
+        // Lines in view were all measured, so their rows are exact.
+        int64_t skip = line == view->start.line ? view->start_row : 0;
+        int64_t line_rows = wrap_index_line_rows(&bufwin->wrap, line);
+        if(!rows_damaged(bufwin, row, row - skip + line_rows - 1))
+        {
+            row += line_rows - skip;
+            continue;
+        }
+        if(skip == 0 && bufwin_row_damaged(bufwin, row))
+            draw_line_number(bufwin, row, line + 1, false);
+        int64_t cursor_row = row - skip + cur->vis.column / width;
+        if(line == cur->vis.line && bufwin_row_damaged(bufwin, cursor_row))
+            draw_cursor(cursor_row, cur->vis.column % width, view, &bufwin->contents_bb);
+
+        // seg.start.column is where the row being drawn starts in the line,
+        // so tabs still line up with the line's own tab stops.
+        View seg = *view;
+        seg.start.column = skip * width;
+        BufferPos first = { line, 0 };
+        BufferPos pos = { row, 0 };
+        if(skip > 0)
+        {
+            BufferPos vis = { line, seg.start.column };
+            VisMark mark = vis_index_seek(&buffer->vis, pt, buffer->version, vis);
+            first.column = mark.column;
+            pos.column = mark.vis - seg.start.column;
+        }
+
+        size_t offset = piece_tree_get_offset_bp(pt, first);
+        size_t node_offset = 0;
+        const PTNode* node = NULL;
+        if(offset < pt->size)
+        {
+            node = piece_tree_node_at(pt, offset, &node_offset);
+            node_offset = offset - node_offset;
+        }
+        while(node != NULL && pos.line < view->count.line)
+        {
+            const char* buf = piece_tree_get_node_start(pt, node);
+            node_offset += handle_str(buf + node_offset, node->length - node_offset, 
+                                      &bufwin->contents_bb, &seg, &pos);
+            if(pos.line != row)
+                break;
+            if(pos.column >= width)
+            {
+                seg.start.column += width;
+                pos.column -= width;
+                pos.line = ++row;
+                continue;
+            }
+            node = piece_tree_next_inorder(pt, node);
+            node_offset = 0;
+        }
+        row = pos.line == row ? row + 1 : pos.line;
+    }
+}
 
-static void handle_str(const char* str, size_t count, const GemQuad* bounding_box, 
-                       const View* view, BufferPos* pos)
+// Draws str until a newline or the right edge of the view, returning how much
+// of it was used. A newline is used up and moves pos to the next line.
+static size_t handle_str(const char* str, size_t count, const GemQuad* bounding_box, 
+                         const View* view, BufferPos* pos)
 {
     int vert_adv = get_vert_advance();
     int hori_adv = s_font.advance;
-    for(size_t i = 0; i < count && pos->line < view->count.line; ++i)
+    size_t i;
+    for(i = 0; i < count && pos->line < view->count.line && pos->column < view->count.column; ++i)
     {
         char c = str[i];
         if(c == '\n')
         {
             pos->line++;
             pos->column = -view->start.column;
+            return i + 1;
         }
         else if(c == ' ')
             pos->column++;
         else if(c == '\t')
             pos->column += 4 - (pos->column + view->start.column) % 4;
+        else if(utf8_is_cont(c))
+            continue; // Rest of a UTF-8 codepoint, which already took its cells
         else
         {
-            if(pos->column >= 0 && pos->column < view->count.column)
+            // Wide codepoints take two cells, same as the cursor sees them.
+            uint32_t cp;
+            size_t len = utf8_decode(str + i, count - i, &cp);
+            bool shown = pos->column >= 0 && (s_damage == NULL || bufwin_row_damaged(s_damage, pos->line));
+            int width = utf8_width(cp);
+            if(shown && s_grid != NULL)
+            {
+                // The shader draws the whole glyph from its first cell.
+                uint32_t* cell = s_grid + pos->line * s_grid_cols + pos->column;
+                cell[0] = get_font_glyph(&s_font, cp);
+                if(width > 1 && pos->column + 1 < s_grid_cols)
+                    cell[1] = CELL_WIDE;
+            }
+            else if(shown)
             {
                 vec2pos loc = { 
                     bounding_box->bl.x + pos->column * hori_adv,
                     bounding_box->tr.y + pos->line * vert_adv
                 };
-                draw_char(c, loc, s_text_color); 
+                draw_char(cp, loc, s_text_color); 
             }
-            pos->column++;
+            i += len - 1;
+            pos->column += width;
         }
     }
+    // Continuation bytes at the edge still belong to the last codepoint.
+    while(i < count && utf8_is_cont(str[i]))
+        i++;
+    return i;
+}
+
+// Points handle_str at a cleared grid of the window's cells, false if the
+// frame is out of cells and the window has to be drawn with quads.
+static bool begin_grid(const BufferWin* bufwin)
+{
+    size_t cells = bufwin->view.count.line * bufwin->view.count.column;
+    if(cells == 0 || s_cell_used + cells > GRID_MAX_CELLS)
+        return false;
+    if(s_cell_used == 0)
+        wait_fence(&s_cell_fences[s_cell_region]);
+
+    s_grid = s_cell_ring + (size_t)s_cell_region * GRID_MAX_CELLS + s_cell_used;
+    s_grid_cols = bufwin->view.count.column;
+    memset(s_grid, 0xFF, sizeof(uint32_t) * cells); // CELL_EMPTY
+    return true;
 }
 
-static void draw_char(char c, vec2pos pos, vec4color color)
+// Draws the grid over what was batched so far, which leaves the cursor
+// under the text rather than over it.
+static void end_grid(const BufferWin* bufwin)
 {
-    const GemGlyphData* data = get_glyph_data_from_font(&s_font, c);
-    pos.x += data->xoff;
-    pos.y += get_font_size() - data->yoff;
+    const View* view = &bufwin->view;
+    const GemQuad* bb = &bufwin->contents_bb;
+    int vert_adv = get_vert_advance();
+    int hori_adv = s_font.advance;
+    uint32_t cells = view->count.line * view->count.column;
+    GemQuad area = make_quad(bb->bl.x,
+                             bb->tr.y + view->count.line * vert_adv,
+                             bb->bl.x + view->count.column * hori_adv,
+                             bb->tr.y);
+
+    renderer_render_batch();
+    draw_quad(&area, GLYPH_SOLID, s_text_color);
+    glUseProgram(s_grid_shader);
+    glUniform2i(0, hori_adv, vert_adv);
+    glUniform2i(1, view->count.column, view->count.line);
+    glUniform1ui(2, (uint32_t)(s_grid - s_cell_ring));
+    glUniform4fv(3, 1, &s_text_color.r);
+    renderer_render_batch();
+    glUseProgram(s_shader);
+
+    s_stats.cell_count += cells;
+    s_cell_used += cells;
+    s_grid = NULL;
+}
+
+static void draw_char(uint32_t cp, vec2pos pos, vec4color color)
+{
+    const GemGlyphData* data = s_font.glyphs + get_font_glyph(&s_font, cp);
+    float scale = s_font.scale;
+    pos.x += (int)lroundf((float)data->xoff * scale);
+    pos.y += get_font_size() - (int)lroundf((float)data->yoff * scale);
     GemQuad char_quad = make_quad(pos.x,
-                                  pos.y + data->height,
-                                  pos.x + data->width, 
+                                  pos.y + (int)lroundf((float)data->height * scale),
+                                  pos.x + (int)lroundf((float)data->width * scale), 
                                   pos.y);
 
-    draw_quad(&char_quad, data->tex_coords, color, false);
+    // The ring is write only, so the line cache gets its copy from here.
+    QuadInstance inst = make_instance(&char_quad, data - s_font.glyphs, color);
+    push_instance(&inst);
+    if(s_run != NULL)
+        line_run_push(s_run, &inst);
+}
+
+// Copies a cached line into the batch, moved down to the row it is on now.
+static void emit_run(const LineRun* run, int32_t top)
+{
+    if(run->quad_cnt == 0)
+        return;
+    if(s_quad_cnt + run->quad_cnt > MAX_QUADS)
+        next_region();
+    if(s_quad_cnt == 0)
+        wait_fence(&s_fences[s_region]);
+
+    QuadInstance* dst = s_quad_data + s_quad_cnt;
+    s_quad_cnt += run->quad_cnt;
+    int16_t dy = (int16_t)(top - run->top);
+    if(dy == 0)
+    {
+        memcpy(dst, run->quads, sizeof(QuadInstance) * run->quad_cnt);
+        return;
+    }
+    // Moved on the way in, the ring is never read back.
+    for(uint32_t i = 0; i < run->quad_cnt; ++i)
+    {
+        QuadInstance inst = run->quads[i];
+        inst.position[1] += dy;
+        dst[i] = inst;
+    }
+}
+
+static void draw_quad(const GemQuad* quad, uint32_t glyph, vec4color color)
+{
+    QuadInstance inst = make_instance(quad, glyph, color);
+    push_instance(&inst);
 }
 
-static void draw_quad(const GemQuad* quad, const float tex[4], vec4color color, bool is_solid)
+static QuadInstance make_instance(const GemQuad* quad, uint32_t glyph, vec4color color)
 {
     GEM_ASSERT(quad != NULL);
-    GEM_ASSERT(is_solid || tex != NULL);
+    GEM_ASSERT(quad->tr.x >= quad->bl.x && quad->bl.y >= quad->tr.y);
+    QuadInstance inst;
+    inst.position[0] = (int16_t)quad->bl.x;
+    inst.position[1] = (int16_t)quad->tr.y;
+    inst.size[0] = (uint16_t)(quad->tr.x - quad->bl.x);
+    inst.size[1] = (uint16_t)(quad->bl.y - quad->tr.y);
+    inst.glyph = glyph;
+    inst.color[0] = (uint8_t)(color.r * 255.0f + 0.5f);
+    inst.color[1] = (uint8_t)(color.g * 255.0f + 0.5f);
+    inst.color[2] = (uint8_t)(color.b * 255.0f + 0.5f);
+    inst.color[3] = (uint8_t)(color.a * 255.0f + 0.5f);
+    return inst;
+}
+
+static void push_instance(const QuadInstance* inst)
+{
     if(s_quad_cnt == MAX_QUADS)
-        renderer_render_batch();
+        next_region();
+    if(s_quad_cnt == 0)
+        wait_fence(&s_fences[s_region]);
+    s_quad_data[s_quad_cnt++] = *inst;
+}
 
-    float positions[8] = { 
-        quad->bl.x, quad->bl.y,
-        quad->tr.x, quad->bl.y,
-        quad->tr.x, quad->tr.y,
-        quad->bl.x, quad->tr.y
-    };
+// Draws what is left of the current region, fences it and moves on.
+static void next_region(void)
+{
+    renderer_render_batch();
+    s_fences[s_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    s_region = (s_region + 1) % RING_REGIONS;
+    s_quad_data = s_ring + (size_t)s_region * MAX_QUADS;
+    s_quad_cnt = 0;
+    s_batch_start = 0;
+}
 
-    float texc[8];
-    if(!is_solid)
-    {
-        texc[0] = tex[0];
-        texc[1] = tex[1];
-        texc[2] = tex[2];
-        texc[3] = tex[1];
-        texc[4] = tex[2];
-        texc[5] = tex[3];
-        texc[6] = tex[0];
-        texc[7] = tex[3];
-    }
+// Blocks until the GPU is past fence, if there is one, and deletes it.
+static void wait_fence(GLsync* fence)
+{
+    if(*fence == NULL)
+        return;
 
-    for(size_t i = 0; i < 4; ++i)
+    GLenum res = glClientWaitSync(*fence, 0, 0);
+    if(res == GL_TIMEOUT_EXPIRED)
     {
-        s_vertex_insert[i].position[0] = positions[2 * i];
-        s_vertex_insert[i].position[1] = positions[2 * i + 1];
-        if(!is_solid)
-        {
-            s_vertex_insert[i].tex_coords[0] = texc[2 * i];
-            s_vertex_insert[i].tex_coords[1] = texc[2 * i + 1];
-        }
-        s_vertex_insert[i].color.r = color.r;
-        s_vertex_insert[i].color.g = color.g;
-        s_vertex_insert[i].color.b = color.b;
-        s_vertex_insert[i].color.a = color.a;
-        s_vertex_insert[i].solid = (float)is_solid;
+        s_stats.fence_waits++;
+        while(res == GL_TIMEOUT_EXPIRED)
+            res = glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
     }
-
-    s_vertex_insert += 4;
-    s_quad_cnt++;
+    GEM_ASSERT(res != GL_WAIT_FAILED);
+    glDeleteSync(*fence);
+    *fence = NULL;
 }
 
 static bool create_shader_program(const char* vert_path, const char* frag_path, GLuint* program_id)
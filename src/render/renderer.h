@@ -4,17 +4,41 @@
 #include "editor/bufferwin.h"
 
 typedef struct GemRenderStats GemRenderStats;
+typedef struct WinSurface     WinSurface;
 struct GemRenderStats
 {
     uint32_t draw_calls;
     uint32_t quad_count;
+    uint32_t cell_count;  // Text cells written by the grid renderer
+    uint32_t fence_waits; // Times the GPU still had the next ring region in use
+    uint32_t composites;  // Window surfaces put on screen
+    uint32_t glyph_loads; // Glyphs rasterized into the atlas
 };
 
+typedef enum
+{
+    RENDER_MODE_QUADS = 0, // A quad per glyph
+    RENDER_MODE_GRID,      // A cell code per glyph, the shader draws the text area
+    RENDER_MODE_CNT
+} GemRenderMode;
+
 void renderer_init(void);
 void renderer_cleanup(void);
 void renderer_start_batch(void);
 void renderer_render_batch(void);
+// Puts the retained frame on screen, ready to swap.
+void renderer_present(void);
+// Sets the projection and resizes the retained frame, which loses what was on it.
+void renderer_resize(int width, int height);
+// Each window draws into its own surface, which keeps its contents while
+// other windows change and is only drawn over where the window is damaged.
+WinSurface* renderer_create_surface(void);
+void renderer_free_surface(WinSurface* surface);
 void renderer_draw_bufwin(const BufferWin* bufwin, bool active);
+// Windows have to be laid out again after, the cell size changes with it.
+void renderer_set_font_size(int font_size);
+void renderer_set_mode(GemRenderMode mode);
+GemRenderMode renderer_get_mode(void);
 
 const GemRenderStats* renderer_get_stats(void);
 const GemFont* gem_get_font(void);
@@ -27,10 +27,17 @@ void uniforms_init(void)
 
 
 void set_projection(int width, int height)
+{
+    set_projection_area(0, 0, width, height);
+}
+
+void set_projection_area(int x, int y, int width, int height)
 {
     GEM_ASSERT(width > 0 && height > 0);
     s_uniforms.projection[0][0] =  2.0f / (float)width;
     s_uniforms.projection[1][1] = -2.0f / (float)height;
+    s_uniforms.projection[3][0] = -1.0f - 2.0f * (float)x / (float)width;
+    s_uniforms.projection[3][1] =  1.0f + 2.0f * (float)y / (float)height;
     glNamedBufferSubData(s_ubo, 0, sizeof(s_uniforms), &s_uniforms);
     glViewport(0, 0, (GLsizei)width, (GLsizei)height);
 }
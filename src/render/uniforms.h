@@ -2,4 +2,6 @@
 
 void uniforms_init(void);
 void set_projection(int width, int height);
+// Maps the width by height area at x, y to the whole viewport.
+void set_projection_area(int x, int y, int width, int height);
 void uniforms_cleanup(void);
@@ -53,8 +53,8 @@
         DA_ASSERT((da) != NULL);                                            \
         DA_ASSERT((index) <= (da)->size);                                   \
         da_reserve((da), (da)->size + 1);                                   \
-        for(size_t __da_idx = (index); __da_idx < (da)->size; ++__da_idx)   \
-            (da)->data[__da_idx + 1] = (da)->data[__da_idx];                \
+        for(size_t __da_idx = (da)->size; __da_idx > (index); --__da_idx)   \
+            (da)->data[__da_idx] = (da)->data[__da_idx - 1];                \
         (da)->data[(index)] = (item);                                       \
         (da)->size++;                                                       \
     }
@@ -66,8 +66,8 @@
         DA_ASSERT((item_count) > 0);                                        \
         DA_ASSERT((index) <= (da)->size);                                   \
         da_reserve((da), (da)->size + (item_count));                        \
-        for(size_t __da_idx = (index); __da_idx < (da)->size; ++__da_idx)   \
-            (da)->data[__da_idx + (item_count)] = (da)->data[__da_idx];     \
+        for(size_t __da_idx = (da)->size; __da_idx > (index); --__da_idx)   \
+            (da)->data[__da_idx - 1 + (item_count)] = (da)->data[__da_idx - 1]; \
         memcpy((da)->data + (index), (item_arr),                            \
                (item_count) * sizeof(*((da)->data)));                       \
         (da)->size += (item_count);                                         \
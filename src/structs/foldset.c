@@ -0,0 +1,290 @@
+#include "foldset.h"
+#include "visindex.h"
+#include "core/core.h"
+#include "structs/da.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct LineScan LineScan;
+struct LineScan
+{
+    PieceTree* pt;
+    const PTNode*    node;
+    size_t           i;
+};
+
+static size_t  folds_starting_by(const FoldSet* fs, size_t line);
+static void    remove_folds(FoldSet* fs, size_t first, size_t count);
+static void    update_hidden(FoldSet* fs, size_t from);
+static void    start_scan(LineScan* ls, PieceTree* pt, size_t line);
+static int64_t scan_line(LineScan* ls);
+
+void fold_set_free(FoldSet* fs)
+{
+    da_free_data(fs);
+}
+
+void fold_set_clear(FoldSet* fs)
+{
+    fs->size = 0;
+}
+
+void fold_set_add(FoldSet* fs, size_t start, size_t end)
+{
+    GEM_ASSERT(fs != NULL);
+    GEM_ASSERT(start > 0 && start <= end);
+
+    // Folds overlapping or right next to this one would hide its header or
+    // have theirs hidden, so they all become one.
+    size_t first = folds_starting_by(fs, start);
+    if(first > 0 && fs->data[first - 1].end + 1 >= start)
+        first--;
+    size_t last = folds_starting_by(fs, end + 1);
+    if(first < last)
+    {
+        if(fs->data[first].start < start)
+            start = fs->data[first].start;
+        if(fs->data[last - 1].end > end)
+            end = fs->data[last - 1].end;
+        remove_folds(fs, first, last - first);
+    }
+
+    Fold fold = { start, end, 0 };
+    da_insert(fs, fold, first);
+    update_hidden(fs, first);
+}
+
+bool fold_set_open(FoldSet* fs, size_t header)
+{
+    GEM_ASSERT(fs != NULL);
+    size_t k = folds_starting_by(fs, header + 1);
+    if(k == 0 || fs->data[k - 1].start != header + 1)
+        return false;
+    remove_folds(fs, k - 1, 1);
+    update_hidden(fs, k - 1);
+    return true;
+}
+
+bool fold_set_reveal(FoldSet* fs, size_t line)
+{
+    GEM_ASSERT(fs != NULL);
+    const Fold* fold = fold_set_find(fs, line);
+    return fold != NULL && fold_set_open(fs, fold->start - 1);
+}
+
+bool fold_set_edit(FoldSet* fs, size_t line, size_t removed_lines, size_t added_lines)
+{
+    GEM_ASSERT(fs != NULL);
+    size_t kept = 0;
+    for(size_t i = 0; i < fs->size; ++i)
+    {
+        Fold fold = fs->data[i];
+        if(fold.start > line + removed_lines)
+        {
+            fold.start = fold.start - removed_lines + added_lines;
+            fold.end = fold.end - removed_lines + added_lines;
+        }
+        else if(fold.end >= line)
+            continue;
+        fs->data[kept++] = fold;
+    }
+    bool opened = kept < fs->size;
+    fs->size = kept;
+    update_hidden(fs, 0);
+    return opened;
+}
+
+const Fold* fold_set_find(const FoldSet* fs, size_t line)
+{
+    GEM_ASSERT(fs != NULL);
+    size_t k = folds_starting_by(fs, line);
+    return k > 0 && fs->data[k - 1].end >= line ? fs->data + k - 1 : NULL;
+}
+
+size_t fold_set_hidden(const FoldSet* fs)
+{
+    GEM_ASSERT(fs != NULL);
+    if(fs->size == 0)
+        return 0;
+    const Fold* last = fs->data + fs->size - 1;
+    return last->hidden_before + last->end - last->start + 1;
+}
+
+size_t fold_set_row_of_line(const FoldSet* fs, size_t line)
+{
+    GEM_ASSERT(fs != NULL);
+    size_t k = folds_starting_by(fs, line);
+    if(k == 0)
+        return line;
+    const Fold* fold = fs->data + k - 1;
+    if(line <= fold->end)
+        return fold->start - 1 - fold->hidden_before;
+    return line - fold->hidden_before - (fold->end - fold->start + 1);
+}
+
+size_t fold_set_line_at_row(const FoldSet* fs, size_t row)
+{
+    GEM_ASSERT(fs != NULL);
+    // Row of the line right after each fold only goes up from fold to fold.
+    size_t lo = 0;
+    size_t hi = fs->size;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(fs->data[mid].start - fs->data[mid].hidden_before <= row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == 0)
+        return row;
+    const Fold* fold = fs->data + lo - 1;
+    return row + fold->hidden_before + (fold->end - fold->start + 1);
+}
+
+size_t fold_set_next_visible(const FoldSet* fs, size_t line)
+{
+    const Fold* fold = fold_set_find(fs, line + 1);
+    return fold != NULL ? fold->end + 1 : line + 1;
+}
+
+size_t fold_indent_block(PieceTree* pt, size_t line)
+{
+    GEM_ASSERT(pt != NULL && line < pt->line_cnt);
+    LineScan ls;
+    start_scan(&ls, pt, line);
+    int64_t depth = scan_line(&ls);
+    size_t end = line;
+    if(depth < 0)
+        return end;
+
+    for(size_t l = line + 1; l < pt->line_cnt; ++l)
+    {
+        int64_t indent = scan_line(&ls);
+        if(indent < 0)
+            continue;
+        if(indent <= depth)
+            break;
+        end = l;
+    }
+    return end;
+}
+
+void fold_top_level(FoldSet* fs, PieceTree* pt)
+{
+    GEM_ASSERT(fs != NULL && pt != NULL);
+    // One pass over the buffer, folds come out in order so they just get
+    // appended.
+    fold_set_clear(fs);
+    LineScan ls;
+    start_scan(&ls, pt, 0);
+    size_t hidden = 0;
+    size_t header = SIZE_MAX;
+    size_t last = 0;
+    for(size_t l = 0; l <= pt->line_cnt; ++l)
+    {
+        int64_t indent = l < pt->line_cnt ? scan_line(&ls) : 0;
+        if(indent < 0)
+            continue;
+        if(indent > 0)
+        {
+            last = l;
+            continue;
+        }
+
+        if(header != SIZE_MAX && last > header)
+        {
+            Fold fold = { header + 1, last, hidden };
+            da_append(fs, fold);
+            hidden += last - header;
+        }
+        header = l;
+    }
+}
+
+// Number of folds starting at or before line.
+static size_t folds_starting_by(const FoldSet* fs, size_t line)
+{
+    size_t lo = 0;
+    size_t hi = fs->size;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(fs->data[mid].start <= line)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void remove_folds(FoldSet* fs, size_t first, size_t count)
+{
+    memmove(fs->data + first, fs->data + first + count, sizeof(Fold) * (fs->size - first - count));
+    fs->size -= count;
+}
+
+static void update_hidden(FoldSet* fs, size_t from)
+{
+    size_t hidden = from > 0 ? fs->data[from - 1].hidden_before + 
+                               fs->data[from - 1].end - fs->data[from - 1].start + 1 : 0;
+    for(size_t i = from; i < fs->size; ++i)
+    {
+        fs->data[i].hidden_before = hidden;
+        hidden += fs->data[i].end - fs->data[i].start + 1;
+    }
+}
+
+static void start_scan(LineScan* ls, PieceTree* pt, size_t line)
+{
+    size_t offset = piece_tree_get_offset(pt, line, 0);
+    ls->pt = pt;
+    ls->node = NULL;
+    ls->i = 0;
+    if(offset < pt->size)
+    {
+        ls->node = piece_tree_node_at(pt, offset, &ls->i);
+        ls->i = offset - ls->i;
+    }
+}
+
+// Indentation of the line the scan is on, -1 if it's blank. Leaves the scan
+// at the start of the next line, the rest of the line is skipped with memchr.
+static int64_t scan_line(LineScan* ls)
+{
+    int64_t indent = 0;
+    bool blank = true;
+    while(ls->node != NULL)
+    {
+        const char* buf = piece_tree_get_node_start(ls->pt, ls->node);
+        size_t len = ls->node->length;
+        for(; blank && ls->i < len; ++ls->i)
+        {
+            char c = buf[ls->i];
+            if(c == ' ')
+                indent++;
+            else if(c == '\t')
+                indent += VIS_TAB_STOP - indent % VIS_TAB_STOP;
+            else if(c == '\n')
+            {
+                ls->i++;
+                return -1;
+            }
+            else if(c != '\r')
+                blank = false;
+        }
+        if(!blank)
+        {
+            const char* nl = memchr(buf + ls->i, '\n', len - ls->i);
+            if(nl != NULL)
+            {
+                ls->i = nl - buf + 1;
+                return indent;
+            }
+        }
+        ls->node = piece_tree_next_inorder(ls->pt, ls->node);
+        ls->i = 0;
+    }
+    return blank ? -1 : indent;
+}
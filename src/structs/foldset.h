@@ -0,0 +1,53 @@
+#pragma once
+#include "structs/piecetree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Fold    Fold;
+typedef struct FoldSet FoldSet;
+
+struct Fold
+{
+    size_t start;         /* First hidden line, the one before it stays as the header */
+    size_t end;           /* Last hidden line */
+    size_t hidden_before; /* Lines hidden by the folds before this one */
+};
+
+// Closed folds of a window, sorted and disjoint, so mapping between visible
+// rows and buffer lines is a binary search over the folds rather than a walk
+// over the lines they hide. A zeroed FoldSet is empty and ready to use.
+struct FoldSet
+{
+    Fold*    data;
+    size_t   size;
+    size_t   capacity;
+    uint64_t version; /* Buffer version the folds match */
+};
+
+void   fold_set_free(FoldSet* fs);
+void   fold_set_clear(FoldSet* fs);
+// Hides [start, end], swallowing any folds it touches.
+void   fold_set_add(FoldSet* fs, size_t start, size_t end);
+// Opens the fold headed by line, false if there isn't one.
+bool   fold_set_open(FoldSet* fs, size_t header);
+// Opens whatever fold hides line, false if it was visible.
+bool   fold_set_reveal(FoldSet* fs, size_t line);
+// Line changed, removed_lines after it were joined onto it and added_lines
+// new ones follow it. Folds the edit reached into are opened, true if any were.
+bool   fold_set_edit(FoldSet* fs, size_t line, size_t removed_lines, size_t added_lines);
+
+// Fold hiding line, NULL if it is visible.
+const Fold* fold_set_find(const FoldSet* fs, size_t line);
+size_t fold_set_hidden(const FoldSet* fs);
+// Visible row of line, hidden lines get their header's.
+size_t fold_set_row_of_line(const FoldSet* fs, size_t line);
+size_t fold_set_line_at_row(const FoldSet* fs, size_t row);
+size_t fold_set_next_visible(const FoldSet* fs, size_t line);
+
+// Last line of the indented block under line, or line itself if nothing
+// under it is indented deeper. Blank lines inside the block go with it.
+size_t fold_indent_block(PieceTree* pt, size_t line);
+// Folds every indented block under an unindented line.
+void   fold_top_level(FoldSet* fs, PieceTree* pt);
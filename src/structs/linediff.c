@@ -0,0 +1,184 @@
+#include "linediff.h"
+#include "da.h"
+
+#include <string.h>
+
+// Past this many edits the middle section is treated as a single hunk.
+// The trace is O(D^2), and a diff this large touches most of the file anyway.
+#define MAX_EDIT_DISTANCE 1024
+
+typedef struct DiffLines DiffLines;
+struct DiffLines
+{
+    const uint64_t* old_hashes;
+    const uint64_t* new_hashes;
+    LineEqualFn     equal;
+    void*           ctx;
+};
+
+static bool same_line(const DiffLines* lines, size_t old_line, size_t new_line);
+static bool myers(const DiffLines* lines, size_t start, size_t n, size_t m,
+                  uint8_t* deleted, uint8_t* inserted);
+
+void line_diff(const uint64_t* old_hashes, size_t old_cnt,
+               const uint64_t* new_hashes, size_t new_cnt,
+               LineEqualFn equal, void* ctx, LineDiff* diff)
+{
+    GEM_ASSERT(diff != NULL);
+    da_init(diff, 0);
+    DiffLines lines = { old_hashes, new_hashes, equal, ctx };
+
+    // Strip the common prefix and suffix first, a reload after a small
+    // external change never gets past this.
+    size_t prefix = 0;
+    while(prefix < old_cnt && prefix < new_cnt && same_line(&lines, prefix, prefix))
+        prefix++;
+    size_t suffix = 0;
+    while(suffix < old_cnt - prefix && suffix < new_cnt - prefix &&
+          same_line(&lines, old_cnt - 1 - suffix, new_cnt - 1 - suffix))
+        suffix++;
+
+    size_t n = old_cnt - prefix - suffix;
+    size_t m = new_cnt - prefix - suffix;
+    if(n == 0 && m == 0)
+        return;
+
+    uint8_t* deleted = calloc(n + m, 1);
+    GEM_ENSURE(deleted != NULL);
+    uint8_t* inserted = deleted + n;
+
+    if(n == 0 || m == 0 || !myers(&lines, prefix, n, m, deleted, inserted))
+    {
+        memset(deleted, 1, n);
+        memset(inserted, 1, m);
+    }
+
+    size_t i = 0;
+    size_t j = 0;
+    while(i < n || j < m)
+    {
+        if(i < n && j < m && !deleted[i] && !inserted[j])
+        {
+            i++;
+            j++;
+            continue;
+        }
+
+        LineHunk hunk;
+        hunk.old_start = prefix + i;
+        hunk.new_start = prefix + j;
+        while((i < n && deleted[i]) || (j < m && inserted[j]))
+        {
+            if(i < n && deleted[i])
+                i++;
+            if(j < m && inserted[j])
+                j++;
+        }
+        hunk.old_cnt = prefix + i - hunk.old_start;
+        hunk.new_cnt = prefix + j - hunk.new_start;
+        da_append(diff, hunk);
+    }
+
+    free(deleted);
+}
+
+size_t line_diff_map_line(const LineDiff* diff, size_t old_line)
+{
+    GEM_ASSERT(diff != NULL);
+    int64_t delta = 0;
+    for(size_t i = 0; i < diff->size; ++i)
+    {
+        const LineHunk* h = diff->data + i;
+        if(old_line < h->old_start)
+            break;
+        if(old_line < h->old_start + h->old_cnt)
+        {
+            // Lines inside a hunk keep their relative position where possible.
+            size_t rel = old_line - h->old_start;
+            if(h->new_cnt == 0)
+                return h->new_start;
+            return h->new_start + (rel < h->new_cnt ? rel : h->new_cnt - 1);
+        }
+        delta += (int64_t)h->new_cnt - (int64_t)h->old_cnt;
+    }
+    return (size_t)((int64_t)old_line + delta);
+}
+
+static bool same_line(const DiffLines* lines, size_t old_line, size_t new_line)
+{
+    return lines->old_hashes[old_line] == lines->new_hashes[new_line] &&
+           (lines->equal == NULL || lines->equal(lines->ctx, old_line, new_line));
+}
+
+// Diffs the n old and m new lines from start on.
+static bool myers(const DiffLines* lines, size_t start, size_t n, size_t m,
+                  uint8_t* deleted, uint8_t* inserted)
+{
+    size_t max_d = n + m < MAX_EDIT_DISTANCE ? n + m : MAX_EDIT_DISTANCE;
+
+    // Round d stores V[-d..d] starting at index d * d.
+    int64_t* trace = malloc(sizeof(int64_t) * (max_d + 1) * (max_d + 1));
+    GEM_ENSURE(trace != NULL);
+    int64_t* v = malloc(sizeof(int64_t) * (2 * max_d + 3));
+    GEM_ENSURE(v != NULL);
+    int64_t* vmid = v + max_d + 1;
+    vmid[1] = 0;
+
+    int64_t d;
+    bool found = false;
+    for(d = 0; d <= (int64_t)max_d && !found; ++d)
+    {
+        for(int64_t k = -d; k <= d; k += 2)
+        {
+            int64_t x;
+            if(k == -d || (k != d && vmid[k - 1] < vmid[k + 1]))
+                x = vmid[k + 1];
+            else
+                x = vmid[k - 1] + 1;
+            int64_t y = x - k;
+            while(x < (int64_t)n && y < (int64_t)m && same_line(lines, start + x, start + y))
+            {
+                x++;
+                y++;
+            }
+            vmid[k] = x;
+            if(x >= (int64_t)n && y >= (int64_t)m)
+                found = true;
+        }
+        memcpy(trace + d * d, vmid - d, sizeof(int64_t) * (2 * d + 1));
+    }
+    free(v);
+
+    if(!found)
+    {
+        free(trace);
+        return false;
+    }
+
+    int64_t x = n;
+    int64_t y = m;
+    for(d = d - 1; d > 0; --d)
+    {
+        const int64_t* prev = trace + (d - 1) * (d - 1) + (d - 1);
+        int64_t k = x - y;
+        int64_t prev_k;
+        if(k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+            prev_k = k + 1;
+        else
+            prev_k = k - 1;
+        int64_t prev_x = prev[prev_k];
+        int64_t prev_y = prev_x - prev_k;
+
+        // The snake leading up to (x, y) is made of equal lines, only the
+        // single edit taken before it needs recording.
+        if(prev_k == k + 1)
+            inserted[prev_y] = 1;
+        else
+            deleted[prev_x] = 1;
+        x = prev_x;
+        y = prev_y;
+    }
+
+    free(trace);
+    return true;
+}
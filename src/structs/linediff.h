@@ -0,0 +1,46 @@
+#pragma once
+#include "core/core.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct LineHunk LineHunk;
+typedef struct LineDiff LineDiff;
+
+// Confirms two lines whose hashes match are really the same, so a collision
+// can't hide a change.
+typedef bool (*LineEqualFn)(void* ctx, size_t old_line, size_t new_line);
+
+struct LineHunk
+{
+    size_t old_start;
+    size_t old_cnt;
+    size_t new_start;
+    size_t new_cnt;
+};
+
+struct LineDiff
+{
+    LineHunk* data;
+    size_t    size;
+    size_t    capacity;
+};
+
+void   line_diff(const uint64_t* old_hashes, size_t old_cnt,
+                 const uint64_t* new_hashes, size_t new_cnt,
+                 LineEqualFn equal, void* ctx, LineDiff* diff);
+size_t line_diff_map_line(const LineDiff* diff, size_t old_line);
+
+// FNV-1a, lines are hashed without their terminating newline.
+#define LINE_HASH_INIT 0xcbf29ce484222325ull
+
+static inline uint64_t line_hash_update(uint64_t hash, const char* data, size_t len)
+{
+    for(size_t i = 0; i < len; ++i)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
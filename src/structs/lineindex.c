@@ -0,0 +1,197 @@
+#include "lineindex.h"
+#include "core/core.h"
+
+#include <string.h>
+
+#define INITIAL_BLOCKS (1 << 4)
+
+static void     pack_tail(LineIndex* li);
+static uint64_t block_anchor(const LineIndex* li, size_t b);
+
+void line_index_init(LineIndex* li)
+{
+    GEM_ASSERT(li != NULL);
+    memset(li, 0, sizeof(LineIndex));
+}
+
+void line_index_free(LineIndex* li)
+{
+    free(li->blocks);
+    free(li->bits);
+}
+
+void line_index_append(LineIndex* li, uint64_t value)
+{
+    GEM_ASSERT(li != NULL);
+    GEM_ASSERT(li->size == 0 || value > line_index_last(li));
+    li->tail[li->size & (LINE_INDEX_BLOCK - 1)] = value;
+    li->size++;
+    if((li->size & (LINE_INDEX_BLOCK - 1)) == 0)
+        pack_tail(li);
+}
+
+void line_index_concat(LineIndex* li, LineIndex* other)
+{
+    GEM_ASSERT(li != NULL && other != NULL);
+    if(other->size == 0)
+        return;
+    GEM_ASSERT((li->size & (LINE_INDEX_BLOCK - 1)) == 0);
+    GEM_ASSERT(li->size == 0 || line_index_get(other, 0) > line_index_last(li));
+
+    // Other's deltas start on a fresh word so they can be copied over as is,
+    // at the cost of the rest of li's last word.
+    size_t word = (li->bit_cnt + 63) / 64;
+    size_t other_words = (other->bit_cnt + 63) / 64;
+    if(li->block_cnt + other->block_cnt > li->block_cap)
+    {
+        li->block_cap = li->block_cnt + other->block_cnt;
+        li->blocks = realloc(li->blocks, sizeof(LIBlock) * li->block_cap);
+        GEM_ENSURE(li->blocks != NULL);
+    }
+    if(word + other_words > li->bit_cap)
+    {
+        li->bit_cap = word + other_words;
+        li->bits = realloc(li->bits, sizeof(uint64_t) * li->bit_cap);
+        GEM_ENSURE(li->bits != NULL);
+    }
+
+    for(size_t b = 0; b < other->block_cnt; ++b)
+    {
+        LIBlock* block = li->blocks + li->block_cnt + b;
+        *block = other->blocks[b];
+        block->packed += (uint64_t)word * 64 << 7;
+    }
+    if(other_words > 0)
+        memcpy(li->bits + word, other->bits, sizeof(uint64_t) * other_words);
+
+    li->block_cnt += other->block_cnt;
+    li->bit_cnt = word * 64 + other->bit_cnt;
+    li->size += other->size;
+    memcpy(li->tail, other->tail, sizeof(li->tail));
+    other->block_cnt = other->bit_cnt = other->size = 0;
+}
+
+size_t line_index_rank(const LineIndex* li, uint64_t value, size_t lo, size_t hi)
+{
+    GEM_ASSERT(li != NULL);
+    GEM_ASSERT(lo <= hi && hi < li->size);
+    GEM_ASSERT(line_index_get(li, lo) <= value);
+
+    // Anchors sit together in memory, so the search narrows down to a block
+    // with those before decoding anything.
+    size_t blo = lo >> LINE_INDEX_BLOCK_SHIFT;
+    size_t bhi = hi >> LINE_INDEX_BLOCK_SHIFT;
+    while(blo < bhi)
+    {
+        size_t mid = (blo + bhi + 1) / 2;
+        if(block_anchor(li, mid) <= value)
+            blo = mid;
+        else
+            bhi = mid - 1;
+    }
+
+    size_t first = blo << LINE_INDEX_BLOCK_SHIFT;
+    if(first > lo)
+        lo = first;
+    if(first + LINE_INDEX_BLOCK - 1 < hi)
+        hi = first + LINE_INDEX_BLOCK - 1;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi + 1) / 2;
+        if(line_index_get(li, mid) <= value)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Eight bytes at a time, the compiler is free to widen it further.
+size_t line_index_count_newlines(const char* data, size_t len)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    size_t cnt = 0;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        word ^= ones * '\n';
+        // Exactly the bytes that were newlines get their high bit set.
+        uint64_t hits = ~(((word & low7) + low7) | word | low7);
+        cnt += ((hits >> 7) * ones) >> 56;
+    }
+    for(; i < len; ++i)
+        cnt += data[i] == '\n';
+    return cnt;
+}
+
+size_t line_index_memory(const LineIndex* li)
+{
+    return sizeof(LineIndex) + sizeof(LIBlock) * li->block_cap + sizeof(uint64_t) * li->bit_cap;
+}
+
+void line_index_shrink(LineIndex* li)
+{
+    GEM_ASSERT(li != NULL);
+    size_t words = (li->bit_cnt + 63) / 64;
+    if(li->block_cnt > 0 && li->block_cnt < li->block_cap)
+    {
+        li->block_cap = li->block_cnt;
+        li->blocks = realloc(li->blocks, sizeof(LIBlock) * li->block_cap);
+        GEM_ENSURE(li->blocks != NULL);
+    }
+    if(words > 0 && words < li->bit_cap)
+    {
+        li->bit_cap = words;
+        li->bits = realloc(li->bits, sizeof(uint64_t) * li->bit_cap);
+        GEM_ENSURE(li->bits != NULL);
+    }
+}
+
+static void pack_tail(LineIndex* li)
+{
+    if(li->block_cnt == li->block_cap)
+    {
+        li->block_cap = li->block_cap == 0 ? INITIAL_BLOCKS : li->block_cap * 2;
+        li->blocks = realloc(li->blocks, sizeof(LIBlock) * li->block_cap);
+        GEM_ENSURE(li->blocks != NULL);
+    }
+
+    uint64_t anchor = li->tail[0];
+    uint64_t max_delta = li->tail[LINE_INDEX_BLOCK - 1] - anchor;
+    unsigned width = 0;
+    while(width < 64 && (max_delta >> width) != 0)
+        width++;
+
+    size_t needed = (li->bit_cnt + (uint64_t)(LINE_INDEX_BLOCK - 1) * width + 63) / 64;
+    if(needed > li->bit_cap)
+    {
+        li->bit_cap = needed * 2;
+        li->bits = realloc(li->bits, sizeof(uint64_t) * li->bit_cap);
+        GEM_ENSURE(li->bits != NULL);
+    }
+
+    LIBlock* block = li->blocks + li->block_cnt++;
+    block->anchor = anchor;
+    block->packed = (uint64_t)li->bit_cnt << 7 | width;
+    for(size_t j = 1; j < LINE_INDEX_BLOCK; ++j)
+    {
+        uint64_t delta = li->tail[j] - anchor;
+        size_t pos = li->bit_cnt;
+        uint64_t* word = li->bits + (pos >> 6);
+        unsigned shift = pos & 63;
+        if(shift == 0)
+            word[0] = 0;
+        word[0] |= delta << shift;
+        if(shift + width > 64)
+            word[1] = delta >> (64 - shift);
+        li->bit_cnt += width;
+    }
+}
+
+static uint64_t block_anchor(const LineIndex* li, size_t b)
+{
+    return b == li->block_cnt ? li->tail[0] : li->blocks[b].anchor;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINE_INDEX_BLOCK_SHIFT 6
+#define LINE_INDEX_BLOCK       (1 << LINE_INDEX_BLOCK_SHIFT)
+
+typedef struct LIBlock   LIBlock;
+typedef struct LineIndex LineIndex;
+
+struct LIBlock
+{
+    uint64_t anchor; /* First line start in the block */
+    uint64_t packed; /* Bit offset of the block's deltas << 7 | their width */
+};
+
+// Append only, strictly increasing line starts. Full blocks store each entry
+// as a fixed width delta from the block's anchor, using only as many bits as
+// the block's largest delta needs, so lookups stay O(1) while short lines take
+// one or two bytes each instead of eight. The last partial block is kept
+// unpacked until it fills up.
+struct LineIndex
+{
+    LIBlock*  blocks;
+    uint64_t* bits;
+    size_t    block_cnt;
+    size_t    block_cap;
+    size_t    bit_cnt;
+    size_t    bit_cap;   /* In words */
+    size_t    size;
+    uint64_t  tail[LINE_INDEX_BLOCK];
+};
+
+void   line_index_init(LineIndex* li);
+void   line_index_free(LineIndex* li);
+void   line_index_append(LineIndex* li, uint64_t value);
+// Moves other's entries onto the end of li, leaving other empty but still to
+// be freed. li must hold a multiple of LINE_INDEX_BLOCK entries unless other
+// is empty.
+void   line_index_concat(LineIndex* li, LineIndex* other);
+// Largest i in [lo, hi] whose line start is <= value, lo's must be.
+size_t line_index_rank(const LineIndex* li, uint64_t value, size_t lo, size_t hi);
+size_t line_index_memory(const LineIndex* li);
+size_t line_index_count_newlines(const char* data, size_t len);
+// Gives back the room kept for growth, for indexes that are done growing.
+void   line_index_shrink(LineIndex* li);
+
+static inline uint64_t line_index_get(const LineIndex* li, size_t i)
+{
+    size_t b = i >> LINE_INDEX_BLOCK_SHIFT;
+    size_t j = i & (LINE_INDEX_BLOCK - 1);
+    if(b == li->block_cnt)
+        return li->tail[j];
+
+    const LIBlock* block = li->blocks + b;
+    unsigned width = block->packed & 0x7f;
+    if(j == 0 || width == 0)
+        return block->anchor;
+
+    // Entry 0 is the anchor itself and isn't stored.
+    uint64_t pos = (block->packed >> 7) + (uint64_t)(j - 1) * width;
+    const uint64_t* word = li->bits + (pos >> 6);
+    unsigned shift = pos & 63;
+    uint64_t delta = word[0] >> shift;
+    if(shift + width > 64)
+        delta |= word[1] << (64 - shift);
+    if(width < 64)
+        delta &= ((uint64_t)1 << width) - 1;
+    return block->anchor + delta;
+}
+
+static inline uint64_t line_index_last(const LineIndex* li)
+{
+    return line_index_get(li, li->size - 1);
+}
@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L
+#include "pagecache.h"
+#include "core/core.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGE_NONE     SIZE_MAX
+#define INITIAL_PAGES (1 << 6)
+
+static size_t page_at_offset(const PageCache* pc, size_t offset);
+static size_t page_of_newline(const PageCache* pc, size_t nl);
+static void   load_page(PageCache* pc, size_t idx);
+static void   evict_pages(PageCache* pc);
+static void   lru_unlink(PageCache* pc, size_t idx);
+static void   lru_push(PageCache* pc, size_t idx);
+static void   touch(PageCache* pc, size_t idx);
+
+static size_t s_budget = PAGE_CACHE_DEFAULT_BUDGET;
+
+void page_cache_set_budget(size_t budget)
+{
+    s_budget = budget;
+}
+
+size_t page_cache_get_budget(void)
+{
+    return s_budget;
+}
+
+void page_cache_init(PageCache* pc, int fd)
+{
+    GEM_ASSERT(pc != NULL);
+    memset(pc, 0, sizeof(PageCache));
+    pc->fd = fd;
+    pc->page_cap = INITIAL_PAGES;
+    pc->pages = malloc(sizeof(PTPage) * pc->page_cap);
+    GEM_ENSURE(pc->pages != NULL);
+    pc->lru_head = pc->lru_tail = PAGE_NONE;
+}
+
+void page_cache_free(PageCache* pc)
+{
+    for(size_t i = 0; i < pc->page_cnt; ++i)
+    {
+        free(pc->pages[i].data);
+        free(pc->pages[i].line_starts);
+    }
+    free(pc->pages);
+    if(pc->fd >= 0)
+        close(pc->fd);
+}
+
+void page_cache_append(PageCache* pc, char* data, size_t len, uint32_t* line_starts, size_t nl_cnt)
+{
+    GEM_ASSERT(pc != NULL);
+    GEM_ASSERT(data != NULL && len > 0);
+    if(pc->page_cnt == pc->page_cap)
+    {
+        pc->page_cap *= 2;
+        pc->pages = realloc(pc->pages, sizeof(PTPage) * pc->page_cap);
+        GEM_ENSURE(pc->pages != NULL);
+    }
+
+    size_t idx = pc->page_cnt++;
+    PTPage* page = pc->pages + idx;
+    PTPage* prev = idx > 0 ? page - 1 : NULL;
+    page->offset = pc->size;
+    page->length = len;
+    page->nl_before = prev != NULL ? prev->nl_before + prev->nl_cnt : 0;
+    page->nl_cnt = nl_cnt;
+    page->last_line_start = nl_cnt > 0 ? page->offset + line_starts[nl_cnt - 1] :
+                            prev != NULL ? prev->last_line_start : 0;
+    page->data = data;
+    page->line_starts = line_starts;
+    pc->size += len;
+
+    pc->resident += len + sizeof(uint32_t) * nl_cnt;
+    pc->loaded_cnt++;
+    lru_push(pc, idx);
+    evict_pages(pc);
+}
+
+const char* page_cache_get(PageCache* pc, size_t offset, size_t* page_remaining)
+{
+    GEM_ASSERT(pc != NULL);
+    GEM_ASSERT(offset < pc->size);
+    size_t idx = page_at_offset(pc, offset);
+    touch(pc, idx);
+    const PTPage* page = pc->pages + idx;
+    if(page_remaining != NULL)
+        *page_remaining = page->offset + page->length - offset;
+    return page->data + offset - page->offset;
+}
+
+size_t page_cache_line_start(PageCache* pc, size_t line)
+{
+    GEM_ASSERT(pc != NULL);
+    if(line == 0)
+        return 0;
+
+    // Line n starts after newline n - 1. Pieces mostly begin at a page
+    // boundary, in a line that started after the last newline of an earlier
+    // page, and that one is known without loading anything.
+    size_t nl = line - 1;
+    size_t idx = page_of_newline(pc, nl);
+    const PTPage* page = pc->pages + idx;
+    if(nl == page->nl_before + page->nl_cnt - 1)
+        return page->last_line_start;
+
+    touch(pc, idx);
+    return page->offset + page->line_starts[nl - page->nl_before];
+}
+
+static size_t page_at_offset(const PageCache* pc, size_t offset)
+{
+    size_t lo = 0;
+    size_t hi = pc->page_cnt - 1;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi + 1) / 2;
+        if(pc->pages[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// First page whose newlines reach past nl, pages without any are never it.
+static size_t page_of_newline(const PageCache* pc, size_t nl)
+{
+    size_t lo = 0;
+    size_t hi = pc->page_cnt - 1;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(pc->pages[mid].nl_before + pc->pages[mid].nl_cnt > nl)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    GEM_ASSERT(pc->pages[lo].nl_before + pc->pages[lo].nl_cnt > nl);
+    return lo;
+}
+
+static void load_page(PageCache* pc, size_t idx)
+{
+    PTPage* page = pc->pages + idx;
+    page->data = malloc(page->length);
+    page->line_starts = malloc(sizeof(uint32_t) * (page->nl_cnt > 0 ? page->nl_cnt : 1));
+    GEM_ENSURE(page->data != NULL && page->line_starts != NULL);
+
+    size_t got = 0;
+    while(got < page->length)
+    {
+        ssize_t res = pread(pc->fd, page->data + got, page->length - got, page->offset + got);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res <= 0)
+            break;
+        got += res;
+    }
+
+    size_t cnt = 0;
+    const char* end = page->data + got;
+    for(const char* nl = page->data; cnt <= page->nl_cnt &&
+        (nl = memchr(nl, '\n', end - nl)) != NULL; nl++)
+    {
+        if(cnt < page->nl_cnt)
+            page->line_starts[cnt] = nl - page->data + 1;
+        cnt++;
+    }
+
+    if(got != page->length || cnt != page->nl_cnt ||
+       (cnt > 0 && page->offset + page->line_starts[cnt - 1] != page->last_line_start))
+    {
+        // The file was changed in place underneath us. The page is replaced
+        // with blanks laid out like the original so the tree stays consistent,
+        // and the cache is marked stale so its buffer is reloaded or at least
+        // never saved like this.
+        fprintf(stderr, "File changed while open, part of it can't be read back (offset %zu).\n",
+                page->offset);
+        pc->stale = true;
+        memset(page->data, ' ', page->length);
+        size_t last = page->last_line_start - page->offset;
+        for(size_t i = 0; i < page->nl_cnt; ++i)
+        {
+            size_t pos = last - page->nl_cnt + i;
+            page->data[pos] = '\n';
+            page->line_starts[i] = pos + 1;
+        }
+    }
+
+    pc->resident += page->length + sizeof(uint32_t) * page->nl_cnt;
+    pc->loaded_cnt++;
+    pc->loads++;
+}
+
+static void evict_pages(PageCache* pc)
+{
+    while(pc->resident > s_budget && pc->loaded_cnt > PAGE_CACHE_MIN_PAGES)
+    {
+        size_t idx = pc->lru_tail;
+        PTPage* page = pc->pages + idx;
+        lru_unlink(pc, idx);
+#ifdef GEM_DEBUG
+        memset(page->data, 0xDD, page->length);
+#endif // GEM_DEBUG
+        free(page->data);
+        free(page->line_starts);
+        page->data = NULL;
+        page->line_starts = NULL;
+        pc->resident -= page->length + sizeof(uint32_t) * page->nl_cnt;
+        pc->loaded_cnt--;
+        pc->evictions++;
+    }
+}
+
+static void lru_unlink(PageCache* pc, size_t idx)
+{
+    PTPage* page = pc->pages + idx;
+    if(page->lru_prev != PAGE_NONE)
+        pc->pages[page->lru_prev].lru_next = page->lru_next;
+    else
+        pc->lru_head = page->lru_next;
+    if(page->lru_next != PAGE_NONE)
+        pc->pages[page->lru_next].lru_prev = page->lru_prev;
+    else
+        pc->lru_tail = page->lru_prev;
+}
+
+static void lru_push(PageCache* pc, size_t idx)
+{
+    PTPage* page = pc->pages + idx;
+    page->lru_prev = PAGE_NONE;
+    page->lru_next = pc->lru_head;
+    if(pc->lru_head != PAGE_NONE)
+        pc->pages[pc->lru_head].lru_prev = idx;
+    else
+        pc->lru_tail = idx;
+    pc->lru_head = idx;
+}
+
+static void touch(PageCache* pc, size_t idx)
+{
+    if(pc->pages[idx].data == NULL)
+    {
+        load_page(pc, idx);
+        lru_push(pc, idx);
+        evict_pages(pc);
+    }
+    else if(pc->lru_head != idx)
+    {
+        lru_unlink(pc, idx);
+        lru_push(pc, idx);
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_CACHE_DEFAULT_BUDGET (1ull << 30) // 1GiB
+#define PAGE_CACHE_MIN_PAGES      4
+
+typedef struct PTPage    PTPage;
+typedef struct PageCache PageCache;
+
+struct PTPage
+{
+    // Always resident
+    size_t    offset;          /* Where the page starts in the file */
+    size_t    length;
+    size_t    nl_before;       /* Newlines in all earlier pages */
+    size_t    nl_cnt;
+    size_t    last_line_start; /* Offset after the page's last newline */
+
+    // Only while loaded
+    char*     data;
+    uint32_t* line_starts;     /* Page relative offsets after each newline */
+    size_t    lru_prev;
+    size_t    lru_next;
+};
+
+// Backs a piece tree's original buffer for files too big to keep in memory.
+// Pages are read back in with pread when touched, and the least recently used
+// ones are dropped once the loaded pages go over the budget. The budget is
+// shared by every cache but applies to each of them separately.
+struct PageCache
+{
+    int     fd;
+    PTPage* pages;
+    size_t  page_cnt;
+    size_t  page_cap;
+    size_t  size;
+    size_t  resident;   /* Bytes of page data and line starts currently loaded */
+    size_t  loaded_cnt;
+    size_t  lru_head;   /* Most recently used */
+    size_t  lru_tail;
+    size_t  loads;
+    size_t  evictions;
+    bool    stale;      /* A page didn't read back the same, the file changed underneath */
+};
+
+void   page_cache_set_budget(size_t budget);
+size_t page_cache_get_budget(void);
+
+// Takes ownership of fd.
+void page_cache_init(PageCache* pc, int fd);
+void page_cache_free(PageCache* pc);
+// Adds the next page of the file, taking ownership of data and line_starts
+// which become its loaded contents.
+void page_cache_append(PageCache* pc, char* data, size_t len, uint32_t* line_starts, size_t nl_cnt);
+
+// Returns the byte at offset, the rest of its page follows it in memory.
+// Only the PAGE_CACHE_MIN_PAGES most recently touched pages are safe from
+// eviction, so the pointer survives touching at most PAGE_CACHE_MIN_PAGES - 1
+// other pages, through either call below. Debug builds scribble over evicted
+// pages so holding on longer shows up.
+const char* page_cache_get(PageCache* pc, size_t offset, size_t* page_remaining);
+size_t      page_cache_line_start(PageCache* pc, size_t line);
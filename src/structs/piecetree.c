@@ -1,16 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
 #include "piecetree.h"
 #include "da.h"
+#include "serial.h"
 #include "core/core.h"
+#include "core/parallel.h"
 
 #include <string.h>
 
 #define PT_INVALID        UINT64_MAX
 #define INITIAL_STORAGE   (1 << 7)
 #define INITIAL_ADDED_CAP (1 << 12)
-#define INITIAL_LINE_CAP  (1 << 6)
+
+#define PARALLEL_INDEX_MIN (1ull << 26) // Originals smaller than this are indexed on the calling thread
+#define INDEX_SLICE_MIN    (1ull << 24)
 
 #ifdef GEM_PT_VALIDATE
-static void validate_tree(const PieceTree* pt);
+static void validate_tree(PieceTree* pt);
+static void validate_original_index(PieceTree* pt);
     #define PT_VALIDATE(pt) { validate_tree(pt); }
 #else
     #define PT_VALIDATE(pt)
@@ -30,11 +36,13 @@ static void    fix_insert(PieceTree* pt, PTNode* node);
 static void    left_rotate(PieceTree* pt, PTNode* node);
 static void    right_rotate(PieceTree* pt, PTNode* node);
 static void    delete_node(PieceTree* pt, PTNode* node);
-static void    bubble_meta_changes(PieceTree* pt, PTNode* node, PTNode* stop, int64_t size_delta, int64_t newln_delta);
+static void    bubble_meta_changes(PieceTree* pt, PTNode* node, PTNode* stop, int64_t size_delta,
+                                   int64_t newln_delta, int64_t char_delta);
 static PTNode* create_node_and_append(PieceTree* pt, const char* str, size_t len);
+static void    append_original_node(PieceTree* pt, size_t len, size_t line_cnt, size_t char_cnt);
 
 static PTNode*   node_at_offset(PieceTree* pt, size_t offset, size_t* node_start_offset, bool tail);
-static BufferPos position_in_buffer(const PieceTree* pt, PTNode* node, size_t offset);
+static BufferPos position_in_buffer(PieceTree* pt, PTNode* node, size_t offset);
 static PTNode*   next(PieceTree* pt, PTNode* node);
 static PTNode*   left_test(const PTNode* node);
 static PTNode*   right_test(const PTNode* node);
@@ -47,6 +55,36 @@ static inline void   mark_free(PieceTree* pt, size_t start);
 static inline bool   is_valid_node(const PieceTree* pt, const PTNode* node);
 static inline size_t node_id(const PieceTree* pt, const PTNode* node);
 static inline PTNode node_default(void);
+static inline size_t orig_line_start(PieceTree* pt, size_t line);
+static inline size_t line_start(PieceTree* pt, const PTNode* node, size_t line);
+
+static size_t      char_index_append(PTCharIndex* ci, const char* data, size_t offset, size_t len);
+static const char* buf_bytes(PieceTree* pt, bool original, size_t offset, size_t* avail);
+static size_t      buf_char_rank(PieceTree* pt, bool original, size_t offset);
+static size_t      buf_char_select(PieceTree* pt, bool original, size_t char_idx);
+static size_t      node_chars(PieceTree* pt, const PTNode* node);
+static size_t      fill_char_counts(PieceTree* pt, PTNode* node);
+static size_t      count_chars(const char* data, size_t len);
+
+typedef struct IndexSlice IndexSlice;
+struct IndexSlice
+{
+    const char* data;
+    size_t      base;     // Offset of data in the original buffer
+    size_t      len;
+    size_t      first;    // Index of the slice's first line start
+    size_t      nl_cnt;
+    size_t      char_cnt;
+    uint64_t    chars_before;
+    uint64_t*   char_marks; // The whole original's, each slice fills in its own
+    size_t      head_cnt;
+    uint64_t    head[LINE_INDEX_BLOCK]; // Line starts before first's block boundary
+    LineIndex   rest;     // Everything after, block aligned with the whole index
+};
+
+static void   index_original(PieceTree* pt);
+static void*  count_slice(void* arg);
+static void*  fill_slice(void* arg);
 
 static PTNode s_Sentinel = {
     .left     = &s_Sentinel,
@@ -69,8 +107,9 @@ void piece_tree_init(PieceTree* pt, const char* original_src, size_t size, bool
     // TODO: Replace the 0 initial capacities with something more reasonable
     // to start with.
     da_init(&pt->added, INITIAL_ADDED_CAP);
-    da_init(&pt->added.line_starts, INITIAL_LINE_CAP);
-    da_append(&pt->added.line_starts, 0);
+    line_index_init(&pt->added.line_starts);
+    line_index_append(&pt->added.line_starts, 0);
+    line_index_init(&pt->original.line_starts);
     pt->size = size;
     pt->original.size = size;
     pt->line_cnt = 1;
@@ -93,32 +132,23 @@ void piece_tree_init(PieceTree* pt, const char* original_src, size_t size, bool
 
     mark_free(pt, 1);
 
-    for(size_t i = 0; i < size; ++i)
-        if(pt->original.data[i] == '\n')
-            pt->line_cnt++;
-
-    pt->original.line_cnt = pt->line_cnt;
-    pt->original.line_starts = malloc(sizeof(size_t) * pt->original.line_cnt);
-    GEM_ENSURE(pt->original.line_starts != NULL);
-    size_t* ls = (size_t*)pt->original.line_starts;
-    *ls = 0;
-    ls++;
-    for(size_t i = 0; i < size; ++i)
-        if(pt->original.data[i] == '\n')
-        {
-            *ls = i + 1;
-            ls++;
-        }
+    LineIndex* ls = &pt->original.line_starts;
+    index_original(pt);
+    line_index_shrink(ls);
+
+    pt->line_cnt = ls->size;
+    pt->original.line_cnt = ls->size;
 
     pt->root = (PTNode*)pt->storage.nodes;
     *(pt->root) = node_default();
 
     pt->root->end.line     = pt->line_cnt - 1;
-    pt->root->end.column   = size - pt->original.line_starts[pt->line_cnt - 1];
+    pt->root->end.column   = size - line_index_last(ls);
     pt->root->length       = size;
     pt->root->is_original  = true;
     pt->root->is_black     = true;
     pt->root->nl_cnt       = pt->line_cnt - 1;
+    pt->root->char_cnt     = pt->original.chars.total;
 
     pt->storage.nodes[0].next = PT_INVALID;
     pt->storage.nodes[0].free = false;
@@ -126,14 +156,75 @@ void piece_tree_init(PieceTree* pt, const char* original_src, size_t size, bool
     PT_VALIDATE(pt);
 }
 
+void piece_tree_init_stream(PieceTree* pt, const char* original_src)
+{
+    GEM_ASSERT(original_src != NULL);
+    piece_tree_init(pt, NULL, 0, false);
+    pt->original.data = original_src;
+    line_index_append(&pt->original.line_starts, 0);
+    pt->original.line_cnt = 1;
+}
+
+void piece_tree_append_original(PieceTree* pt, size_t len, const uint32_t* line_starts, size_t line_cnt)
+{
+    GEM_ASSERT(pt != NULL);
+    GEM_ASSERT(pt->original.data != NULL && pt->original.line_cnt > 0);
+    if(len == 0)
+        return;
+
+    PTOrigBuffer* orig = &pt->original;
+    for(size_t i = 0; i < line_cnt; ++i)
+        line_index_append(&orig->line_starts, orig->size + line_starts[i]);
+    size_t chars = char_index_append(&orig->chars, orig->data + orig->size, orig->size, len);
+    append_original_node(pt, len, line_cnt, chars);
+}
+
+void piece_tree_end_stream(PieceTree* pt)
+{
+    GEM_ASSERT(pt != NULL);
+    line_index_shrink(&pt->original.line_starts);
+}
+
+void piece_tree_init_paged(PieceTree* pt, int fd)
+{
+    piece_tree_init(pt, NULL, 0, false);
+    pt->original.pages = malloc(sizeof(PageCache));
+    GEM_ENSURE(pt->original.pages != NULL);
+    page_cache_init(pt->original.pages, fd);
+    pt->original.line_cnt = 1;
+}
+
+void piece_tree_append_page(PieceTree* pt, char* data, size_t len, uint32_t* line_starts, size_t line_cnt)
+{
+    GEM_ASSERT(pt != NULL);
+    GEM_ASSERT(piece_tree_is_paged(pt));
+    if(len == 0)
+    {
+        free(data);
+        free(line_starts);
+        return;
+    }
+
+    size_t chars = char_index_append(&pt->original.chars, data, pt->original.size, len);
+    page_cache_append(pt->original.pages, data, len, line_starts, line_cnt);
+    append_original_node(pt, len, line_cnt, chars);
+}
+
 void piece_tree_free(PieceTree* pt)
 {
+    if(pt->original.pages != NULL)
+    {
+        page_cache_free(pt->original.pages);
+        free(pt->original.pages);
+    }
     free(pt->storage.nodes);
     free((void*)pt->original.data);
-    free((void*)pt->original.line_starts);
+    line_index_free(&pt->original.line_starts);
+    da_free_data(&pt->original.chars);
 
     da_free_data(&pt->added);
-    da_free_data(&pt->added.line_starts);
+    line_index_free(&pt->added.line_starts);
+    da_free_data(&pt->added.chars);
 }
 
 void piece_tree_insert(PieceTree* pt, const char* data, size_t len, size_t offset)
@@ -165,23 +256,24 @@ void piece_tree_insert_repeat(PieceTree* pt, const char* data, size_t len,
     *new = node_default();
     new->length = len * rep_count;
 
-    PTPosDA* ls = &pt->added.line_starts;
+    LineIndex* ls = &pt->added.line_starts;
     new->start.line = ls->size - 1;
-    new->start.column = pt->added.size - ls->data[ls->size - 1];
+    new->start.column = pt->added.size - line_index_last(ls);
 
     for(size_t i = 0; i < rep_count; ++i)
     {
         for(size_t j = 0; j < len; ++j)
-            if(data[i] == '\n')
+            if(data[j] == '\n')
             {
-                da_append(ls, pt->added.size + i + 1);
+                line_index_append(ls, pt->added.size + j + 1);
                 new->nl_cnt++;
             }
 
         da_append_arr(&pt->added, data, len);
+        new->char_cnt += char_index_append(&pt->added.chars, data, pt->added.size - len, len);
     }
     new->end.line = ls->size - 1;
-    new->end.column = pt->added.size - ls->data[ls->size - 1];
+    new->end.column = pt->added.size - line_index_last(ls);
     
     pt->size += new->length;
     pt->line_cnt += new->nl_cnt;
@@ -219,9 +311,12 @@ void piece_tree_delete(PieceTree* pt, size_t offset, size_t count)
             }
             start->start = position_in_buffer(pt, start, offset + count - start_offset);
             size_t prev_nl_cnt = start->nl_cnt;
+            size_t prev_char_cnt = start->char_cnt;
             start->nl_cnt = start->end.line - start->start.line;
             start->length -= count;
-            bubble_meta_changes(pt, start, pt->root, -count, start->nl_cnt - prev_nl_cnt);
+            start->char_cnt = node_chars(pt, start);
+            bubble_meta_changes(pt, start, pt->root, -count, start->nl_cnt - prev_nl_cnt,
+                                start->char_cnt - prev_char_cnt);
             pt->size -= count;
             pt->line_cnt -= prev_nl_cnt - start->nl_cnt;
             PT_VALIDATE(pt);
@@ -232,9 +327,12 @@ void piece_tree_delete(PieceTree* pt, size_t offset, size_t count)
         {
             start->end = position_in_buffer(pt, start, offset - start_offset);
             size_t prev_nl_cnt = start->nl_cnt;
+            size_t prev_char_cnt = start->char_cnt;
             start->nl_cnt = start->end.line - start->start.line;
             start->length -= count;
-            bubble_meta_changes(pt, start, pt->root, -count, start->nl_cnt - prev_nl_cnt);
+            start->char_cnt = node_chars(pt, start);
+            bubble_meta_changes(pt, start, pt->root, -count, start->nl_cnt - prev_nl_cnt,
+                                start->char_cnt - prev_char_cnt);
             pt->size -= count;
             pt->line_cnt -= prev_nl_cnt - start->nl_cnt;
             PT_VALIDATE(pt);
@@ -242,6 +340,7 @@ void piece_tree_delete(PieceTree* pt, size_t offset, size_t count)
         }
 
         size_t prev_nl_cnt = start->nl_cnt;
+        size_t prev_char_cnt = start->char_cnt;
         PTNode* split = split_node(pt, start, offset - start_offset, 
                                    start_offset + start->length - offset - count);
         if(start->right == SENTINEL) 
@@ -256,15 +355,18 @@ void piece_tree_delete(PieceTree* pt, size_t offset, size_t count)
             {
                 leftmost->left_size += split->length;
                 leftmost->left_nl_cnt += split->nl_cnt;
+                leftmost->left_char_cnt += split->char_cnt;
                 leftmost = leftmost->left;
             }
             leftmost->left = split;
             leftmost->left_size = split->length;
             leftmost->left_nl_cnt = split->nl_cnt;
+            leftmost->left_char_cnt = split->char_cnt;
             split->parent = leftmost;
         }
         int64_t nl_delta = start->nl_cnt + split->nl_cnt - prev_nl_cnt;
-        bubble_meta_changes(pt, start, pt->root, -count, nl_delta);
+        int64_t char_delta = start->char_cnt + split->char_cnt - prev_char_cnt;
+        bubble_meta_changes(pt, start, pt->root, -count, nl_delta, char_delta);
         fix_insert(pt, split);
         pt->size -= count;
         pt->line_cnt += nl_delta;
@@ -283,24 +385,31 @@ void piece_tree_delete(PieceTree* pt, size_t offset, size_t count)
 
     size_t prev_length;
     size_t prev_nl_cnt;
+    size_t prev_char_cnt;
 
     // TODO: Separate these into functions like delete_head and delete_tail
     prev_length = start->length;
     prev_nl_cnt = start->nl_cnt;
+    prev_char_cnt = start->char_cnt;
     start->end = position_in_buffer(pt, start, offset - start_offset);
     start->nl_cnt = start->end.line - start->start.line;
     start->length = offset - start_offset;
-    bubble_meta_changes(pt, start, pt->root, start->length - prev_length, start->nl_cnt - prev_nl_cnt);
+    start->char_cnt = start->length == 0 ? 0 : node_chars(pt, start);
+    bubble_meta_changes(pt, start, pt->root, start->length - prev_length, start->nl_cnt - prev_nl_cnt,
+                        start->char_cnt - prev_char_cnt);
     pt->line_cnt -= prev_nl_cnt - start->nl_cnt;
     if(start->length == 0)
         da_append(&nodes_to_del, start);
 
     prev_length = end->length;
     prev_nl_cnt = end->nl_cnt;
+    prev_char_cnt = end->char_cnt;
     end->start = position_in_buffer(pt, end, offset + count - end_offset);
     end->nl_cnt = end->end.line - end->start.line;
     end->length -= offset + count - end_offset;
-    bubble_meta_changes(pt, end, pt->root, end->length - prev_length, end->nl_cnt - prev_nl_cnt);
+    end->char_cnt = end->length == 0 ? 0 : node_chars(pt, end);
+    bubble_meta_changes(pt, end, pt->root, end->length - prev_length, end->nl_cnt - prev_nl_cnt,
+                        end->char_cnt - prev_char_cnt);
     pt->line_cnt -= prev_nl_cnt - end->nl_cnt;
     if(end->length == 0)
         da_append(&nodes_to_del, end);
@@ -330,7 +439,7 @@ const PTNode* piece_tree_node_at(const PieceTree* pt, size_t offset, size_t* nod
     return node_at_offset((PieceTree*)pt, offset, node_start_offset, false);
 }
 
-const PTNode* piece_tree_node_at_line(const PieceTree* pt, size_t line, size_t* node_offset)
+const PTNode* piece_tree_node_at_line(PieceTree* pt, size_t line, size_t* node_offset)
 {
     GEM_ASSERT(pt != NULL);
     GEM_ASSERT(node_offset != NULL);
@@ -347,22 +456,18 @@ const PTNode* piece_tree_node_at_line(const PieceTree* pt, size_t line, size_t*
             node = node->left;
         else if(line < node->left_nl_cnt + node->nl_cnt)
         {
-            const size_t* ls = node->is_original ?
-                                pt->original.line_starts :
-                                pt->added.line_starts.data;
             line += node->start.line - node->left_nl_cnt;
-            *node_offset = ls[line] - ls[node->start.line] - node->start.column;
+            *node_offset = line_start(pt, node, line) - line_start(pt, node, node->start.line) -
+                           node->start.column;
             return node;
         }
         else if(line == node->left_nl_cnt + node->nl_cnt)
         {
-            const size_t* ls = node->is_original ?
-                                pt->original.line_starts :
-                                pt->added.line_starts.data;
-            const char* buf = piece_tree_get_node_start(pt, node);
-            if(buf[node->length - 1] == '\n')
+            // The node's last line only starts in it if there is anything
+            // after its last newline.
+            if(node->end.column == 0)
                 return piece_tree_next_inorder(pt, node);
-            *node_offset = ls[node->end.line] - ls[node->start.line] - node->start.column;
+            *node_offset = node->length - node->end.column;
             return node;
         }
         else
@@ -408,17 +513,32 @@ const PTNode* piece_tree_prev_inorder(const PieceTree* pt, const PTNode* node)
     return NULL;
 }
 
-const char* piece_tree_get_node_start(const PieceTree* pt, const PTNode* node)
+const char* piece_tree_get_node_start(PieceTree* pt, const PTNode* node)
 {
     GEM_ASSERT(pt != NULL);
     GEM_ASSERT(node != SENTINEL);
     GEM_ASSERT(is_valid_node(pt, node));
+    if(node->is_original && piece_tree_is_paged(pt))
+    {
+        size_t remaining;
+        const char* res = page_cache_get(pt->original.pages, piece_tree_get_node_buf_offset(pt, node),
+                                         &remaining);
+        GEM_ASSERT(remaining >= node->length);
+        return res;
+    }
     if(node->is_original)
-        return pt->original.data + pt->original.line_starts[node->start.line] + node->start.column;
-    return pt->added.data + pt->added.line_starts.data[node->start.line] + node->start.column;
+        return pt->original.data + line_index_get(&pt->original.line_starts, node->start.line) + node->start.column;
+    return pt->added.data + line_index_get(&pt->added.line_starts, node->start.line) + node->start.column;
+}
+
+size_t piece_tree_get_node_buf_offset(PieceTree* pt, const PTNode* node)
+{
+    GEM_ASSERT(pt != NULL);
+    GEM_ASSERT(is_valid_node(pt, node));
+    return line_start(pt, node, node->start.line) + node->start.column;
 }
 
-size_t piece_tree_get_line_length(const PieceTree* pt, size_t line_num)
+size_t piece_tree_get_line_length(PieceTree* pt, size_t line_num)
 {
     GEM_ASSERT(pt != NULL);
     GEM_ASSERT(line_num < pt->line_cnt);
@@ -428,7 +548,7 @@ size_t piece_tree_get_line_length(const PieceTree* pt, size_t line_num)
     return piece_tree_get_offset(pt, line_num + 1, 0) - piece_tree_get_offset(pt, line_num, 0) - 1;
 }
 
-size_t piece_tree_get_offset(const PieceTree* pt, size_t line, size_t column)
+size_t piece_tree_get_offset(PieceTree* pt, size_t line, size_t column)
 {
     if(line == 0)
         return column;
@@ -442,11 +562,8 @@ size_t piece_tree_get_offset(const PieceTree* pt, size_t line, size_t column)
         else if(node->left_nl_cnt + node->nl_cnt >= line)
         {
             left_len += node->left_size;
-            const size_t* ls = node->is_original ?
-                                pt->original.line_starts :
-                                pt->added.line_starts.data;
-            
-            return left_len + column + ls[node->start.line + line - node->left_nl_cnt] - ls[node->start.line] - node->start.column;
+            return left_len + column + line_start(pt, node, node->start.line + line - node->left_nl_cnt) -
+                   line_start(pt, node, node->start.line) - node->start.column;
         }
         else
         {
@@ -459,7 +576,7 @@ size_t piece_tree_get_offset(const PieceTree* pt, size_t line, size_t column)
     return left_len;
 }
 
-BufferPos piece_tree_get_buffer_pos(const PieceTree* pt, size_t offset)
+BufferPos piece_tree_get_buffer_pos(PieceTree* pt, size_t offset)
 {
     GEM_ASSERT(pt != NULL);
     if(offset == pt->size)
@@ -500,7 +617,89 @@ BufferPos piece_tree_get_buffer_pos(const PieceTree* pt, size_t offset)
     return res;
 }
 
-static void print_node_contents(const PieceTree* pt, const PTNode* node)
+size_t piece_tree_chars_before(PieceTree* pt, size_t offset)
+{
+    GEM_ASSERT(pt != NULL);
+    GEM_ASSERT(offset <= pt->size);
+    size_t res = 0;
+    PTNode* node = pt->root;
+    while(node != SENTINEL)
+    {
+        if(offset < node->left_size)
+            node = node->left;
+        else if(offset < node->left_size + node->length)
+        {
+            res += node->left_char_cnt;
+            offset -= node->left_size;
+            if(offset > 0)
+            {
+                size_t start = piece_tree_get_node_buf_offset(pt, node);
+                res += buf_char_rank(pt, node->is_original, start + offset) -
+                       buf_char_rank(pt, node->is_original, start);
+            }
+            return res;
+        }
+        else
+        {
+            res += node->left_char_cnt + node->char_cnt;
+            offset -= node->left_size + node->length;
+            node = node->right;
+        }
+    }
+    return res;
+}
+
+size_t piece_tree_offset_of_char(PieceTree* pt, size_t char_idx)
+{
+    GEM_ASSERT(pt != NULL);
+    if(char_idx == 0)
+        return 0;
+    size_t res = 0;
+    PTNode* node = pt->root;
+    while(node != SENTINEL)
+    {
+        if(char_idx < node->left_char_cnt)
+            node = node->left;
+        else if(char_idx < node->left_char_cnt + node->char_cnt)
+        {
+            size_t start = piece_tree_get_node_buf_offset(pt, node);
+            size_t target = buf_char_rank(pt, node->is_original, start) + char_idx - node->left_char_cnt;
+            return res + node->left_size + buf_char_select(pt, node->is_original, target) - start;
+        }
+        else
+        {
+            char_idx -= node->left_char_cnt + node->char_cnt;
+            res += node->left_size + node->length;
+            node = node->right;
+        }
+    }
+    return res;
+}
+
+size_t piece_tree_get_char_column(PieceTree* pt, size_t line, size_t column)
+{
+    GEM_ASSERT(pt != NULL);
+    size_t line_len = piece_tree_get_line_length(pt, line);
+    size_t start = piece_tree_get_offset(pt, line, 0);
+    if(column > line_len)
+        column = line_len;
+    return piece_tree_chars_before(pt, start + column) - piece_tree_chars_before(pt, start);
+}
+
+size_t piece_tree_get_byte_column(PieceTree* pt, size_t line, size_t char_column)
+{
+    GEM_ASSERT(pt != NULL);
+    if(char_column == 0)
+        return 0;
+    size_t line_len = piece_tree_get_line_length(pt, line);
+    size_t start = piece_tree_get_offset(pt, line, 0);
+    size_t first = piece_tree_chars_before(pt, start);
+    if(first + char_column >= piece_tree_chars_before(pt, start + line_len))
+        return line_len;
+    return piece_tree_offset_of_char(pt, first + char_column) - start;
+}
+
+static void print_node_contents(PieceTree* pt, const PTNode* node)
 {
     GEM_ASSERT(((NodeIntern*)node)->next != PT_INVALID);
     if(!is_valid_node(pt, node))
@@ -513,7 +712,7 @@ static void print_node_contents(const PieceTree* pt, const PTNode* node)
     print_node_contents(pt, node->right);
 }
 
-void piece_tree_print_contents(const PieceTree* pt)
+void piece_tree_print_contents(PieceTree* pt)
 {
     GEM_ASSERT(pt != NULL);
     
@@ -572,6 +771,191 @@ size_t piece_tree_node_id(const PieceTree* pt, const PTNode* node)
     return node_id(pt, node);
 }
 
+enum
+{
+    SNAP_ORIGINAL = 1,
+    SNAP_BLACK    = 2,
+    SNAP_FREE     = 4
+};
+
+// Line indices go out decoded, as an array of 8 byte line starts.
+static void serialize_line_index(const LineIndex* li, StringBuilder* out)
+{
+    serial_put_u64(out, sizeof(uint64_t) * li->size);
+    for(size_t i = 0; i < li->size; ++i)
+        serial_put_u64(out, line_index_get(li, i));
+}
+
+static bool deserialize_line_index(LineIndex* li, const char* data, size_t len)
+{
+    line_index_init(li);
+    for(size_t i = 0; i < len / sizeof(uint64_t); ++i)
+    {
+        uint64_t value;
+        memcpy(&value, data + i * sizeof(uint64_t), sizeof(value));
+        if(li->size > 0 && value <= line_index_last(li))
+            return false;
+        line_index_append(li, value);
+    }
+    return true;
+}
+
+static uint64_t snapshot_index(const PieceTree* pt, const PTNode* node)
+{
+    return node == SENTINEL ? PT_INVALID : node_id(pt, node) - 1;
+}
+
+void piece_tree_serialize(const PieceTree* pt, StringBuilder* out)
+{
+    GEM_ASSERT(pt != NULL);
+    GEM_ASSERT(out != NULL);
+    GEM_ASSERT(!piece_tree_is_paged(pt));
+    const PTStorage* s = &pt->storage;
+    serial_put_u64(out, pt->size);
+    serial_put_u64(out, pt->line_cnt);
+    serial_put_u64(out, pt->original.size);
+    serial_put_u64(out, pt->original.line_cnt);
+    serial_put_u64(out, s->capacity);
+    serial_put_u64(out, s->free_head);
+    serial_put_u64(out, s->free_count);
+    serial_put_u64(out, snapshot_index(pt, pt->root));
+
+    serialize_line_index(&pt->original.line_starts, out);
+    serial_put_bytes(out, pt->added.data, pt->added.size);
+    serialize_line_index(&pt->added.line_starts, out);
+
+    // Links become indices into the node array, which is all that's needed
+    // to rebuild the tree wherever the array ends up.
+    for(size_t i = 0; i < s->capacity; ++i)
+    {
+        const NodeIntern* intern = s->nodes + i;
+        const PTNode* node = &intern->node;
+        uint64_t flags = (node->is_original ? SNAP_ORIGINAL : 0) |
+                         (node->is_black ? SNAP_BLACK : 0) |
+                         (intern->free ? SNAP_FREE : 0);
+        serial_put_u64(out, flags);
+        serial_put_u64(out, intern->next);
+        if(intern->free)
+            continue;
+        serial_put_u64(out, node->start.line);
+        serial_put_u64(out, node->start.column);
+        serial_put_u64(out, node->end.line);
+        serial_put_u64(out, node->end.column);
+        serial_put_u64(out, node->length);
+        serial_put_u64(out, node->nl_cnt);
+        serial_put_u64(out, node->left_size);
+        serial_put_u64(out, node->left_nl_cnt);
+        serial_put_u64(out, snapshot_index(pt, node->left));
+        serial_put_u64(out, snapshot_index(pt, node->right));
+        serial_put_u64(out, snapshot_index(pt, node->parent));
+    }
+}
+
+static PTNode* snapshot_node(PieceTree* pt, uint64_t index, bool* ok)
+{
+    if(index == PT_INVALID)
+        return SENTINEL;
+    if(index >= pt->storage.capacity)
+    {
+        *ok = false;
+        return SENTINEL;
+    }
+    return &pt->storage.nodes[index].node;
+}
+
+bool piece_tree_deserialize(PieceTree* pt, const char* original_src, size_t size, SerialReader* in)
+{
+    GEM_ASSERT(pt != NULL);
+    GEM_ASSERT(in != NULL);
+    PieceTree res;
+    memset(&res, 0, sizeof(PieceTree));
+    res.size = serial_get_u64(in);
+    res.line_cnt = serial_get_u64(in);
+    res.original.size = serial_get_u64(in);
+    res.original.line_cnt = serial_get_u64(in);
+    res.storage.capacity = serial_get_u64(in);
+    res.storage.free_head = serial_get_u64(in);
+    res.storage.free_count = serial_get_u64(in);
+    uint64_t root = serial_get_u64(in);
+
+    size_t orig_ls_len, added_len, added_ls_len;
+    const char* orig_ls = serial_get_bytes(in, &orig_ls_len);
+    const char* added = serial_get_bytes(in, &added_len);
+    const char* added_ls = serial_get_bytes(in, &added_ls_len);
+    if(!in->ok || res.original.size != size || res.storage.capacity == 0 ||
+       res.storage.capacity > (size_t)(in->end - in->ptr) / 16 ||
+       orig_ls_len != sizeof(size_t) * res.original.line_cnt ||
+       added_ls_len == 0 || added_ls_len % sizeof(size_t) != 0)
+        return false;
+
+    res.original.data = size == 0 ? NULL : original_src;
+    da_init(&res.added, added_len > INITIAL_ADDED_CAP ? added_len : INITIAL_ADDED_CAP);
+    if(added_len > 0)
+        memcpy(res.added.data, added, added_len);
+    res.added.size = added_len;
+
+    bool ok = deserialize_line_index(&res.original.line_starts, orig_ls, orig_ls_len) &&
+              deserialize_line_index(&res.added.line_starts, added_ls, added_ls_len);
+
+    res.storage.nodes = malloc(sizeof(NodeIntern) * res.storage.capacity);
+    GEM_ENSURE(res.storage.nodes != NULL);
+
+    for(size_t i = 0; i < res.storage.capacity && ok; ++i)
+    {
+        NodeIntern* intern = res.storage.nodes + i;
+        uint64_t flags = serial_get_u64(in);
+        intern->next = serial_get_u64(in);
+        intern->free = flags & SNAP_FREE;
+        intern->node = node_default();
+        if(intern->free)
+            continue;
+
+        PTNode* node = &intern->node;
+        node->is_original = flags & SNAP_ORIGINAL;
+        node->is_black = flags & SNAP_BLACK;
+        node->start.line = serial_get_u64(in);
+        node->start.column = serial_get_u64(in);
+        node->end.line = serial_get_u64(in);
+        node->end.column = serial_get_u64(in);
+        node->length = serial_get_u64(in);
+        node->nl_cnt = serial_get_u64(in);
+        node->left_size = serial_get_u64(in);
+        node->left_nl_cnt = serial_get_u64(in);
+        node->left = snapshot_node(&res, serial_get_u64(in), &ok);
+        node->right = snapshot_node(&res, serial_get_u64(in), &ok);
+        node->parent = snapshot_node(&res, serial_get_u64(in), &ok);
+
+        // Pieces have to stay inside their buffer, everything else is
+        // trusted to the session checksum.
+        const LineIndex* ls = node->is_original ? &res.original.line_starts : &res.added.line_starts;
+        size_t buf_size = node->is_original ? res.original.size : res.added.size;
+        ok = ok && in->ok && (uint64_t)node->start.line < ls->size &&
+             line_index_get(ls, node->start.line) + node->start.column + node->length <= buf_size;
+    }
+    res.root = snapshot_node(&res, root, &ok);
+
+    if(!ok || !in->ok)
+    {
+        free(res.storage.nodes);
+        line_index_free(&res.original.line_starts);
+        da_free_data(&res.added);
+        line_index_free(&res.added.line_starts);
+        return false;
+    }
+
+    // Codepoint counts aren't part of the snapshot, they're rebuilt from the
+    // buffers themselves.
+    if(size > 0)
+        char_index_append(&res.original.chars, original_src, 0, size);
+    if(added_len > 0)
+        char_index_append(&res.added.chars, res.added.data, 0, added_len);
+    fill_char_counts(&res, res.root);
+
+    *pt = res;
+    PT_VALIDATE(pt);
+    return true;
+}
+
 static void insert_node(PieceTree* pt, PTNode* new, size_t offset)
 {
     PTNode* node;
@@ -593,7 +977,7 @@ static void insert_node(PieceTree* pt, PTNode* new, size_t offset)
         node = left_test(pt->root);
         new->parent = node;
         node->left = new;
-        bubble_meta_changes(pt, new, pt->root, new->length, new->nl_cnt);
+        bubble_meta_changes(pt, new, pt->root, new->length, new->nl_cnt, new->char_cnt);
         fix_insert(pt, new);
         PT_VALIDATE(pt);
         return;
@@ -619,11 +1003,13 @@ static void insert_node(PieceTree* pt, PTNode* new, size_t offset)
             {
                 leftmost->left_size += split->length;
                 leftmost->left_nl_cnt += split->nl_cnt;
+                leftmost->left_char_cnt += split->char_cnt;
                 leftmost = leftmost->left;
             }
             leftmost->left = split;
             leftmost->left_size = split->length;
             leftmost->left_nl_cnt = split->nl_cnt;
+            leftmost->left_char_cnt = split->char_cnt;
             split->parent = leftmost;
         }
         fix_insert(pt, split);
@@ -632,14 +1018,14 @@ static void insert_node(PieceTree* pt, PTNode* new, size_t offset)
         {
             node->right = new;
             new->parent = node;
-            bubble_meta_changes(pt, node, pt->root, new->length, new->nl_cnt);
+            bubble_meta_changes(pt, node, pt->root, new->length, new->nl_cnt, new->char_cnt);
         }
         else
         {
             PTNode* leftmost = left_test(node->right);
             leftmost->left = new;
             new->parent = leftmost;
-            bubble_meta_changes(pt, new, pt->root, new->length, new->nl_cnt);
+            bubble_meta_changes(pt, new, pt->root, new->length, new->nl_cnt, new->char_cnt);
         }
         fix_insert(pt, new);
     }
@@ -649,7 +1035,8 @@ static void insert_node(PieceTree* pt, PTNode* new, size_t offset)
         node->end = new->end;
         node->length += new->length;
         node->nl_cnt += new->nl_cnt;
-        bubble_meta_changes(pt, node, pt->root, new->length, new->nl_cnt);
+        node->char_cnt += new->char_cnt;
+        bubble_meta_changes(pt, node, pt->root, new->length, new->nl_cnt, new->char_cnt);
         free_node(pt, new);
     }
     else // Insert to the right of node
@@ -658,14 +1045,14 @@ static void insert_node(PieceTree* pt, PTNode* new, size_t offset)
         {
             node->right = new;
             new->parent = node;
-            bubble_meta_changes(pt, node, pt->root, new->length, new->nl_cnt);
+            bubble_meta_changes(pt, node, pt->root, new->length, new->nl_cnt, new->char_cnt);
         }
         else
         {
             PTNode* leftmost = left_test(node->right);
             leftmost->left = new;
             new->parent = leftmost;
-            bubble_meta_changes(pt, new, pt->root, new->length, new->nl_cnt);
+            bubble_meta_changes(pt, new, pt->root, new->length, new->nl_cnt, new->char_cnt);
         }
         fix_insert(pt, new);
     }
@@ -684,11 +1071,13 @@ static PTNode* split_node(PieceTree* pt, PTNode* node, size_t left_size, size_t
     split->length = right_size;
     split->nl_cnt = split->end.line - split->start.line;
     split->is_original = node->is_original;
+    split->char_cnt = node_chars(pt, split);
 
 
     node->end = position_in_buffer(pt, node, left_size);
     node->length = left_size;
     node->nl_cnt = node->end.line - node->start.line;
+    node->char_cnt = node_chars(pt, node);
     return split;
 }
 
@@ -743,6 +1132,7 @@ static void left_rotate(PieceTree* pt, PTNode* node)
     PTNode* right = node->right;
     right->left_size += node->left_size + node->length;
     right->left_nl_cnt += node->left_nl_cnt + node->nl_cnt;
+    right->left_char_cnt += node->left_char_cnt + node->char_cnt;
     node->right = right->left;
 
     if(node->right != SENTINEL)
@@ -769,6 +1159,7 @@ static void right_rotate(PieceTree* pt, PTNode* node)
 
     node->left_size -= left->left_size + left->length;
     node->left_nl_cnt -= left->left_nl_cnt + left->nl_cnt;
+    node->left_char_cnt -= left->left_char_cnt + left->char_cnt;
 
     if(pt->root == node)
         pt->root = left;
@@ -820,6 +1211,7 @@ static void delete_node(PieceTree* pt, PTNode* node)
         y->parent->left = x;
         y->parent->left_size -= y->length;
         y->parent->left_nl_cnt -= y->nl_cnt;
+        y->parent->left_char_cnt -= y->char_cnt;
     }
     else
         y->parent->right = x;
@@ -827,7 +1219,7 @@ static void delete_node(PieceTree* pt, PTNode* node)
     if(y == node)
     {
         x->parent = y->parent;
-        bubble_meta_changes(pt, x->parent, pt->root, -y->length, -y->nl_cnt);
+        bubble_meta_changes(pt, x->parent, pt->root, -y->length, -y->nl_cnt, -y->char_cnt);
     }
     else
     {
@@ -836,7 +1228,7 @@ static void delete_node(PieceTree* pt, PTNode* node)
         else
         {
             x->parent = y->parent;
-            bubble_meta_changes(pt, x->parent, node->right, -y->length, -y->nl_cnt);
+            bubble_meta_changes(pt, x->parent, node->right, -y->length, -y->nl_cnt, -y->char_cnt);
         }
 
         
@@ -859,7 +1251,8 @@ static void delete_node(PieceTree* pt, PTNode* node)
 
         y->left_size = node->left_size;
         y->left_nl_cnt = node->left_nl_cnt;
-        bubble_meta_changes(pt, y, pt->root, -node->length, -node->nl_cnt);
+        y->left_char_cnt = node->left_char_cnt;
+        bubble_meta_changes(pt, y, pt->root, -node->length, -node->nl_cnt, -node->char_cnt);
     }
 
     free_node(pt, node);
@@ -947,8 +1340,8 @@ static void delete_node(PieceTree* pt, PTNode* node)
     SENTINEL->parent = SENTINEL;
 }
 
-static void bubble_meta_changes(PieceTree* pt, PTNode* node, PTNode* stop,
-                                int64_t size_delta, int64_t newln_delta)
+static void bubble_meta_changes(PieceTree* pt, PTNode* node, PTNode* stop, int64_t size_delta,
+                                int64_t newln_delta, int64_t char_delta)
 {
     (void)pt; // For release
     GEM_ASSERT(node == SENTINEL || is_valid_node(pt, node));
@@ -958,6 +1351,7 @@ static void bubble_meta_changes(PieceTree* pt, PTNode* node, PTNode* stop,
         {
             node->parent->left_size += size_delta;
             node->parent->left_nl_cnt += newln_delta;
+            node->parent->left_char_cnt += char_delta;
         }
         node = node->parent;
     }
@@ -969,20 +1363,21 @@ static PTNode* create_node_and_append(PieceTree* pt, const char* str, size_t len
     *result = node_default();
     result->length = len;
 
-    PTPosDA* ls = &pt->added.line_starts;
+    LineIndex* ls = &pt->added.line_starts;
     result->start.line = ls->size - 1;
-    result->start.column = pt->added.size - ls->data[ls->size - 1];
+    result->start.column = pt->added.size - line_index_last(ls);
 
     for(size_t i = 0; i < len; ++i)
         if(str[i] == '\n')
         {
-            da_append(ls, pt->added.size + i + 1);
+            line_index_append(ls, pt->added.size + i + 1);
             result->nl_cnt++;
         }
 
     da_append_arr(&pt->added, str, len);
+    result->char_cnt = char_index_append(&pt->added.chars, str, pt->added.size - len, len);
     result->end.line = ls->size - 1;
-    result->end.column = pt->added.size - ls->data[ls->size - 1];
+    result->end.column = pt->added.size - line_index_last(ls);
     
     pt->size += len;
     pt->line_cnt += result->nl_cnt;
@@ -990,6 +1385,31 @@ static PTNode* create_node_and_append(PieceTree* pt, const char* str, size_t len
     return result;
 }
 
+static void append_original_node(PieceTree* pt, size_t len, size_t line_cnt, size_t char_cnt)
+{
+    expand_node_storage(pt, 1);
+
+    PTOrigBuffer* orig = &pt->original;
+    PTNode* new = alloc_node(pt);
+    *new = node_default();
+    new->is_original = true;
+    new->length = len;
+    new->nl_cnt = line_cnt;
+    new->char_cnt = char_cnt;
+    new->start.line = orig->line_cnt - 1;
+    new->start.column = orig->size - orig_line_start(pt, new->start.line);
+
+    orig->line_cnt += line_cnt;
+    orig->size += len;
+    new->end.line = orig->line_cnt - 1;
+    new->end.column = orig->size - orig_line_start(pt, new->end.line);
+
+    size_t offset = pt->size;
+    pt->size += len;
+    pt->line_cnt += line_cnt;
+    insert_node(pt, new, offset);
+}
+
 static PTNode* node_at_offset(PieceTree* pt, size_t offset, size_t* node_start_offset, bool tail)
 {
     GEM_ASSERT(!tail || offset > 0);
@@ -1020,7 +1440,7 @@ static PTNode* node_at_offset(PieceTree* pt, size_t offset, size_t* node_start_o
     return NULL;
 }
 
-static BufferPos position_in_buffer(const PieceTree* pt, PTNode* node, size_t offset)
+static BufferPos position_in_buffer(PieceTree* pt, PTNode* node, size_t offset)
 {
     GEM_ASSERT(is_valid_node(pt, node));
     GEM_ASSERT(offset <= node->length);
@@ -1029,21 +1449,26 @@ static BufferPos position_in_buffer(const PieceTree* pt, PTNode* node, size_t of
     if(offset == node->length)
         return node->end;
 
-    const size_t* ls = node->is_original ? 
-                        pt->original.line_starts : 
-                        pt->added.line_starts.data;
-
-    size_t buf_off = ls[node->start.line] + node->start.column + offset;
+    size_t buf_off = line_start(pt, node, node->start.line) + node->start.column + offset;
     size_t lo = node->start.line;
     size_t hi = node->end.line;
+    if(!node->is_original || !piece_tree_is_paged(pt))
+    {
+        const LineIndex* ls = node->is_original ? &pt->original.line_starts : &pt->added.line_starts;
+        size_t line = line_index_rank(ls, buf_off, lo, hi);
+        return (BufferPos) {
+            .line = line,
+            .column = buf_off - line_index_get(ls, line)
+        };
+    }
 
     size_t mid = (lo + hi) / 2;
 
     while(lo < hi)
     {
-        if(buf_off < ls[mid])
+        if(buf_off < line_start(pt, node, mid))
             hi = mid - 1;
-        else if(buf_off >= ls[mid + 1])
+        else if(buf_off >= line_start(pt, node, mid + 1))
             lo = mid + 1;
         else
             break;
@@ -1053,7 +1478,7 @@ static BufferPos position_in_buffer(const PieceTree* pt, PTNode* node, size_t of
 
     return (BufferPos) {
         .line = mid,
-        .column = buf_off - ls[mid]
+        .column = buf_off - line_start(pt, node, mid)
     };
 }
 
@@ -1157,6 +1582,221 @@ static void expand_node_storage(PieceTree* pt, size_t increase)
     mark_free(pt, new_cap);
 }
 
+static void index_original(PieceTree* pt)
+{
+    LineIndex* ls = &pt->original.line_starts;
+    const char* data = pt->original.data;
+    size_t size = pt->original.size;
+    line_index_append(ls, 0);
+
+    size_t cnt = parallel_slice_cnt(size, INDEX_SLICE_MIN);
+    if(size < PARALLEL_INDEX_MIN || cnt < 2)
+    {
+        const char* end = data + size;
+        for(const char* nl = data; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++)
+            line_index_append(ls, nl - data + 1);
+        char_index_append(&pt->original.chars, data, 0, size);
+        return;
+    }
+
+    // Every slice counts its newlines first, so each knows where its line
+    // starts land in the index and can pack them in place of the others.
+    // Slices start on a stride so their codepoint marks don't overlap.
+    PTCharIndex* ci = &pt->original.chars;
+    da_resize(ci, (size + PT_CHAR_STRIDE - 1) / PT_CHAR_STRIDE);
+    IndexSlice* slices = malloc(sizeof(IndexSlice) * cnt);
+    GEM_ENSURE(slices != NULL);
+    size_t slice_len = size / cnt & ~(size_t)(PT_CHAR_STRIDE - 1);
+    for(size_t i = 0; i < cnt; ++i)
+    {
+        slices[i].base = slice_len * i;
+        slices[i].data = data + slices[i].base;
+        slices[i].len = i + 1 < cnt ? slice_len : size - slices[i].base;
+        slices[i].char_marks = ci->data;
+    }
+    parallel_run(slices, sizeof(IndexSlice), cnt, count_slice);
+
+    size_t first = 1;
+    for(size_t i = 0; i < cnt; ++i)
+    {
+        slices[i].first = first;
+        slices[i].chars_before = ci->total;
+        first += slices[i].nl_cnt;
+        ci->total += slices[i].char_cnt;
+    }
+    parallel_run(slices, sizeof(IndexSlice), cnt, fill_slice);
+
+    for(size_t i = 0; i < cnt; ++i)
+    {
+        for(size_t j = 0; j < slices[i].head_cnt; ++j)
+            line_index_append(ls, slices[i].head[j]);
+        line_index_concat(ls, &slices[i].rest);
+        line_index_free(&slices[i].rest);
+    }
+    free(slices);
+#ifdef GEM_PT_VALIDATE
+    validate_original_index(pt);
+#endif
+}
+
+static void* count_slice(void* arg)
+{
+    IndexSlice* slice = arg;
+    slice->nl_cnt = line_index_count_newlines(slice->data, slice->len);
+
+    // Marks start out relative to the slice until the ones before it are known.
+    slice->char_cnt = 0;
+    for(size_t i = 0; i < slice->len; i += PT_CHAR_STRIDE)
+    {
+        size_t len = slice->len - i < PT_CHAR_STRIDE ? slice->len - i : PT_CHAR_STRIDE;
+        slice->char_marks[(slice->base + i) / PT_CHAR_STRIDE] = slice->char_cnt;
+        slice->char_cnt += count_chars(slice->data + i, len);
+    }
+    return NULL;
+}
+
+static void* fill_slice(void* arg)
+{
+    IndexSlice* slice = arg;
+    size_t aligned = (slice->first + LINE_INDEX_BLOCK - 1) & ~(size_t)(LINE_INDEX_BLOCK - 1);
+    size_t idx = slice->first;
+    slice->head_cnt = 0;
+    line_index_init(&slice->rest);
+
+    const char* end = slice->data + slice->len;
+    for(const char* nl = slice->data; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++, idx++)
+    {
+        uint64_t start = slice->base + (nl - slice->data) + 1;
+        if(idx < aligned)
+            slice->head[slice->head_cnt++] = start;
+        else
+            line_index_append(&slice->rest, start);
+    }
+
+    for(size_t i = 0; i < slice->len; i += PT_CHAR_STRIDE)
+        slice->char_marks[(slice->base + i) / PT_CHAR_STRIDE] += slice->chars_before;
+    return NULL;
+}
+
+// Returns how many codepoints were added.
+static size_t char_index_append(PTCharIndex* ci, const char* data, size_t offset, size_t len)
+{
+    uint64_t before = ci->total;
+    for(size_t i = 0; i < len;)
+    {
+        size_t in_stride = (offset + i) & (PT_CHAR_STRIDE - 1);
+        if(in_stride == 0)
+            da_append(ci, ci->total);
+        size_t run = PT_CHAR_STRIDE - in_stride < len - i ? PT_CHAR_STRIDE - in_stride : len - i;
+        ci->total += count_chars(data + i, run);
+        i += run;
+    }
+    return ci->total - before;
+}
+
+static const char* buf_bytes(PieceTree* pt, bool original, size_t offset, size_t* avail)
+{
+    if(!original)
+    {
+        *avail = pt->added.size - offset;
+        return pt->added.data + offset;
+    }
+    if(piece_tree_is_paged(pt))
+        return page_cache_get(pt->original.pages, offset, avail);
+    *avail = pt->original.size - offset;
+    return pt->original.data + offset;
+}
+
+static size_t buf_char_rank(PieceTree* pt, bool original, size_t offset)
+{
+    const PTCharIndex* ci = original ? &pt->original.chars : &pt->added.chars;
+    size_t buf_size = original ? pt->original.size : pt->added.size;
+    GEM_ASSERT(offset <= buf_size);
+    if(offset == buf_size)
+        return ci->total;
+
+    size_t pos = offset & ~(size_t)(PT_CHAR_STRIDE - 1);
+    size_t res = ci->data[pos / PT_CHAR_STRIDE];
+    while(pos < offset)
+    {
+        size_t avail;
+        const char* bytes = buf_bytes(pt, original, pos, &avail);
+        size_t len = avail < offset - pos ? avail : offset - pos;
+        res += count_chars(bytes, len);
+        pos += len;
+    }
+    return res;
+}
+
+static size_t buf_char_select(PieceTree* pt, bool original, size_t char_idx)
+{
+    const PTCharIndex* ci = original ? &pt->original.chars : &pt->added.chars;
+    GEM_ASSERT(char_idx < ci->total);
+    size_t lo = 0;
+    size_t hi = ci->size - 1;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi + 1) / 2;
+        if(ci->data[mid] <= char_idx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    // The codepoint is somewhere after the mark, usually within its stride.
+    size_t pos = lo * PT_CHAR_STRIDE;
+    size_t seen = ci->data[lo];
+    while(true)
+    {
+        size_t avail;
+        const char* bytes = buf_bytes(pt, original, pos, &avail);
+        for(size_t i = 0; i < avail; ++i)
+        {
+            if(((unsigned char)bytes[i] & 0xC0) == 0x80)
+                continue;
+            if(seen == char_idx)
+                return pos + i;
+            seen++;
+        }
+        pos += avail;
+    }
+}
+
+static size_t node_chars(PieceTree* pt, const PTNode* node)
+{
+    size_t start = piece_tree_get_node_buf_offset(pt, node);
+    return buf_char_rank(pt, node->is_original, start + node->length) -
+           buf_char_rank(pt, node->is_original, start);
+}
+
+static size_t fill_char_counts(PieceTree* pt, PTNode* node)
+{
+    if(node == SENTINEL)
+        return 0;
+    node->left_char_cnt = fill_char_counts(pt, node->left);
+    node->char_cnt = node_chars(pt, node);
+    return node->left_char_cnt + node->char_cnt + fill_char_counts(pt, node->right);
+}
+
+// Everything but UTF-8 continuation bytes, eight at a time.
+static size_t count_chars(const char* data, size_t len)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t high = 0x8080808080808080ull;
+    size_t cont = 0;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        uint64_t hits = word & ~(word << 1) & high;
+        cont += ((hits >> 7) * ones) >> 56;
+    }
+    for(; i < len; ++i)
+        cont += ((unsigned char)data[i] & 0xC0) == 0x80;
+    return len - cont;
+}
+
 static inline void mark_free(PieceTree* pt, size_t start)
 {
     PTStorage* s = &pt->storage;
@@ -1200,20 +1840,34 @@ static inline size_t node_id(const PieceTree* pt, const PTNode* node)
 }
 
 
+static inline size_t orig_line_start(PieceTree* pt, size_t line)
+{
+    if(pt->original.pages != NULL)
+        return page_cache_line_start(pt->original.pages, line);
+    return line_index_get(&pt->original.line_starts, line);
+}
+
+static inline size_t line_start(PieceTree* pt, const PTNode* node, size_t line)
+{
+    return node->is_original ? orig_line_start(pt, line) : line_index_get(&pt->added.line_starts, line);
+}
+
 static inline PTNode node_default(void)
 {
     return (PTNode){
-        .start       = { 0, 0 },
-        .end         = { 0, 0 },
-        .length      = 0,
-        .nl_cnt      = 0,
-        .left_size   = 0,
-        .left_nl_cnt = 0,
-        .left        = SENTINEL,
-        .right       = SENTINEL,
-        .parent      = SENTINEL,
-        .is_original = false,
-        .is_black    = false
+        .start         = { 0, 0 },
+        .end           = { 0, 0 },
+        .length        = 0,
+        .nl_cnt        = 0,
+        .char_cnt      = 0,
+        .left_size     = 0,
+        .left_nl_cnt   = 0,
+        .left_char_cnt = 0,
+        .left          = SENTINEL,
+        .right         = SENTINEL,
+        .parent        = SENTINEL,
+        .is_original   = false,
+        .is_black      = false
     };
 }
 
@@ -1222,6 +1876,7 @@ typedef struct
 {
     size_t size;
     size_t nl_cnt;
+    size_t char_cnt;
     size_t black_height;
     size_t node_cnt;
 } PTValidData;
@@ -1282,12 +1937,13 @@ static inline void pt_check_simple(const PieceTree* pt, const PTNode* node,
 #define PT_CHECK_GT(actual, expected, msg) { if((actual) <= (expected)) pt_check_impl(pt, node, msg, 3, actual, expected); }
 #define PT_CHECK_GE(actual, expected, msg) { if((actual) < (expected)) pt_check_impl(pt, node, msg, 4, actual, expected); }
 
-static PTValidData validate_node(const PieceTree* pt, const PTNode* node)
+static PTValidData validate_node(PieceTree* pt, const PTNode* node)
 {
     PTValidData res;
     res.size = 0;
     res.black_height = 0;
     res.nl_cnt = 0;
+    res.char_cnt = 0;
     res.node_cnt = 0;
     if(node == SENTINEL)
         return res;
@@ -1304,52 +1960,60 @@ static PTValidData validate_node(const PieceTree* pt, const PTNode* node)
     ((PTNode*)node)->used = true;
 
     // Check start and end bounds for validity.
-    const size_t* ls;
     size_t line_count;
     size_t buf_size;
     if(node->is_original)
     {
-        ls = pt->original.line_starts;
         line_count = pt->original.line_cnt;
         buf_size = pt->original.size;
+        PT_CHECK_EQ(pt->original.line_starts.size, piece_tree_is_paged(pt) ? 0 : line_count,
+                    "Original line index is out of sync.");
     }
     else
     {
-        ls = pt->added.line_starts.data;
         line_count = pt->added.line_starts.size;
         buf_size = pt->added.size;
     }
     PT_CHECK_LT((size_t)node->start.line, line_count, "Start line out of bounds.");
     PT_CHECK_LT((size_t)node->end.line, line_count, "End line out of bounds.");
     size_t start_check = (size_t)node->start.line == line_count - 1 ?
-                            buf_size - ls[node->start.line] :
-                            ls[node->start.line + 1] - ls[node->start.line];
+                            buf_size - line_start(pt, node, node->start.line) :
+                            line_start(pt, node, node->start.line + 1) - line_start(pt, node, node->start.line);
     size_t end_check = (size_t)node->end.line == line_count - 1 ?
-                            buf_size - ls[node->end.line] :
-                            ls[node->end.line + 1] - ls[node->end.line];
+                            buf_size - line_start(pt, node, node->end.line) :
+                            line_start(pt, node, node->end.line + 1) - line_start(pt, node, node->end.line);
 
     PT_CHECK_LT((size_t)node->start.column, start_check, "Start column out of bounds.");
     PT_CHECK_LE((size_t)node->end.column, end_check, "End column out of bounds.");
     PT_CHECK(node->start.line < node->end.line || 
              node->start.column < node->end.column, "End is before or in the same place as start.");
-    PT_CHECK_EQ(node->length, (ls[node->end.line] - ls[node->start.line] - node->start.column + node->end.column), 
-                   "Length is invalid.");
+    PT_CHECK_EQ(node->length, (line_start(pt, node, node->end.line) - line_start(pt, node, node->start.line) -
+                               node->start.column + node->end.column), "Length is invalid.");
+    if(node->is_original && piece_tree_is_paged(pt))
+    {
+        size_t remaining;
+        page_cache_get(pt->original.pages, piece_tree_get_node_buf_offset(pt, node), &remaining);
+        PT_CHECK_LE(node->length, remaining, "Original piece spans two pages.");
+    }
     PT_CHECK_EQ((int64_t)node->nl_cnt, node->end.line - node->start.line, "Newline count is invalid.");
+    PT_CHECK_EQ(node->char_cnt, node_chars(pt, node), "Codepoint count is invalid.");
 
     PTValidData left = validate_node(pt, node->left);
     PTValidData right = validate_node(pt, node->right);
     PT_CHECK_EQ(node->left_nl_cnt, left.nl_cnt, "Left newline count is invalid.");
     PT_CHECK_EQ(node->left_size, left.size, "Left size is invalid.");
+    PT_CHECK_EQ(node->left_char_cnt, left.char_cnt, "Left codepoint count is invalid.");
     PT_CHECK(left.black_height == right.black_height, "Black height is mismatched.");
 
     res.black_height = left.black_height + node->is_black;
     res.nl_cnt = left.nl_cnt + node->nl_cnt + right.nl_cnt;
+    res.char_cnt = left.char_cnt + node->char_cnt + right.char_cnt;
     res.size = left.size + node->length + right.size;
     res.node_cnt = left.node_cnt + 1 + right.node_cnt;
     return res;
 }
 
-static void validate_tree(const PieceTree* pt)
+static void validate_tree(PieceTree* pt)
 {
     GEM_ASSERT(pt != NULL);
     // To check:
@@ -1377,4 +2041,25 @@ static void validate_tree(const PieceTree* pt)
     PT_CHECK_EQ(cnt, data.node_cnt, "Memory leak in node buffer. Ensure nodes are free when detached.");
     PT_CHECK_EQ(pt->storage.capacity - cnt, pt->storage.free_count, "Free count is incorrect.");
 }
+
+// Redoes the threaded indexing of the original on this thread and compares.
+static void validate_original_index(PieceTree* pt)
+{
+    const PTOrigBuffer* orig = &pt->original;
+    const PTNode* node = NULL;
+    size_t line = 1;
+    const char* end = orig->data + orig->size;
+    for(const char* nl = orig->data; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++, line++)
+        PT_CHECK_EQ(line_index_get(&orig->line_starts, line), (size_t)(nl - orig->data + 1),
+                    "Original line start is invalid.");
+    PT_CHECK_EQ(orig->line_starts.size, line, "Original line count is invalid.");
+
+    PTCharIndex serial = {0};
+    char_index_append(&serial, orig->data, 0, orig->size);
+    PT_CHECK_EQ(orig->chars.size, serial.size, "Original char mark count is invalid.");
+    PT_CHECK_EQ(orig->chars.total, serial.total, "Original char count is invalid.");
+    for(size_t i = 0; i < serial.size; ++i)
+        PT_CHECK_EQ(orig->chars.data[i], serial.data[i], "Original char mark is invalid.");
+    da_free_data(&serial);
+}
 #endif
@@ -1,5 +1,8 @@
 #pragma once
 #include "core/core.h"
+#include "structs/lineindex.h"
+#include "structs/pagecache.h"
+#include "structs/serial.h"
 
 #include <stdbool.h>
 #include <string.h>
@@ -8,7 +11,7 @@ typedef struct BufferPos      BufferPos;
 typedef struct PTNode         PTNode;
 typedef struct __PTNodeIntern __PTNodeIntern;
 typedef struct PTStorage      PTStorage;
-typedef struct PTPosDA        PTPosDA;
+typedef struct PTCharIndex    PTCharIndex;
 typedef struct PTOrigBuffer   PTOrigBuffer;
 typedef struct PTAddBuffer    PTAddBuffer;
 typedef struct PieceTree      PieceTree;
@@ -26,9 +29,11 @@ struct PTNode
     BufferPos  end;
     size_t     length;
     size_t     nl_cnt;
+    size_t     char_cnt;
 
     size_t     left_size;
     size_t     left_nl_cnt;
+    size_t     left_char_cnt;
 
     PTNode*    left;
     PTNode*    right;
@@ -51,27 +56,35 @@ struct PTStorage
     size_t free_count;
 };
 
-struct PTPosDA
+#define PT_CHAR_STRIDE (1 << 10)
+
+// Codepoints are counted by their lead bytes, so malformed UTF-8 still adds
+// up, stray continuation bytes just belong to whatever came before them.
+struct PTCharIndex
 {
-    size_t*  data;
-    size_t   capacity;
-    size_t   size;
+    uint64_t* data;     /* Codepoints before every PT_CHAR_STRIDE'th byte */
+    size_t    size;
+    size_t    capacity;
+    uint64_t  total;
 };
 
 struct PTOrigBuffer
 {
     const char*   data;        /* Original buffer */
     size_t        size;        /* Original buffer size */
-    const size_t* line_starts; /* Locations of all line starts in original buffer */
+    LineIndex     line_starts; /* Locations of all line starts in original buffer */
     size_t        line_cnt;    /* Number of lines in the buffer (will always be > 0) */
+    PTCharIndex   chars;
+    PageCache*    pages;       /* Replaces data and line_starts for files read in through a page cache */
 };
 
 struct PTAddBuffer
 {
-    char*   data;
-    size_t  size;
-    size_t  capacity;
-    PTPosDA line_starts;
+    char*       data;
+    size_t      size;
+    size_t      capacity;
+    LineIndex   line_starts;
+    PTCharIndex chars;
 };
 
 struct PieceTree
@@ -86,23 +99,65 @@ struct PieceTree
 
 void piece_tree_init(PieceTree* pt, const char* original_src, size_t size, bool copy);
 void piece_tree_free(PieceTree* pt);
+// Streamed loads start from an empty tree whose original buffer is filled in
+// behind it. Each chunk read becomes an original piece at the end of the tree,
+// line_starts holds the chunk relative offsets following each of its newlines.
+void piece_tree_init_stream(PieceTree* pt, const char* original_src);
+void piece_tree_append_original(PieceTree* pt, size_t len, const uint32_t* line_starts, size_t line_cnt);
+// Called once nothing more will be appended to the original buffer.
+void piece_tree_end_stream(PieceTree* pt);
+// Paged trees read their original buffer from fd through a page cache. Each
+// page gets its own piece, so no original piece ever spans two pages. The
+// tree takes ownership of fd, data and line_starts.
+void piece_tree_init_paged(PieceTree* pt, int fd);
+void piece_tree_append_page(PieceTree* pt, char* data, size_t len, uint32_t* line_starts, size_t line_cnt);
 void piece_tree_insert(PieceTree* pt, const char* data, size_t len, size_t offset);
 void piece_tree_insert_repeat(PieceTree* pt, const char* data, size_t len, size_t rep_count, size_t offset);
 void piece_tree_delete(PieceTree* pt, size_t offset, size_t count);
 
 const PTNode* piece_tree_node_at(const PieceTree* pt, size_t offset, size_t* node_start_offset);
-const PTNode* piece_tree_node_at_line(const PieceTree* pt, size_t line, size_t* node_offset);
+const PTNode* piece_tree_node_at_line(PieceTree* pt, size_t line, size_t* node_offset);
 const PTNode* piece_tree_next_inorder(const PieceTree* pt, const PTNode* node);
 const PTNode* piece_tree_prev_inorder(const PieceTree* pt, const PTNode* node);
-const char*   piece_tree_get_node_start(const PieceTree* pt, const PTNode* node);
-size_t        piece_tree_get_line_length(const PieceTree* pt, size_t line_num);
-size_t        piece_tree_get_offset(const PieceTree* pt, size_t line, size_t column);
-BufferPos     piece_tree_get_buffer_pos(const PieceTree* pt, size_t offset);
-
-void   piece_tree_print_contents(const PieceTree* pt);
+// For paged trees the contents stay valid until PAGE_CACHE_MIN_PAGES - 1
+// other pages are touched, so nodes should be used one at a time.
+const char*   piece_tree_get_node_start(PieceTree* pt, const PTNode* node);
+size_t        piece_tree_get_node_buf_offset(PieceTree* pt, const PTNode* node);
+size_t        piece_tree_get_line_length(PieceTree* pt, size_t line_num);
+size_t        piece_tree_get_offset(PieceTree* pt, size_t line, size_t column);
+BufferPos     piece_tree_get_buffer_pos(PieceTree* pt, size_t offset);
+// Codepoints before offset, and the offset of the codepoint that many come
+// before (or the end of the tree). Both are a descent plus a scan of at most
+// PT_CHAR_STRIDE bytes.
+size_t        piece_tree_chars_before(PieceTree* pt, size_t offset);
+size_t        piece_tree_offset_of_char(PieceTree* pt, size_t char_idx);
+// Convert between byte and codepoint columns within a line, byte columns past
+// the end of the line are clamped to it.
+size_t        piece_tree_get_char_column(PieceTree* pt, size_t line, size_t column);
+size_t        piece_tree_get_byte_column(PieceTree* pt, size_t line, size_t char_column);
+
+void   piece_tree_print_contents(PieceTree* pt);
 void   piece_tree_print_tree(const PieceTree* pt);
 size_t piece_tree_node_id(const PieceTree* pt, const PTNode* node);
 
+// Snapshots leave out the original buffer itself. Deserializing takes
+// ownership of original_src on success, which must be the same contents the
+// tree was built from.
+void piece_tree_serialize(const PieceTree* pt, StringBuilder* out);
+bool piece_tree_deserialize(PieceTree* pt, const char* original_src, size_t size, SerialReader* in);
+
+static inline bool piece_tree_is_paged(const PieceTree* pt)
+{
+    return pt->original.pages != NULL;
+}
+
+// Part of a paged original buffer no longer matches the file, the tree has
+// blanks in its place.
+static inline bool piece_tree_is_stale(const PieceTree* pt)
+{
+    return pt->original.pages != NULL && pt->original.pages->stale;
+}
+
 static inline void piece_tree_insert_str(PieceTree* pt, const char* str, size_t offset)
 {
     piece_tree_insert(pt, str, strlen(str), offset);
@@ -113,7 +168,7 @@ static inline void piece_tree_insert_char(PieceTree* pt, char c, size_t offset)
     piece_tree_insert(pt, &c, 1, offset);
 }
 
-static inline size_t piece_tree_get_offset_bp(const PieceTree* pt, BufferPos pos)
+static inline size_t piece_tree_get_offset_bp(PieceTree* pt, BufferPos pos)
 { 
     return piece_tree_get_offset(pt, pos.line, pos.column);
 }
@@ -0,0 +1,75 @@
+#pragma once
+#include "da.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Helpers for flat binary formats. Everything is written as 8 byte words
+// (byte strings are padded to a multiple of 8) so a mapped file can be read
+// in place, and the reader bounds checks everything instead of trusting it.
+
+typedef struct SerialReader SerialReader;
+struct SerialReader
+{
+    const char* ptr;
+    const char* end;
+    bool        ok;
+};
+
+static inline void serial_put_u64(StringBuilder* out, uint64_t value)
+{
+    da_append_arr(out, (const char*)&value, sizeof(value));
+}
+
+static inline void serial_put_bytes(StringBuilder* out, const void* data, size_t len)
+{
+    static const char zeros[8] = { 0 };
+    serial_put_u64(out, len);
+    if(len > 0)
+        da_append_arr(out, (const char*)data, len);
+    if(len % 8 != 0)
+        da_append_arr(out, zeros, 8 - len % 8);
+}
+
+static inline uint64_t serial_get_u64(SerialReader* in)
+{
+    uint64_t value = 0;
+    if(!in->ok || in->end - in->ptr < (ptrdiff_t)sizeof(value))
+    {
+        in->ok = false;
+        return 0;
+    }
+    memcpy(&value, in->ptr, sizeof(value));
+    in->ptr += sizeof(value);
+    return value;
+}
+
+// Returns a pointer into the serialized data, NULL if len bytes aren't there.
+static inline const char* serial_get_bytes(SerialReader* in, size_t* len)
+{
+    uint64_t n = serial_get_u64(in);
+    uint64_t padded = (n + 7) & ~(uint64_t)7;
+    if(!in->ok || padded < n || (uint64_t)(in->end - in->ptr) < padded)
+    {
+        in->ok = false;
+        return NULL;
+    }
+    const char* res = in->ptr;
+    in->ptr += padded;
+    *len = (size_t)n;
+    return res;
+}
+
+// FNV-1a, catches files that were cut short or damaged.
+static inline uint64_t serial_checksum(const char* data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < len; ++i)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
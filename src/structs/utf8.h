@@ -0,0 +1,51 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static inline bool utf8_is_cont(char c)
+{
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+// Decodes the codepoint at the start of str without reading past len bytes.
+// Malformed or cut off sequences come out as their first byte alone.
+static inline size_t utf8_decode(const char* str, size_t len, uint32_t* cp)
+{
+    unsigned char lead = str[0];
+    size_t n = lead < 0xC0 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : lead < 0xF8 ? 4 : 1;
+    *cp = lead;
+    if(n == 1 || n > len)
+        return 1;
+
+    uint32_t res = lead & (0x7F >> n);
+    for(size_t i = 1; i < n; ++i)
+    {
+        if(!utf8_is_cont(str[i]))
+            return 1;
+        res = res << 6 | ((unsigned char)str[i] & 0x3F);
+    }
+    *cp = res;
+    return n;
+}
+
+// Cells a codepoint takes up, East Asian wide and fullwidth ones get two.
+static inline int utf8_width(uint32_t cp)
+{
+    if(cp < 0x1100)
+        return 1;
+    return (cp <= 0x115F) ||
+           (cp >= 0x2E80 && cp <= 0x303E) ||
+           (cp >= 0x3041 && cp <= 0x33FF) ||
+           (cp >= 0x3400 && cp <= 0x4DBF) ||
+           (cp >= 0x4E00 && cp <= 0x9FFF) ||
+           (cp >= 0xA000 && cp <= 0xA4CF) ||
+           (cp >= 0xAC00 && cp <= 0xD7A3) ||
+           (cp >= 0xF900 && cp <= 0xFAFF) ||
+           (cp >= 0xFE30 && cp <= 0xFE4F) ||
+           (cp >= 0xFF00 && cp <= 0xFF60) ||
+           (cp >= 0xFFE0 && cp <= 0xFFE6) ||
+           (cp >= 0x1F300 && cp <= 0x1F64F) ||
+           (cp >= 0x1F900 && cp <= 0x1F9FF) ||
+           (cp >= 0x20000 && cp <= 0x3FFFD) ? 2 : 1;
+}
@@ -0,0 +1,193 @@
+#include "visindex.h"
+#include "utf8.h"
+#include "core/core.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static VisLine* get_line(VisIndex* vi, int64_t line);
+static size_t   find_mark(const VisLine* vl, int64_t target, bool by_vis);
+static void     add_mark(VisLine* vl, VisMark mark);
+static VisMark  scan_line(VisLine* vl, PieceTree* pt, int64_t line, VisMark from,
+                          int64_t stop_col, int64_t stop_vis);
+
+void vis_index_init(VisIndex* vi)
+{
+    GEM_ASSERT(vi != NULL);
+    memset(vi, 0, sizeof(VisIndex));
+    for(size_t i = 0; i < VIS_INDEX_LINES; ++i)
+        vi->lines[i].line = -1;
+}
+
+void vis_index_free(VisIndex* vi)
+{
+    for(size_t i = 0; i < VIS_INDEX_LINES; ++i)
+        free(vi->lines[i].marks);
+}
+
+void vis_index_clear(VisIndex* vi)
+{
+    for(size_t i = 0; i < VIS_INDEX_LINES; ++i)
+        vi->lines[i].line = -1;
+}
+
+void vis_index_edit(VisIndex* vi, uint64_t version, BufferPos pos, size_t removed_lines, size_t added_lines)
+{
+    GEM_ASSERT(vi != NULL);
+    if(vi->version != version)
+    {
+        vis_index_clear(vi);
+        vi->version = version + 1;
+        return;
+    }
+    vi->version = version + 1;
+
+    for(size_t i = 0; i < VIS_INDEX_LINES; ++i)
+    {
+        VisLine* vl = vi->lines + i;
+        if(vl->line < pos.line)
+            continue;
+
+        // Whatever was inserted could join the codepoint before it, so a
+        // mark right at the edit goes too.
+        if(vl->line == pos.line)
+        {
+            while(vl->mark_cnt > 1 && vl->marks[vl->mark_cnt - 1].column >= pos.column)
+                vl->mark_cnt--;
+        }
+        else if(vl->line <= pos.line + (int64_t)removed_lines)
+            vl->line = -1;
+        else
+            vl->line += (int64_t)added_lines - (int64_t)removed_lines;
+    }
+}
+
+int64_t vis_index_to_vis(VisIndex* vi, PieceTree* pt, uint64_t version, BufferPos actual)
+{
+    GEM_ASSERT(vi != NULL && pt != NULL);
+    if(vi->version != version)
+    {
+        vis_index_clear(vi);
+        vi->version = version;
+    }
+    VisLine* vl = get_line(vi, actual.line);
+    VisMark from = vl->marks[find_mark(vl, actual.column, false)];
+    return scan_line(vl, pt, actual.line, from, actual.column, INT64_MAX).vis;
+}
+
+int64_t vis_index_to_actual(VisIndex* vi, PieceTree* pt, uint64_t version, BufferPos vis)
+{
+    return vis_index_seek(vi, pt, version, vis).column;
+}
+
+VisMark vis_index_seek(VisIndex* vi, PieceTree* pt, uint64_t version, BufferPos vis)
+{
+    GEM_ASSERT(vi != NULL && pt != NULL);
+    if(vi->version != version)
+    {
+        vis_index_clear(vi);
+        vi->version = version;
+    }
+    VisLine* vl = get_line(vi, vis.line);
+    VisMark from = vl->marks[find_mark(vl, vis.column, true)];
+    return scan_line(vl, pt, vis.line, from, INT64_MAX, vis.column);
+}
+
+static VisLine* get_line(VisIndex* vi, int64_t line)
+{
+    VisLine* victim = NULL;
+    for(size_t i = 0; i < VIS_INDEX_LINES; ++i)
+    {
+        VisLine* vl = vi->lines + i;
+        if(vl->line == line)
+        {
+            vl->last_use = ++vi->clock;
+            return vl;
+        }
+        if(victim == NULL || (victim->line >= 0 && (vl->line < 0 || vl->last_use < victim->last_use)))
+            victim = vl;
+    }
+
+    if(victim->mark_cap == 0)
+    {
+        victim->mark_cap = 16;
+        victim->marks = malloc(sizeof(VisMark) * victim->mark_cap);
+        GEM_ENSURE(victim->marks != NULL);
+    }
+    victim->line = line;
+    victim->marks[0] = (VisMark){ 0, 0 };
+    victim->mark_cnt = 1;
+    victim->last_use = ++vi->clock;
+    return victim;
+}
+
+// Last mark at or before target.
+static size_t find_mark(const VisLine* vl, int64_t target, bool by_vis)
+{
+    size_t lo = 0;
+    size_t hi = vl->mark_cnt - 1;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi + 1) / 2;
+        const VisMark* m = vl->marks + mid;
+        if((by_vis ? m->vis : m->column) <= target)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static void add_mark(VisLine* vl, VisMark mark)
+{
+    if(vl->mark_cnt == vl->mark_cap)
+    {
+        vl->mark_cap *= 2;
+        vl->marks = realloc(vl->marks, sizeof(VisMark) * vl->mark_cap);
+        GEM_ENSURE(vl->marks != NULL);
+    }
+    vl->marks[vl->mark_cnt++] = mark;
+}
+
+// Steps over whole codepoints while they start before stop_col and the
+// visual column is below stop_vis, marking the line as it goes past its last
+// mark. Stray continuation bytes take no room and go with the codepoint
+// before them, the renderer draws them the same way.
+static VisMark scan_line(VisLine* vl, PieceTree* pt, int64_t line, VisMark from,
+                         int64_t stop_col, int64_t stop_vis)
+{
+    VisMark pos = from;
+    size_t offset = piece_tree_get_offset(pt, line, pos.column);
+    if(offset >= pt->size)
+        return pos;
+
+    size_t i;
+    const PTNode* node = piece_tree_node_at(pt, offset, &i);
+    i = offset - i;
+    while(node != NULL)
+    {
+        const char* buf = piece_tree_get_node_start(pt, node);
+        while(i < node->length)
+        {
+            if(pos.column >= stop_col || pos.vis >= stop_vis || buf[i] == '\n')
+                return pos;
+            if(pos.column >= vl->marks[vl->mark_cnt - 1].column + VIS_MARK_STRIDE)
+                add_mark(vl, pos);
+
+            uint32_t cp;
+            size_t len = 1;
+            if(buf[i] == '\t')
+                pos.vis += VIS_TAB_STOP - pos.vis % VIS_TAB_STOP;
+            else if(!utf8_is_cont(buf[i]))
+            {
+                len = utf8_decode(buf + i, node->length - i, &cp);
+                pos.vis += utf8_width(cp);
+            }
+            for(i += len, pos.column += len; i < node->length && utf8_is_cont(buf[i]); ++i)
+                pos.column++;
+        }
+        node = piece_tree_next_inorder(pt, node);
+        i = 0;
+    }
+    return pos;
+}
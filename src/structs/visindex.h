@@ -0,0 +1,56 @@
+#pragma once
+#include "structs/piecetree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VIS_INDEX_LINES 128      // Lines remembered at once, enough to cover a whole view
+#define VIS_MARK_STRIDE (1 << 8) // Bytes of a line between marks
+#define VIS_TAB_STOP    4
+
+typedef struct VisMark  VisMark;
+typedef struct VisLine  VisLine;
+typedef struct VisIndex VisIndex;
+
+struct VisMark
+{
+    int64_t column;
+    int64_t vis;
+};
+
+struct VisLine
+{
+    int64_t  line;     /* -1 when the slot is free */
+    VisMark* marks;    /* Codepoint boundaries about every VIS_MARK_STRIDE bytes, marks[0] is { 0, 0 } */
+    size_t   mark_cnt;
+    size_t   mark_cap;
+    uint64_t last_use;
+};
+
+// Maps between byte and visual columns (tabs and wide codepoints expanded)
+// without walking lines from their start. Lines get marks as they are walked,
+// so answering is a binary search plus a scan of at most VIS_MARK_STRIDE
+// bytes. Edits only drop the marks they could have moved, anything else that
+// changes the buffer bumps its version and starts the index over.
+struct VisIndex
+{
+    VisLine  lines[VIS_INDEX_LINES];
+    uint64_t version;
+    uint64_t clock;
+};
+
+void vis_index_init(VisIndex* vi);
+void vis_index_free(VisIndex* vi);
+void vis_index_clear(VisIndex* vi);
+// An edit at pos took out removed_lines newlines and put in added_lines,
+// version is the buffer's from before it.
+void vis_index_edit(VisIndex* vi, uint64_t version, BufferPos pos, size_t removed_lines, size_t added_lines);
+
+// Visual column reached after every codepoint starting before actual.column.
+int64_t vis_index_to_vis(VisIndex* vi, PieceTree* pt, uint64_t version, BufferPos actual);
+// Byte column of the first codepoint boundary at or past vis.column, or of
+// the end of the line.
+int64_t vis_index_to_actual(VisIndex* vi, PieceTree* pt, uint64_t version, BufferPos vis);
+// Same as vis_index_to_actual, along with the visual column it lands on.
+VisMark vis_index_seek(VisIndex* vi, PieceTree* pt, uint64_t version, BufferPos vis);
@@ -0,0 +1,367 @@
+#include "wrapindex.h"
+#include "core/core.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void     fenwick_add(uint64_t* tree, size_t n, size_t b, int64_t delta);
+static uint64_t fenwick_prefix(const uint64_t* tree, size_t b);
+static size_t   fenwick_search(const uint64_t* tree, size_t n, uint64_t target, uint64_t* before);
+static void     rebuild_sums(WrapIndex* wi);
+static size_t   block_of_line(const WrapIndex* wi, size_t line, size_t* first_line);
+static uint32_t block_line_rows(const WrapBlock* block, size_t j);
+static void     ensure_rows(WrapBlock* block, size_t line_cnt);
+static void     insert_blocks(WrapIndex* wi, size_t at, size_t count);
+static void     remove_empty_blocks(WrapIndex* wi);
+static void     split_block(WrapIndex* wi, size_t b);
+
+void wrap_index_init(WrapIndex* wi)
+{
+    GEM_ASSERT(wi != NULL);
+    memset(wi, 0, sizeof(WrapIndex));
+}
+
+void wrap_index_free(WrapIndex* wi)
+{
+    for(size_t b = 0; b < wi->block_cnt; ++b)
+        free(wi->blocks[b].rows);
+    free(wi->blocks);
+    free(wi->line_sums);
+    free(wi->row_sums);
+}
+
+void wrap_index_reset(WrapIndex* wi, size_t line_cnt)
+{
+    GEM_ASSERT(wi != NULL);
+    for(size_t b = 0; b < wi->block_cnt; ++b)
+        free(wi->blocks[b].rows);
+    wi->block_cnt = 0;
+
+    size_t count = (line_cnt + WRAP_BLOCK_LINES - 1) / WRAP_BLOCK_LINES;
+    insert_blocks(wi, 0, count);
+    for(size_t b = 0; b < count; ++b)
+    {
+        WrapBlock* block = wi->blocks + b;
+        block->line_cnt = b + 1 < count ? WRAP_BLOCK_LINES : line_cnt - b * WRAP_BLOCK_LINES;
+        block->row_cnt = block->line_cnt;
+    }
+    wi->line_total = line_cnt;
+    wi->row_total = line_cnt;
+    rebuild_sums(wi);
+}
+
+void wrap_index_set_width(WrapIndex* wi, int64_t width)
+{
+    GEM_ASSERT(wi != NULL);
+    wi->width = width;
+}
+
+void wrap_index_edit(WrapIndex* wi, size_t line, size_t removed_lines, size_t added_lines)
+{
+    GEM_ASSERT(wi != NULL);
+    GEM_ASSERT(line + removed_lines < wi->line_total);
+
+    size_t first;
+    size_t b = block_of_line(wi, line, &first);
+    size_t j = line - first;
+    if(wi->blocks[b].rows != NULL)
+        wi->blocks[b].rows[j] |= WRAP_STALE;
+
+    // Joined lines come out of this block and the ones after it. Only later
+    // blocks can empty out, so b stays put.
+    bool rebuild = false;
+    size_t rb = b;
+    size_t rj = j + 1;
+    while(removed_lines > 0)
+    {
+        WrapBlock* cur = wi->blocks + rb;
+        if(rj == cur->line_cnt)
+        {
+            rb++;
+            rj = 0;
+            continue;
+        }
+
+        size_t n = removed_lines < cur->line_cnt - rj ? removed_lines : cur->line_cnt - rj;
+        uint64_t rows = n;
+        if(cur->rows != NULL)
+        {
+            rows = 0;
+            for(size_t k = rj; k < rj + n; ++k)
+                rows += cur->rows[k] & ~WRAP_STALE;
+            memmove(cur->rows + rj, cur->rows + rj + n, sizeof(uint32_t) * (cur->line_cnt - rj - n));
+        }
+        cur->line_cnt -= n;
+        cur->row_cnt -= rows;
+        wi->line_total -= n;
+        wi->row_total -= rows;
+        fenwick_add(wi->line_sums, wi->block_cnt, rb, -(int64_t)n);
+        fenwick_add(wi->row_sums, wi->block_cnt, rb, -(int64_t)rows);
+        rebuild |= cur->line_cnt == 0;
+        removed_lines -= n;
+    }
+    if(rebuild)
+        remove_empty_blocks(wi);
+
+    if(added_lines > 0)
+    {
+        WrapBlock* block = wi->blocks + b;
+        if(block->rows != NULL)
+        {
+            ensure_rows(block, block->line_cnt + added_lines);
+            memmove(block->rows + j + 1 + added_lines, block->rows + j + 1,
+                    sizeof(uint32_t) * (block->line_cnt - j - 1));
+            for(size_t k = 0; k < added_lines; ++k)
+                block->rows[j + 1 + k] = 1 | WRAP_STALE;
+        }
+        block->line_cnt += added_lines;
+        block->row_cnt += added_lines;
+        wi->line_total += added_lines;
+        wi->row_total += added_lines;
+        fenwick_add(wi->line_sums, wi->block_cnt, b, added_lines);
+        fenwick_add(wi->row_sums, wi->block_cnt, b, added_lines);
+        if(block->line_cnt > 2 * WRAP_BLOCK_LINES)
+        {
+            split_block(wi, b);
+            rebuild = true;
+        }
+    }
+    if(rebuild)
+        rebuild_sums(wi);
+}
+
+bool wrap_index_is_exact(const WrapIndex* wi, size_t line)
+{
+    GEM_ASSERT(wi != NULL);
+    size_t first;
+    const WrapBlock* block = wi->blocks + block_of_line(wi, line, &first);
+    return block->width == wi->width && block->rows != NULL && 
+           !(block->rows[line - first] & WRAP_STALE);
+}
+
+void wrap_index_set_rows(WrapIndex* wi, size_t line, uint32_t rows)
+{
+    GEM_ASSERT(wi != NULL);
+    GEM_ASSERT(rows > 0 && rows < WRAP_STALE);
+    size_t first;
+    size_t b = block_of_line(wi, line, &first);
+    WrapBlock* block = wi->blocks + b;
+    if(block->width != wi->width)
+    {
+        // Everything else in the block was measured at another width.
+        if(block->rows != NULL)
+            for(size_t j = 0; j < block->line_cnt; ++j)
+                block->rows[j] |= WRAP_STALE;
+        block->width = wi->width;
+    }
+    ensure_rows(block, block->line_cnt);
+
+    uint32_t* cur = block->rows + (line - first);
+    int64_t delta = (int64_t)rows - (int64_t)(*cur & ~WRAP_STALE);
+    *cur = rows;
+    block->row_cnt += delta;
+    wi->row_total += delta;
+    fenwick_add(wi->row_sums, wi->block_cnt, b, delta);
+}
+
+uint32_t wrap_index_line_rows(const WrapIndex* wi, size_t line)
+{
+    GEM_ASSERT(wi != NULL);
+    size_t first;
+    size_t b = block_of_line(wi, line, &first);
+    return block_line_rows(wi->blocks + b, line - first);
+}
+
+uint64_t wrap_index_row_of_line(const WrapIndex* wi, size_t line)
+{
+    GEM_ASSERT(wi != NULL);
+    size_t first;
+    size_t b = block_of_line(wi, line, &first);
+    uint64_t row = fenwick_prefix(wi->row_sums, b);
+    for(size_t j = 0; j < line - first; ++j)
+        row += block_line_rows(wi->blocks + b, j);
+    return row;
+}
+
+size_t wrap_index_line_at_row(const WrapIndex* wi, uint64_t row, uint64_t* line_row)
+{
+    GEM_ASSERT(wi != NULL && wi->line_total > 0);
+    if(row >= wi->row_total)
+    {
+        *line_row = wrap_index_row_of_line(wi, wi->line_total - 1);
+        return wi->line_total - 1;
+    }
+
+    uint64_t before;
+    size_t b = fenwick_search(wi->row_sums, wi->block_cnt, row, &before);
+    size_t line = fenwick_prefix(wi->line_sums, b);
+    const WrapBlock* block = wi->blocks + b;
+    for(size_t j = 0; j < block->line_cnt; ++j)
+    {
+        uint32_t rows = block_line_rows(block, j);
+        if(before + rows > row)
+        {
+            *line_row = before;
+            return line + j;
+        }
+        before += rows;
+    }
+    GEM_ASSERT(false);
+    return line;
+}
+
+static void fenwick_add(uint64_t* tree, size_t n, size_t b, int64_t delta)
+{
+    for(size_t i = b + 1; i <= n; i += i & -i)
+        tree[i] += delta;
+}
+
+// Sum of the first b blocks.
+static uint64_t fenwick_prefix(const uint64_t* tree, size_t b)
+{
+    uint64_t sum = 0;
+    for(size_t i = b; i > 0; i -= i & -i)
+        sum += tree[i];
+    return sum;
+}
+
+// Block holding target, with the sum of those before it in before.
+static size_t fenwick_search(const uint64_t* tree, size_t n, uint64_t target, uint64_t* before)
+{
+    size_t step = 1;
+    while(step * 2 <= n)
+        step *= 2;
+
+    size_t pos = 0;
+    uint64_t sum = 0;
+    for(; step > 0; step /= 2)
+    {
+        if(pos + step <= n && sum + tree[pos + step] <= target)
+        {
+            pos += step;
+            sum += tree[pos];
+        }
+    }
+    *before = sum;
+    return pos;
+}
+
+static void rebuild_sums(WrapIndex* wi)
+{
+    size_t n = wi->block_cnt;
+    for(size_t i = 1; i <= n; ++i)
+    {
+        wi->line_sums[i] = wi->blocks[i - 1].line_cnt;
+        wi->row_sums[i] = wi->blocks[i - 1].row_cnt;
+    }
+    for(size_t i = 1; i <= n; ++i)
+    {
+        size_t parent = i + (i & -i);
+        if(parent <= n)
+        {
+            wi->line_sums[parent] += wi->line_sums[i];
+            wi->row_sums[parent] += wi->row_sums[i];
+        }
+    }
+}
+
+static size_t block_of_line(const WrapIndex* wi, size_t line, size_t* first_line)
+{
+    GEM_ASSERT(line < wi->line_total);
+    uint64_t first;
+    size_t b = fenwick_search(wi->line_sums, wi->block_cnt, line, &first);
+    *first_line = first;
+    return b;
+}
+
+static uint32_t block_line_rows(const WrapBlock* block, size_t j)
+{
+    return block->rows != NULL ? block->rows[j] & ~WRAP_STALE : 1;
+}
+
+static void ensure_rows(WrapBlock* block, size_t line_cnt)
+{
+    if(block->rows == NULL)
+    {
+        block->line_cap = line_cnt > WRAP_BLOCK_LINES ? line_cnt : WRAP_BLOCK_LINES;
+        block->rows = malloc(sizeof(uint32_t) * block->line_cap);
+        GEM_ENSURE(block->rows != NULL);
+        for(size_t j = 0; j < block->line_cnt; ++j)
+            block->rows[j] = 1 | WRAP_STALE;
+    }
+    else if(line_cnt > block->line_cap)
+    {
+        block->line_cap = line_cnt > block->line_cap * 2 ? line_cnt : block->line_cap * 2;
+        block->rows = realloc(block->rows, sizeof(uint32_t) * block->line_cap);
+        GEM_ENSURE(block->rows != NULL);
+    }
+}
+
+// Opens up count empty blocks at at, the sums need rebuilding after.
+static void insert_blocks(WrapIndex* wi, size_t at, size_t count)
+{
+    if(wi->block_cnt + count > wi->block_cap)
+    {
+        wi->block_cap = wi->block_cap * 3 / 2 > wi->block_cnt + count ? 
+                        wi->block_cap * 3 / 2 : wi->block_cnt + count;
+        wi->blocks = realloc(wi->blocks, sizeof(WrapBlock) * wi->block_cap);
+        wi->line_sums = realloc(wi->line_sums, sizeof(uint64_t) * (wi->block_cap + 1));
+        wi->row_sums = realloc(wi->row_sums, sizeof(uint64_t) * (wi->block_cap + 1));
+        GEM_ENSURE(wi->blocks != NULL && wi->line_sums != NULL && wi->row_sums != NULL);
+    }
+    memmove(wi->blocks + at + count, wi->blocks + at, sizeof(WrapBlock) * (wi->block_cnt - at));
+    for(size_t b = at; b < at + count; ++b)
+    {
+        WrapBlock* block = wi->blocks + b;
+        memset(block, 0, sizeof(WrapBlock));
+        block->width = wi->width;
+    }
+    wi->block_cnt += count;
+}
+
+static void remove_empty_blocks(WrapIndex* wi)
+{
+    size_t kept = 0;
+    for(size_t b = 0; b < wi->block_cnt; ++b)
+    {
+        if(wi->blocks[b].line_cnt == 0)
+            free(wi->blocks[b].rows);
+        else
+            wi->blocks[kept++] = wi->blocks[b];
+    }
+    wi->block_cnt = kept;
+}
+
+// Cuts block b into WRAP_BLOCK_LINES sized pieces.
+static void split_block(WrapIndex* wi, size_t b)
+{
+    size_t line_cnt = wi->blocks[b].line_cnt;
+    size_t pieces = (line_cnt + WRAP_BLOCK_LINES - 1) / WRAP_BLOCK_LINES;
+    insert_blocks(wi, b + 1, pieces - 1);
+
+    WrapBlock* src = wi->blocks + b;
+    for(size_t p = 1; p < pieces; ++p)
+    {
+        WrapBlock* dst = wi->blocks + b + p;
+        size_t start = p * WRAP_BLOCK_LINES;
+        dst->line_cnt = start + WRAP_BLOCK_LINES < line_cnt ? WRAP_BLOCK_LINES : line_cnt - start;
+        dst->row_cnt = dst->line_cnt;
+        dst->width = src->width;
+        if(src->rows != NULL)
+        {
+            ensure_rows(dst, dst->line_cnt);
+            memcpy(dst->rows, src->rows + start, sizeof(uint32_t) * dst->line_cnt);
+            dst->row_cnt = 0;
+            for(size_t j = 0; j < dst->line_cnt; ++j)
+                dst->row_cnt += dst->rows[j] & ~WRAP_STALE;
+        }
+        src->row_cnt -= dst->row_cnt;
+    }
+    src->line_cnt = WRAP_BLOCK_LINES;
+    if(src->rows != NULL && src->line_cap > 2 * WRAP_BLOCK_LINES)
+    {
+        src->line_cap = WRAP_BLOCK_LINES;
+        src->rows = realloc(src->rows, sizeof(uint32_t) * src->line_cap);
+        GEM_ENSURE(src->rows != NULL);
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRAP_BLOCK_LINES 512       // Lines per block, blocks split once they pass twice this
+#define WRAP_STALE       (1u << 31) // Row count is only a guess until the line is measured
+
+typedef struct WrapBlock WrapBlock;
+typedef struct WrapIndex WrapIndex;
+
+struct WrapBlock
+{
+    uint32_t* rows;     /* Rows per line, NULL while no line has been measured */
+    size_t    line_cnt;
+    size_t    line_cap;
+    uint64_t  row_cnt;
+    int64_t   width;    /* Width the rows were measured at, any other makes them all stale */
+};
+
+// Maps buffer lines to the visual rows they wrap into. Lines are kept in
+// blocks with Fenwick trees over the blocks' line and row counts, so finding
+// the line at a row is O(log n) plus a scan of one block. Lines nobody has
+// measured count as a single row, and changing the width only bumps what the
+// blocks are compared against, leaving the old counts as guesses until the
+// lines get measured again.
+struct WrapIndex
+{
+    WrapBlock* blocks;
+    uint64_t*  line_sums; /* Fenwick trees over the blocks, 1-based */
+    uint64_t*  row_sums;
+    size_t     block_cnt;
+    size_t     block_cap;
+    size_t     line_total;
+    uint64_t   row_total;
+    int64_t    width;
+    uint64_t   version;   /* Buffer version and size the index matches */
+    size_t     size;
+};
+
+void     wrap_index_init(WrapIndex* wi);
+void     wrap_index_free(WrapIndex* wi);
+// Forgets every measurement, leaving line_cnt single row lines.
+void     wrap_index_reset(WrapIndex* wi, size_t line_cnt);
+void     wrap_index_set_width(WrapIndex* wi, int64_t width);
+// Line changed, removed_lines after it were joined onto it and added_lines
+// new ones follow it. All of them need measuring again.
+void     wrap_index_edit(WrapIndex* wi, size_t line, size_t removed_lines, size_t added_lines);
+
+bool     wrap_index_is_exact(const WrapIndex* wi, size_t line);
+void     wrap_index_set_rows(WrapIndex* wi, size_t line, uint32_t rows);
+uint32_t wrap_index_line_rows(const WrapIndex* wi, size_t line);
+uint64_t wrap_index_row_of_line(const WrapIndex* wi, size_t line);
+// Line holding row, with the row it starts on in line_row. Rows past the end
+// land on the last line.
+size_t   wrap_index_line_at_row(const WrapIndex* wi, uint64_t row, uint64_t* line_row);